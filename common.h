@@ -18,16 +18,68 @@
 #ifndef MEMORY_OVERLAY_COMMON_H
 #define MEMORY_OVERLAY_COMMON_H
 
+// Command numbers encode the size of their request, so binaries built against
+// an older version of this header keep using the request layout they were
+// built with. New request fields must only be added at the end of a request.
 #define MAGIC 's'
-#define IOCTL_MEM_OVERLAY_REQ_CMD _IOWR(MAGIC, 1, struct mem_overlay_req *)
+#define IOCTL_MEM_OVERLAY_REQ_CMD _IOWR(MAGIC, 1, struct mem_overlay_req)
 #define IOCTL_MEM_OVERLAY_CLEANUP_CMD \
-	_IOWR(MAGIC, 2, struct mem_overlay_cleanup_req *)
+	_IOWR(MAGIC, 2, struct mem_overlay_cleanup_req)
+#define IOCTL_MEM_OVERLAY_BATCH_REQ_CMD \
+	_IOWR(MAGIC, 3, struct mem_overlay_batch_req)
+#define IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD \
+	_IOWR(MAGIC, 4, struct mem_overlay_batch_cleanup_req)
+#define IOCTL_MEM_OVERLAY_DIRTY_CMD \
+	_IOWR(MAGIC, 5, struct mem_overlay_dirty_req)
+#define IOCTL_MEM_OVERLAY_ACCESS_CMD \
+	_IOWR(MAGIC, 6, struct mem_overlay_access_req)
+#define IOCTL_MEM_OVERLAY_PREFETCH_CMD \
+	_IOWR(MAGIC, 7, struct mem_overlay_prefetch_req)
+#define IOCTL_MEM_OVERLAY_READY_CMD \
+	_IOWR(MAGIC, 8, struct mem_overlay_ready_req)
+
+// Register the memory overlay in the process referenced by
+// mem_overlay_req.pidfd instead of the calling process.
+#define MEM_OVERLAY_REQ_PIDFD (1 << 0)
+// Write to the files that back each page instead of creating private copies.
+// Writes to overlaid pages modify the overlay file and writes to other pages
+// modify the scratch file mapped at mem_overlay_req.scratch_addr.
+#define MEM_OVERLAY_REQ_WRITE_REDIRECT (1 << 1)
+// Record the base pages written while the memory overlay is registered. The
+// dirty pages are read with IOCTL_MEM_OVERLAY_DIRTY_CMD.
+#define MEM_OVERLAY_REQ_TRACK_DIRTY (1 << 2)
+// Record the base pages accessed while the memory overlay is registered, in
+// the order they were first touched. The pages are read with
+// IOCTL_MEM_OVERLAY_ACCESS_CMD. Accesses are recorded at fault-around
+// granularity: pages mapped around a faulting page are recorded with it, even
+// if they are never touched.
+#define MEM_OVERLAY_REQ_RECORD_ACCESS (1 << 3)
 
 static const char kmod_device_path[] = "/dev/memory_overlay";
 
+// Segment pages are read from the overlay file mapped at
+// mem_overlay_req.overlay_addr.
+#define MEM_OVERLAY_SEGMENT_FILE 0
+// Segment pages are filled with zeros. Writes in private base mappings copy
+// the page.
+#define MEM_OVERLAY_SEGMENT_ZERO 1
+// Segment pages are read from the memory mapped at
+// mem_overlay_segment_req.buffer_addr, such as a memfd or shared anonymous
+// memory.
+#define MEM_OVERLAY_SEGMENT_BUFFER 2
+
+// Segment pages are not available yet. Page faults on them block and are
+// reported as events read from the device until the pages are marked as ready
+// with IOCTL_MEM_OVERLAY_READY_CMD.
+#define MEM_OVERLAY_SEGMENT_PENDING (1 << 0)
+
 struct mem_overlay_segment_req {
 	unsigned long start_pgoff;
 	unsigned long end_pgoff;
+
+	unsigned int type;
+	unsigned int flags;
+	unsigned long buffer_addr;
 };
 
 struct mem_overlay_req {
@@ -36,12 +88,121 @@ struct mem_overlay_req {
 	unsigned long base_addr;
 	unsigned long overlay_addr;
 
+	// Later segments replace earlier ones where they overlap.
 	unsigned int segments_size;
 	struct mem_overlay_segment_req *segments;
+
+	unsigned int flags;
+	int pidfd;
+	unsigned long scratch_addr;
 };
 
+// Unmap pages covered by overlay segments during cleanup so the base memory
+// area reverts to the contents of the base file.
+#define MEM_OVERLAY_CLEANUP_RESTORE_BASE (1 << 0)
+
 struct mem_overlay_cleanup_req {
 	unsigned long id;
+	unsigned int flags;
+};
+
+// Clear the dirty set after reading it, so the next read only returns pages
+// written after this one.
+#define MEM_OVERLAY_DIRTY_RESET (1 << 0)
+
+// Dirty base pages are returned as segments, in ascending order, that can be
+// used to register the next memory overlay.
+struct mem_overlay_dirty_req {
+	unsigned long id;
+	unsigned int flags;
+
+	unsigned int segments_size;
+	struct mem_overlay_segment_req *segments;
+};
+
+// Clear the recorded pages after reading them.
+#define MEM_OVERLAY_ACCESS_RESET (1 << 0)
+// Stop recording after reading the recorded pages.
+#define MEM_OVERLAY_ACCESS_STOP (1 << 1)
+
+// Recorded base pages are returned as page offsets in the order they were
+// first touched. The pages are a superset of the pages touched, since all the
+// pages mapped by a page fault, including fault-around, are recorded.
+struct mem_overlay_access_req {
+	unsigned long id;
+	unsigned int flags;
+
+	unsigned long pgoffs_size;
+	unsigned long *pgoffs;
+};
+
+// Stop the prefetch running for the memory overlay.
+#define MEM_OVERLAY_PREFETCH_CANCEL (1 << 0)
+// Change the batch_pages and delay_us of the prefetch running for the memory
+// overlay.
+#define MEM_OVERLAY_PREFETCH_THROTTLE (1 << 1)
+
+// Pages are prefetched in the order of pgoffs, in batches of batch_pages
+// pages with a delay of delay_us microseconds between batches.
+struct mem_overlay_prefetch_req {
+	unsigned long id;
+	unsigned int flags;
+
+	unsigned int batch_pages;
+	unsigned int delay_us;
+
+	unsigned long pgoffs_size;
+	unsigned long *pgoffs;
+};
+
+struct mem_overlay_range {
+	unsigned long start_pgoff;
+	unsigned long end_pgoff;
+};
+
+// Pending pages are marked as ready once their data has been written to the
+// overlay file or buffer.
+struct mem_overlay_ready_req {
+	unsigned long id;
+
+	unsigned int ranges_size;
+	struct mem_overlay_range *ranges;
+};
+
+// Event read from the device when page faults wait for a range of pending
+// pages. Page faults on adjacent pages are reported in the same event.
+struct mem_overlay_pending_event {
+	unsigned long id;
+	unsigned long start_pgoff;
+	unsigned long end_pgoff;
+};
+
+// Payload of io_uring IORING_OP_URING_CMD submissions. The SQE cmd_op must be
+// set to one of the IOCTL_MEM_OVERLAY_* commands and arg to the address of its
+// request.
+struct mem_overlay_uring_cmd {
+	unsigned long arg;
+};
+
+// Maximum number of requests of a batch command.
+#define MEM_OVERLAY_BATCH_MAX 4096
+
+// Batch commands return 0 once every request has been handled, even if some
+// of them failed. The result of each request is stored in statuses, as 0 or
+// the negative error code of the equivalent single request command. A
+// negative error code is only returned if the batch itself could not be
+// handled, such as when reqs or statuses can't be accessed.
+
+struct mem_overlay_batch_req {
+	unsigned int reqs_size;
+	struct mem_overlay_req *reqs;
+	int *statuses;
+};
+
+struct mem_overlay_batch_cleanup_req {
+	unsigned int reqs_size;
+	struct mem_overlay_cleanup_req *reqs;
+	int *statuses;
 };
 
 #endif //MEMORY_OVERLAY_COMMON_H
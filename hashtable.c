@@ -89,6 +89,8 @@ int hashtable_insert(struct hashtable *hashtable, const unsigned long key,
 	int ret = rhashtable_lookup_insert_fast(&hashtable->rhashtable,
 						&object->linkage,
 						hashtable_object_params);
+	if (ret)
+		kvfree(object);
 	log_trace("end hashtable_insert for hashtable with id '%pUB'",
 		  hashtable->id);
 	return ret;
@@ -116,6 +118,17 @@ void *hashtable_lookup(struct hashtable *hashtable, const unsigned long key)
 }
 
 void *hashtable_delete(struct hashtable *hashtable, const unsigned long key)
+{
+	return hashtable_delete_if(hashtable, key, NULL, NULL);
+}
+
+/*
+ * Delete the object with the given key only if check returns 0 for its data,
+ * otherwise return the error of check as an ERR_PTR. check is called from an
+ * RCU read-side critical section, so it must not sleep.
+ */
+void *hashtable_delete_if(struct hashtable *hashtable, const unsigned long key,
+			  int (*check)(void *data, void *arg), void *arg)
 {
 	log_trace("called hashtable_delete for hashtable with id '%pUB'",
 		  hashtable->id);
@@ -124,9 +137,15 @@ void *hashtable_delete(struct hashtable *hashtable, const unsigned long key)
 	struct hashtable_object *object = rhashtable_lookup(
 		&hashtable->rhashtable, &key, hashtable_object_params);
 	if (object) {
-		if (!rhashtable_remove_fast(&hashtable->rhashtable,
-					    &object->linkage,
-					    hashtable_object_params)) {
+		int err = check ? check(object->data, arg) : 0;
+		if (err) {
+			ret = ERR_PTR(err);
+			log_debug(
+				"hashtable object '%lu' not removed for hashtable with id '%pUB': %d",
+				key, hashtable->id, err);
+		} else if (!rhashtable_remove_fast(&hashtable->rhashtable,
+						   &object->linkage,
+						   hashtable_object_params)) {
 			ret = object->data;
 			kvfree_rcu(object, rcu_read);
 			log_debug(
@@ -148,6 +167,37 @@ void *hashtable_delete(struct hashtable *hashtable, const unsigned long key)
 	return ret;
 }
 
+/*
+ * Call fn for every object in the hashtable. fn is called from an RCU
+ * read-side critical section, so it must not sleep, and objects may be
+ * inserted or deleted concurrently.
+ */
+void hashtable_for_each(struct hashtable *hashtable,
+			void (*fn)(unsigned long key, void *data, void *arg),
+			void *arg)
+{
+	log_trace("start hashtable_for_each for hashtable with id '%pUB'",
+		  hashtable->id);
+	struct rhashtable_iter iter;
+	struct hashtable_object *object;
+	rhashtable_walk_enter(&hashtable->rhashtable, &iter);
+	rhashtable_walk_start(&iter);
+	while ((object = rhashtable_walk_next(&iter)) != NULL) {
+		if (IS_ERR(object)) {
+			// The table was resized during the walk, which
+			// may visit some objects twice.
+			if (PTR_ERR(object) == -EAGAIN)
+				continue;
+			break;
+		}
+		fn(object->key, object->data, arg);
+	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+	log_trace("end hashtable_for_each for hashtable with id '%pUB'",
+		  hashtable->id);
+}
+
 void hashtable_cleanup(struct hashtable *hashtable)
 {
 	log_trace("start hashtable_cleanup");
@@ -43,6 +43,11 @@ int hashtable_insert(struct hashtable *hashtable, const unsigned long key,
 		     void *data);
 void *hashtable_lookup(struct hashtable *hashtable, const unsigned long key);
 void *hashtable_delete(struct hashtable *hashtable, const unsigned long key);
+void *hashtable_delete_if(struct hashtable *hashtable, const unsigned long key,
+			  int (*check)(void *data, void *arg), void *arg);
+void hashtable_for_each(struct hashtable *hashtable,
+			void (*fn)(unsigned long key, void *data, void *arg),
+			void *arg);
 void hashtable_cleanup(struct hashtable *hashtable);
 
 #endif //MEMORY_OVERLAY_HASHTABLE_COMMON_H
@@ -0,0 +1,142 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+
+#include "histogram.h"
+#include "log.h"
+
+int histogram_init(struct histogram *histogram, const char *name)
+{
+	histogram->name = name;
+	histogram->cpu = alloc_percpu(struct histogram_cpu);
+	if (!histogram->cpu) {
+		log_error("unable to allocate histogram '%s'", name);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void histogram_destroy(struct histogram *histogram)
+{
+	free_percpu(histogram->cpu);
+	histogram->cpu = NULL;
+}
+
+/*
+ * Clear the histogram. Values recorded concurrently by other CPUs may be
+ * partially kept.
+ */
+void histogram_reset(struct histogram *histogram)
+{
+	int cpu;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(histogram->cpu, cpu), 0,
+		       sizeof(struct histogram_cpu));
+}
+
+/*
+ * Return the upper bound of the bucket that contains the value at the given
+ * rank, in per mille, of the sorted values.
+ */
+static u64 histogram_percentile(const u64 *buckets, u64 count,
+				unsigned int permille)
+{
+	u64 target = div_u64(count * permille + 999, 1000);
+	u64 seen = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= target && seen > 0)
+			return i == HISTOGRAM_BUCKETS - 1 ? U64_MAX :
+							    (2ULL << i) - 1;
+	}
+	return 0;
+}
+
+static int histogram_show(struct seq_file *m, void *v)
+{
+	struct histogram *histogram = m->private;
+	u64 buckets[HISTOGRAM_BUCKETS] = { 0 };
+	u64 count = 0;
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct histogram_cpu *c = per_cpu_ptr(histogram->cpu, cpu);
+		for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+			buckets[i] += READ_ONCE(c->buckets[i]);
+		sum += READ_ONCE(c->sum);
+	}
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		count += buckets[i];
+
+	seq_printf(m, "name: %s\n", histogram->name);
+	seq_printf(m, "count: %llu\n", count);
+	seq_printf(m, "mean_ns: %llu\n", count ? div64_u64(sum, count) : 0);
+	seq_printf(m, "p50_ns: %llu\n", histogram_percentile(buckets, count, 500));
+	seq_printf(m, "p99_ns: %llu\n", histogram_percentile(buckets, count, 990));
+	seq_printf(m, "p999_ns: %llu\n",
+		   histogram_percentile(buckets, count, 999));
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (!buckets[i])
+			continue;
+		seq_printf(m, "%llu-%llu: %llu\n", i ? 1ULL << i : 0,
+			   i == HISTOGRAM_BUCKETS - 1 ? U64_MAX :
+							(2ULL << i) - 1,
+			   buckets[i]);
+	}
+	return 0;
+}
+
+static int histogram_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, histogram_show, inode->i_private);
+}
+
+// Any write resets the histogram.
+static ssize_t histogram_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	histogram_reset(m->private);
+	return count;
+}
+
+static const struct file_operations histogram_fops = {
+	.owner = THIS_MODULE,
+	.open = histogram_open,
+	.read = seq_read,
+	.write = histogram_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Expose the histogram in a debugfs file named after it. Reading the file
+ * shows the percentiles and buckets, and writing to it resets the histogram.
+ */
+void histogram_debugfs_create(struct histogram *histogram,
+			      struct dentry *parent)
+{
+	debugfs_create_file(histogram->name, 0644, parent, histogram,
+			    &histogram_fops);
+}
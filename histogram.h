@@ -0,0 +1,57 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEMORY_OVERLAY_HISTOGRAM_H
+#define MEMORY_OVERLAY_HISTOGRAM_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+
+// Values are counted in log2 buckets, with bucket n holding values between
+// 2^n and 2^(n+1) - 1. Bucket 0 also holds 0.
+#define HISTOGRAM_BUCKETS 64
+
+struct histogram_cpu {
+	u64 buckets[HISTOGRAM_BUCKETS];
+	u64 sum;
+};
+
+struct histogram {
+	const char *name;
+	struct histogram_cpu __percpu *cpu;
+};
+
+int histogram_init(struct histogram *histogram, const char *name);
+void histogram_destroy(struct histogram *histogram);
+void histogram_reset(struct histogram *histogram);
+void histogram_debugfs_create(struct histogram *histogram,
+			      struct dentry *parent);
+
+/*
+ * Add a value to the histogram. Only the counters of the current CPU are
+ * changed, so it's safe to call from any context.
+ */
+static inline void histogram_record(struct histogram *histogram, u64 value)
+{
+	unsigned int bucket = value ? ilog2(value) : 0;
+	this_cpu_inc(histogram->cpu->buckets[bucket]);
+	this_cpu_add(histogram->cpu->sum, value);
+}
+
+#endif //MEMORY_OVERLAY_HISTOGRAM_H
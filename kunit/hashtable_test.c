@@ -0,0 +1,222 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+#include "../hashtable.h"
+
+// Memory overlays are keyed by the address of their VMA, so keys are spread
+// like slab objects.
+#define HASHTABLE_TEST_KEY(i) (0x100000UL + (unsigned long)(i) * 192)
+
+static void hashtable_test_count(unsigned long key, void *data, void *arg)
+{
+	(*(unsigned int *)arg)++;
+}
+
+static int hashtable_test_check(void *data, void *arg)
+{
+	return data == arg ? 0 : -EPERM;
+}
+
+static unsigned int hashtable_test_freed;
+
+static void hashtable_test_free(void *data)
+{
+	hashtable_test_freed++;
+}
+
+static void hashtable_lookup_test(struct kunit *test)
+{
+	unsigned int values[3];
+	unsigned int count = 0;
+
+	struct hashtable *hashtable = hashtable_setup(NULL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, hashtable);
+
+	for (int i = 0; i < ARRAY_SIZE(values); i++)
+		KUNIT_EXPECT_EQ(test,
+				hashtable_insert(hashtable,
+						 HASHTABLE_TEST_KEY(i),
+						 &values[i]),
+				0);
+	KUNIT_EXPECT_EQ(test,
+			hashtable_insert(hashtable, HASHTABLE_TEST_KEY(0),
+					 &values[1]),
+			-EEXIST);
+
+	for (int i = 0; i < ARRAY_SIZE(values); i++)
+		KUNIT_EXPECT_PTR_EQ(test,
+				    hashtable_lookup(hashtable,
+						     HASHTABLE_TEST_KEY(i)),
+				    (void *)&values[i]);
+	KUNIT_EXPECT_PTR_EQ(test,
+			    hashtable_lookup(hashtable, HASHTABLE_TEST_KEY(3)),
+			    NULL);
+
+	hashtable_for_each(hashtable, hashtable_test_count, &count);
+	KUNIT_EXPECT_EQ(test, count, 3U);
+
+	KUNIT_EXPECT_PTR_EQ(test,
+			    hashtable_delete(hashtable, HASHTABLE_TEST_KEY(1)),
+			    (void *)&values[1]);
+	KUNIT_EXPECT_PTR_EQ(test,
+			    hashtable_lookup(hashtable, HASHTABLE_TEST_KEY(1)),
+			    NULL);
+	KUNIT_EXPECT_PTR_EQ(test,
+			    hashtable_delete(hashtable, HASHTABLE_TEST_KEY(1)),
+			    NULL);
+
+	count = 0;
+	hashtable_for_each(hashtable, hashtable_test_count, &count);
+	KUNIT_EXPECT_EQ(test, count, 2U);
+
+	// Conditional deletes keep the object if the check fails.
+	KUNIT_EXPECT_PTR_EQ(test,
+			    hashtable_delete_if(hashtable,
+						HASHTABLE_TEST_KEY(0),
+						hashtable_test_check,
+						&values[2]),
+			    ERR_PTR(-EPERM));
+	KUNIT_EXPECT_PTR_EQ(test,
+			    hashtable_lookup(hashtable, HASHTABLE_TEST_KEY(0)),
+			    (void *)&values[0]);
+	KUNIT_EXPECT_PTR_EQ(test,
+			    hashtable_delete_if(hashtable,
+						HASHTABLE_TEST_KEY(0),
+						hashtable_test_check,
+						&values[0]),
+			    (void *)&values[0]);
+
+	hashtable_cleanup(hashtable);
+}
+
+static void hashtable_cleanup_test(struct kunit *test)
+{
+	unsigned int values[4];
+
+	struct hashtable *hashtable = hashtable_setup(hashtable_test_free);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, hashtable);
+
+	for (int i = 0; i < ARRAY_SIZE(values); i++)
+		KUNIT_EXPECT_EQ(test,
+				hashtable_insert(hashtable,
+						 HASHTABLE_TEST_KEY(i),
+						 &values[i]),
+				0);
+
+	// Deleted objects are handed back to the caller and not freed.
+	hashtable_delete(hashtable, HASHTABLE_TEST_KEY(0));
+
+	hashtable_test_freed = 0;
+	hashtable_cleanup(hashtable);
+	KUNIT_EXPECT_EQ(test, hashtable_test_freed, 3U);
+}
+
+// Microbenchmarks of the memory overlay lookup done by every page fault.
+static const unsigned int hashtable_bench_params[] = { 1, 64, 4096, 65536 };
+
+static void hashtable_bench_desc(const unsigned int *param, char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "overlays=%u", *param);
+}
+
+KUNIT_ARRAY_PARAM(hashtable_bench, hashtable_bench_params,
+		  hashtable_bench_desc);
+
+#define HASHTABLE_BENCH_LOOKUPS (1 << 20)
+
+static void hashtable_bench(struct kunit *test)
+{
+	unsigned int n = *(const unsigned int *)test->param_value;
+	unsigned int value;
+
+	struct hashtable *hashtable = hashtable_setup(NULL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, hashtable);
+
+	u64 start = ktime_get_ns();
+	for (unsigned int i = 0; i < n; i++) {
+		if (hashtable_insert(hashtable, HASHTABLE_TEST_KEY(i),
+				     &value)) {
+			KUNIT_FAIL(test, "failed to insert overlay %u", i);
+			hashtable_cleanup(hashtable);
+			return;
+		}
+		if (!(i & 0xfff))
+			cond_resched();
+	}
+	u64 insert_ns = ktime_get_ns() - start;
+
+	// Hits are spread over all overlays, misses look up keys between
+	// them.
+	unsigned long found = 0;
+	start = ktime_get_ns();
+	for (unsigned int i = 0; i < HASHTABLE_BENCH_LOOKUPS; i++) {
+		found += hashtable_lookup(hashtable,
+					  HASHTABLE_TEST_KEY(i % n)) != NULL;
+		if (!(i & 0xffff))
+			cond_resched();
+	}
+	u64 hit_ns = ktime_get_ns() - start;
+	KUNIT_EXPECT_EQ(test, found, (unsigned long)HASHTABLE_BENCH_LOOKUPS);
+
+	found = 0;
+	start = ktime_get_ns();
+	for (unsigned int i = 0; i < HASHTABLE_BENCH_LOOKUPS; i++) {
+		found += hashtable_lookup(hashtable,
+					  HASHTABLE_TEST_KEY(i % n) + 1) !=
+			 NULL;
+		if (!(i & 0xffff))
+			cond_resched();
+	}
+	u64 miss_ns = ktime_get_ns() - start;
+	KUNIT_EXPECT_EQ(test, found, 0UL);
+
+	start = ktime_get_ns();
+	for (unsigned int i = 0; i < n; i++) {
+		hashtable_delete(hashtable, HASHTABLE_TEST_KEY(i));
+		if (!(i & 0xfff))
+			cond_resched();
+	}
+	u64 delete_ns = ktime_get_ns() - start;
+
+	hashtable_cleanup(hashtable);
+
+	kunit_info(test,
+		   "insert=%llu ns/overlay hit=%llu ns/lookup miss=%llu ns/lookup delete=%llu ns/overlay\n",
+		   div64_u64(insert_ns, n),
+		   div64_u64(hit_ns, HASHTABLE_BENCH_LOOKUPS),
+		   div64_u64(miss_ns, HASHTABLE_BENCH_LOOKUPS),
+		   div64_u64(delete_ns, n));
+}
+
+static struct kunit_case hashtable_test_cases[] = {
+	KUNIT_CASE(hashtable_lookup_test),
+	KUNIT_CASE(hashtable_cleanup_test),
+	KUNIT_CASE_PARAM(hashtable_bench, hashtable_bench_gen_params),
+	{}
+};
+
+static struct kunit_suite hashtable_test_suite = {
+	.name = "memory_overlay_hashtable",
+	.test_cases = hashtable_test_cases,
+};
+
+kunit_test_suite(hashtable_test_suite);
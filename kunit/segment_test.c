@@ -0,0 +1,586 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+
+#include "../segment.h"
+
+static const struct mem_overlay_segment_req sorted_reqs[] = {
+	{ .start_pgoff = 10, .end_pgoff = 19 },
+	{ .start_pgoff = 20, .end_pgoff = 29 },
+	{ .start_pgoff = 40, .end_pgoff = 40, .type = MEM_OVERLAY_SEGMENT_ZERO },
+	{ .start_pgoff = 100, .end_pgoff = 163 },
+};
+
+static const struct mem_overlay_segment_req unsorted_reqs[] = {
+	{ .start_pgoff = 100, .end_pgoff = 163 },
+	{ .start_pgoff = 40, .end_pgoff = 40, .type = MEM_OVERLAY_SEGMENT_ZERO },
+	{ .start_pgoff = 10, .end_pgoff = 19 },
+	{ .start_pgoff = 20, .end_pgoff = 29 },
+};
+
+// Index in sorted_reqs of the segment that contains each page offset, or -1.
+static const struct {
+	pgoff_t pgoff;
+	int seg;
+} sorted_lookups[] = {
+	{ 0, -1 },  { 9, -1 },	 { 10, 0 },   { 19, 0 },   { 20, 1 },
+	{ 29, 1 },  { 30, -1 },	 { 39, -1 },  { 40, 2 },   { 41, -1 },
+	{ 99, -1 }, { 100, 3 },	 { 127, 3 },  { 128, 3 },  { 163, 3 },
+	{ 164, -1 }, { ULONG_MAX, -1 },
+};
+
+// Runs of a fault-around over the range between 0 and 200. Overlay runs are
+// identified by the index in sorted_reqs of their last segment, base runs by
+// -1. The first two segments are contiguous and share a run.
+static const struct {
+	pgoff_t start;
+	pgoff_t end;
+	int seg;
+} sorted_runs[] = {
+	{ 0, 9, -1 },	{ 10, 29, 1 },	 { 30, 39, -1 }, { 40, 40, 2 },
+	{ 41, 99, -1 }, { 100, 163, 3 }, { 164, 200, -1 },
+};
+
+/*
+ * Build a segment index from requests, the way memory overlays are created.
+ * File segments read the overlay file at the same page offsets as the base
+ * file.
+ */
+static void build_segments(struct kunit *test,
+			   struct mem_overlay_segments *segments,
+			   const struct mem_overlay_segment_req *reqs,
+			   unsigned int size)
+{
+	KUNIT_ASSERT_EQ(test, segments_init(segments, size), 0);
+	for (unsigned int i = 0; i < size; i++) {
+		struct mem_overlay_segment *seg = &segments->buf[i];
+		KUNIT_ASSERT_EQ(test, segment_parse(&reqs[i], seg), 0);
+		seg->overlay_pgoff = reqs[i].start_pgoff;
+		KUNIT_ASSERT_EQ(test, segments_insert(segments, i), 0);
+	}
+}
+
+static struct mem_overlay_segment *
+find_segment(struct mem_overlay_segments *segments, pgoff_t pgoff)
+{
+	XA_STATE(xas, &segments->xa, pgoff);
+	rcu_read_lock();
+	struct mem_overlay_segment *seg =
+		segments_find_first(segments, &xas, pgoff, pgoff);
+	rcu_read_unlock();
+	return seg;
+}
+
+/*
+ * Split the range between start and end into runs with the walk used by
+ * hijacked_map_pages, and return the number of runs.
+ */
+static unsigned int walk_runs(struct mem_overlay_segments *segments,
+			      pgoff_t start, pgoff_t end,
+			      struct segments_run *runs, unsigned int runs_size)
+{
+	struct segments_walk walk;
+	struct segments_run run;
+	unsigned int n = 0;
+
+	rcu_read_lock();
+	segments_walk_start(&walk, segments, start, end);
+	while (segments_walk_next(&walk, &run)) {
+		if (n < runs_size)
+			runs[n] = run;
+		n++;
+	}
+	segments_walk_end(&walk);
+	rcu_read_unlock();
+	return n;
+}
+
+static void expect_run(struct kunit *test, struct segments_run *run,
+		       pgoff_t start, pgoff_t end, int seg)
+{
+	KUNIT_EXPECT_EQ(test, run->start, start);
+	KUNIT_EXPECT_EQ(test, run->end, end);
+	if (seg < 0) {
+		KUNIT_EXPECT_PTR_EQ(test, run->seg,
+				    (struct mem_overlay_segment *)NULL);
+		return;
+	}
+	KUNIT_ASSERT_NOT_NULL(test, run->seg);
+	KUNIT_EXPECT_EQ(test, run->seg->start_pgoff,
+			sorted_reqs[seg].start_pgoff);
+}
+
+static void expect_run_seg(struct kunit *test, struct segments_run *run,
+			   pgoff_t start, pgoff_t end,
+			   struct mem_overlay_segment *seg)
+{
+	KUNIT_EXPECT_EQ(test, run->start, start);
+	KUNIT_EXPECT_EQ(test, run->end, end);
+	KUNIT_EXPECT_PTR_EQ(test, run->seg, seg);
+}
+
+static void segment_parse_test(struct kunit *test)
+{
+	struct mem_overlay_segment seg = { 0 };
+	struct mem_overlay_segment_req req = {
+		.start_pgoff = 10,
+		.end_pgoff = 20,
+		.type = MEM_OVERLAY_SEGMENT_BUFFER,
+		.flags = MEM_OVERLAY_SEGMENT_PENDING,
+	};
+
+	KUNIT_EXPECT_EQ(test, segment_parse(&req, &seg), 0);
+	KUNIT_EXPECT_EQ(test, seg.start_pgoff, 10UL);
+	KUNIT_EXPECT_EQ(test, seg.end_pgoff, 20UL);
+	KUNIT_EXPECT_EQ(test, seg.type, (unsigned int)MEM_OVERLAY_SEGMENT_BUFFER);
+
+	const struct mem_overlay_segment_req invalid_reqs[] = {
+		// End before start.
+		{ .start_pgoff = 20, .end_pgoff = 10 },
+		// Unknown flag.
+		{ .flags = MEM_OVERLAY_SEGMENT_PENDING << 1 },
+		// Pending zero segment.
+		{ .type = MEM_OVERLAY_SEGMENT_ZERO,
+		  .flags = MEM_OVERLAY_SEGMENT_PENDING },
+		// Unknown type.
+		{ .type = 42 },
+	};
+	for (int i = 0; i < ARRAY_SIZE(invalid_reqs); i++)
+		KUNIT_EXPECT_EQ_MSG(test, segment_parse(&invalid_reqs[i], &seg),
+				    -EINVAL, "invalid request %d", i);
+}
+
+static void segments_sorted_lookup_test(struct kunit *test)
+{
+	struct mem_overlay_segments *segments = test->priv;
+	build_segments(test, segments, sorted_reqs, ARRAY_SIZE(sorted_reqs));
+	KUNIT_EXPECT_TRUE(test, segments->sorted);
+
+	for (int i = 0; i < ARRAY_SIZE(sorted_lookups); i++) {
+		int expected = sorted_lookups[i].seg;
+		KUNIT_EXPECT_PTR_EQ_MSG(test,
+					find_segment(segments,
+						     sorted_lookups[i].pgoff),
+					expected < 0 ? NULL :
+						       &segments->buf[expected],
+					"pgoff=%lu", sorted_lookups[i].pgoff);
+	}
+}
+
+static void segments_unsorted_lookup_test(struct kunit *test)
+{
+	struct mem_overlay_segments *segments = test->priv;
+	build_segments(test, segments, unsorted_reqs,
+		       ARRAY_SIZE(unsorted_reqs));
+	KUNIT_EXPECT_FALSE(test, segments->sorted);
+
+	// Unsorted segments are never cached.
+	segments_cache(segments, &segments->buf[0]);
+	KUNIT_EXPECT_PTR_EQ(test, segments->cached,
+			    (struct mem_overlay_segment *)NULL);
+
+	for (int i = 0; i < ARRAY_SIZE(sorted_lookups); i++) {
+		struct mem_overlay_segment *seg =
+			find_segment(segments, sorted_lookups[i].pgoff);
+		int expected = sorted_lookups[i].seg;
+		if (expected < 0) {
+			KUNIT_EXPECT_PTR_EQ_MSG(test, seg, NULL, "pgoff=%lu",
+						sorted_lookups[i].pgoff);
+			continue;
+		}
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, seg);
+		KUNIT_EXPECT_EQ(test, seg->start_pgoff,
+				sorted_reqs[expected].start_pgoff);
+	}
+}
+
+static void segments_overlap_test(struct kunit *test)
+{
+	struct mem_overlay_segments *segments = test->priv;
+	const struct mem_overlay_segment_req reqs[] = {
+		{ .start_pgoff = 0, .end_pgoff = 63 },
+		{ .start_pgoff = 64, .end_pgoff = 127,
+		  .type = MEM_OVERLAY_SEGMENT_ZERO },
+	};
+	build_segments(test, segments, reqs, ARRAY_SIZE(reqs));
+	KUNIT_EXPECT_TRUE(test, segments->sorted);
+
+	// A segment that starts at or before the end of the previous one
+	// disables the sorted walk.
+	const struct mem_overlay_segment_req overlapping_reqs[] = {
+		{ .start_pgoff = 0, .end_pgoff = 63 },
+		{ .start_pgoff = 63, .end_pgoff = 127 },
+	};
+	segments_destroy(segments);
+	build_segments(test, segments, overlapping_reqs,
+		       ARRAY_SIZE(overlapping_reqs));
+	KUNIT_EXPECT_FALSE(test, segments->sorted);
+	KUNIT_EXPECT_PTR_EQ(test, find_segment(segments, 100),
+			    &segments->buf[1]);
+
+	// Runs end where a later nested segment replaced part of an earlier
+	// one, so fault-around maps the same pages as page faults.
+	const struct mem_overlay_segment_req nested_reqs[] = {
+		{ .start_pgoff = 0, .end_pgoff = 10 },
+		{ .start_pgoff = 5, .end_pgoff = 6,
+		  .type = MEM_OVERLAY_SEGMENT_ZERO },
+	};
+	struct segments_run runs[4];
+	segments_destroy(segments);
+	build_segments(test, segments, nested_reqs, ARRAY_SIZE(nested_reqs));
+	KUNIT_EXPECT_PTR_EQ(test, find_segment(segments, 5),
+			    &segments->buf[1]);
+	KUNIT_ASSERT_EQ(test,
+			walk_runs(segments, 0, 15, runs, ARRAY_SIZE(runs)),
+			4U);
+	expect_run_seg(test, &runs[0], 0, 4, &segments->buf[0]);
+	expect_run_seg(test, &runs[1], 5, 6, &segments->buf[1]);
+	expect_run_seg(test, &runs[2], 7, 10, &segments->buf[0]);
+	expect_run_seg(test, &runs[3], 11, 15, NULL);
+
+	KUNIT_ASSERT_EQ(test,
+			walk_runs(segments, 6, 8, runs, ARRAY_SIZE(runs)),
+			2U);
+	expect_run_seg(test, &runs[0], 6, 6, &segments->buf[1]);
+	expect_run_seg(test, &runs[1], 7, 8, &segments->buf[0]);
+
+	// A later segment that covers an earlier one replaces it entirely.
+	const struct mem_overlay_segment_req covering_reqs[] = {
+		{ .start_pgoff = 5, .end_pgoff = 6,
+		  .type = MEM_OVERLAY_SEGMENT_ZERO },
+		{ .start_pgoff = 0, .end_pgoff = 10 },
+	};
+	segments_destroy(segments);
+	build_segments(test, segments, covering_reqs,
+		       ARRAY_SIZE(covering_reqs));
+	KUNIT_ASSERT_EQ(test,
+			walk_runs(segments, 0, 10, runs, ARRAY_SIZE(runs)),
+			1U);
+	expect_run_seg(test, &runs[0], 0, 10, &segments->buf[1]);
+}
+
+static void segments_cached_lookup_test(struct kunit *test)
+{
+	struct mem_overlay_segments *segments = test->priv;
+	struct mem_overlay_segment *seg;
+	build_segments(test, segments, sorted_reqs, ARRAY_SIZE(sorted_reqs));
+
+	// Nothing is cached until the first page fault.
+	KUNIT_EXPECT_FALSE(test, segments_find_cached(segments, 10, &seg));
+
+	segments_cache(segments, &segments->buf[1]);
+	KUNIT_EXPECT_PTR_EQ(test, segments->cached, &segments->buf[1]);
+
+	// Hit on the cached segment.
+	KUNIT_EXPECT_TRUE(test, segments_find_cached(segments, 25, &seg));
+	KUNIT_EXPECT_PTR_EQ(test, seg, &segments->buf[1]);
+
+	// Hit on its successor, including the gap before it.
+	KUNIT_EXPECT_TRUE(test, segments_find_cached(segments, 30, &seg));
+	KUNIT_EXPECT_PTR_EQ(test, seg, &segments->buf[2]);
+
+	// Misses before the cached segment and past its successor.
+	KUNIT_EXPECT_FALSE(test, segments_find_cached(segments, 15, &seg));
+	KUNIT_EXPECT_FALSE(test, segments_find_cached(segments, 50, &seg));
+
+	// Misses still find the right segment through the xarray.
+	KUNIT_EXPECT_PTR_EQ(test, find_segment(segments, 15),
+			    &segments->buf[0]);
+	KUNIT_EXPECT_PTR_EQ(test, find_segment(segments, 120),
+			    &segments->buf[3]);
+
+	// There is nothing after the last segment.
+	segments_cache(segments, &segments->buf[3]);
+	KUNIT_EXPECT_TRUE(test, segments_find_cached(segments, 200, &seg));
+	KUNIT_EXPECT_PTR_EQ(test, seg, (struct mem_overlay_segment *)NULL);
+}
+
+static void segments_walk_test(struct kunit *test)
+{
+	struct mem_overlay_segments *segments = test->priv;
+	struct segments_run runs[ARRAY_SIZE(sorted_runs)];
+
+	for (int sorted = 1; sorted >= 0; sorted--) {
+		build_segments(test, segments,
+			       sorted ? sorted_reqs : unsorted_reqs,
+			       ARRAY_SIZE(sorted_reqs));
+
+		// Runs are walked in ascending order either way.
+		KUNIT_ASSERT_EQ(test,
+				walk_runs(segments, 0, 200, runs,
+					  ARRAY_SIZE(runs)),
+				(unsigned int)ARRAY_SIZE(sorted_runs));
+		for (int i = 0; i < ARRAY_SIZE(sorted_runs); i++)
+			expect_run(test, &runs[i], sorted_runs[i].start,
+				   sorted_runs[i].end, sorted_runs[i].seg);
+
+		// Walks within a fault-around window are clipped to it.
+		KUNIT_ASSERT_EQ(test,
+				walk_runs(segments, 16, 31, runs,
+					  ARRAY_SIZE(runs)),
+				2U);
+		expect_run(test, &runs[0], 16, 29, 1);
+		expect_run(test, &runs[1], 30, 31, -1);
+
+		KUNIT_ASSERT_EQ(test,
+				walk_runs(segments, 30, 39, runs,
+					  ARRAY_SIZE(runs)),
+				1U);
+		expect_run(test, &runs[0], 30, 39, -1);
+
+		KUNIT_ASSERT_EQ(test,
+				walk_runs(segments, 32, 47, runs,
+					  ARRAY_SIZE(runs)),
+				3U);
+		expect_run(test, &runs[0], 32, 39, -1);
+		expect_run(test, &runs[1], 40, 40, 2);
+		expect_run(test, &runs[2], 41, 47, -1);
+
+		// A walk up to the last page offset ends without wrapping.
+		KUNIT_ASSERT_EQ(test,
+				walk_runs(segments, 150, ULONG_MAX, runs,
+					  ARRAY_SIZE(runs)),
+				2U);
+		expect_run(test, &runs[0], 150, 163, 3);
+		expect_run(test, &runs[1], 164, ULONG_MAX, -1);
+
+		segments_destroy(segments);
+	}
+}
+
+static void segments_contiguous_test(struct kunit *test)
+{
+	struct mem_overlay_segment seg = {
+		.type = MEM_OVERLAY_SEGMENT_FILE,
+		.start_pgoff = 0,
+		.end_pgoff = 9,
+		.overlay_pgoff = 100,
+	};
+	struct mem_overlay_segment next = {
+		.type = MEM_OVERLAY_SEGMENT_FILE,
+		.start_pgoff = 10,
+		.end_pgoff = 19,
+		.overlay_pgoff = 110,
+	};
+
+	KUNIT_EXPECT_TRUE(test, segments_contiguous(&seg, &next));
+	KUNIT_EXPECT_EQ(test, segment_file_pgoff(&next, 15), 115UL);
+
+	// Not the next file page.
+	next.overlay_pgoff = 111;
+	KUNIT_EXPECT_FALSE(test, segments_contiguous(&seg, &next));
+
+	// Not the next base page.
+	next.overlay_pgoff = 110;
+	next.start_pgoff = 11;
+	KUNIT_EXPECT_FALSE(test, segments_contiguous(&seg, &next));
+
+	// Zero segments map every page to the same file page.
+	next.start_pgoff = 10;
+	seg.type = MEM_OVERLAY_SEGMENT_ZERO;
+	seg.overlay_pgoff = 0;
+	KUNIT_EXPECT_FALSE(test, segments_contiguous(&seg, &next));
+	KUNIT_EXPECT_EQ(test, segment_file_pgoff(&seg, 5), 0UL);
+}
+
+static void segments_destroy_test(struct kunit *test)
+{
+	struct mem_overlay_segments *segments = test->priv;
+	build_segments(test, segments, sorted_reqs, ARRAY_SIZE(sorted_reqs));
+	segments_count_nodes(segments);
+	KUNIT_EXPECT_GT(test, segments->nodes, 0UL);
+
+	segments_destroy(segments);
+	KUNIT_EXPECT_TRUE(test, xa_empty(&segments->xa));
+	KUNIT_EXPECT_PTR_EQ(test, segments->buf,
+			    (struct mem_overlay_segment *)NULL);
+	KUNIT_EXPECT_EQ(test, segments->size, 0U);
+}
+
+// Microbenchmarks build an alternating layout where every other page is
+// overlaid, the worst case for the xarray, in ascending or descending order.
+struct segments_bench_param {
+	unsigned int segments;
+	bool sorted;
+};
+
+static const struct segments_bench_param segments_bench_params[] = {
+	{ 1024, true },	   { 1024, false },    { 65536, true },
+	{ 65536, false },  { 1048576, true },  { 1048576, false },
+};
+
+static void segments_bench_desc(const struct segments_bench_param *param,
+				char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "segments=%u %s",
+		 param->segments, param->sorted ? "sorted" : "unsorted");
+}
+
+KUNIT_ARRAY_PARAM(segments_bench, segments_bench_params, segments_bench_desc);
+
+#define SEGMENTS_BENCH_FAULT_AROUND_PAGES 16
+
+static void bench_resched(unsigned long i)
+{
+	if (!(i & 0xffff))
+		cond_resched();
+}
+
+static u32 bench_random(u32 *state)
+{
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void segments_bench(struct kunit *test)
+{
+	const struct segments_bench_param *param = test->param_value;
+	struct mem_overlay_segments *segments = test->priv;
+	unsigned int n = param->segments;
+	pgoff_t pages = 2 * (pgoff_t)n;
+
+	u64 start = ktime_get_ns();
+	KUNIT_ASSERT_EQ(test, segments_init(segments, n), 0);
+	for (unsigned int i = 0; i < n; i++) {
+		pgoff_t pgoff = 2 * (pgoff_t)(param->sorted ? i : n - 1 - i);
+		struct mem_overlay_segment_req req = {
+			.start_pgoff = pgoff,
+			.end_pgoff = pgoff,
+		};
+		if (segment_parse(&req, &segments->buf[i]) ||
+		    segments_insert(segments, i)) {
+			KUNIT_FAIL(test, "failed to insert segment %u", i);
+			return;
+		}
+		bench_resched(i);
+	}
+	u64 insert_ns = ktime_get_ns() - start;
+	KUNIT_EXPECT_EQ(test, segments->sorted, param->sorted);
+
+	// Sequential lookups, like page faults reading the memory area in
+	// order. Sorted segments hit the cached segment.
+	unsigned long found = 0;
+	start = ktime_get_ns();
+	for (pgoff_t pgoff = 0; pgoff < pages; pgoff++) {
+		struct mem_overlay_segment *seg = find_segment(segments, pgoff);
+		if (seg) {
+			segments_cache(segments, seg);
+			found++;
+		}
+		bench_resched(pgoff);
+	}
+	u64 sequential_ns = ktime_get_ns() - start;
+	KUNIT_EXPECT_EQ(test, found, (unsigned long)n);
+
+	// Random lookups mostly miss the cached segment.
+	u32 state = 1;
+	start = ktime_get_ns();
+	for (pgoff_t i = 0; i < pages; i++) {
+		pgoff_t pgoff = bench_random(&state) % pages;
+		struct mem_overlay_segment *seg = find_segment(segments, pgoff);
+		if (seg)
+			segments_cache(segments, seg);
+		bench_resched(i);
+	}
+	u64 random_ns = ktime_get_ns() - start;
+
+	// Fault-around walks over consecutive windows, like hijacked_map_pages.
+	// Segments are not contiguous, so each one is its own overlay run.
+	unsigned long walked = 0;
+	start = ktime_get_ns();
+	for (pgoff_t pgoff = 0; pgoff < pages;
+	     pgoff += SEGMENTS_BENCH_FAULT_AROUND_PAGES) {
+		pgoff_t end = pgoff + SEGMENTS_BENCH_FAULT_AROUND_PAGES - 1;
+		struct segments_walk walk;
+		struct segments_run run;
+		rcu_read_lock();
+		segments_walk_start(&walk, segments, pgoff, end);
+		while (segments_walk_next(&walk, &run))
+			if (run.seg)
+				walked++;
+		segments_walk_end(&walk);
+		rcu_read_unlock();
+		bench_resched(pgoff);
+	}
+	u64 walk_ns = ktime_get_ns() - start;
+	KUNIT_EXPECT_EQ(test, walked, (unsigned long)n);
+
+	segments_count_nodes(segments);
+	unsigned long memory = n * sizeof(struct mem_overlay_segment) +
+			       segments->nodes * sizeof(struct xa_node);
+
+	start = ktime_get_ns();
+	segments_destroy(segments);
+	u64 destroy_ns = ktime_get_ns() - start;
+
+	kunit_info(test,
+		   "insert=%llu ns/segment sequential=%llu ns/lookup random=%llu ns/lookup walk=%llu ns/window destroy=%llu ns/segment memory=%lu bytes/segment\n",
+		   div64_u64(insert_ns, n), div64_u64(sequential_ns, pages),
+		   div64_u64(random_ns, pages),
+		   div64_u64(walk_ns, pages / SEGMENTS_BENCH_FAULT_AROUND_PAGES),
+		   div64_u64(destroy_ns, n), memory / n);
+}
+
+static int segments_test_init(struct kunit *test)
+{
+	test->priv = kunit_kzalloc(test, sizeof(struct mem_overlay_segments),
+				   GFP_KERNEL);
+	if (!test->priv)
+		return -ENOMEM;
+	return 0;
+}
+
+static void segments_test_exit(struct kunit *test)
+{
+	struct mem_overlay_segments *segments = test->priv;
+	if (segments->buf)
+		segments_destroy(segments);
+}
+
+static struct kunit_case segments_test_cases[] = {
+	KUNIT_CASE(segment_parse_test),
+	KUNIT_CASE(segments_sorted_lookup_test),
+	KUNIT_CASE(segments_unsorted_lookup_test),
+	KUNIT_CASE(segments_overlap_test),
+	KUNIT_CASE(segments_cached_lookup_test),
+	KUNIT_CASE(segments_walk_test),
+	KUNIT_CASE(segments_contiguous_test),
+	KUNIT_CASE(segments_destroy_test),
+	KUNIT_CASE_PARAM(segments_bench, segments_bench_gen_params),
+	{}
+};
+
+static struct kunit_suite segments_test_suite = {
+	.name = "memory_overlay_segments",
+	.init = segments_test_init,
+	.exit = segments_test_exit,
+	.test_cases = segments_test_cases,
+};
+
+kunit_test_suite(segments_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for the memory overlay module");
@@ -0,0 +1,919 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/userfaultfd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "memory_overlay.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// Maximum number of pages copied by the userfaultfd handler for each page
+// fault, as long as they are read from the same source.
+#define UFFD_FAULT_AROUND_PAGES 16
+
+// Memory area read from /proc/self/maps.
+struct mapping {
+	unsigned long start;
+	unsigned long end;
+	unsigned long offset;
+	int prot;
+	bool shared;
+	dev_t dev;
+	ino_t inode;
+	char path[PATH_MAX];
+};
+
+// File that backs overlay or buffer segments.
+struct segment_file {
+	struct mapping map;
+	int fd;
+};
+
+struct segment {
+	unsigned long start_pgoff;
+	unsigned long end_pgoff;
+	// Index of the segment file, or -1 for zero segments.
+	int file;
+	// Offset in the segment file of the first segment page.
+	unsigned long offset;
+};
+
+struct mem_overlay {
+	struct mem_overlay *next;
+	enum mem_overlay_backend backend;
+	long page_size;
+
+	struct mapping base;
+	unsigned long base_pgoff;
+	int base_fd;
+
+	struct segment *segments;
+	unsigned int segments_size;
+	bool segments_sorted;
+
+	struct segment_file *files;
+	unsigned int files_size;
+
+	// Only used by the userfaultfd backend.
+	char *stash;
+	int uffd;
+	int stop_fds[2];
+	pthread_t handler;
+};
+
+struct mem_overlay_ctx {
+	unsigned int flags;
+	int dev;
+	long page_size;
+
+	pthread_mutex_t lock;
+	struct mem_overlay *overlays;
+};
+
+/*
+ * find_mapping reads the memory area that contains addr from
+ * /proc/self/maps.
+ */
+static int find_mapping(unsigned long addr, struct mapping *m)
+{
+	FILE *f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return -1;
+
+	int res = -1;
+	errno = EINVAL;
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, f) > 0) {
+		char perms[5];
+		unsigned int major, minor;
+		unsigned long inode;
+		int path_pos = 0;
+		if (sscanf(line, "%lx-%lx %4s %lx %x:%x %lu %n", &m->start,
+			   &m->end, perms, &m->offset, &major, &minor, &inode,
+			   &path_pos) < 7)
+			continue;
+		if (addr < m->start || addr >= m->end)
+			continue;
+
+		m->prot = (perms[0] == 'r' ? PROT_READ : 0) |
+			  (perms[1] == 'w' ? PROT_WRITE : 0) |
+			  (perms[2] == 'x' ? PROT_EXEC : 0);
+		m->shared = perms[3] == 's';
+		m->dev = makedev(major, minor);
+		m->inode = inode;
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(m->path, sizeof(m->path), "%s", line + path_pos);
+		res = 0;
+		break;
+	}
+
+	free(line);
+	fclose(f);
+	return res;
+}
+
+/*
+ * open_mapping_file opens the file that backs the memory area.
+ */
+static int open_mapping_file(struct mapping *m, int flags)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/map_files/%lx-%lx", m->start,
+		 m->end);
+	int fd = open(path, flags | O_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+
+	// Opening map_files requires CAP_SYS_ADMIN or CAP_CHECKPOINT_RESTORE,
+	// so fall back to the file path as long as it still refers to the
+	// mapped file. Deleted files, such as memfds, can't be reopened.
+	if (m->path[0] != '/') {
+		errno = ENOENT;
+		return -1;
+	}
+	fd = open(m->path, flags | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_dev != m->dev || st.st_ino != m->inode) {
+		close(fd);
+		errno = ENOENT;
+		return -1;
+	}
+	return fd;
+}
+
+static long read_long(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	long value = -1;
+	if (fscanf(f, "%ld", &value) != 1)
+		value = -1;
+	fclose(f);
+	return value;
+}
+
+static long count_vmas()
+{
+	FILE *f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return -1;
+
+	long vmas = 0;
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		if (c == '\n')
+			vmas++;
+	}
+	fclose(f);
+	return vmas;
+}
+
+static unsigned long segment_addr(struct mem_overlay *ov,
+				  struct segment *seg)
+{
+	return ov->base.start +
+	       (seg->start_pgoff - ov->base_pgoff) * ov->page_size;
+}
+
+static size_t segment_len(struct mem_overlay *ov, struct segment *seg)
+{
+	return (seg->end_pgoff - seg->start_pgoff + 1) * ov->page_size;
+}
+
+/*
+ * find_segment returns the segment that contains pgoff, or NULL. next is set
+ * to the first page offset after pgoff that is covered by a segment, or
+ * ULONG_MAX.
+ */
+static struct segment *find_segment(struct mem_overlay *ov,
+				    unsigned long pgoff, unsigned long *next)
+{
+	*next = ULONG_MAX;
+
+	if (ov->segments_sorted) {
+		unsigned int lo = 0, hi = ov->segments_size;
+		while (lo < hi) {
+			unsigned int mid = lo + (hi - lo) / 2;
+			if (ov->segments[mid].end_pgoff < pgoff)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == ov->segments_size)
+			return NULL;
+		if (ov->segments[lo].start_pgoff <= pgoff)
+			return &ov->segments[lo];
+		*next = ov->segments[lo].start_pgoff;
+		return NULL;
+	}
+
+	// Later segments replace earlier ones, like in the kernel module.
+	for (unsigned int i = ov->segments_size; i-- > 0;) {
+		struct segment *seg = &ov->segments[i];
+		if (seg->start_pgoff <= pgoff && pgoff <= seg->end_pgoff)
+			return seg;
+		if (seg->start_pgoff > pgoff && seg->start_pgoff < *next)
+			*next = seg->start_pgoff;
+	}
+	return NULL;
+}
+
+/*
+ * find_segment_file returns the index of the segment file mapped at addr,
+ * adding it if needed, or -1 if addr is not backed by a file.
+ */
+static int find_segment_file(struct mem_overlay *ov, unsigned long addr)
+{
+	for (unsigned int i = ov->files_size; i-- > 0;) {
+		struct mapping *m = &ov->files[i].map;
+		if (m->start <= addr && addr < m->end)
+			return i;
+	}
+
+	struct mapping m;
+	if (find_mapping(addr, &m))
+		return -1;
+	if (m.inode == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct segment_file *files =
+		realloc(ov->files, (ov->files_size + 1) * sizeof(*files));
+	if (!files)
+		return -1;
+	ov->files = files;
+	ov->files[ov->files_size].map = m;
+	ov->files[ov->files_size].fd = -1;
+	return ov->files_size++;
+}
+
+/*
+ * prepare_segments validates the segments of the request, clips them to the
+ * base memory area and merges adjacent segments read from contiguous pages.
+ */
+static int prepare_segments(struct mem_overlay *ov,
+			    struct mem_overlay_req *req)
+{
+	unsigned long base_end =
+		ov->base_pgoff + (ov->base.end - ov->base.start) / ov->page_size -
+		1;
+	int overlay_file = -1;
+
+	ov->segments = calloc(req->segments_size ? req->segments_size : 1,
+			      sizeof(struct segment));
+	if (!ov->segments)
+		return -1;
+
+	// Segments can only be merged if they are in ascending order and
+	// don't overlap.
+	ov->segments_sorted = true;
+	for (unsigned int i = 1; i < req->segments_size; i++) {
+		if (req->segments[i].start_pgoff <=
+		    req->segments[i - 1].end_pgoff)
+			ov->segments_sorted = false;
+	}
+
+	for (unsigned int i = 0; i < req->segments_size; i++) {
+		struct mem_overlay_segment_req *seg_req = &req->segments[i];
+		if (seg_req->start_pgoff > seg_req->end_pgoff ||
+		    seg_req->flags & ~MEM_OVERLAY_SEGMENT_PENDING) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (seg_req->flags & MEM_OVERLAY_SEGMENT_PENDING) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+
+		struct segment seg = {
+			.start_pgoff = seg_req->start_pgoff,
+			.end_pgoff = seg_req->end_pgoff,
+		};
+		switch (seg_req->type) {
+		case MEM_OVERLAY_SEGMENT_FILE:
+			if (overlay_file < 0) {
+				overlay_file =
+					find_segment_file(ov, req->overlay_addr);
+				if (overlay_file < 0) {
+					errno = EINVAL;
+					return -1;
+				}
+			}
+			seg.file = overlay_file;
+			seg.offset = seg.start_pgoff * ov->page_size;
+			break;
+		case MEM_OVERLAY_SEGMENT_ZERO:
+			// Writes to a shared mapping would modify the zero
+			// page.
+			if (ov->base.shared && (ov->base.prot & PROT_WRITE)) {
+				errno = EINVAL;
+				return -1;
+			}
+			seg.file = -1;
+			break;
+		case MEM_OVERLAY_SEGMENT_BUFFER: {
+			seg.file = find_segment_file(ov, seg_req->buffer_addr);
+			if (seg.file < 0) {
+				errno = EINVAL;
+				return -1;
+			}
+			struct mapping *m = &ov->files[seg.file].map;
+			if (seg_req->buffer_addr +
+				    (seg.end_pgoff - seg.start_pgoff + 1) *
+					    ov->page_size >
+			    m->end) {
+				errno = EINVAL;
+				return -1;
+			}
+			seg.offset = m->offset + (seg_req->buffer_addr - m->start);
+			break;
+		}
+		default:
+			errno = EINVAL;
+			return -1;
+		}
+
+		// Pages outside of the base memory area are never accessed.
+		if (seg.end_pgoff < ov->base_pgoff || seg.start_pgoff > base_end)
+			continue;
+		if (seg.start_pgoff < ov->base_pgoff) {
+			if (seg.file >= 0)
+				seg.offset += (ov->base_pgoff - seg.start_pgoff) *
+					      ov->page_size;
+			seg.start_pgoff = ov->base_pgoff;
+		}
+		if (seg.end_pgoff > base_end)
+			seg.end_pgoff = base_end;
+
+		struct segment *prev = ov->segments_size ?
+					       &ov->segments[ov->segments_size - 1] :
+					       NULL;
+		if (ov->segments_sorted && prev &&
+		    prev->end_pgoff + 1 == seg.start_pgoff &&
+		    prev->file == seg.file &&
+		    (seg.file < 0 ||
+		     prev->offset + segment_len(ov, prev) == seg.offset)) {
+			prev->end_pgoff = seg.end_pgoff;
+			continue;
+		}
+		ov->segments[ov->segments_size++] = seg;
+	}
+
+	return 0;
+}
+
+/*
+ * restore_segments maps the base file over the first segments_size segments.
+ */
+static void restore_segments(struct mem_overlay *ov,
+			     unsigned int segments_size)
+{
+	int flags = MAP_FIXED | (ov->base.shared ? MAP_SHARED : MAP_PRIVATE);
+	for (unsigned int i = 0; i < segments_size; i++) {
+		struct segment *seg = &ov->segments[i];
+		mmap((void *)segment_addr(ov, seg), segment_len(ov, seg),
+		     ov->base.prot, flags, ov->base_fd,
+		     ov->base.offset +
+			     (seg->start_pgoff - ov->base_pgoff) * ov->page_size);
+	}
+}
+
+static int setup_mmap(struct mem_overlay_ctx *ctx, struct mem_overlay *ov)
+{
+	int open_flags = ov->base.shared && (ov->base.prot & PROT_WRITE) ?
+				 O_RDWR :
+				 O_RDONLY;
+	ov->base_fd = open_mapping_file(&ov->base, open_flags);
+	if (ov->base_fd < 0)
+		return -1;
+	for (unsigned int i = 0; i < ov->files_size; i++) {
+		ov->files[i].fd =
+			open_mapping_file(&ov->files[i].map, open_flags);
+		if (ov->files[i].fd < 0)
+			return -1;
+	}
+
+	// Each segment splits the base VMA in up to three VMAs, so check that
+	// the process won't run out of them halfway.
+	long max_map_count = read_long("/proc/sys/vm/max_map_count");
+	if (max_map_count > 0 &&
+	    count_vmas() + 2 * (long)ov->segments_size >= max_map_count) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	int flags = MAP_FIXED | (ov->base.shared ? MAP_SHARED : MAP_PRIVATE);
+	for (unsigned int i = 0; i < ov->segments_size; i++) {
+		struct segment *seg = &ov->segments[i];
+		void *addr = (void *)segment_addr(ov, seg);
+		size_t len = segment_len(ov, seg);
+
+		void *res;
+		if (seg->file < 0)
+			res = mmap(addr, len, ov->base.prot,
+				   MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
+				   0);
+		else
+			res = mmap(addr, len, ov->base.prot, flags,
+				   ov->files[seg->file].fd, seg->offset);
+		if (res == MAP_FAILED) {
+			int err = errno;
+			restore_segments(ov, i);
+			errno = err;
+			return -1;
+		}
+
+		// Populating is only a hint, so errors, such as kernels
+		// without MADV_POPULATE_READ, are ignored.
+		if (ctx->flags & MEM_OVERLAY_OPEN_POPULATE)
+			madvise(addr, len, MADV_POPULATE_READ);
+	}
+
+	return 0;
+}
+
+/*
+ * resolve_uffd_fault copies len bytes from src to dst, or fills them with
+ * zeros if src is 0, waking the threads waiting on them.
+ */
+static void resolve_uffd_fault(struct mem_overlay *ov, unsigned long dst,
+			       unsigned long src, unsigned long len)
+{
+	unsigned long fault_addr = dst;
+
+	while (len > 0) {
+		long long done;
+		int res;
+		if (src) {
+			struct uffdio_copy copy = {
+				.dst = dst,
+				.src = src,
+				.len = len,
+			};
+			res = ioctl(ov->uffd, UFFDIO_COPY, &copy);
+			done = copy.copy;
+		} else {
+			struct uffdio_zeropage zeropage = {
+				.range = { .start = dst, .len = len },
+			};
+			res = ioctl(ov->uffd, UFFDIO_ZEROPAGE, &zeropage);
+			done = zeropage.zeropage;
+		}
+		if (!res)
+			return;
+
+		if (done > 0) {
+			dst += done;
+			if (src)
+				src += done;
+			len -= done;
+			continue;
+		}
+		if (errno == EAGAIN)
+			continue;
+		if (errno != EEXIST)
+			break;
+
+		// Pages that are already mapped are skipped.
+		dst += ov->page_size;
+		if (src)
+			src += ov->page_size;
+		len -= ov->page_size;
+	}
+
+	// Make sure the faulting thread is woken up even if its page was
+	// mapped by someone else.
+	struct uffdio_range range = {
+		.start = fault_addr,
+		.len = ov->page_size,
+	};
+	ioctl(ov->uffd, UFFDIO_WAKE, &range);
+}
+
+static void handle_uffd_fault(struct mem_overlay *ov, unsigned long addr)
+{
+	unsigned long pgoff =
+		ov->base_pgoff + (addr - ov->base.start) / ov->page_size;
+	unsigned long pages = (ov->base.end - addr) / ov->page_size;
+	if (pages > UFFD_FAULT_AROUND_PAGES)
+		pages = UFFD_FAULT_AROUND_PAGES;
+
+	unsigned long next;
+	struct segment *seg = find_segment(ov, pgoff, &next);
+	unsigned long src = 0;
+	if (!seg) {
+		// Pages outside of the segments are read from the base memory
+		// area moved to the stash.
+		if (next - pgoff < pages)
+			pages = next - pgoff;
+		src = (unsigned long)ov->stash + (addr - ov->base.start);
+	} else {
+		if (seg->end_pgoff - pgoff + 1 < pages)
+			pages = seg->end_pgoff - pgoff + 1;
+
+		// Pages beyond the memory area of the segment file are filled
+		// with zeros.
+		if (seg->file >= 0) {
+			struct mapping *m = &ov->files[seg->file].map;
+			unsigned long offset =
+				seg->offset +
+				(pgoff - seg->start_pgoff) * ov->page_size;
+			if (offset >= m->offset &&
+			    offset - m->offset < m->end - m->start) {
+				src = m->start + (offset - m->offset);
+				if ((m->end - src) / ov->page_size < pages)
+					pages = (m->end - src) / ov->page_size;
+			} else {
+				pages = 1;
+			}
+		}
+	}
+
+	resolve_uffd_fault(ov, addr, src, pages * ov->page_size);
+}
+
+static void *handle_uffd_faults(void *arg)
+{
+	struct mem_overlay *ov = arg;
+	struct pollfd fds[2] = {
+		{ .fd = ov->uffd, .events = POLLIN },
+		{ .fd = ov->stop_fds[0], .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		struct uffd_msg msg;
+		if (read(ov->uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		handle_uffd_fault(ov, msg.arg.pagefault.address &
+					      ~(ov->page_size - 1));
+	}
+	return NULL;
+}
+
+static int setup_uffd(struct mem_overlay *ov)
+{
+	// Missing page faults are only reported for anonymous memory, which
+	// can't stand in for a shared base memory area.
+	if (ov->base.shared) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	int err;
+	size_t size = ov->base.end - ov->base.start;
+	ov->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (ov->uffd < 0)
+		return -1;
+
+	struct uffdio_api api = { .api = UFFD_API };
+	if (ioctl(ov->uffd, UFFDIO_API, &api)) {
+		err = errno;
+		goto close_uffd;
+	}
+
+	if (pipe2(ov->stop_fds, O_CLOEXEC)) {
+		err = errno;
+		goto close_uffd;
+	}
+
+	// The base memory area is moved out of the way and replaced by
+	// anonymous memory, where the handler copies the missing pages.
+	ov->stash = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+			 -1, 0);
+	if (ov->stash == MAP_FAILED) {
+		err = errno;
+		goto close_pipe;
+	}
+	if (mremap((void *)ov->base.start, size, size,
+		   MREMAP_MAYMOVE | MREMAP_FIXED, ov->stash) == MAP_FAILED) {
+		err = errno;
+		goto unmap_stash;
+	}
+	if (mmap((void *)ov->base.start, size, ov->base.prot,
+		 MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+		err = errno;
+		goto restore_base;
+	}
+
+	struct uffdio_register reg = {
+		.range = { .start = ov->base.start, .len = size },
+		.mode = UFFDIO_REGISTER_MODE_MISSING,
+	};
+	if (ioctl(ov->uffd, UFFDIO_REGISTER, &reg)) {
+		err = errno;
+		goto restore_base;
+	}
+
+	err = pthread_create(&ov->handler, NULL, handle_uffd_faults, ov);
+	if (err)
+		goto restore_base;
+
+	return 0;
+
+restore_base:
+	mremap(ov->stash, size, size, MREMAP_MAYMOVE | MREMAP_FIXED,
+	       (void *)ov->base.start);
+	goto close_pipe;
+unmap_stash:
+	munmap(ov->stash, size);
+close_pipe:
+	close(ov->stop_fds[0]);
+	close(ov->stop_fds[1]);
+close_uffd:
+	close(ov->uffd);
+	ov->uffd = -1;
+	ov->stash = NULL;
+	errno = err;
+	return -1;
+}
+
+static void free_overlay(struct mem_overlay *ov)
+{
+	if (ov->base_fd >= 0)
+		close(ov->base_fd);
+	for (unsigned int i = 0; i < ov->files_size; i++) {
+		if (ov->files[i].fd >= 0)
+			close(ov->files[i].fd);
+	}
+	free(ov->files);
+	free(ov->segments);
+	free(ov);
+}
+
+static void destroy_overlay(struct mem_overlay *ov, bool restore_base)
+{
+	switch (ov->backend) {
+	case MEM_OVERLAY_BACKEND_MMAP:
+		if (restore_base)
+			restore_segments(ov, ov->segments_size);
+		break;
+	case MEM_OVERLAY_BACKEND_UFFD: {
+		size_t size = ov->base.end - ov->base.start;
+		write(ov->stop_fds[1], "", 1);
+		pthread_join(ov->handler, NULL);
+
+		// The anonymous memory can't be filled once the handler is
+		// stopped, so the base memory area is always restored. Closing
+		// the userfaultfd afterwards wakes up any thread still waiting
+		// for a page.
+		mremap(ov->stash, size, size, MREMAP_MAYMOVE | MREMAP_FIXED,
+		       (void *)ov->base.start);
+		close(ov->uffd);
+		close(ov->stop_fds[0]);
+		close(ov->stop_fds[1]);
+		break;
+	}
+	default:
+		break;
+	}
+	free_overlay(ov);
+}
+
+static struct mem_overlay **find_overlay(struct mem_overlay_ctx *ctx,
+					 unsigned long id)
+{
+	struct mem_overlay **ov = &ctx->overlays;
+	while (*ov && (*ov)->base.start != id)
+		ov = &(*ov)->next;
+	return ov;
+}
+
+static int create_overlay(struct mem_overlay_ctx *ctx,
+			  struct mem_overlay_req *req)
+{
+	int err;
+	struct mem_overlay *ov = calloc(1, sizeof(struct mem_overlay));
+	if (!ov)
+		return -1;
+	ov->page_size = ctx->page_size;
+	ov->base_fd = -1;
+	ov->uffd = -1;
+
+	if (req->flags) {
+		free_overlay(ov);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (find_mapping(req->base_addr, &ov->base) || ov->base.inode == 0) {
+		free_overlay(ov);
+		errno = EINVAL;
+		return -1;
+	}
+	ov->base_pgoff = ov->base.offset / ov->page_size;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (*find_overlay(ctx, ov->base.start)) {
+		err = EEXIST;
+		goto free_overlay;
+	}
+
+	if (prepare_segments(ov, req)) {
+		err = errno;
+		goto free_overlay;
+	}
+
+	err = EOPNOTSUPP;
+	if (!(ctx->flags & MEM_OVERLAY_OPEN_NO_MMAP)) {
+		if (!setup_mmap(ctx, ov)) {
+			ov->backend = MEM_OVERLAY_BACKEND_MMAP;
+			goto register_overlay;
+		}
+		err = errno;
+	}
+	if (setup_uffd(ov)) {
+		// Report why the mmap backend failed if the userfaultfd
+		// backend can't be used at all.
+		if (errno != EOPNOTSUPP)
+			err = errno;
+		goto free_overlay;
+	}
+	ov->backend = MEM_OVERLAY_BACKEND_UFFD;
+
+register_overlay:
+	ov->next = ctx->overlays;
+	ctx->overlays = ov;
+	req->id = ov->base.start;
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+
+free_overlay:
+	pthread_mutex_unlock(&ctx->lock);
+	free_overlay(ov);
+	errno = err;
+	return -1;
+}
+
+static int cleanup_overlay(struct mem_overlay_ctx *ctx,
+			   struct mem_overlay_cleanup_req *req)
+{
+	if (req->flags & ~MEM_OVERLAY_CLEANUP_RESTORE_BASE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	struct mem_overlay **link = find_overlay(ctx, req->id);
+	struct mem_overlay *ov = *link;
+	if (!ov) {
+		pthread_mutex_unlock(&ctx->lock);
+		errno = ENOENT;
+		return -1;
+	}
+	*link = ov->next;
+	pthread_mutex_unlock(&ctx->lock);
+
+	destroy_overlay(ov, req->flags & MEM_OVERLAY_CLEANUP_RESTORE_BASE);
+	return 0;
+}
+
+struct mem_overlay_ctx *mem_overlay_open(unsigned int flags)
+{
+	struct mem_overlay_ctx *ctx = calloc(1, sizeof(struct mem_overlay_ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->flags = flags;
+	ctx->page_size = sysconf(_SC_PAGESIZE);
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	// Any error opening the device, such as the module not being loaded,
+	// selects the userspace backends.
+	ctx->dev = -1;
+	if (!(flags & MEM_OVERLAY_OPEN_NO_MODULE))
+		ctx->dev = open(kmod_device_path, O_WRONLY | O_CLOEXEC);
+
+	return ctx;
+}
+
+void mem_overlay_close(struct mem_overlay_ctx *ctx)
+{
+	while (ctx->overlays) {
+		struct mem_overlay *ov = ctx->overlays;
+		ctx->overlays = ov->next;
+		destroy_overlay(ov, true);
+	}
+
+	if (ctx->dev >= 0)
+		close(ctx->dev);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+int mem_overlay_ioctl(struct mem_overlay_ctx *ctx, unsigned long cmd,
+		      void *arg)
+{
+	if (ctx->dev >= 0)
+		return ioctl(ctx->dev, cmd, arg);
+
+	switch (cmd) {
+	case IOCTL_MEM_OVERLAY_REQ_CMD:
+		return create_overlay(ctx, arg);
+	case IOCTL_MEM_OVERLAY_CLEANUP_CMD:
+		return cleanup_overlay(ctx, arg);
+	case IOCTL_MEM_OVERLAY_BATCH_REQ_CMD: {
+		struct mem_overlay_batch_req *batch = arg;
+		if (batch->reqs_size > MEM_OVERLAY_BATCH_MAX) {
+			errno = E2BIG;
+			return -1;
+		}
+		for (unsigned int i = 0; i < batch->reqs_size; i++) {
+			batch->statuses[i] = 0;
+			if (create_overlay(ctx, &batch->reqs[i]))
+				batch->statuses[i] = -errno;
+		}
+		return 0;
+	}
+	case IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD: {
+		struct mem_overlay_batch_cleanup_req *batch = arg;
+		if (batch->reqs_size > MEM_OVERLAY_BATCH_MAX) {
+			errno = E2BIG;
+			return -1;
+		}
+		for (unsigned int i = 0; i < batch->reqs_size; i++) {
+			batch->statuses[i] = 0;
+			if (cleanup_overlay(ctx, &batch->reqs[i]))
+				batch->statuses[i] = -errno;
+		}
+		return 0;
+	}
+	case IOCTL_MEM_OVERLAY_DIRTY_CMD:
+	case IOCTL_MEM_OVERLAY_ACCESS_CMD:
+	case IOCTL_MEM_OVERLAY_PREFETCH_CMD:
+	case IOCTL_MEM_OVERLAY_READY_CMD:
+		errno = EOPNOTSUPP;
+		return -1;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+int mem_overlay_backend(struct mem_overlay_ctx *ctx, unsigned long id)
+{
+	if (ctx->dev >= 0)
+		return MEM_OVERLAY_BACKEND_MODULE;
+
+	pthread_mutex_lock(&ctx->lock);
+	struct mem_overlay *ov = *find_overlay(ctx, id);
+	int backend = ov ? (int)ov->backend : -1;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (!ov)
+		errno = ENOENT;
+	return backend;
+}
@@ -0,0 +1,81 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEMORY_OVERLAY_LIB_H
+#define MEMORY_OVERLAY_LIB_H
+
+#include <sys/ioctl.h>
+
+#include "../common.h"
+
+// Userspace memory overlay library.
+//
+// The library takes the same commands and requests as the kernel module
+// device. If the module is loaded, commands are forwarded to it. Otherwise
+// memory overlays are built in userspace:
+//
+//   MEM_OVERLAY_BACKEND_MMAP  Segments are mapped over the base memory area
+//                             with mmap(MAP_FIXED), merging adjacent segments
+//                             into a single mapping.
+//   MEM_OVERLAY_BACKEND_UFFD  The base memory area is replaced by anonymous
+//                             memory, and missing pages are copied from the
+//                             base, overlay or buffer memory by a
+//                             userfaultfd handler thread.
+//
+// The mmap backend is used when the files backing the base, overlay and
+// buffer memory areas can be opened and the process has enough VMAs left,
+// otherwise the userfaultfd backend is used.
+
+enum mem_overlay_backend {
+	MEM_OVERLAY_BACKEND_MODULE,
+	MEM_OVERLAY_BACKEND_MMAP,
+	MEM_OVERLAY_BACKEND_UFFD,
+};
+
+// Don't forward commands to the kernel module, even if it's loaded.
+#define MEM_OVERLAY_OPEN_NO_MODULE (1 << 0)
+// Don't use the mmap backend.
+#define MEM_OVERLAY_OPEN_NO_MMAP (1 << 1)
+// Populate the page tables of mapped segments with
+// madvise(MADV_POPULATE_READ) when the mmap backend is used.
+#define MEM_OVERLAY_OPEN_POPULATE (1 << 2)
+
+struct mem_overlay_ctx;
+
+// mem_overlay_open returns a new library context, or NULL with errno set on
+// error.
+struct mem_overlay_ctx *mem_overlay_open(unsigned int flags);
+
+// mem_overlay_close cleans up the memory overlays built in userspace,
+// restoring their base memory areas, and frees the context.
+void mem_overlay_close(struct mem_overlay_ctx *ctx);
+
+// mem_overlay_ioctl runs one of the IOCTL_MEM_OVERLAY_* commands and returns
+// the same values as ioctl(2) on the kernel module device.
+//
+// Without the kernel module only IOCTL_MEM_OVERLAY_REQ_CMD,
+// IOCTL_MEM_OVERLAY_CLEANUP_CMD and their batch variants are supported, and
+// requests can't set flags or use pending segments. Other commands fail with
+// EOPNOTSUPP.
+int mem_overlay_ioctl(struct mem_overlay_ctx *ctx, unsigned long cmd,
+		      void *arg);
+
+// mem_overlay_backend returns the backend of the memory overlay, or -1 with
+// errno set to ENOENT if it's not registered.
+int mem_overlay_backend(struct mem_overlay_ctx *ctx, unsigned long id);
+
+#endif //MEMORY_OVERLAY_LIB_H
@@ -15,4 +15,60 @@
     along with this program. If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include "log.h"
\ No newline at end of file
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+
+#include "log.h"
+
+DEFINE_STATIC_KEY_FALSE(log_debug_enabled);
+DEFINE_STATIC_KEY_FALSE(log_trace_enabled);
+DEFINE_STATIC_KEY_FALSE(log_benchmark_enabled);
+
+static unsigned int log_level = LOG_LEVEL;
+
+static void log_set_key(struct static_key_false *key, bool enabled)
+{
+	if (enabled)
+		static_branch_enable(key);
+	else
+		static_branch_disable(key);
+}
+
+static void log_update_keys(unsigned int level)
+{
+	log_set_key(&log_debug_enabled, level > 1);
+	log_set_key(&log_trace_enabled, level > 2);
+	log_set_key(&log_benchmark_enabled, level > 3);
+}
+
+static int log_level_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int level;
+	int ret = kstrtouint(val, 0, &level);
+	if (ret)
+		return ret;
+	if (level > LOG_LEVEL_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(log_level, level);
+	log_update_keys(level);
+	return 0;
+}
+
+static const struct kernel_param_ops log_level_ops = {
+	.set = log_level_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(log_level, &log_level_ops, &log_level, 0644);
+MODULE_PARM_DESC(log_level,
+		 "Log verbosity: 1 INFO, 2 DEBUG, 3 TRACE, 4 BENCH (default: LOG_LEVEL build variable)");
+
+/*
+ * Apply the default log level if it wasn't set when loading the module.
+ */
+void log_init(void)
+{
+	log_update_keys(READ_ONCE(log_level));
+}
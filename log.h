@@ -18,6 +18,17 @@
 #ifndef MEMORY_OVERLAY_LOG_H
 #define MEMORY_OVERLAY_LOG_H
 
+#include <linux/printk.h>
+#include <linux/jump_label.h>
+
+// Default log level, which can be changed at runtime with the log_level
+// module parameter.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 1
+#endif
+
+#define LOG_LEVEL_MAX 4
+
 #define _log_prepend_crit "[memory_overlay  (CRIT)]:"
 #define _log_prepend_error "[memory_overlay (ERROR)]:"
 #define _log_prepend_warn "[memory_overlay  (WARN)]:"
@@ -26,6 +37,14 @@
 #define _log_prepend_trace "[memory_overlay (TRACE)]:"
 #define _log_prepend_benchmark "[memory_overlay (BENCH)]:"
 
+// Levels above INFO are gated by static keys, so disabled log calls are a
+// single patched NOP and their arguments are not evaluated.
+DECLARE_STATIC_KEY_FALSE(log_debug_enabled);
+DECLARE_STATIC_KEY_FALSE(log_trace_enabled);
+DECLARE_STATIC_KEY_FALSE(log_benchmark_enabled);
+
+void log_init(void);
+
 #define log_crit(fmt, ...)                                             \
 	printk(KERN_CRIT _log_prepend_crit " " fmt "\n" __VA_OPT__(, ) \
 		       __VA_ARGS__)
@@ -39,28 +58,30 @@
 	printk(KERN_INFO _log_prepend_info " " fmt "\n" __VA_OPT__(, ) \
 		       __VA_ARGS__)
 
-#if LOG_LEVEL > 1
-#define log_debug(fmt, ...)                                              \
-	printk(KERN_DEBUG _log_prepend_debug " " fmt "\n" __VA_OPT__(, ) \
-		       __VA_ARGS__)
-#else
-#define log_debug(fmt, ...)
-#endif
+// Errors that may be logged for every page fault.
+#define log_error_ratelimited(fmt, ...)                                  \
+	printk_ratelimited(KERN_ERR _log_prepend_error " " fmt             \
+			   "\n" __VA_OPT__(, ) __VA_ARGS__)
 
-#if LOG_LEVEL > 2
-#define log_trace(fmt, ...)                                              \
-	printk(KERN_DEBUG _log_prepend_trace " " fmt "\n" __VA_OPT__(, ) \
-		       __VA_ARGS__)
-#else
-#define log_trace(fmt, ...)
-#endif
+#define log_debug(fmt, ...)                                                    \
+	do {                                                                   \
+		if (static_branch_unlikely(&log_debug_enabled))                \
+			printk(KERN_DEBUG _log_prepend_debug " " fmt           \
+			       "\n" __VA_OPT__(, ) __VA_ARGS__);               \
+	} while (0)
 
-#if LOG_LEVEL > 3
-#define log_benchmark(fmt, ...)                                              \
-	printk(KERN_DEBUG _log_prepend_benchmark " " fmt "\n" __VA_OPT__(, ) \
-		       __VA_ARGS__)
-#else
-#define log_benchmark(fmt, ...)
-#endif
+#define log_trace(fmt, ...)                                                    \
+	do {                                                                   \
+		if (static_branch_unlikely(&log_trace_enabled))                \
+			printk(KERN_DEBUG _log_prepend_trace " " fmt           \
+			       "\n" __VA_OPT__(, ) __VA_ARGS__);               \
+	} while (0)
+
+#define log_benchmark(fmt, ...)                                                \
+	do {                                                                   \
+		if (static_branch_unlikely(&log_benchmark_enabled))            \
+			printk(KERN_DEBUG _log_prepend_benchmark " " fmt       \
+			       "\n" __VA_OPT__(, ) __VA_ARGS__);               \
+	} while (0)
 
 #endif //MEMORY_OVERLAY_LOG_H
@@ -24,23 +24,348 @@
 #include <linux/slab.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <linux/device.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
 #include <linux/xarray.h>
 #include <linux/percpu_counter.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/shmem_fs.h>
+#include <linux/fadvise.h>
+#include <linux/delay.h>
+#include <linux/poll.h>
+#include <linux/refcount.h>
+#include <linux/pid.h>
+#include <linux/ptrace.h>
+#include <linux/capability.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/sched/clock.h>
+#include <linux/sort.h>
+#include <linux/version.h>
+#ifdef HAVE_IO_URING_CMD_H
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
 
 #include <asm/io.h>
 
 #include "module.h"
 #include "common.h"
 #include "hashtable.h"
+#include "histogram.h"
 #include "log.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 MODULE_AUTHOR("Loophole Labs (Shivansh Vij)");
 MODULE_DESCRIPTION("Memory overlay");
 MODULE_LICENSE("GPL");
 
 static struct hashtable *mem_overlays;
+static struct workqueue_struct *mem_overlay_wq;
+
+// All zero segments map the same page of a one page shmem file, so zero
+// filled ranges don't use any storage, IO or additional page cache. The page
+// is pinned while the module is loaded.
+static struct file *mem_overlay_zero_file;
+static struct folio *mem_overlay_zero_folio;
+
+// Set when the module is unloaded to stop running prefetches.
+static bool mem_overlay_prefetch_stopped;
+
+// Page fault counters of all memory overlays, including the ones that have
+// been removed, exposed in debugfs with the counters of each memory overlay.
+static struct percpu_counter mem_overlay_stats[MEM_OVERLAY_NR_STATS];
+static struct dentry *mem_overlay_debugfs_dir;
+static struct dentry *mem_overlay_debugfs_summary;
+
+static const char *const mem_overlay_stat_names[MEM_OVERLAY_NR_STATS] = {
+	[MEM_OVERLAY_STAT_MAP_PAGES] = "map_pages",
+	[MEM_OVERLAY_STAT_RUNS] = "runs",
+	[MEM_OVERLAY_STAT_BASE_PAGES] = "base_pages",
+	[MEM_OVERLAY_STAT_OVERLAY_PAGES] = "overlay_pages",
+	[MEM_OVERLAY_STAT_FAULTS] = "faults",
+	[MEM_OVERLAY_STAT_FAULT_ERRORS] = "fault_errors",
+};
+
+// Latency histograms, only recorded while enabled through debugfs. They are
+// enabled by default in benchmark builds.
+static struct histogram mem_overlay_latency[MEM_OVERLAY_NR_LATENCIES];
+#ifdef BENCHMARK
+static DEFINE_STATIC_KEY_TRUE(mem_overlay_latency_enabled);
+#else
+static DEFINE_STATIC_KEY_FALSE(mem_overlay_latency_enabled);
+#endif
+
+static const char *const mem_overlay_latency_names[MEM_OVERLAY_NR_LATENCIES] = {
+	[MEM_OVERLAY_LATENCY_MAP_PAGES] = "map_pages",
+	[MEM_OVERLAY_LATENCY_BASE_RUN] = "map_pages_base_run",
+	[MEM_OVERLAY_LATENCY_OVERLAY_RUN] = "map_pages_overlay_run",
+	[MEM_OVERLAY_LATENCY_FAULT] = "fault",
+	[MEM_OVERLAY_LATENCY_CREATE] = "create",
+	[MEM_OVERLAY_LATENCY_CLEANUP] = "cleanup",
+};
+
+/*
+ * Return the start time of an operation if its latency is recorded or if it's
+ * traced, or 0 otherwise.
+ */
+static u64 latency_start(bool traced)
+{
+	if (traced || static_branch_unlikely(&mem_overlay_latency_enabled))
+		return ktime_get_ns();
+	return 0;
+}
+
+/*
+ * Record the latency of an operation that started at start, as returned by
+ * latency_start, and return it.
+ */
+static u64 record_latency(enum mem_overlay_latency latency, u64 start)
+{
+	if (!start)
+		return 0;
+	u64 duration = ktime_get_ns() - start;
+	if (static_branch_unlikely(&mem_overlay_latency_enabled))
+		histogram_record(&mem_overlay_latency[latency], duration);
+	return duration;
+}
+
+/*
+ * Add to a page fault counter of the module and, if it's known, of the memory
+ * overlay that handled the page fault.
+ */
+static void add_mem_overlay_stat(struct mem_overlay *mem_overlay,
+				 enum mem_overlay_stat stat, s64 amount)
+{
+	percpu_counter_add(&mem_overlay_stats[stat], amount);
+	if (mem_overlay)
+		percpu_counter_add(&mem_overlay->stats[stat], amount);
+}
+
+/*
+ * Map the base pages between start and end from the file that backs seg.
+ * vmf->vma must point to overlay_vma, a copy of base_vma with the segment
+ * file, which has its page offset moved so the file pages are mapped at the
+ * base addresses. Zero segments map the same file page at every address, so
+ * each page is mapped separately.
+ */
+static vm_fault_t map_overlay_pages(struct vm_fault *vmf,
+				    struct vm_area_struct *base_vma,
+				    struct vm_area_struct *overlay_vma,
+				    struct mem_overlay_segment *seg,
+				    pgoff_t start, pgoff_t end)
+{
+	vm_fault_t ret = 0;
+
+	if (seg->type == MEM_OVERLAY_SEGMENT_ZERO) {
+		for (pgoff_t pgoff = start; pgoff <= end; pgoff++) {
+			overlay_vma->vm_pgoff =
+				base_vma->vm_pgoff + seg->overlay_pgoff - pgoff;
+			ret |= filemap_map_pages(vmf, seg->overlay_pgoff,
+						 seg->overlay_pgoff);
+			if (ret & VM_FAULT_ERROR)
+				break;
+		}
+		return ret;
+	}
+
+	pgoff_t file_start = segment_file_pgoff(seg, start);
+	overlay_vma->vm_pgoff = base_vma->vm_pgoff + file_start - start;
+	return filemap_map_pages(vmf, file_start, file_start + (end - start));
+}
+
+/*
+ * Return the scratch and dirty bitmap index of a base page offset, or -1 if
+ * the page is outside of the base VMA range that was registered.
+ */
+static long base_page_index(struct mem_overlay *mem_overlay, pgoff_t pgoff)
+{
+	if (pgoff < mem_overlay->base_pgoff ||
+	    pgoff - mem_overlay->base_pgoff >= mem_overlay->base_pages)
+		return -1;
+	return pgoff - mem_overlay->base_pgoff;
+}
+
+/*
+ * Return the scratch bitmap index of a base page offset, or -1 if write
+ * redirect is disabled or the page is outside of the registered range.
+ */
+static long scratch_index(struct mem_overlay *mem_overlay, pgoff_t pgoff)
+{
+	if (!mem_overlay->scratch_file)
+		return -1;
+	return base_page_index(mem_overlay, pgoff);
+}
+
+/*
+ * Move the entries of a per-CPU access buffer to the access log. Each page is
+ * only recorded once, so the log never overflows, and the slots of a whole
+ * buffer are reserved at once so buffers of different CPUs can be flushed
+ * concurrently.
+ */
+static void flush_access_buf(struct mem_overlay *mem_overlay,
+			     struct mem_overlay_access_buf *buf)
+{
+	if (!buf->len)
+		return;
+	unsigned long pos =
+		atomic_long_add_return(buf->len, &mem_overlay->access_len) -
+		buf->len;
+	memcpy(&mem_overlay->access_log[pos], buf->entries,
+	       buf->len * sizeof(struct mem_overlay_access));
+	buf->len = 0;
+}
+
+/*
+ * Record the first access to a base page in a per-CPU buffer. Pages that have
+ * already been recorded only cost a bitmap lookup.
+ */
+static void record_access_page(struct mem_overlay *mem_overlay,
+			       struct mem_overlay_access_buf *buf,
+			       pgoff_t pgoff)
+{
+	long idx = base_page_index(mem_overlay, pgoff);
+	if (idx < 0 || test_bit(idx, mem_overlay->access_bitmap) ||
+	    test_and_set_bit(idx, mem_overlay->access_bitmap))
+		return;
+
+	// Times are kept strictly increasing on each CPU so pages recorded by
+	// the same page fault keep their order when the log is sorted.
+	u64 time = max(local_clock(), buf->last_time + 1);
+	buf->last_time = time;
+	buf->entries[buf->len].time = time;
+	buf->entries[buf->len].pgoff = pgoff;
+	if (++buf->len == MEM_OVERLAY_ACCESS_BUF_SIZE)
+		flush_access_buf(mem_overlay, buf);
+}
+
+/*
+ * Record the accesses to the base pages between start and end, which are
+ * mapped together by a page fault. The faulting page is recorded first.
+ */
+static void record_access(struct mem_overlay *mem_overlay,
+			  struct vm_fault *vmf, pgoff_t start, pgoff_t end)
+{
+	// Faults from other address spaces, such as the ones made by prefetch
+	// workers, are not accesses of the workload.
+	if (current->mm != vmf->vma->vm_mm)
+		return;
+
+	struct mem_overlay_access_buf *buf =
+		get_cpu_ptr(mem_overlay->access_bufs);
+	record_access_page(mem_overlay, buf, vmf->pgoff);
+	for (pgoff_t pgoff = start; pgoff <= end; pgoff++) {
+		if (pgoff != vmf->pgoff)
+			record_access_page(mem_overlay, buf, pgoff);
+	}
+	put_cpu_ptr(mem_overlay->access_bufs);
+}
+
+/*
+ * Map the overlay pages between start and end, skipping pending pages that
+ * userspace hasn't supplied yet so they fault and wait for them.
+ */
+static vm_fault_t map_ready_overlay_pages(struct vm_fault *vmf,
+					  struct mem_overlay *mem_overlay,
+					  struct vm_area_struct *base_vma,
+					  struct vm_area_struct *overlay_vma,
+					  struct mem_overlay_segment *seg,
+					  pgoff_t start, pgoff_t end)
+{
+	unsigned long *bitmap = mem_overlay->pending_bitmap;
+	long first_idx = base_page_index(mem_overlay, start);
+	long last_idx = base_page_index(mem_overlay, end);
+	if (!bitmap || first_idx < 0 || last_idx < 0)
+		return map_overlay_pages(vmf, base_vma, overlay_vma, seg, start,
+					 end);
+
+	vm_fault_t ret = 0;
+	pgoff_t first = mem_overlay->base_pgoff;
+	unsigned long idx = first_idx;
+	while (idx <= last_idx) {
+		unsigned long next = find_next_bit(bitmap, last_idx + 1, idx);
+		if (next > idx) {
+			ret |= map_overlay_pages(vmf, base_vma, overlay_vma,
+						 seg, first + idx,
+						 first + next - 1);
+			if (ret & VM_FAULT_ERROR)
+				break;
+		}
+		if (next > last_idx)
+			break;
+		idx = find_next_zero_bit(bitmap, last_idx + 1, next);
+	}
+	return ret;
+}
+
+/*
+ * Map the base pages between start and end. In write redirect mode, pages
+ * that have been copied to the scratch file are mapped from it instead, using
+ * overlay_vma, a copy of base_vma.
+ */
+static vm_fault_t map_base_pages(struct vm_fault *vmf,
+				 struct mem_overlay *mem_overlay,
+				 struct vm_area_struct *base_vma,
+				 struct vm_area_struct *overlay_vma,
+				 pgoff_t start, pgoff_t end)
+{
+	pgoff_t first = mem_overlay->base_pgoff;
+	pgoff_t last = first + mem_overlay->base_pages - 1;
+	if (!mem_overlay->scratch_file || end < first || start > last)
+		return filemap_map_pages(vmf, start, end);
+
+	// Pages outside of the registered range are never redirected.
+	vm_fault_t ret = 0;
+	if (start < first) {
+		ret |= filemap_map_pages(vmf, start, first - 1);
+		if (ret & VM_FAULT_ERROR)
+			return ret;
+		start = first;
+	}
+	pgoff_t tail_end = end;
+	end = min(end, last);
+
+	struct vm_area_struct **vma_p = (struct vm_area_struct **)&vmf->vma;
+	unsigned long *bitmap = mem_overlay->scratch_bitmap;
+	unsigned long idx = start - first;
+	unsigned long last_idx = end - first;
+
+	while (idx <= last_idx) {
+		bool scratch = test_bit(idx, bitmap);
+		unsigned long next =
+			scratch ? find_next_zero_bit(bitmap, last_idx + 1, idx) :
+				  find_next_bit(bitmap, last_idx + 1, idx);
+		pgoff_t run_start = first + idx;
+		pgoff_t run_end = first + next - 1;
+
+		if (scratch) {
+			overlay_vma->vm_file = mem_overlay->scratch_file;
+			overlay_vma->vm_pgoff = base_vma->vm_pgoff;
+			*vma_p = overlay_vma;
+			ret |= filemap_map_pages(vmf, run_start, run_end);
+			*vma_p = base_vma;
+		} else {
+			ret |= filemap_map_pages(vmf, run_start, run_end);
+		}
+		if (ret & VM_FAULT_ERROR)
+			return ret;
+		idx = next;
+	}
+
+	if (tail_end > end)
+		ret |= filemap_map_pages(vmf, end + 1, tail_end);
+	return ret;
+}
 
 static vm_fault_t hijacked_map_pages(struct vm_fault *vmf, pgoff_t start_pgoff,
 				     pgoff_t end_pgoff)
@@ -49,348 +374,2931 @@ static vm_fault_t hijacked_map_pages(struct vm_fault *vmf, pgoff_t start_pgoff,
 	log_debug("page fault page=%lu start=%lu end=%lu id=%lu", vmf->pgoff,
 		  start_pgoff, end_pgoff, id);
 
+	// This function may be called with only the per-VMA lock of the base
+	// VMA held (FAULT_FLAG_VMA_LOCK) instead of the mm mmap lock, so it must
+	// not access any other VMA. Memory overlay changes write-lock the base
+	// VMA, and the RCU read lock is held for the entire fault so the memory
+	// overlay is not freed by a concurrent cleanup.
+	rcu_read_lock();
+	u64 map_start = latency_start(false);
+	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, id);
+	if (!mem_overlay) {
+		rcu_read_unlock();
+		log_error_ratelimited("unable to find memory overlay id=%lu",
+				      id);
+		add_mem_overlay_stat(NULL, MEM_OVERLAY_STAT_FAULT_ERRORS, 1);
+		return VM_FAULT_SIGBUS;
+	}
+
+	// Pages mapped by fault-around won't fault when they are touched, so
+	// the whole range is recorded as accessed by this page fault.
+	if (READ_ONCE(mem_overlay->access_recording))
+		record_access(mem_overlay, vmf, start_pgoff, end_pgoff);
+	trace_mem_overlay_map_pages_start(id, vmf->pgoff, start_pgoff,
+					  end_pgoff);
+
+	// The fault-around range is split into alternating runs of base and
+	// overlay pages that are mapped with one filemap_map_pages call each.
+	//
+	// filemap_map_pages only returns VM_FAULT_NOPAGE for the run that
+	// contains the faulting address, so the result of every run must be
+	// accumulated.
+	struct segments_walk walk;
+	struct segments_run run;
+	vm_fault_t ret = 0;
+
+	// Counters are accumulated locally and added once per call.
+	unsigned long runs = 0;
+	unsigned long base_pages = 0;
+	unsigned long overlay_pages = 0;
+
+	// Overlay runs are mapped using a copy of the base VMA with a different
+	// source file and page offset to avoid affecting any potential
+	// concurrent reader. The copy is only made once per fault and reused
+	// for every overlay run.
+	struct vm_area_struct *base_vma = vmf->vma;
+	struct vm_area_struct overlay_vma;
+	bool overlay_vma_init = false;
+
+	// Base runs may also need the copy in write redirect mode.
+	if (mem_overlay->scratch_file) {
+		memcpy(&overlay_vma, base_vma, sizeof(struct vm_area_struct));
+		overlay_vma_init = true;
+	}
+
+	// Use a pointer to the vmf->vma pointer to alter its refence since this
+	// field is marked as a const.
+	struct vm_area_struct **vma_p = (struct vm_area_struct **)&vmf->vma;
+
+	segments_walk_start(&walk, &mem_overlay->segments, start_pgoff,
+			    end_pgoff);
+	while (segments_walk_next(&walk, &run)) {
+		// Pages that don't overlap with any segment are handled like a
+		// normal page fault.
+		if (run.seg == NULL) {
+			log_debug(
+				"handling base page fault start=%lu end=%lu id=%lu",
+				run.start, run.end, id);
+
+			trace_mem_overlay_map_pages_run(
+				id, run.start, run.end,
+				MEM_OVERLAY_TRACE_RUN_BASE);
+			u64 run_start = latency_start(false);
+			ret |= map_base_pages(vmf, mem_overlay, base_vma,
+					      &overlay_vma, run.start, run.end);
+			record_latency(MEM_OVERLAY_LATENCY_BASE_RUN, run_start);
+			runs++;
+			base_pages += run.end - run.start + 1;
+			if (ret & VM_FAULT_ERROR)
+				break;
+			continue;
+		}
+
+		log_debug(
+			"handling overlay page fault start=%lu end=%lu id=%lu",
+			run.start, run.end, id);
+
+		if (!overlay_vma_init) {
+			memcpy(&overlay_vma, base_vma,
+			       sizeof(struct vm_area_struct));
+			overlay_vma_init = true;
+		}
+		overlay_vma.vm_file = run.seg->overlay_file;
+		trace_mem_overlay_map_pages_run(id, run.start, run.end,
+						run.seg->type);
+
+		u64 run_start = latency_start(false);
+		*vma_p = &overlay_vma;
+		ret |= map_ready_overlay_pages(vmf, mem_overlay, base_vma,
+					       &overlay_vma, run.seg, run.start,
+					       run.end);
+		*vma_p = base_vma;
+		record_latency(MEM_OVERLAY_LATENCY_OVERLAY_RUN, run_start);
+		runs++;
+		overlay_pages += run.end - run.start + 1;
+		if (ret & VM_FAULT_ERROR)
+			break;
+	}
+	segments_walk_end(&walk);
+
+	add_mem_overlay_stat(mem_overlay, MEM_OVERLAY_STAT_MAP_PAGES, 1);
+	add_mem_overlay_stat(mem_overlay, MEM_OVERLAY_STAT_RUNS, runs);
+	add_mem_overlay_stat(mem_overlay, MEM_OVERLAY_STAT_BASE_PAGES,
+			     base_pages);
+	add_mem_overlay_stat(mem_overlay, MEM_OVERLAY_STAT_OVERLAY_PAGES,
+			     overlay_pages);
+	if (ret & VM_FAULT_ERROR)
+		add_mem_overlay_stat(mem_overlay, MEM_OVERLAY_STAT_FAULT_ERRORS,
+				     1);
+	trace_mem_overlay_map_pages_end(id, runs, base_pages, overlay_pages,
+					ret);
+	rcu_read_unlock();
+	record_latency(MEM_OVERLAY_LATENCY_MAP_PAGES, map_start);
+	return ret;
+}
+
+/*
+ * Call a fault handler for a page of the file that backs a base page, using a
+ * copy of the base VMA that is moved so the file page is mapped at the base
+ * address.
+ */
+static vm_fault_t call_overlay_handler(struct vm_fault *vmf,
+				       vm_fault_t (*handler)(struct vm_fault *),
+				       struct file *file,
+				       const struct vm_operations_struct *vm_ops,
+				       pgoff_t file_pgoff)
+{
+	struct vm_area_struct *base_vma = vmf->vma;
+	pgoff_t base_pgoff = vmf->pgoff;
+	struct vm_area_struct overlay_vma;
+	memcpy(&overlay_vma, base_vma, sizeof(struct vm_area_struct));
+	overlay_vma.vm_file = file;
+	overlay_vma.vm_ops = vm_ops;
+	overlay_vma.vm_pgoff = base_vma->vm_pgoff + file_pgoff - base_pgoff;
+
+	// Fault handlers may release the mmap or per-VMA lock and return
+	// VM_FAULT_RETRY while waiting for IO, which would unlock the VMA copy
+	// and leave the memory overlay unprotected. Prevent it by not allowing
+	// retries for overlay pages.
+	enum fault_flag flags = vmf->flags;
+	vmf->flags &= ~(FAULT_FLAG_ALLOW_RETRY | FAULT_FLAG_RETRY_NOWAIT);
+
+	// Use pointers to alter vmf->vma and vmf->pgoff since these fields are
+	// marked as const.
+	struct vm_area_struct **vma_p = (struct vm_area_struct **)&vmf->vma;
+	pgoff_t *pgoff_p = (pgoff_t *)&vmf->pgoff;
+	*vma_p = &overlay_vma;
+	*pgoff_p = file_pgoff;
+	vm_fault_t ret = handler(vmf);
+	*vma_p = base_vma;
+	*pgoff_p = base_pgoff;
+	vmf->flags = flags;
+	return ret;
+}
+
+/*
+ * Handle the first write to a base page in write redirect mode. The page is
+ * faulted from the scratch file and its contents are replaced with the
+ * contents of the base page, so the write lands in the scratch file.
+ */
+static vm_fault_t fault_scratch_copy(struct vm_fault *vmf,
+				     struct mem_overlay *mem_overlay,
+				     unsigned long idx)
+{
+	struct file *base_file = vmf->vma->vm_file;
+	struct folio *base_folio =
+		read_mapping_folio(base_file->f_mapping, vmf->pgoff, base_file);
+	if (IS_ERR(base_folio))
+		return vmf_error(PTR_ERR(base_folio));
+
+	vm_fault_t ret = call_overlay_handler(vmf,
+					      mem_overlay->scratch_vm_ops->fault,
+					      mem_overlay->scratch_file,
+					      mem_overlay->scratch_vm_ops,
+					      vmf->pgoff);
+	if (ret & (VM_FAULT_ERROR | VM_FAULT_NOPAGE | VM_FAULT_RETRY |
+		   VM_FAULT_DONE_COW))
+		goto out;
+
+	struct folio *folio = page_folio(vmf->page);
+	if (!(ret & VM_FAULT_LOCKED)) {
+		folio_lock(folio);
+		ret |= VM_FAULT_LOCKED;
+	}
+
+	// The page is only copied once, while holding the scratch folio lock,
+	// so concurrent faults don't overwrite data already written to it.
+	if (!test_bit(idx, mem_overlay->scratch_bitmap)) {
+		log_debug("copying base page to scratch file page=%lu",
+			  vmf->pgoff);
+		copy_highpage(vmf->page,
+			      folio_file_page(base_folio, vmf->pgoff));
+		set_bit(idx, mem_overlay->scratch_bitmap);
+	}
+
+out:
+	folio_put(base_folio);
+	return ret;
+}
+
+static void put_pending(struct mem_overlay_pending *pending)
+{
+	if (refcount_dec_and_test(&pending->refs))
+		kfree(pending);
+}
+
+static void free_client(struct kref *kref)
+{
+	kfree(container_of(kref, struct mem_overlay_client, refs));
+}
+
+static void put_client(struct mem_overlay_client *client)
+{
+	kref_put(&client->refs, free_client);
+}
+
+/*
+ * Find the event of a page fault waiting for the same pending page, or an
+ * unread event for an adjacent page that can be extended to include it, so
+ * userspace receives contiguous ranges. The client lock must be held.
+ */
+static struct mem_overlay_pending *
+find_pending(struct mem_overlay_client *client, unsigned long id,
+	     pgoff_t pgoff)
+{
+	struct mem_overlay_pending *pending;
+	list_for_each_entry(pending, &client->pending_list, list) {
+		if (pending->id != id)
+			continue;
+		if (pgoff >= pending->start_pgoff && pgoff <= pending->end_pgoff)
+			return pending;
+		if (pending->read)
+			continue;
+		if (pgoff == pending->end_pgoff + 1) {
+			pending->end_pgoff = pgoff;
+			return pending;
+		}
+		if (pgoff + 1 == pending->start_pgoff) {
+			pending->start_pgoff = pgoff;
+			return pending;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Wait for userspace to supply a pending page. An event is queued for the page
+ * on the device file that owns the memory overlay and the page fault sleeps
+ * until the page is marked as ready or the memory overlay is removed. Fails
+ * with VM_FAULT_SIGBUS if the file has been closed, since nothing can supply
+ * the page anymore.
+ *
+ * If the page fault can be retried, the mmap or per-VMA lock is released
+ * while waiting and VM_FAULT_RETRY is returned, so the memory overlay must not
+ * be accessed afterwards. Otherwise 0 is returned once the page is ready and
+ * the fault can continue. If the page was never supplied because the memory
+ * overlay was removed, VM_FAULT_NOPAGE is returned so the page fault runs
+ * again once the base VMA is restored.
+ */
+static vm_fault_t wait_pending_page(struct vm_fault *vmf,
+				    struct mem_overlay *mem_overlay,
+				    unsigned long id, unsigned long idx)
+{
+	struct mem_overlay_pending *new =
+		kzalloc(sizeof(struct mem_overlay_pending), GFP_KERNEL);
+	if (!new)
+		return VM_FAULT_OOM;
+
+	// The page may have been supplied, or the memory overlay removed,
+	// since the pending bit was checked. Both happen while holding the
+	// client lock, so no wake up can be missed after this check.
+	struct mem_overlay_client *client = mem_overlay->owner;
+	spin_lock(&client->lock);
+	if (!test_bit(idx, mem_overlay->pending_bitmap)) {
+		spin_unlock(&client->lock);
+		kfree(new);
+		return 0;
+	}
+	if (hashtable_lookup(mem_overlays, id) != mem_overlay) {
+		spin_unlock(&client->lock);
+		kfree(new);
+		return VM_FAULT_NOPAGE;
+	}
+	if (client->closed) {
+		spin_unlock(&client->lock);
+		kfree(new);
+		log_error_ratelimited(
+			"device file of memory overlay id=%lu was closed, pending page=%lu can't be supplied",
+			id, vmf->pgoff);
+		return VM_FAULT_SIGBUS;
+	}
+
+	struct mem_overlay_pending *pending =
+		find_pending(client, id, vmf->pgoff);
+	bool queued = false;
+	if (!pending) {
+		pending = new;
+		new = NULL;
+		pending->id = id;
+		pending->start_pgoff = vmf->pgoff;
+		pending->end_pgoff = vmf->pgoff;
+		refcount_set(&pending->refs, 1);
+		init_waitqueue_head(&pending->wq);
+		list_add_tail(&pending->list, &client->pending_list);
+		client->events_unread++;
+		queued = true;
+	}
+	refcount_inc(&pending->refs);
+	spin_unlock(&client->lock);
+	kfree(new);
+
+	if (queued)
+		wake_up_interruptible(&client->events_wq);
+	log_debug("waiting for pending page=%lu id=%lu", vmf->pgoff, id);
+
+	// With FAULT_FLAG_RETRY_NOWAIT the caller expects the lock to still be
+	// held and will retry the fault later.
+	if (vmf->flags & FAULT_FLAG_RETRY_NOWAIT) {
+		put_pending(pending);
+		return VM_FAULT_RETRY;
+	}
+
+	bool retry = vmf->flags & FAULT_FLAG_ALLOW_RETRY;
+	if (retry) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+		release_fault_lock(vmf);
+#else
+		mmap_read_unlock(vmf->vma->vm_mm);
+#endif
+	}
+	int err = wait_event_killable(pending->wq, READ_ONCE(pending->done));
+	put_pending(pending);
+	if (retry)
+		return VM_FAULT_RETRY;
+	if (err)
+		return VM_FAULT_SIGBUS;
+
+	// Page faults are also woken up when the memory overlay is removed or
+	// its device file is closed, in which case the page is still pending.
+	// The lock was held while waiting, so the memory overlay is still
+	// valid.
+	if (test_bit(idx, mem_overlay->pending_bitmap))
+		return VM_FAULT_NOPAGE;
+	return 0;
+}
+
+/*
+ * Remove a pending event from its client and wake up the page faults waiting
+ * for it. The client lock must be held.
+ */
+static void complete_pending_event(struct mem_overlay_client *client,
+				   struct mem_overlay_pending *pending)
+{
+	log_debug("completing pending pages start=%lu end=%lu id=%lu",
+		  pending->start_pgoff, pending->end_pgoff, pending->id);
+	if (!pending->read)
+		client->events_unread--;
+	list_del(&pending->list);
+	WRITE_ONCE(pending->done, true);
+	wake_up_all(&pending->wq);
+	put_pending(pending);
+}
+
+/*
+ * Wake up the page faults waiting for pages of a memory overlay that have
+ * been supplied, or all of them if pending_bitmap is NULL. All waiters are
+ * woken up in a single pass. The client lock must be held.
+ */
+static void complete_pending(struct mem_overlay_client *client,
+			     unsigned long id, unsigned long *pending_bitmap,
+			     unsigned long base_pgoff)
+{
+	struct mem_overlay_pending *pending, *tmp;
+	list_for_each_entry_safe(pending, tmp, &client->pending_list, list) {
+		if (pending->id != id)
+			continue;
+		if (pending_bitmap) {
+			unsigned long start = pending->start_pgoff - base_pgoff;
+			unsigned long end = pending->end_pgoff - base_pgoff;
+			if (find_next_bit(pending_bitmap, end + 1, start) <= end)
+				continue;
+		}
+		complete_pending_event(client, pending);
+	}
+}
+
+/*
+ * Wake up the page faults waiting for pending pages of a memory overlay that
+ * is being removed. They are retried against the reverted base VMA.
+ */
+static void cancel_pending(struct mem_overlay *mem_overlay)
+{
+	struct mem_overlay_client *client = mem_overlay->owner;
+	spin_lock(&client->lock);
+	complete_pending(client, (unsigned long)mem_overlay->base_vma, NULL, 0);
+	spin_unlock(&client->lock);
+}
+
+/*
+ * Handle page faults that were not resolved by hijacked_map_pages, such as
+ * pages that are not in the page cache or that have been swapped out, and
+ * write faults that must copy the page first. The memory overlay that handled
+ * the page fault is returned in mem_overlay_p, if it was found.
+ *
+ * Pages in a segment are faulted by the fault handler of the overlay file,
+ * which may be different from the base file handler (e.g. shmem_fault for
+ * memfd and tmpfs files), using a copy of the base VMA. In write redirect
+ * mode, base pages that have been written are faulted from the scratch file.
+ */
+static vm_fault_t handle_hijacked_fault(struct vm_fault *vmf,
+					struct mem_overlay **mem_overlay_p)
+{
+	unsigned long id = (unsigned long)vmf->vma;
+	log_debug("page fault page=%lu id=%lu", vmf->pgoff, id);
+
+	// The memory overlay can't be reverted while the base VMA is locked by
+	// this page fault, so it remains valid after the RCU read lock is
+	// released. The fault handlers may sleep, so they must be called
+	// outside of the RCU read-side critical section.
+	rcu_read_lock();
+	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, id);
+	if (!mem_overlay) {
+		rcu_read_unlock();
+		log_error_ratelimited("unable to find memory overlay id=%lu",
+				      id);
+		return VM_FAULT_SIGBUS;
+	}
+	*mem_overlay_p = mem_overlay;
+	add_mem_overlay_stat(mem_overlay, MEM_OVERLAY_STAT_FAULTS, 1);
+
+	// Write faults and pages that are not in the page cache may not go
+	// through hijacked_map_pages first.
+	if (READ_ONCE(mem_overlay->access_recording))
+		record_access(mem_overlay, vmf, vmf->pgoff, vmf->pgoff);
+
+	XA_STATE(xas, &mem_overlay->segments.xa, vmf->pgoff);
+	struct mem_overlay_segment *seg = segments_find_first(
+		&mem_overlay->segments, &xas, vmf->pgoff, vmf->pgoff);
+	rcu_read_unlock();
+
+	long idx = seg == NULL ? scratch_index(mem_overlay, vmf->pgoff) : -1;
+	if (idx >= 0) {
+		if (test_bit(idx, mem_overlay->scratch_bitmap)) {
+			log_debug("handling scratch page fault page=%lu id=%lu",
+				  vmf->pgoff, id);
+			return call_overlay_handler(
+				vmf, mem_overlay->scratch_vm_ops->fault,
+				mem_overlay->scratch_file,
+				mem_overlay->scratch_vm_ops, vmf->pgoff);
+		}
+		if (vmf->flags & FAULT_FLAG_WRITE)
+			return fault_scratch_copy(vmf, mem_overlay, idx);
+	}
+
+	if (seg == NULL) {
+		log_debug("handling base page fault page=%lu id=%lu",
+			  vmf->pgoff, id);
+		return mem_overlay->original_vm_ops->fault(vmf);
+	}
+
+	// Pages of pending segments are only mapped once userspace has
+	// supplied them.
+	long pending_idx = mem_overlay->pending_bitmap ?
+				   base_page_index(mem_overlay, vmf->pgoff) :
+				   -1;
+	if (pending_idx >= 0 &&
+	    test_bit(pending_idx, mem_overlay->pending_bitmap)) {
+		vm_fault_t ret =
+			wait_pending_page(vmf, mem_overlay, id, pending_idx);
+		if (ret)
+			return ret;
+	}
+
+	log_debug("handling overlay page fault page=%lu id=%lu", vmf->pgoff,
+		  id);
+
+	// Zero segments always resolve to the pinned zero page, which is
+	// returned unlocked with a new reference for the caller to map.
+	if (seg->type == MEM_OVERLAY_SEGMENT_ZERO) {
+		folio_get(mem_overlay_zero_folio);
+		vmf->page = folio_page(mem_overlay_zero_folio, 0);
+		return 0;
+	}
+
+	return call_overlay_handler(vmf, seg->overlay_vm_ops->fault,
+				    seg->overlay_file, seg->overlay_vm_ops,
+				    segment_file_pgoff(seg, vmf->pgoff));
+}
+
+static vm_fault_t hijacked_fault(struct vm_fault *vmf)
+{
+	struct mem_overlay *mem_overlay = NULL;
+	u64 start = latency_start(false);
+	vm_fault_t ret = handle_hijacked_fault(vmf, &mem_overlay);
+	record_latency(MEM_OVERLAY_LATENCY_FAULT, start);
+
+	// The memory overlay may have been removed if the fault lock was
+	// released, in which case the error is only added to the module total.
+	if (ret & VM_FAULT_ERROR)
+		add_mem_overlay_stat(ret & VM_FAULT_RETRY ? NULL : mem_overlay,
+				     MEM_OVERLAY_STAT_FAULT_ERRORS, 1);
+	trace_mem_overlay_fault((unsigned long)vmf->vma, vmf->pgoff,
+				vmf->flags, ret);
+	return ret;
+}
+
+/*
+ * Notify the file that backs a page in a shared base VMA that it's about to
+ * become writable, since the base file page_mkwrite handler can't be used for
+ * pages of other files.
+ *
+ * If the page currently mapped doesn't belong to the file that should back
+ * it, such as a base page that must be copied to the scratch file in write
+ * redirect mode first, it's unmapped and the write is faulted again.
+ */
+static vm_fault_t overlay_page_mkwrite(struct vm_fault *vmf,
+				       struct mem_overlay *mem_overlay,
+				       struct mem_overlay_segment *seg)
+{
+	unsigned long id = (unsigned long)vmf->vma;
+	struct file *file = NULL;
+	const struct vm_operations_struct *vm_ops = NULL;
+	pgoff_t file_pgoff = vmf->pgoff;
+	long idx = scratch_index(mem_overlay, vmf->pgoff);
+
+	if (seg != NULL) {
+		file = seg->overlay_file;
+		vm_ops = seg->overlay_vm_ops;
+		file_pgoff = segment_file_pgoff(seg, vmf->pgoff);
+	} else if (idx >= 0) {
+		if (test_bit(idx, mem_overlay->scratch_bitmap)) {
+			file = mem_overlay->scratch_file;
+			vm_ops = mem_overlay->scratch_vm_ops;
+		}
+	} else {
+		const struct vm_operations_struct *original_vm_ops =
+			mem_overlay->original_vm_ops;
+		if (original_vm_ops->page_mkwrite)
+			return original_vm_ops->page_mkwrite(vmf);
+		return 0;
+	}
+
+	if (file == NULL || page_folio(vmf->page)->mapping != file->f_mapping) {
+		log_debug("unmapping stale page for write page=%lu id=%lu",
+			  vmf->pgoff, id);
+		zap_page_range_single(vmf->vma, vmf->address & PAGE_MASK,
+				      PAGE_SIZE, NULL);
+		return VM_FAULT_NOPAGE;
+	}
+
+	if (vm_ops == NULL || vm_ops->page_mkwrite == NULL)
+		return 0;
+	return call_overlay_handler(vmf, vm_ops->page_mkwrite, file, vm_ops,
+				    file_pgoff);
+}
+
+/*
+ * Handle the first write to a page mapped in a shared base VMA. Base pages
+ * are mapped read-only in write redirect and dirty tracking modes, so every
+ * write to a clean page goes through this handler.
+ */
+static vm_fault_t hijacked_page_mkwrite(struct vm_fault *vmf)
+{
+	unsigned long id = (unsigned long)vmf->vma;
+	log_debug("page mkwrite page=%lu id=%lu", vmf->pgoff, id);
+
+	rcu_read_lock();
 	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, id);
 	if (!mem_overlay) {
-		log_error("unable to find memory overlay id=%lu", id);
+		rcu_read_unlock();
+		log_error_ratelimited("unable to find memory overlay id=%lu",
+				      id);
 		return VM_FAULT_SIGBUS;
 	}
 
-	XA_STATE(xas, &mem_overlay->segments, start_pgoff);
-	struct mem_overlay_segment *seg;
-	vm_fault_t ret;
-	pgoff_t end;
+	XA_STATE(xas, &mem_overlay->segments.xa, vmf->pgoff);
+	struct mem_overlay_segment *seg = segments_find_first(
+		&mem_overlay->segments, &xas, vmf->pgoff, vmf->pgoff);
+	rcu_read_unlock();
+
+	vm_fault_t ret = overlay_page_mkwrite(vmf, mem_overlay, seg);
+	if (ret & (VM_FAULT_ERROR | VM_FAULT_NOPAGE | VM_FAULT_RETRY))
+		return ret;
+
+	// The page is recorded before its PTE is made writable. The dirty set
+	// is only reset while holding the base VMA write lock, so a write can't
+	// be lost between the two.
+	long idx = base_page_index(mem_overlay, vmf->pgoff);
+	if (mem_overlay->dirty_bitmap && idx >= 0 &&
+	    !test_bit(idx, mem_overlay->dirty_bitmap)) {
+		log_debug("marking base page dirty page=%lu id=%lu", vmf->pgoff,
+			  id);
+		set_bit(idx, mem_overlay->dirty_bitmap);
+	}
+	return ret;
+}
+
+static void destroy_mem_overlay_stats(struct mem_overlay *mem_overlay)
+{
+	for (int i = 0; i < MEM_OVERLAY_NR_STATS; i++)
+		percpu_counter_destroy(&mem_overlay->stats[i]);
+}
+
+/*
+ * Release the file references held by the memory overlay segments.
+ */
+static void put_segment_files(struct mem_overlay *mem_overlay)
+{
+	for (unsigned int i = 0; i < mem_overlay->segments.size; i++) {
+		struct mem_overlay_segment *seg = &mem_overlay->segments.buf[i];
+		if (seg->overlay_file && seg->type != MEM_OVERLAY_SEGMENT_ZERO)
+			fput(seg->overlay_file);
+	}
+}
+
+/*
+ * Free memory used by a memory overlay entry. The base VMA must already have
+ * been reverted and no page fault may be accessing the memory overlay.
+ */
+static void free_mem_overlay(struct mem_overlay *mem_overlay)
+{
+	put_segment_files(mem_overlay);
+	segments_destroy(&mem_overlay->segments);
+	kvfree(mem_overlay->hijacked_vm_ops);
+	if (mem_overlay->scratch_file)
+		fput(mem_overlay->scratch_file);
+	kvfree(mem_overlay->scratch_bitmap);
+	kvfree(mem_overlay->dirty_bitmap);
+	kvfree(mem_overlay->access_bitmap);
+	kvfree(mem_overlay->access_log);
+	free_percpu(mem_overlay->access_bufs);
+	kvfree(mem_overlay->pending_bitmap);
+	destroy_mem_overlay_stats(mem_overlay);
+	put_client(mem_overlay->owner);
+	mmdrop(mem_overlay->mm);
+	kvfree(mem_overlay);
+}
+
+static void free_mem_overlay_work(struct work_struct *work)
+{
+	struct mem_overlay *mem_overlay =
+		container_of(to_rcu_work(work), struct mem_overlay, free_work);
+	log_debug("freeing memory overlay segments=%u",
+		  mem_overlay->segments.size);
+	free_mem_overlay(mem_overlay);
+}
+
+/*
+ * Check that the base VMA of a memory overlay still exists. Userspace may
+ * unmap or remap the base range at any time, which frees the VMA, so the saved
+ * pointer can only be used after this check. The mm mmap lock must be held
+ * before calling this function.
+ */
+static bool mem_overlay_base_vma_valid(struct mem_overlay *mem_overlay)
+{
+	if (!mem_overlay->base_vma)
+		return false;
+	struct vm_area_struct *vma =
+		find_vma(mem_overlay->mm, mem_overlay->base_addr);
+	return vma == mem_overlay->base_vma &&
+	       vma->vm_ops == mem_overlay->hijacked_vm_ops;
+}
+
+/*
+ * Revert base VMA vm_ops to its original value in case the VMA is used after
+ * cleanup (usually to call ->close() on unmap). If the base VMA no longer
+ * exists, base_vma is cleared instead. The mm mmap write lock must be held
+ * before calling this function, unless base_vma has been cleared because the
+ * address space is already gone.
+ */
+static void revert_mem_overlay(struct mem_overlay *mem_overlay)
+{
+	if (!mem_overlay_base_vma_valid(mem_overlay)) {
+		mem_overlay->base_vma = NULL;
+		return;
+	}
+
+	vma_start_write(mem_overlay->base_vma);
+	mem_overlay->base_vma->vm_ops = mem_overlay->original_vm_ops;
+	if (mem_overlay->base_vma_nohugepage)
+		vm_flags_clear(mem_overlay->base_vma, VM_NOHUGEPAGE);
+	if (mem_overlay->scratch_file || mem_overlay->dirty_bitmap)
+		WRITE_ONCE(mem_overlay->base_vma->vm_page_prot,
+			   mem_overlay->original_vm_page_prot);
+}
+
+/*
+ * Unmap the base VMA pages between the start and end page offsets, clipped to
+ * the VMA range.
+ */
+static void zap_base_pages(struct vm_area_struct *vma, pgoff_t start,
+			   pgoff_t end)
+{
+	start = max(start, vma->vm_pgoff);
+	end = min(end, vma->vm_pgoff + vma_pages(vma) - 1);
+	if (start > end)
+		return;
+
+	unsigned long addr =
+		vma->vm_start + ((start - vma->vm_pgoff) << PAGE_SHIFT);
+	unsigned long size = (end - start + 1) << PAGE_SHIFT;
+	log_debug("zapping overlay pages start=%lu end=%lu", start, end);
+	zap_page_range_single(vma, addr, size, NULL);
+}
+
+/*
+ * Unmap the pages of the base VMA covered by overlay segments, or redirected to
+ * the scratch file, so they are faulted again from the base file. Other pages
+ * are not affected. Must be called after revert_mem_overlay(), which clears
+ * base_vma if the VMA no longer exists, with the mm mmap write lock held.
+ */
+static void restore_mem_overlay_base(struct mem_overlay *mem_overlay)
+{
+	struct vm_area_struct *vma = mem_overlay->base_vma;
+	if (!vma)
+		return;
+
+	for (unsigned int i = 0; i < mem_overlay->segments.size; i++) {
+		struct mem_overlay_segment *seg = &mem_overlay->segments.buf[i];
+		zap_base_pages(vma, seg->start_pgoff, seg->end_pgoff);
+	}
+
+	// Pages written in write redirect mode are mapped from the scratch
+	// file.
+	if (mem_overlay->scratch_file) {
+		unsigned int start, end;
+		for_each_set_bitrange(start, end, mem_overlay->scratch_bitmap,
+				      mem_overlay->base_pages)
+			zap_base_pages(vma, mem_overlay->base_pgoff + start,
+				       mem_overlay->base_pgoff + end - 1);
+	}
+}
+
+/*
+ * Revert the base VMA and schedule the memory overlay to be freed after an
+ * RCU grace period, once page faults that started before the revert are
+ * done. If the process that owns the memory can be assumed to still be
+ * running, a mm mmap write lock should be held before calling this function.
+ */
+static void cleanup_mem_overlay_deferred(struct mem_overlay *mem_overlay,
+					 unsigned int flags)
+{
+	debugfs_remove(mem_overlay->debugfs_dir);
+	revert_mem_overlay(mem_overlay);
+	if (flags & MEM_OVERLAY_CLEANUP_RESTORE_BASE)
+		restore_mem_overlay_base(mem_overlay);
+	INIT_RCU_WORK(&mem_overlay->free_work, free_mem_overlay_work);
+	queue_rcu_work(mem_overlay_wq, &mem_overlay->free_work);
+}
+
+/*
+ * Revert and immediately free a memory overlay. Used when the module is
+ * unloaded.
+ */
+static void cleanup_mem_overlay(void *data)
+{
+	struct mem_overlay *mem_overlay = (struct mem_overlay *)data;
+	cancel_pending(mem_overlay);
+	debugfs_remove(mem_overlay->debugfs_dir);
+
+	// The base VMA is reverted under the mmap write lock, like any other
+	// cleanup, so no page fault runs concurrently. The process that owns
+	// the memory may have already exited, in which case there is no VMA
+	// left to restore.
+	struct mm_struct *mm = mem_overlay->mm;
+	if (mmget_not_zero(mm)) {
+		mmap_write_lock(mm);
+		revert_mem_overlay(mem_overlay);
+		mmap_write_unlock(mm);
+		mmput(mm);
+	} else {
+		log_warn("address space already released for memory overlay id=%lu",
+			 (unsigned long)mem_overlay->base_vma);
+	}
+	synchronize_rcu();
+	free_mem_overlay(mem_overlay);
+}
+
+/*
+ * Return the approximate number of bytes of kernel memory used by a memory
+ * overlay, including its segments, segment index, bitmaps and counters.
+ */
+static unsigned long mem_overlay_memory(struct mem_overlay *mem_overlay)
+{
+	unsigned long bitmap_size =
+		BITS_TO_LONGS(mem_overlay->base_pages) * sizeof(unsigned long);
+	unsigned long size = sizeof(struct mem_overlay) +
+			     sizeof(struct vm_operations_struct);
+
+	size += mem_overlay->segments.size * sizeof(struct mem_overlay_segment);
+	size += mem_overlay->segments.nodes * sizeof(struct xa_node);
+	if (mem_overlay->scratch_bitmap)
+		size += bitmap_size;
+	if (mem_overlay->dirty_bitmap)
+		size += bitmap_size;
+	if (mem_overlay->pending_bitmap)
+		size += bitmap_size;
+	if (mem_overlay->access_bitmap)
+		size += bitmap_size +
+			mem_overlay->base_pages *
+				sizeof(struct mem_overlay_access) +
+			num_possible_cpus() *
+				sizeof(struct mem_overlay_access_buf);
+	size += MEM_OVERLAY_NR_STATS * num_possible_cpus() * sizeof(s32);
+	return size;
+}
+
+static int mem_overlay_stats_show(struct seq_file *m, void *v)
+{
+	struct mem_overlay *mem_overlay = m->private;
+	seq_printf(m, "base_addr: 0x%lx\n", mem_overlay->base_addr);
+	seq_printf(m, "segments: %u\n", mem_overlay->segments.size);
+	seq_printf(m, "memory_bytes: %lu\n", mem_overlay_memory(mem_overlay));
+	for (int i = 0; i < MEM_OVERLAY_NR_STATS; i++)
+		seq_printf(m, "%s: %lld\n", mem_overlay_stat_names[i],
+			   percpu_counter_sum(&mem_overlay->stats[i]));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mem_overlay_stats);
+
+struct mem_overlay_summary {
+	struct seq_file *m;
+	unsigned long count;
+	unsigned long segments;
+	unsigned long memory;
+};
+
+static void mem_overlay_summary_show_one(unsigned long id, void *data,
+					 void *arg)
+{
+	struct mem_overlay *mem_overlay = data;
+	struct mem_overlay_summary *summary = arg;
+	unsigned long memory = mem_overlay_memory(mem_overlay);
+
+	seq_printf(summary->m, "%lu 0x%lx %u %lu %lld %lld\n", id,
+		   mem_overlay->base_addr, mem_overlay->segments.size, memory,
+		   percpu_counter_sum(
+			   &mem_overlay->stats[MEM_OVERLAY_STAT_MAP_PAGES]),
+		   percpu_counter_sum(
+			   &mem_overlay->stats[MEM_OVERLAY_STAT_FAULTS]));
+	summary->count++;
+	summary->segments += mem_overlay->segments.size;
+	summary->memory += memory;
+}
+
+static int mem_overlay_summary_show(struct seq_file *m, void *v)
+{
+	struct mem_overlay_summary summary = { .m = m };
+
+	seq_puts(m, "id base_addr segments memory_bytes map_pages faults\n");
+	hashtable_for_each(mem_overlays, mem_overlay_summary_show_one,
+			   &summary);
+
+	seq_printf(m, "\noverlays: %lu\n", summary.count);
+	seq_printf(m, "segments: %lu\n", summary.segments);
+	seq_printf(m, "memory_bytes: %lu\n", summary.memory);
+	for (int i = 0; i < MEM_OVERLAY_NR_STATS; i++)
+		seq_printf(m, "%s: %lld\n", mem_overlay_stat_names[i],
+			   percpu_counter_sum(&mem_overlay_stats[i]));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mem_overlay_summary);
+
+static ssize_t latency_enabled_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	char value[3] = { '0', '\n', '\0' };
+	if (static_key_enabled(&mem_overlay_latency_enabled))
+		value[0] = '1';
+	return simple_read_from_buffer(buf, count, ppos, value, 2);
+}
+
+static ssize_t latency_enabled_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	bool enabled;
+	int ret = kstrtobool_from_user(buf, count, &enabled);
+	if (ret)
+		return ret;
+
+	if (enabled)
+		static_branch_enable(&mem_overlay_latency_enabled);
+	else
+		static_branch_disable(&mem_overlay_latency_enabled);
+	return count;
+}
+
+static const struct file_operations latency_enabled_fops = {
+	.owner = THIS_MODULE,
+	.read = latency_enabled_read,
+	.write = latency_enabled_write,
+	.llseek = default_llseek,
+};
+
+/*
+ * Create the debugfs directory of a memory overlay, named after its id.
+ * debugfs errors are not fatal, since the counters are only informative.
+ */
+static void create_mem_overlay_debugfs(struct mem_overlay *mem_overlay,
+				       unsigned long id)
+{
+	char name[24];
+	snprintf(name, sizeof(name), "%lu", id);
+	mem_overlay->debugfs_dir =
+		debugfs_create_dir(name, mem_overlay_debugfs_dir);
+	debugfs_create_file("stats", 0444, mem_overlay->debugfs_dir,
+			    mem_overlay, &mem_overlay_stats_fops);
+}
+
+static int device_open(struct inode *device_file, struct file *instance)
+{
+	log_debug("called device_open");
+	struct mem_overlay_client *client =
+		kzalloc(sizeof(struct mem_overlay_client), GFP_KERNEL);
+	if (!client) {
+		log_error("failed to allocate memory for device file");
+		return -ENOMEM;
+	}
+	spin_lock_init(&client->lock);
+	INIT_LIST_HEAD(&client->pending_list);
+	init_waitqueue_head(&client->events_wq);
+	kref_init(&client->refs);
+	instance->private_data = client;
+	log_info("device opened");
+	return 0;
+}
+
+/*
+ * Close a device file. The memory overlays it registered remain in place until
+ * they are cleaned up, but their pending pages can no longer be supplied, so
+ * the page faults waiting for them are woken up and fail.
+ */
+static int device_close(struct inode *device_file, struct file *instance)
+{
+	log_debug("called device_close");
+	struct mem_overlay_client *client = instance->private_data;
+	struct mem_overlay_pending *pending, *tmp;
+
+	spin_lock(&client->lock);
+	client->closed = true;
+	list_for_each_entry_safe(pending, tmp, &client->pending_list, list)
+		complete_pending_event(client, pending);
+	spin_unlock(&client->lock);
+	put_client(client);
+	log_info("device closed");
+	return 0;
+}
+
+/*
+ * Read the events of page faults waiting for pending pages of the memory
+ * overlays registered through this file. Each event is returned once, as a
+ * struct mem_overlay_pending_event. Blocks until an event is available unless
+ * the file is non-blocking.
+ */
+static ssize_t device_read(struct file *file, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	struct mem_overlay_client *client = file->private_data;
+	size_t max = min_t(size_t,
+			   count / sizeof(struct mem_overlay_pending_event),
+			   MEM_OVERLAY_EVENTS_READ_MAX);
+	if (max == 0)
+		return -EINVAL;
+
+	struct mem_overlay_pending_event *events =
+		kvcalloc(max, sizeof(struct mem_overlay_pending_event),
+			 GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
+
+	ssize_t res;
+	size_t n = 0;
+	while (n == 0) {
+		spin_lock(&client->lock);
+		struct mem_overlay_pending *pending;
+		list_for_each_entry(pending, &client->pending_list, list) {
+			if (n == max)
+				break;
+			if (pending->read)
+				continue;
+			events[n].id = pending->id;
+			events[n].start_pgoff = pending->start_pgoff;
+			events[n].end_pgoff = pending->end_pgoff;
+			pending->read = true;
+			client->events_unread--;
+			n++;
+		}
+		spin_unlock(&client->lock);
+		if (n > 0)
+			break;
+
+		if (file->f_flags & O_NONBLOCK) {
+			res = -EAGAIN;
+			goto free_events;
+		}
+		if (wait_event_interruptible(
+			    client->events_wq,
+			    READ_ONCE(client->events_unread) > 0)) {
+			res = -ERESTARTSYS;
+			goto free_events;
+		}
+	}
+
+	res = n * sizeof(struct mem_overlay_pending_event);
+	if (copy_to_user(buf, events, res)) {
+		log_error("failed to copy %zu pending events to user", n);
+		res = -EFAULT;
+	}
+
+free_events:
+	kvfree(events);
+	return res;
+}
+
+static __poll_t device_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct mem_overlay_client *client = file->private_data;
+	poll_wait(file, &client->events_wq, wait);
+	if (READ_ONCE(client->events_unread) > 0)
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+/*
+ * Resolve the address space targeted by a memory overlay request. The returned
+ * mm must be released with mmput().
+ */
+static struct mm_struct *get_mem_overlay_req_mm(struct mem_overlay_req *req)
+{
+	if (!(req->flags & MEM_OVERLAY_REQ_PIDFD)) {
+		mmget(current->mm);
+		return current->mm;
+	}
+
+	// Modifying the memory of another process is restricted to privileged
+	// controllers.
+	if (!capable(CAP_SYS_PTRACE)) {
+		log_error("missing CAP_SYS_PTRACE to use pidfd=%d", req->pidfd);
+		return ERR_PTR(-EPERM);
+	}
+
+#ifdef HAVE_PIDFD_GET_TASK
+	unsigned int pidfd_flags;
+	struct task_struct *task = pidfd_get_task(req->pidfd, &pidfd_flags);
+	if (IS_ERR(task)) {
+		log_error("failed to resolve pidfd=%d: %ld", req->pidfd,
+			  PTR_ERR(task));
+		return ERR_CAST(task);
+	}
+
+	// Check that the caller is allowed to modify the memory of the task,
+	// which also honors LSM ptrace restrictions. mm_access() is not
+	// exported to modules, so its checks are done here. exec_update_lock
+	// keeps the task from switching to a new address space, such as a
+	// setuid program, between the check and taking its mm.
+	int ret = down_read_killable(&task->signal->exec_update_lock);
+	if (ret) {
+		put_task_struct(task);
+		return ERR_PTR(ret);
+	}
+	struct mm_struct *mm = get_task_mm(task);
+	if (mm && !ptrace_may_access(task, PTRACE_MODE_ATTACH_REALCREDS)) {
+		mmput(mm);
+		mm = ERR_PTR(-EACCES);
+	}
+	up_read(&task->signal->exec_update_lock);
+	put_task_struct(task);
+	if (IS_ERR_OR_NULL(mm)) {
+		log_error("failed to access address space of pidfd=%d: %ld",
+			  req->pidfd, mm ? PTR_ERR(mm) : -ESRCH);
+		return mm ? ERR_CAST(mm) : ERR_PTR(-ESRCH);
+	}
+	return mm;
+#else
+	// The kernel doesn't export the interfaces needed to resolve a pidfd.
+	log_error("pidfd=%d is not supported by this kernel", req->pidfd);
+	return ERR_PTR(-EOPNOTSUPP);
+#endif
+}
+
+/*
+ * Find the VMA that maps addr and the following pages of a segment. The VMA
+ * must be backed by a file, such as a memfd or shared anonymous memory, so
+ * its pages can be faulted into the base VMA. If pages is 0, only the page at
+ * addr is checked.
+ */
+static struct vm_area_struct *find_segment_vma(struct mm_struct *mm,
+					       unsigned long addr,
+					       unsigned long pages)
+{
+	struct vm_area_struct *vma = find_vma(mm, addr);
+	if (vma == NULL || vma->vm_start > addr || !PAGE_ALIGNED(addr))
+		return NULL;
+	if (vma->vm_file == NULL || vma->vm_ops == NULL ||
+	    vma->vm_ops->fault == NULL) {
+		log_error("VMA at addr=0x%lx is not backed by a file", addr);
+		return NULL;
+	}
+	if (pages > (vma->vm_end - addr) >> PAGE_SHIFT) {
+		log_error("VMA at addr=0x%lx is smaller than %lu pages", addr,
+			  pages);
+		return NULL;
+	}
+	return vma;
+}
+
+static bool vma_is_shared_writable(struct vm_area_struct *vma)
+{
+	return (vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE);
+}
+
+static long int setup_mem_overlay(struct mm_struct *mm,
+				  struct mem_overlay_client *client,
+				  struct mem_overlay_req *req,
+				  struct mem_overlay_segment_req *segs)
+{
+	long int res = 0;
+
+	if (req->flags & ~MEM_OVERLAY_REQ_FLAGS) {
+		log_error("unknown memory overlay request flags=0x%x",
+			  req->flags);
+		return -EINVAL;
+	}
+
+	// Find base VMA. The overlay VMA is only needed by file segments, so
+	// it's looked up when the first one is found.
+	struct vm_area_struct *overlay_vma = NULL;
+	struct vm_area_struct *base_vma = find_vma(mm, req->base_addr);
+	if (base_vma == NULL || base_vma->vm_start > req->base_addr) {
+		log_error("failed to find base VMA");
+		return -EINVAL;
+	}
+	if (base_vma->vm_file == NULL || base_vma->vm_ops == NULL ||
+	    base_vma->vm_ops->map_pages == NULL ||
+	    base_vma->vm_ops->fault == NULL) {
+		log_error("base VMA is not backed by a file");
+		return -EINVAL;
+	}
+	unsigned long id = (unsigned long)base_vma;
+
+	// Write redirect mode sends writes to the files that back each page,
+	// so the base and scratch VMAs must be shared mappings. Dirty tracking
+	// relies on page_mkwrite, which is only called for shared mappings.
+	bool write_redirect = req->flags & MEM_OVERLAY_REQ_WRITE_REDIRECT;
+	bool track_dirty = req->flags & MEM_OVERLAY_REQ_TRACK_DIRTY;
+	if ((write_redirect || track_dirty) &&
+	    !vma_is_shared_writable(base_vma)) {
+		log_error("write redirect and dirty tracking require a shared writable base VMA");
+		return -EINVAL;
+	}
+
+	struct vm_area_struct *scratch_vma = NULL;
+	if (write_redirect) {
+		scratch_vma = find_segment_vma(mm, req->scratch_addr, 0);
+		if (!scratch_vma || !vma_is_shared_writable(scratch_vma)) {
+			log_error("failed to find shared writable scratch VMA");
+			return -EINVAL;
+		}
+	}
+
+	// Check if VMA is already stored.
+	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, id);
+	if (mem_overlay) {
+		if (base_vma->vm_ops->map_pages == hijacked_map_pages) {
+			log_error("memory overlay already exists");
+			return -EEXIST;
+		}
+
+		// Leftover memory overlay, delete from state and proceed. Its
+		// base VMA was freed and the pointer reused, possibly by
+		// another address space, so there is nothing to revert.
+		hashtable_delete(mem_overlays, id);
+		cancel_pending(mem_overlay);
+		mem_overlay->base_vma = NULL;
+		cleanup_mem_overlay_deferred(mem_overlay, 0);
+		mem_overlay = NULL;
+	}
+
+	log_debug(
+		"received memory overlay request base_addr=%lu overlay_addr=%lu",
+		req->base_addr, req->overlay_addr);
+
+	// Create new memory overlay instance.
+	mem_overlay = kvzalloc(sizeof(struct mem_overlay), GFP_KERNEL);
+	if (!mem_overlay) {
+		log_error("failed to allocate memory for memory overlay");
+		return -ENOMEM;
+	}
+
+	mem_overlay->base_addr = req->base_addr;
+	res = segments_init(&mem_overlay->segments, req->segments_size);
+	if (res)
+		goto cleanup_segments;
+
+	for (int i = 0; i < MEM_OVERLAY_NR_STATS; i++) {
+		if (percpu_counter_init(&mem_overlay->stats[i], 0,
+					GFP_KERNEL)) {
+			log_error("failed to allocate memory overlay counters");
+			res = -ENOMEM;
+			goto cleanup_segments;
+		}
+	}
+
+	struct mem_overlay_segment *seg;
+	for (int i = 0; i < req->segments_size; i++) {
+		unsigned long start = segs[i].start_pgoff;
+		unsigned long end = segs[i].end_pgoff;
+
+		seg = &mem_overlay->segments.buf[i];
+		res = segment_parse(&segs[i], seg);
+		if (res)
+			goto cleanup_segments;
+
+		// Hold a reference to the segment file since page faults may
+		// run under the per-VMA lock of the base VMA, without
+		// preventing the overlay or buffer VMA from being unmapped
+		// concurrently.
+		switch (seg->type) {
+		case MEM_OVERLAY_SEGMENT_FILE:
+			if (!overlay_vma) {
+				overlay_vma = find_segment_vma(
+					mm, req->overlay_addr, 0);
+				if (!overlay_vma ||
+				    (write_redirect &&
+				     !vma_is_shared_writable(overlay_vma))) {
+					log_error("failed to find overlay VMA");
+					res = -EINVAL;
+					goto cleanup_segments;
+				}
+			}
+			seg->overlay_addr = req->overlay_addr;
+			seg->overlay_file = get_file(overlay_vma->vm_file);
+			seg->overlay_vm_ops = overlay_vma->vm_ops;
+			seg->overlay_pgoff = start;
+			break;
+		case MEM_OVERLAY_SEGMENT_ZERO:
+			// Writes to a shared mapping would modify the zero
+			// page.
+			if ((base_vma->vm_flags & VM_SHARED) &&
+			    (base_vma->vm_flags & VM_MAYWRITE)) {
+				log_error(
+					"zero segments require a read-only or private base VMA");
+				res = -EINVAL;
+				goto cleanup_segments;
+			}
+			seg->overlay_file = mem_overlay_zero_file;
+			seg->overlay_pgoff = 0;
+			break;
+		case MEM_OVERLAY_SEGMENT_BUFFER: {
+			unsigned long addr = segs[i].buffer_addr;
+			struct vm_area_struct *vma =
+				find_segment_vma(mm, addr, end - start + 1);
+			if (!vma ||
+			    (write_redirect && !vma_is_shared_writable(vma))) {
+				log_error(
+					"failed to find buffer VMA for segment start=%lu end=%lu",
+					start, end);
+				res = -EINVAL;
+				goto cleanup_segments;
+			}
+			seg->overlay_addr = addr;
+			seg->overlay_file = get_file(vma->vm_file);
+			seg->overlay_vm_ops = vma->vm_ops;
+			seg->overlay_pgoff = vma->vm_pgoff +
+					     ((addr - vma->vm_start) >> PAGE_SHIFT);
+			break;
+		}
+		}
+
+		res = segments_insert(&mem_overlay->segments, i);
+		if (res)
+			goto cleanup_segments;
+	}
+	segments_count_nodes(&mem_overlay->segments);
+
+	mem_overlay->base_pgoff = base_vma->vm_pgoff;
+	mem_overlay->base_pages = vma_pages(base_vma);
+
+	if (track_dirty) {
+		mem_overlay->dirty_bitmap =
+			kvcalloc(BITS_TO_LONGS(mem_overlay->base_pages),
+				 sizeof(unsigned long), GFP_KERNEL);
+		if (!mem_overlay->dirty_bitmap) {
+			log_error("failed to allocate memory for dirty bitmap");
+			res = -ENOMEM;
+			goto cleanup_segments;
+		}
+	}
+
+	// Pages of pending segments are tracked in a bitmap until userspace
+	// marks them as ready.
+	for (int i = 0; i < req->segments_size; i++) {
+		if (!(segs[i].flags & MEM_OVERLAY_SEGMENT_PENDING))
+			continue;
+
+		unsigned long base_end =
+			mem_overlay->base_pgoff + mem_overlay->base_pages - 1;
+		unsigned long start = max(segs[i].start_pgoff,
+					  mem_overlay->base_pgoff);
+		unsigned long end = min(segs[i].end_pgoff, base_end);
+		if (start > end)
+			continue;
+
+		if (!mem_overlay->pending_bitmap) {
+			mem_overlay->pending_bitmap = kvcalloc(
+				BITS_TO_LONGS(mem_overlay->base_pages),
+				sizeof(unsigned long), GFP_KERNEL);
+			if (!mem_overlay->pending_bitmap) {
+				log_error("failed to allocate memory for pending bitmap");
+				res = -ENOMEM;
+				goto cleanup_segments;
+			}
+		}
+		bitmap_set(mem_overlay->pending_bitmap,
+			   start - mem_overlay->base_pgoff, end - start + 1);
+	}
+
+	if (req->flags & MEM_OVERLAY_REQ_RECORD_ACCESS) {
+		mem_overlay->access_bitmap =
+			kvcalloc(BITS_TO_LONGS(mem_overlay->base_pages),
+				 sizeof(unsigned long), GFP_KERNEL);
+		mem_overlay->access_log =
+			kvcalloc(mem_overlay->base_pages,
+				 sizeof(struct mem_overlay_access), GFP_KERNEL);
+		mem_overlay->access_bufs =
+			alloc_percpu(struct mem_overlay_access_buf);
+		if (!mem_overlay->access_bitmap || !mem_overlay->access_log ||
+		    !mem_overlay->access_bufs) {
+			log_error("failed to allocate memory for access recorder");
+			res = -ENOMEM;
+			goto cleanup_segments;
+		}
+		atomic_long_set(&mem_overlay->access_len, 0);
+		mem_overlay->access_recording = true;
+	}
+
+	if (write_redirect) {
+		mem_overlay->scratch_bitmap =
+			kvcalloc(BITS_TO_LONGS(mem_overlay->base_pages),
+				 sizeof(unsigned long), GFP_KERNEL);
+		if (!mem_overlay->scratch_bitmap) {
+			log_error("failed to allocate memory for scratch bitmap");
+			res = -ENOMEM;
+			goto cleanup_segments;
+		}
+		mem_overlay->scratch_file = get_file(scratch_vma->vm_file);
+		mem_overlay->scratch_vm_ops = scratch_vma->vm_ops;
+	}
+
+	// Hijack page fault handler for base VMA.
+	log_info("hijacking vm_ops for base VMA addr=0x%lu", req->base_addr);
+	mem_overlay->hijacked_vm_ops =
+		kvzalloc(sizeof(struct vm_operations_struct), GFP_KERNEL);
+	if (!mem_overlay->hijacked_vm_ops) {
+		log_error("failed to allocate memory for hijacked vm_ops");
+		res = -ENOMEM;
+		goto cleanup_segments;
+	}
+
+	// Store base VMA and original vm_ops so we can restore it on cleanup.
+	mem_overlay->base_vma = base_vma;
+	mem_overlay->original_vm_ops = base_vma->vm_ops;
+	memcpy(mem_overlay->hijacked_vm_ops, base_vma->vm_ops,
+	       sizeof(struct vm_operations_struct));
+	mem_overlay->hijacked_vm_ops->map_pages = hijacked_map_pages;
+	mem_overlay->hijacked_vm_ops->fault = hijacked_fault;
+	if (write_redirect || track_dirty || base_vma->vm_ops->page_mkwrite)
+		mem_overlay->hijacked_vm_ops->page_mkwrite =
+			hijacked_page_mkwrite;
+
+	mem_overlay->mm = mm;
+	mmgrab(mm);
+	mem_overlay->owner = client;
+	kref_get(&client->refs);
+
+	// Save memory overlay into hashtable before publishing the hijacked
+	// vm_ops so page faults always find it.
+	int iret = hashtable_insert(mem_overlays, id, mem_overlay);
+	if (iret) {
+		log_error("failed to insert memory overlay into hashtable: %d",
+			  iret);
+		res = -EFAULT;
+		goto put_refs;
+	}
+
+	// Wait for page faults running under the per-VMA lock to complete and
+	// block new ones until the mmap write lock is released.
+	vma_start_write(base_vma);
+	base_vma->vm_ops = mem_overlay->hijacked_vm_ops;
+
+	// Huge pages, such as the ones used by tmpfs and shmem, would map a
+	// whole PMD from a single file, ignoring segment boundaries.
+	if (!(base_vma->vm_flags & VM_NOHUGEPAGE)) {
+		vm_flags_set(base_vma, VM_NOHUGEPAGE);
+		mem_overlay->base_vma_nohugepage = true;
+	}
+
+	// In write redirect and dirty tracking modes, pages must be mapped
+	// read-only so the first write to each of them calls page_mkwrite, even
+	// if the base file doesn't need write notifications. Unmap any page
+	// that may already be writable.
+	if (write_redirect || track_dirty) {
+		mem_overlay->original_vm_page_prot = base_vma->vm_page_prot;
+		WRITE_ONCE(base_vma->vm_page_prot,
+			   pgprot_modify(base_vma->vm_page_prot,
+					 vm_get_page_prot(base_vma->vm_flags &
+							  ~VM_SHARED)));
+		zap_page_range_single(base_vma, base_vma->vm_start,
+				      base_vma->vm_end - base_vma->vm_start,
+				      NULL);
+	}
+	log_info("done hijacking vm_ops addr=0x%lu", req->base_addr);
+
+	create_mem_overlay_debugfs(mem_overlay, id);
+
+	req->id = id;
+	log_info("memory overlay created successfully id=%lu", id);
+	return 0;
+
+put_refs:
+	put_client(client);
+	mmdrop(mm);
+	kvfree(mem_overlay->hijacked_vm_ops);
+cleanup_segments:
+	put_segment_files(mem_overlay);
+	segments_destroy(&mem_overlay->segments);
+	if (mem_overlay->scratch_file)
+		fput(mem_overlay->scratch_file);
+	kvfree(mem_overlay->scratch_bitmap);
+	kvfree(mem_overlay->dirty_bitmap);
+	kvfree(mem_overlay->access_bitmap);
+	kvfree(mem_overlay->access_log);
+	free_percpu(mem_overlay->access_bufs);
+	kvfree(mem_overlay->pending_bitmap);
+	destroy_mem_overlay_stats(mem_overlay);
+	kvfree(mem_overlay);
+	return res;
+}
+
+/*
+ * Create a new memory overlay in the given address space, owned by the device
+ * file of client. The mm mmap write lock must be held before calling this
+ * function.
+ */
+static long int create_mem_overlay(struct mm_struct *mm,
+				   struct mem_overlay_client *client,
+				   struct mem_overlay_req *req,
+				   struct mem_overlay_segment_req *segs)
+{
+	u64 start = latency_start(trace_mem_overlay_create_enabled());
+	long int res = setup_mem_overlay(mm, client, req, segs);
+	u64 duration = record_latency(MEM_OVERLAY_LATENCY_CREATE, start);
+	trace_mem_overlay_create(res ? 0 : req->id, req->base_addr,
+				 req->segments_size, req->flags, res, duration);
+	return res;
+}
+
+/*
+ * Acquire the mmap write lock of an address space, tracing the time spent
+ * waiting for it. id is the memory overlay being changed, or 0 if it's being
+ * created.
+ */
+static void mem_overlay_mmap_write_lock(struct mm_struct *mm,
+					unsigned long id)
+{
+	if (!trace_mem_overlay_lock_wait_enabled()) {
+		mmap_write_lock(mm);
+		return;
+	}
+	u64 start = ktime_get_ns();
+	mmap_write_lock(mm);
+	trace_mem_overlay_lock_wait(id, ktime_get_ns() - start);
+}
+
+/*
+ * Free a group of memory overlays that were already removed from the module
+ * state using the MEM_OVERLAY_CLEANUP_* flags of each overlay. Overlays are
+ * grouped by address space so the mmap write lock of each mm is only acquired
+ * once.
+ */
+static void cleanup_mem_overlays(struct mem_overlay **overlays,
+				 const unsigned int *flags, unsigned int n)
+{
+	// Page faults waiting for pending pages may hold the mmap read lock,
+	// so they must be woken up before acquiring the write lock.
+	for (unsigned int i = 0; i < n; i++) {
+		if (overlays[i])
+			cancel_pending(overlays[i]);
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		if (!overlays[i])
+			continue;
+
+		// The process that owns the memory may have already exited, in
+		// which case there is no VMA left to restore.
+		struct mm_struct *mm = overlays[i]->mm;
+		bool mm_alive = mmget_not_zero(mm);
+		if (mm_alive)
+			mem_overlay_mmap_write_lock(
+				mm, (unsigned long)overlays[i]->base_vma);
+		else
+			log_warn("address space already released for memory overlay id=%lu",
+				 (unsigned long)overlays[i]->base_vma);
+
+		for (unsigned int j = i; j < n; j++) {
+			if (!overlays[j] || overlays[j]->mm != mm)
+				continue;
+			unsigned long id = (unsigned long)overlays[j]->base_vma;
+			unsigned int segments = overlays[j]->segments.size;
+			u64 start =
+				latency_start(trace_mem_overlay_cleanup_enabled());
+			if (!mm_alive)
+				overlays[j]->base_vma = NULL;
+			cleanup_mem_overlay_deferred(overlays[j], flags[j]);
+			overlays[j] = NULL;
+			u64 duration =
+				record_latency(MEM_OVERLAY_LATENCY_CLEANUP, start);
+			trace_mem_overlay_cleanup(id, segments, flags[j],
+						  duration);
+		}
+
+		if (mm_alive) {
+			mmap_write_unlock(mm);
+			mmput(mm);
+		}
+	}
+}
+
+/*
+ * Check that a memory overlay was registered through the device file of the
+ * client passed in arg. Memory overlays may be registered in other processes
+ * via pidfd, so only their owner can change them or read their state.
+ */
+static int check_mem_overlay_owner(void *data, void *arg)
+{
+	struct mem_overlay *mem_overlay = data;
+	if (mem_overlay->owner != arg) {
+		log_error("memory overlay id=%lu is owned by another device file",
+			  (unsigned long)mem_overlay->base_vma);
+		return -EPERM;
+	}
+	return 0;
+}
+
+/*
+ * Remove a memory overlay owned by client from the module state and free its
+ * memory.
+ */
+static long int destroy_mem_overlay(struct mem_overlay_client *client,
+				    unsigned long id, unsigned int flags)
+{
+	if (flags & ~MEM_OVERLAY_CLEANUP_FLAGS) {
+		log_error("unknown memory overlay cleanup flags=0x%x", flags);
+		return -EINVAL;
+	}
+
+	struct mem_overlay *mem_overlay = hashtable_delete_if(
+		mem_overlays, id, check_mem_overlay_owner, client);
+	if (IS_ERR(mem_overlay))
+		return PTR_ERR(mem_overlay);
+	if (!mem_overlay) {
+		log_error("failed to cleanup memory overlay id=%lu", id);
+		return -ENOENT;
+	}
+
+	cleanup_mem_overlays(&mem_overlay, &flags, 1);
+	log_info("memory overlay removed successfully id=%lu", id);
+	return 0;
+}
+
+/*
+ * Read the segments of a memory overlay request from userspace. The returned
+ * array must be released with kvfree().
+ */
+static struct mem_overlay_segment_req *
+copy_mem_overlay_segments(struct mem_overlay_req *req)
+{
+	if (req->segments_size > MEM_OVERLAY_SEGMENTS_MAX) {
+		log_error("too many memory overlay segments: %u > %zu",
+			  req->segments_size, MEM_OVERLAY_SEGMENTS_MAX);
+		return ERR_PTR(-E2BIG);
+	}
+
+	struct mem_overlay_segment_req *segs = kvzalloc(
+		sizeof(struct mem_overlay_segment_req) * req->segments_size,
+		GFP_KERNEL);
+	if (!segs) {
+		log_error("failed to allocate segments");
+		return ERR_PTR(-ENOMEM);
+	}
+	unsigned long ret = copy_from_user(
+		segs, req->segments,
+		sizeof(struct mem_overlay_segment_req) * req->segments_size);
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay segments request from user: %lu",
+			ret);
+		kvfree(segs);
+		return ERR_PTR(-EFAULT);
+	}
+	return segs;
+}
+
+/*
+ * Read the segments of a memory overlay request of the first version of
+ * common.h, whose segments only have a range, and convert them to file
+ * segments. The returned array must be released with kvfree().
+ */
+static struct mem_overlay_segment_req *
+copy_mem_overlay_segments_v1(struct mem_overlay_req_v1 *req)
+{
+	if (req->segments_size > MEM_OVERLAY_SEGMENTS_MAX) {
+		log_error("too many memory overlay segments: %u > %zu",
+			  req->segments_size, MEM_OVERLAY_SEGMENTS_MAX);
+		return ERR_PTR(-E2BIG);
+	}
+
+	struct mem_overlay_segment_req *segs = kvzalloc(
+		sizeof(struct mem_overlay_segment_req) * req->segments_size,
+		GFP_KERNEL);
+	if (!segs) {
+		log_error("failed to allocate segments");
+		return ERR_PTR(-ENOMEM);
+	}
+	unsigned long ret = copy_from_user(
+		segs, req->segments,
+		sizeof(struct mem_overlay_segment_req_v1) * req->segments_size);
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay segments request from user: %lu",
+			ret);
+		kvfree(segs);
+		return ERR_PTR(-EFAULT);
+	}
+
+	// Expand the segments in place, starting from the last one so each
+	// segment is read before it's overwritten by a converted one.
+	struct mem_overlay_segment_req_v1 *segs_v1 =
+		(struct mem_overlay_segment_req_v1 *)segs;
+	for (unsigned int i = req->segments_size; i-- > 0;) {
+		struct mem_overlay_segment_req_v1 seg = segs_v1[i];
+		segs[i] = (struct mem_overlay_segment_req){
+			.start_pgoff = seg.start_pgoff,
+			.end_pgoff = seg.end_pgoff,
+			.type = MEM_OVERLAY_SEGMENT_FILE,
+		};
+	}
+	return segs;
+}
+
+static long int handle_mem_overlay_req(struct mem_overlay_client *client,
+				       struct mem_overlay_req *req,
+				       struct mem_overlay_segment_req *segs)
+{
+	struct mm_struct *mm = get_mem_overlay_req_mm(req);
+	if (IS_ERR(mm))
+		return PTR_ERR(mm);
+
+	// Acquire mm write lock since we expect to mutate the base VMA.
+	mem_overlay_mmap_write_lock(mm, 0);
+	long int res = create_mem_overlay(mm, client, req, segs);
+	mmap_write_unlock(mm);
+	mmput(mm);
+	return res;
+}
+
+static long int
+unlocked_ioctl_handle_mem_overlay_req(struct mem_overlay_client *client,
+				      unsigned long arg)
+{
+	// Read request data from userspace.
+	struct mem_overlay_req req;
+	unsigned long ret = copy_from_user(&req, (struct mem_overlay_req *)arg,
+					   sizeof(struct mem_overlay_req));
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay request from user: %lu",
+			ret);
+		return -EFAULT;
+	}
+
+	// Read overlay segments from request.
+	struct mem_overlay_segment_req *segs = copy_mem_overlay_segments(&req);
+	if (IS_ERR(segs))
+		return PTR_ERR(segs);
+	long int res = handle_mem_overlay_req(client, &req, segs);
+	kvfree(segs);
+	if (res)
+		return res;
+
+	// Return ID to userspace request.
+	ret = copy_to_user((struct mem_overlay_req *)arg, &req,
+			   sizeof(struct mem_overlay_req));
+	if (ret) {
+		log_error("failed to copy memory overlay ID to user: %lu", ret);
+		destroy_mem_overlay(client, req.id, 0);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * Handle a memory overlay request of the first version of common.h, which
+ * doesn't support request and segment options.
+ */
+static long int
+unlocked_ioctl_handle_mem_overlay_req_v1(struct mem_overlay_client *client,
+					 unsigned long arg)
+{
+	struct mem_overlay_req_v1 req_v1;
+	unsigned long ret =
+		copy_from_user(&req_v1, (struct mem_overlay_req_v1 *)arg,
+			       sizeof(struct mem_overlay_req_v1));
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay request from user: %lu",
+			ret);
+		return -EFAULT;
+	}
+
+	struct mem_overlay_segment_req *segs =
+		copy_mem_overlay_segments_v1(&req_v1);
+	if (IS_ERR(segs))
+		return PTR_ERR(segs);
+
+	struct mem_overlay_req req = {
+		.base_addr = req_v1.base_addr,
+		.overlay_addr = req_v1.overlay_addr,
+		.segments_size = req_v1.segments_size,
+	};
+	long int res = handle_mem_overlay_req(client, &req, segs);
+	kvfree(segs);
+	if (res)
+		return res;
+
+	// Return ID to userspace request.
+	if (put_user(req.id, &((struct mem_overlay_req_v1 *)arg)->id)) {
+		log_error("failed to copy memory overlay ID to user");
+		destroy_mem_overlay(client, req.id, 0);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long int
+unlocked_ioctl_handle_mem_overlay_cleanup_req(struct mem_overlay_client *client,
+					      unsigned long arg)
+{
+	struct mem_overlay_cleanup_req req;
+	unsigned long ret =
+		copy_from_user(&req, (struct mem_overlay_cleanup_req *)arg,
+			       sizeof(struct mem_overlay_cleanup_req));
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay cleanup request from user: %lu",
+			ret);
+		return -EFAULT;
+	}
+
+	return destroy_mem_overlay(client, req.id, req.flags);
+}
+
+static long int
+unlocked_ioctl_handle_mem_overlay_cleanup_req_v1(
+	struct mem_overlay_client *client, unsigned long arg)
+{
+	struct mem_overlay_cleanup_req_v1 req;
+	unsigned long ret =
+		copy_from_user(&req, (struct mem_overlay_cleanup_req_v1 *)arg,
+			       sizeof(struct mem_overlay_cleanup_req_v1));
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay cleanup request from user: %lu",
+			ret);
+		return -EFAULT;
+	}
+
+	return destroy_mem_overlay(client, req.id, 0);
+}
+
+/*
+ * Find a memory overlay and acquire the mmap write lock of its address space
+ * and the write lock of its base VMA, which block page faults on the base VMA
+ * until unlock_mem_overlay() is called. Fails with -ENOENT if the memory
+ * overlay or its base VMA no longer exists.
+ */
+static struct mem_overlay *lock_mem_overlay(unsigned long id,
+					    struct mm_struct **mm_p)
+{
+	// Hold a reference to the address space of the memory overlay so its
+	// mmap lock can be acquired.
+	rcu_read_lock();
+	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, id);
+	struct mm_struct *mm = mem_overlay ? mem_overlay->mm : NULL;
+	if (mm && !mmget_not_zero(mm))
+		mm = NULL;
+	rcu_read_unlock();
+	if (!mm) {
+		log_error("failed to find memory overlay id=%lu", id);
+		return ERR_PTR(-ENOENT);
+	}
+
+	// The memory overlay may have been removed while waiting for the lock.
+	// Cleanups only free it after acquiring the mmap write lock, so it
+	// remains valid until the lock is released.
+	mem_overlay_mmap_write_lock(mm, id);
+	mem_overlay = hashtable_lookup(mem_overlays, id);
+	if (!mem_overlay || mem_overlay->mm != mm) {
+		log_error("failed to find memory overlay id=%lu", id);
+		mmap_write_unlock(mm);
+		mmput(mm);
+		return ERR_PTR(-ENOENT);
+	}
+	if (!mem_overlay_base_vma_valid(mem_overlay)) {
+		log_error("base VMA of memory overlay id=%lu no longer exists",
+			  id);
+		mmap_write_unlock(mm);
+		mmput(mm);
+		return ERR_PTR(-ENOENT);
+	}
+
+	// Wait for page faults running under the per-VMA lock and block new
+	// ones until the mmap write lock is released.
+	vma_start_write(mem_overlay->base_vma);
+	*mm_p = mm;
+	return mem_overlay;
+}
+
+static void unlock_mem_overlay(struct mm_struct *mm)
+{
+	mmap_write_unlock(mm);
+	mmput(mm);
+}
+
+/*
+ * Read the dirty pages of a memory overlay owned by client as an array of
+ * segments, which must be released with kvfree(), and optionally reset them.
+ * Fails with -E2BIG if there are more than max segments, in which case count
+ * is set to the number of segments needed and the dirty set is not reset.
+ */
+static long int read_mem_overlay_dirty(struct mem_overlay_client *client,
+				       unsigned long id, unsigned int flags,
+				       unsigned int max,
+				       struct mem_overlay_segment_req **segs_p,
+				       unsigned int *count)
+{
+	if (flags & ~MEM_OVERLAY_DIRTY_FLAGS) {
+		log_error("unknown memory overlay dirty flags=0x%x", flags);
+		return -EINVAL;
+	}
+
+	struct mm_struct *mm;
+	struct mem_overlay *mem_overlay = lock_mem_overlay(id, &mm);
+	if (IS_ERR(mem_overlay))
+		return PTR_ERR(mem_overlay);
+
+	long int res = check_mem_overlay_owner(mem_overlay, client);
+	if (res)
+		goto unlock;
+	if (!mem_overlay->dirty_bitmap) {
+		log_error("dirty tracking is not enabled for memory overlay id=%lu",
+			  id);
+		res = -EINVAL;
+		goto unlock;
+	}
+
+	struct vm_area_struct *vma = mem_overlay->base_vma;
+	unsigned long *bitmap = mem_overlay->dirty_bitmap;
+	unsigned long pgoff = mem_overlay->base_pgoff;
+	unsigned int start, end, n = 0;
+	for_each_set_bitrange(start, end, bitmap, mem_overlay->base_pages)
+		n++;
+	*count = n;
+	if (n > max) {
+		log_error("too many dirty segments for memory overlay id=%lu: %u > %u",
+			  id, n, max);
+		res = -E2BIG;
+		goto unlock;
+	}
+	if (n == 0)
+		goto unlock;
+
+	struct mem_overlay_segment_req *segs = kvcalloc(
+		n, sizeof(struct mem_overlay_segment_req), GFP_KERNEL);
+	if (!segs) {
+		log_error("failed to allocate memory for %u dirty segments", n);
+		res = -ENOMEM;
+		goto unlock;
+	}
+
+	unsigned int i = 0;
+	for_each_set_bitrange(start, end, bitmap, mem_overlay->base_pages) {
+		segs[i].start_pgoff = pgoff + start;
+		segs[i].end_pgoff = pgoff + end - 1;
+		segs[i].type = MEM_OVERLAY_SEGMENT_FILE;
+		i++;
+	}
+	*segs_p = segs;
+
+	// Unmap the dirty pages so the next write to each of them calls
+	// page_mkwrite again. The base VMA is a shared mapping, so changes are
+	// kept in the page cache of the files that back the pages.
+	if (flags & MEM_OVERLAY_DIRTY_RESET) {
+		for (i = 0; i < n; i++)
+			zap_base_pages(vma, segs[i].start_pgoff,
+				       segs[i].end_pgoff);
+		bitmap_zero(bitmap, mem_overlay->base_pages);
+	}
+	log_debug("read dirty segments id=%lu segments=%u reset=%d", id, n,
+		  !!(flags & MEM_OVERLAY_DIRTY_RESET));
+
+unlock:
+	unlock_mem_overlay(mm);
+	return res;
+}
+
+static long int
+unlocked_ioctl_handle_mem_overlay_dirty_req(struct mem_overlay_client *client,
+					    unsigned long arg)
+{
+	struct mem_overlay_dirty_req req;
+	unsigned long ret =
+		copy_from_user(&req, (struct mem_overlay_dirty_req *)arg,
+			       sizeof(struct mem_overlay_dirty_req));
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay dirty request from user: %lu",
+			ret);
+		return -EFAULT;
+	}
+
+	// Segments are copied to userspace after the mmap lock is released,
+	// since writing to user memory may fault.
+	struct mem_overlay_segment_req *segs = NULL;
+	unsigned int count = 0;
+	long int res = read_mem_overlay_dirty(client, req.id, req.flags,
+					      req.segments_size, &segs, &count);
+	if (res && res != -E2BIG)
+		return res;
+
+	if (!res && count > 0) {
+		ret = copy_to_user(req.segments, segs,
+				   sizeof(struct mem_overlay_segment_req) *
+					   count);
+		if (ret) {
+			log_error(
+				"failed to copy dirty segments to user: %lu",
+				ret);
+			res = -EFAULT;
+			goto free_segs;
+		}
+	}
+
+	// Return the number of segments, or the number of segments needed if
+	// the array is too small.
+	req.segments_size = count;
+	ret = copy_to_user((struct mem_overlay_dirty_req *)arg, &req,
+			   sizeof(struct mem_overlay_dirty_req));
+	if (ret) {
+		log_error("failed to copy dirty segments size to user: %lu",
+			  ret);
+		res = -EFAULT;
+	}
+
+free_segs:
+	kvfree(segs);
+	return res;
+}
+
+/*
+ * Find the file and the page offset in this file that back a base page.
+ * Returns false for pages that don't need to be read, such as zero segment
+ * pages. The mm mmap lock must be held while the file is used.
+ */
+static bool prefetch_page_file(struct mem_overlay *mem_overlay, pgoff_t pgoff,
+			       struct file **file, pgoff_t *file_pgoff)
+{
+	rcu_read_lock();
+	XA_STATE(xas, &mem_overlay->segments.xa, pgoff);
+	struct mem_overlay_segment *seg =
+		segments_find_first(&mem_overlay->segments, &xas, pgoff, pgoff);
+	rcu_read_unlock();
+
+	if (seg != NULL) {
+		if (seg->type == MEM_OVERLAY_SEGMENT_ZERO)
+			return false;
+		*file = seg->overlay_file;
+		*file_pgoff = segment_file_pgoff(seg, pgoff);
+		return true;
+	}
+
+	long idx = scratch_index(mem_overlay, pgoff);
+	if (idx >= 0 && test_bit(idx, mem_overlay->scratch_bitmap))
+		*file = mem_overlay->scratch_file;
+	else
+		*file = mem_overlay->base_vma->vm_file;
+	*file_pgoff = pgoff;
+	return true;
+}
+
+/*
+ * Start reading the profile pages between start and end into the page cache
+ * without waiting for the IO to complete. Consecutive pages of the same file
+ * are read with a single request.
+ */
+static void prefetch_readahead(struct mem_overlay *mem_overlay,
+			       const unsigned long *pgoffs, unsigned long start,
+			       unsigned long end)
+{
+	struct file *run_file = NULL;
+	pgoff_t run_start = 0;
+	pgoff_t run_len = 0;
+
+	for (unsigned long i = start; i < end; i++) {
+		struct file *file;
+		pgoff_t file_pgoff;
+		if (!prefetch_page_file(mem_overlay, pgoffs[i], &file,
+					&file_pgoff))
+			continue;
+		if (file == run_file && file_pgoff == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+
+		if (run_file)
+			vfs_fadvise(run_file, (loff_t)run_start << PAGE_SHIFT,
+				    (loff_t)run_len << PAGE_SHIFT,
+				    POSIX_FADV_WILLNEED);
+		run_file = file;
+		run_start = file_pgoff;
+		run_len = 1;
+	}
+
+	if (run_file)
+		vfs_fadvise(run_file, (loff_t)run_start << PAGE_SHIFT,
+			    (loff_t)run_len << PAGE_SHIFT, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Map the profile pages between start and end into the base VMA by faulting
+ * them through the hijacked handlers, in profile order.
+ */
+static void prefetch_map_pages(struct mem_overlay *mem_overlay,
+			       struct mm_struct *mm,
+			       const unsigned long *pgoffs,
+			       unsigned long start, unsigned long end)
+{
+	struct vm_area_struct *vma = mem_overlay->base_vma;
+	for (unsigned long i = start; i < end; i++) {
+		pgoff_t pgoff = pgoffs[i];
+		if (pgoff < vma->vm_pgoff ||
+		    pgoff - vma->vm_pgoff >= vma_pages(vma))
+			continue;
+
+		// Pending pages would block the prefetch until userspace
+		// supplies them.
+		long idx = base_page_index(mem_overlay, pgoff);
+		if (mem_overlay->pending_bitmap && idx >= 0 &&
+		    test_bit(idx, mem_overlay->pending_bitmap))
+			continue;
+
+		// Without the unlocked argument the fault can't drop the mmap
+		// lock, so the memory overlay remains valid.
+		unsigned long addr =
+			vma->vm_start + ((pgoff - vma->vm_pgoff) << PAGE_SHIFT);
+		int ret = fixup_user_fault(mm, addr, 0, NULL);
+		if (ret)
+			log_debug("failed to prefetch page=%lu: %d", pgoff,
+				  ret);
+	}
+}
+
+/*
+ * Replay a prefetch profile in batches. The IO for the next batch is started
+ * before the pages of the current batch are mapped, so reading and mapping
+ * pages overlap. The mmap read lock is released between batches so the
+ * memory overlay can be cleaned up, which stops the prefetch.
+ */
+static void prefetch_work(struct work_struct *work)
+{
+	struct mem_overlay_prefetch *prefetch =
+		container_of(work, struct mem_overlay_prefetch, work);
+	struct mm_struct *mm = prefetch->mm;
+	unsigned long n = prefetch->pgoffs_size;
+	unsigned long pos = 0;
+	unsigned long ra_end = 0;
+
+	log_debug("starting prefetch id=%lu pages=%lu", prefetch->id, n);
+	while (pos < n) {
+		if (READ_ONCE(prefetch->cancelled) ||
+		    READ_ONCE(mem_overlay_prefetch_stopped))
+			break;
+		if (!mmget_not_zero(mm))
+			break;
+
+		mmap_read_lock(mm);
+		struct mem_overlay *mem_overlay =
+			hashtable_lookup(mem_overlays, prefetch->id);
+		if (!mem_overlay || mem_overlay->prefetch != prefetch ||
+		    !mem_overlay_base_vma_valid(mem_overlay)) {
+			mmap_read_unlock(mm);
+			mmput(mm);
+			break;
+		}
+
+		unsigned long batch = READ_ONCE(prefetch->batch_pages);
+		unsigned long end = min(n, pos + batch);
+		unsigned long next_end = min(n, end + batch);
+		if (ra_end < next_end) {
+			prefetch_readahead(mem_overlay, prefetch->pgoffs,
+					   max(pos, ra_end), next_end);
+			ra_end = next_end;
+		}
+		prefetch_map_pages(mem_overlay, mm, prefetch->pgoffs, pos, end);
+		mmap_read_unlock(mm);
+		mmput(mm);
+		pos = end;
+
+		unsigned int delay_us = READ_ONCE(prefetch->delay_us);
+		if (delay_us)
+			fsleep(delay_us);
+		else
+			cond_resched();
+	}
+	log_debug("finished prefetch id=%lu pages=%lu/%lu", prefetch->id, pos,
+		  n);
+
+	// Detach the prefetch from the memory overlay, if it still exists, so
+	// a new one can be started.
+	if (mmget_not_zero(mm)) {
+		mmap_read_lock(mm);
+		struct mem_overlay *mem_overlay =
+			hashtable_lookup(mem_overlays, prefetch->id);
+		if (mem_overlay && mem_overlay->prefetch == prefetch)
+			WRITE_ONCE(mem_overlay->prefetch, NULL);
+		mmap_read_unlock(mm);
+		mmput(mm);
+	}
+
+	mmdrop(mm);
+	kvfree(prefetch->pgoffs);
+	kvfree(prefetch);
+}
+
+/*
+ * Start, cancel or throttle the prefetch of a memory overlay owned by client.
+ * On start, pgoffs is owned by the prefetch.
+ */
+static long int
+handle_mem_overlay_prefetch(struct mem_overlay_client *client,
+			    struct mem_overlay_prefetch_req *req,
+			    unsigned long *pgoffs)
+{
+	struct mm_struct *mm;
+	struct mem_overlay *mem_overlay = lock_mem_overlay(req->id, &mm);
+	if (IS_ERR(mem_overlay))
+		return PTR_ERR(mem_overlay);
+
+	long int res = check_mem_overlay_owner(mem_overlay, client);
+	if (res)
+		goto unlock;
+
+	struct mem_overlay_prefetch *prefetch = mem_overlay->prefetch;
+	unsigned int batch_pages = req->batch_pages ?
+					   req->batch_pages :
+					   MEM_OVERLAY_PREFETCH_BATCH_PAGES;
+
+	if (req->flags & MEM_OVERLAY_PREFETCH_CANCEL) {
+		if (prefetch)
+			WRITE_ONCE(prefetch->cancelled, true);
+		goto unlock;
+	}
+
+	if (req->flags & MEM_OVERLAY_PREFETCH_THROTTLE) {
+		if (!prefetch) {
+			log_error("no prefetch running for memory overlay id=%lu",
+				  req->id);
+			res = -ESRCH;
+			goto unlock;
+		}
+		WRITE_ONCE(prefetch->batch_pages, batch_pages);
+		WRITE_ONCE(prefetch->delay_us, req->delay_us);
+		goto unlock;
+	}
+
+	if (prefetch) {
+		log_error("prefetch already running for memory overlay id=%lu",
+			  req->id);
+		res = -EBUSY;
+		goto unlock;
+	}
+
+	prefetch = kvzalloc(sizeof(struct mem_overlay_prefetch), GFP_KERNEL);
+	if (!prefetch) {
+		log_error("failed to allocate memory for prefetch");
+		res = -ENOMEM;
+		goto unlock;
+	}
+	prefetch->id = req->id;
+	prefetch->mm = mm;
+	mmgrab(mm);
+	prefetch->pgoffs = pgoffs;
+	prefetch->pgoffs_size = req->pgoffs_size;
+	prefetch->batch_pages = batch_pages;
+	prefetch->delay_us = req->delay_us;
+	INIT_WORK(&prefetch->work, prefetch_work);
+
+	mem_overlay->prefetch = prefetch;
+	queue_work(mem_overlay_wq, &prefetch->work);
+	log_debug("queued prefetch id=%lu pages=%lu", req->id,
+		  req->pgoffs_size);
+
+unlock:
+	unlock_mem_overlay(mm);
+	return res;
+}
 
+/*
+ * Return the number of pages of the base VMA of a memory overlay, or 0 if it
+ * doesn't exist. Used to bound the size of arrays read from userspace before
+ * allocating memory for them.
+ */
+static unsigned long mem_overlay_base_pages(unsigned long id)
+{
 	rcu_read_lock();
-	for (pgoff_t start = start_pgoff; start <= end_pgoff; start = end + 1) {
-		do {
-			seg = xas_find(&xas, end_pgoff);
-		} while (xas_retry(&xas, seg));
+	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, id);
+	unsigned long pages = mem_overlay ? mem_overlay->base_pages : 0;
+	rcu_read_unlock();
+	return pages;
+}
 
-		// The range doesn't overlap with any segment, so handle it like a
-		// normal page fault.
-		if (seg == NULL) {
-			end = end_pgoff;
-			log_debug(
-				"handling base page fault start=%lu end=%lu id=%lu",
-				start, end, id);
+static long int unlocked_ioctl_handle_mem_overlay_prefetch_req(
+	struct mem_overlay_client *client, unsigned long arg)
+{
+	struct mem_overlay_prefetch_req req;
+	unsigned long ret =
+		copy_from_user(&req, (struct mem_overlay_prefetch_req *)arg,
+			       sizeof(struct mem_overlay_prefetch_req));
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay prefetch request from user: %lu",
+			ret);
+		return -EFAULT;
+	}
+	if (req.flags & ~MEM_OVERLAY_PREFETCH_FLAGS ||
+	    (req.flags & MEM_OVERLAY_PREFETCH_FLAGS) ==
+		    MEM_OVERLAY_PREFETCH_FLAGS) {
+		log_error("invalid memory overlay prefetch flags=0x%x",
+			  req.flags);
+		return -EINVAL;
+	}
 
-			ret = filemap_map_pages(vmf, start, end);
-			break;
+	// The profile is read before locking the memory overlay, since reading
+	// user memory may fault.
+	unsigned long *pgoffs = NULL;
+	bool start = !(req.flags & (MEM_OVERLAY_PREFETCH_CANCEL |
+				    MEM_OVERLAY_PREFETCH_THROTTLE));
+	if (start) {
+		if (req.pgoffs_size == 0)
+			return 0;
+		unsigned long base_pages = mem_overlay_base_pages(req.id);
+		if (!base_pages) {
+			log_error("failed to find memory overlay id=%lu",
+				  req.id);
+			return -ENOENT;
 		}
-
-		// Handle any non-overlay range before the next segment.
-		if (start < seg->start_pgoff) {
-			end = seg->start_pgoff - 1;
-			log_debug(
-				"handling base page fault start=%lu end=%lu id=%lu",
-				start, end, id);
-
-			ret = filemap_map_pages(vmf, start, end);
-			if (ret & VM_FAULT_ERROR)
-				break;
-			start = end + 1;
+		if (req.pgoffs_size > base_pages) {
+			log_error("too many prefetch pages for memory overlay id=%lu: %lu > %lu",
+				  req.id, req.pgoffs_size, base_pages);
+			return -E2BIG;
+		}
+		pgoffs = kvmalloc_array(req.pgoffs_size, sizeof(unsigned long),
+					GFP_KERNEL);
+		if (!pgoffs) {
+			log_error("failed to allocate memory for %lu prefetch pages",
+				  req.pgoffs_size);
+			return -ENOMEM;
+		}
+		ret = copy_from_user(pgoffs, req.pgoffs,
+				     sizeof(unsigned long) * req.pgoffs_size);
+		if (ret) {
+			log_error("failed to copy prefetch pages from user: %lu",
+				  ret);
+			kvfree(pgoffs);
+			return -EFAULT;
 		}
-
-		// Handle fault over overlay range.
-		end = min(seg->end_pgoff, end_pgoff);
-		log_debug(
-			"handling overlay page fault start=%lu end=%lu id=%lu",
-			start, end, id);
-
-		// Make a copy of the target VMA to change its source file without
-		// affecting any potential concurrent reader.
-		struct vm_area_struct *vma_orig = vmf->vma;
-		struct vm_area_struct vma_copy;
-		memcpy(&vma_copy, vmf->vma, sizeof(struct vm_area_struct));
-		vma_copy.vm_file = seg->overlay_vma->vm_file;
-
-		// Use a pointer to the vmf->vma pointer to alter its refence since
-		// this field is marked as a const.
-		struct vm_area_struct **vma_p =
-			(struct vm_area_struct **)&vmf->vma;
-		*vma_p = &vma_copy;
-		ret = filemap_map_pages(vmf, start, end);
-		*vma_p = vma_orig;
-		if (ret & VM_FAULT_ERROR)
-			break;
 	}
-	rcu_read_unlock();
-	return ret;
+
+	long int res = handle_mem_overlay_prefetch(client, &req, pgoffs);
+	if (res)
+		kvfree(pgoffs);
+	return res;
 }
 
-static void cleanup_mem_overlay_segments(struct xarray segments)
+static int access_time_cmp(const void *a, const void *b)
 {
-	unsigned long i;
-	struct mem_overlay_segment *seg;
-	xa_for_each(&segments, i, seg) {
-		kvfree(seg);
-		i = seg->end_pgoff + 1;
-	}
-	xa_destroy(&segments);
+	u64 time_a = ((const struct mem_overlay_access *)a)->time;
+	u64 time_b = ((const struct mem_overlay_access *)b)->time;
+	return time_a < time_b ? -1 : time_a > time_b;
 }
 
 /*
- * Free memory used by a memory overlay entry. If the process that owns the
- * memory can be assumed to still be running, a mm mmap write lock should be
- * held before calling this function.
+ * Read the pages recorded by the access recorder of a memory overlay owned by
+ * client in the order they were first touched, as an array that must be
+ * released with kvfree(). Fails with -E2BIG if there are more than max pages,
+ * in which case count is set to the number of pages recorded and the recorder
+ * is not changed.
  */
-static void cleanup_mem_overlay(void *data)
+static long int read_mem_overlay_access(struct mem_overlay_client *client,
+					unsigned long id, unsigned int flags,
+					unsigned long max,
+					unsigned long **pgoffs_p,
+					unsigned long *count)
 {
-	struct mem_overlay *mem_overlay = (struct mem_overlay *)data;
+	if (flags & ~MEM_OVERLAY_ACCESS_FLAGS) {
+		log_error("unknown memory overlay access flags=0x%x", flags);
+		return -EINVAL;
+	}
 
-	// Revert base VMA vm_ops to its original value in case the VMA is used
-	// after cleanup (usually to call ->close() on unmap).
-	const struct vm_operations_struct *vm_ops =
-		mem_overlay->base_vma->vm_ops;
-	if (vm_ops != NULL && vm_ops->map_pages == hijacked_map_pages) {
-		mem_overlay->base_vma->vm_ops = mem_overlay->original_vm_ops;
+	struct mm_struct *mm;
+	struct mem_overlay *mem_overlay = lock_mem_overlay(id, &mm);
+	if (IS_ERR(mem_overlay))
+		return PTR_ERR(mem_overlay);
+
+	long int res = check_mem_overlay_owner(mem_overlay, client);
+	if (res)
+		goto unlock;
+	if (!mem_overlay->access_bitmap) {
+		log_error("access recording is not enabled for memory overlay id=%lu",
+			  id);
+		res = -EINVAL;
+		goto unlock;
 	}
 
-	kvfree(mem_overlay->hijacked_vm_ops);
-	cleanup_mem_overlay_segments(mem_overlay->segments);
-	kvfree(mem_overlay);
-}
+	// Page faults are blocked, so the per-CPU buffers can be flushed from
+	// this CPU.
+	int cpu;
+	for_each_possible_cpu(cpu)
+		flush_access_buf(mem_overlay,
+				 per_cpu_ptr(mem_overlay->access_bufs, cpu));
+
+	unsigned long n = atomic_long_read(&mem_overlay->access_len);
+	*count = n;
+	if (n > max) {
+		log_error("too many recorded pages for memory overlay id=%lu: %lu > %lu",
+			  id, n, max);
+		res = -E2BIG;
+		goto unlock;
+	}
 
-static int device_open(struct inode *device_file, struct file *instance)
-{
-	log_debug("called device_open");
-	log_info("device opened");
-	return 0;
-}
+	// The log is copied and sorted after the lock is released, so page
+	// faults are only blocked while it's copied.
+	struct mem_overlay_access *log = NULL;
+	unsigned long *pgoffs = NULL;
+	if (n > 0) {
+		log = kvmalloc_array(n, sizeof(struct mem_overlay_access),
+				     GFP_KERNEL);
+		pgoffs = kvmalloc_array(n, sizeof(unsigned long), GFP_KERNEL);
+		if (!log || !pgoffs) {
+			log_error("failed to allocate memory for %lu recorded pages",
+				  n);
+			kvfree(log);
+			kvfree(pgoffs);
+			res = -ENOMEM;
+			goto unlock;
+		}
+		memcpy(log, mem_overlay->access_log,
+		       n * sizeof(struct mem_overlay_access));
+	}
 
-static int device_close(struct inode *device_file, struct file *instance)
-{
-	log_debug("called device_close");
-	log_info("device closed");
+	if (flags & MEM_OVERLAY_ACCESS_RESET) {
+		bitmap_zero(mem_overlay->access_bitmap,
+			    mem_overlay->base_pages);
+		atomic_long_set(&mem_overlay->access_len, 0);
+	}
+	if (flags & MEM_OVERLAY_ACCESS_STOP)
+		WRITE_ONCE(mem_overlay->access_recording, false);
+	unlock_mem_overlay(mm);
+	log_debug("read recorded pages id=%lu pages=%lu flags=%u", id, n,
+		  flags);
+
+	if (n > 0) {
+		sort(log, n, sizeof(struct mem_overlay_access),
+		     access_time_cmp, NULL);
+		for (unsigned long i = 0; i < n; i++)
+			pgoffs[i] = log[i].pgoff;
+		kvfree(log);
+		*pgoffs_p = pgoffs;
+	}
 	return 0;
+
+unlock:
+	unlock_mem_overlay(mm);
+	return res;
 }
 
-static long int unlocked_ioctl_handle_mem_overlay_req(unsigned long arg)
+static long int
+unlocked_ioctl_handle_mem_overlay_access_req(struct mem_overlay_client *client,
+					     unsigned long arg)
 {
-	long int res = 0;
-
-	// Read request data from userspace.
-	struct mem_overlay_req req;
-	unsigned long ret = copy_from_user(&req, (struct mem_overlay_req *)arg,
-					   sizeof(struct mem_overlay_req));
+	struct mem_overlay_access_req req;
+	unsigned long ret =
+		copy_from_user(&req, (struct mem_overlay_access_req *)arg,
+			       sizeof(struct mem_overlay_access_req));
 	if (ret) {
 		log_error(
-			"failed to copy memory overlay request from user: %lu",
+			"failed to copy memory overlay access request from user: %lu",
 			ret);
 		return -EFAULT;
 	}
 
-	// Acquire mm write lock since we expect to mutate the base VMA.
-	// TODO: support per-VMA locking (https://lwn.net/Articles/937943/).
-	mmap_write_lock(current->mm);
-
-	// Find base and overlay VMAs.
-	struct vm_area_struct *overlay_vma =
-		find_vma(current->mm, req.overlay_addr);
-	if (overlay_vma == NULL || overlay_vma->vm_start > req.overlay_addr) {
-		log_error("failed to find overlay VMA");
-		res = -EINVAL;
-		goto out;
+	// Page offsets are copied to userspace after the mmap lock is
+	// released, since writing to user memory may fault.
+	unsigned long *pgoffs = NULL;
+	unsigned long count = 0;
+	long int res = read_mem_overlay_access(client, req.id, req.flags,
+					       req.pgoffs_size, &pgoffs, &count);
+	if (res && res != -E2BIG)
+		return res;
+
+	if (!res && count > 0) {
+		ret = copy_to_user(req.pgoffs, pgoffs,
+				   sizeof(unsigned long) * count);
+		if (ret) {
+			log_error("failed to copy recorded pages to user: %lu",
+				  ret);
+			res = -EFAULT;
+			goto free_pgoffs;
+		}
 	}
 
-	struct vm_area_struct *base_vma = find_vma(current->mm, req.base_addr);
-	if (base_vma == NULL || base_vma->vm_start > req.base_addr) {
-		log_error("failed to find base VMA");
-		res = -EINVAL;
-		goto out;
+	// Return the number of pages recorded.
+	req.pgoffs_size = count;
+	ret = copy_to_user((struct mem_overlay_access_req *)arg, &req,
+			   sizeof(struct mem_overlay_access_req));
+	if (ret) {
+		log_error("failed to copy recorded pages size to user: %lu",
+			  ret);
+		res = -EFAULT;
 	}
-	unsigned long id = (unsigned long)base_vma;
 
-	// Check if VMA is already stored.
-	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, id);
-	if (mem_overlay) {
-		if (base_vma->vm_ops->map_pages == hijacked_map_pages) {
-			log_error("memory overlay already exists");
-			res = -EEXIST;
-			goto out;
-		}
-
-		// Leftover memory overlay, delete from state and proceed.
-		cleanup_mem_overlay(mem_overlay);
-		hashtable_delete(mem_overlays, id);
-		mem_overlay = NULL;
-	}
+free_pgoffs:
+	kvfree(pgoffs);
+	return res;
+}
 
-	// Read overlay segments from request.
-	struct mem_overlay_segment_req *segs =
-		kvzalloc(sizeof(struct mem_overlay_segment) * req.segments_size,
-			 GFP_KERNEL);
-	if (!segs) {
-		log_error("failed to allocate segments");
-		res = -ENOMEM;
-		goto out;
-	}
-	ret = copy_from_user(segs, req.segments,
-			     sizeof(struct mem_overlay_segment_req) *
-				     req.segments_size);
+/*
+ * Mark ranges of pending pages of a memory overlay as ready and wake up the
+ * page faults waiting for them. Only the device file that registered the
+ * memory overlay can supply its pages.
+ */
+static long int
+unlocked_ioctl_handle_mem_overlay_ready_req(struct mem_overlay_client *client,
+					    unsigned long arg)
+{
+	struct mem_overlay_ready_req req;
+	unsigned long ret =
+		copy_from_user(&req, (struct mem_overlay_ready_req *)arg,
+			       sizeof(struct mem_overlay_ready_req));
 	if (ret) {
 		log_error(
-			"failed to copy memory overlay segments request from user: %lu",
+			"failed to copy memory overlay ready request from user: %lu",
 			ret);
-		res = -EFAULT;
-		goto free_segs;
+		return -EFAULT;
+	}
+	if (req.ranges_size == 0)
+		return 0;
+	unsigned long base_pages = mem_overlay_base_pages(req.id);
+	if (!base_pages) {
+		log_error("failed to find memory overlay id=%lu", req.id);
+		return -ENOENT;
+	}
+	if (req.ranges_size > base_pages) {
+		log_error("too many ready ranges for memory overlay id=%lu: %u > %lu",
+			  req.id, req.ranges_size, base_pages);
+		return -E2BIG;
 	}
 
-	log_debug(
-		"received memory overlay request base_addr=%lu overlay_addr=%lu",
-		req.base_addr, req.overlay_addr);
+	struct mem_overlay_range *ranges = kvcalloc(
+		req.ranges_size, sizeof(struct mem_overlay_range), GFP_KERNEL);
+	if (!ranges) {
+		log_error("failed to allocate memory for %u ready ranges",
+			  req.ranges_size);
+		return -ENOMEM;
+	}
+	ret = copy_from_user(ranges, req.ranges,
+			     sizeof(struct mem_overlay_range) * req.ranges_size);
+	if (ret) {
+		log_error("failed to copy ready ranges from user: %lu", ret);
+		kvfree(ranges);
+		return -EFAULT;
+	}
 
-	// Create new memory overlay instance.
-	mem_overlay = kvzalloc(sizeof(struct mem_overlay), GFP_KERNEL);
+	long int res = 0;
+	rcu_read_lock();
+	struct mem_overlay *mem_overlay = hashtable_lookup(mem_overlays, req.id);
 	if (!mem_overlay) {
-		log_error("failed to allocate memory for memory overlay");
-		res = -ENOMEM;
-		goto free_segs;
+		log_error("failed to find memory overlay id=%lu", req.id);
+		res = -ENOENT;
+		goto unlock;
+	}
+	if (mem_overlay->owner != client) {
+		log_error("memory overlay id=%lu is owned by another device file",
+			  req.id);
+		res = -EPERM;
+		goto unlock;
+	}
+	if (!mem_overlay->pending_bitmap) {
+		log_error("memory overlay id=%lu has no pending segments",
+			  req.id);
+		res = -EINVAL;
+		goto unlock;
 	}
 
-	mem_overlay->base_addr = req.base_addr;
-	xa_init(&(mem_overlay->segments));
-
-	struct mem_overlay_segment *seg;
-	for (int i = 0; i < req.segments_size; i++) {
-		unsigned long start = segs[i].start_pgoff;
-		unsigned long end = segs[i].end_pgoff;
-
-		seg = kvzalloc(sizeof(struct mem_overlay_segment), GFP_KERNEL);
-		if (!seg) {
-			log_error(
-				"failed to allocate memory for memory overlay segment start=%lu end=%lu",
-				start, end);
-			res = -ENOMEM;
-			goto cleanup_segments;
-		}
+	// Clear all ranges first so every waiter is woken up in one pass.
+	unsigned long first = mem_overlay->base_pgoff;
+	unsigned long last = first + mem_overlay->base_pages - 1;
+	struct mem_overlay_client *owner = mem_overlay->owner;
+	spin_lock(&owner->lock);
+	for (unsigned int i = 0; i < req.ranges_size; i++) {
+		unsigned long start = max(ranges[i].start_pgoff, first);
+		unsigned long end = min(ranges[i].end_pgoff, last);
+		if (start > end)
+			continue;
+		bitmap_clear(mem_overlay->pending_bitmap, start - first,
+			     end - start + 1);
+	}
+	complete_pending(owner, req.id, mem_overlay->pending_bitmap, first);
+	spin_unlock(&owner->lock);
+	log_debug("marked pending ranges as ready id=%lu ranges=%u", req.id,
+		  req.ranges_size);
 
-		seg->start_pgoff = start;
-		seg->end_pgoff = end;
-		seg->overlay_addr = req.overlay_addr;
-		seg->overlay_vma = overlay_vma;
+unlock:
+	rcu_read_unlock();
+	kvfree(ranges);
+	return res;
+}
 
-		log_debug("inserting segment to overlay start=%lu end=%lu",
-			  start, end);
-		xa_store_range(&mem_overlay->segments, start, end, seg,
-			       GFP_KERNEL);
+static long int
+unlocked_ioctl_handle_mem_overlay_batch_req(struct mem_overlay_client *client,
+					    unsigned long arg)
+{
+	struct mem_overlay_batch_req batch;
+	unsigned long ret =
+		copy_from_user(&batch, (struct mem_overlay_batch_req *)arg,
+			       sizeof(struct mem_overlay_batch_req));
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay batch request from user: %lu",
+			ret);
+		return -EFAULT;
+	}
+	if (batch.reqs_size == 0)
+		return 0;
+	if (batch.reqs_size > MEM_OVERLAY_BATCH_MAX) {
+		log_error("too many memory overlay batch requests: %u > %u",
+			  batch.reqs_size, MEM_OVERLAY_BATCH_MAX);
+		return -E2BIG;
 	}
 
-	// Hijack page fault handler for base VMA.
-	log_info("hijacking vm_ops for base VMA addr=0x%lu", req.base_addr);
-	mem_overlay->hijacked_vm_ops =
-		kvzalloc(sizeof(struct vm_operations_struct), GFP_KERNEL);
-	if (!mem_overlay->hijacked_vm_ops) {
-		log_error("failed to allocate memory for hijacked vm_ops");
+	long int res = 0;
+	unsigned int n = batch.reqs_size;
+	struct mem_overlay_req *reqs =
+		kvcalloc(n, sizeof(struct mem_overlay_req), GFP_KERNEL);
+	struct mem_overlay_segment_req **segs =
+		kvcalloc(n, sizeof(struct mem_overlay_segment_req *), GFP_KERNEL);
+	struct mm_struct **mms =
+		kvcalloc(n, sizeof(struct mm_struct *), GFP_KERNEL);
+	int *statuses = kvcalloc(n, sizeof(int), GFP_KERNEL);
+	if (!reqs || !segs || !mms || !statuses) {
+		log_error("failed to allocate memory for batch request");
 		res = -ENOMEM;
-		goto cleanup_segments;
+		goto free_batch;
 	}
 
-	// Store base VMA and original vm_ops so we can restore it on cleanup.
-	mem_overlay->base_vma = base_vma;
-	mem_overlay->original_vm_ops = base_vma->vm_ops;
+	ret = copy_from_user(reqs, batch.reqs,
+			     sizeof(struct mem_overlay_req) * n);
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay batch requests from user: %lu",
+			ret);
+		res = -EFAULT;
+		goto free_batch;
+	}
 
-	memcpy(mem_overlay->hijacked_vm_ops, base_vma->vm_ops,
-	       sizeof(struct vm_operations_struct));
-	mem_overlay->hijacked_vm_ops->map_pages = hijacked_map_pages;
-	base_vma->vm_ops = mem_overlay->hijacked_vm_ops;
-	log_info("done hijacking vm_ops addr=0x%lu", req.base_addr);
+	// Read segments and resolve target address spaces before taking any
+	// lock.
+	for (unsigned int i = 0; i < n; i++) {
+		segs[i] = copy_mem_overlay_segments(&reqs[i]);
+		if (IS_ERR(segs[i])) {
+			statuses[i] = PTR_ERR(segs[i]);
+			segs[i] = NULL;
+			continue;
+		}
 
-	// Save memory overlay into hashtable.
-	int iret = hashtable_insert(mem_overlays, id, mem_overlay);
-	if (iret) {
-		log_error("failed to insert memory overlay into hashtable: %d",
-			  iret);
-		res = -EFAULT;
-		goto revert_vm_ops;
+		mms[i] = get_mem_overlay_req_mm(&reqs[i]);
+		if (IS_ERR(mms[i])) {
+			statuses[i] = PTR_ERR(mms[i]);
+			mms[i] = NULL;
+		}
 	}
 
-	// Return ID to userspace request.
-	req.id = id;
-	ret = copy_to_user((struct mem_overlay_req *)arg, &req,
-			   sizeof(struct mem_overlay_req));
+	// Handle requests grouped by address space so the mmap write lock of
+	// each mm is only acquired once.
+	for (unsigned int i = 0; i < n; i++) {
+		if (!mms[i])
+			continue;
+
+		struct mm_struct *mm = mms[i];
+		unsigned int refs = 0;
+		mem_overlay_mmap_write_lock(mm, 0);
+		for (unsigned int j = i; j < n; j++) {
+			if (mms[j] != mm)
+				continue;
+			statuses[j] = create_mem_overlay(mm, client, &reqs[j],
+							 segs[j]);
+			mms[j] = NULL;
+			refs++;
+		}
+		mmap_write_unlock(mm);
+		while (refs--)
+			mmput(mm);
+	}
+
+	// Return IDs and per-request status to userspace.
+	ret = copy_to_user(batch.reqs, reqs,
+			   sizeof(struct mem_overlay_req) * n);
+	if (!ret)
+		ret = copy_to_user(batch.statuses, statuses, sizeof(int) * n);
 	if (ret) {
-		log_error("failed to copy memory overlay ID to user: %lu", ret);
+		log_error(
+			"failed to copy memory overlay batch result to user: %lu",
+			ret);
+		for (unsigned int i = 0; i < n; i++) {
+			if (!statuses[i])
+				destroy_mem_overlay(client, reqs[i].id, 0);
+		}
 		res = -EFAULT;
-		goto revert_vm_ops;
+		goto free_batch;
 	}
 
-	log_info("memory overlay created successfully id=%lu", id);
-	goto free_segs;
+	unsigned int failed = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		if (statuses[i])
+			failed++;
+	}
+	log_debug("handled memory overlay batch request size=%u failed=%u", n,
+		  failed);
 
-revert_vm_ops:
-	base_vma->vm_ops = mem_overlay->original_vm_ops;
-	kvfree(mem_overlay->hijacked_vm_ops);
-cleanup_segments:
-	cleanup_mem_overlay_segments(mem_overlay->segments);
-	kvfree(mem_overlay);
-free_segs:
+free_batch:
+	if (segs) {
+		for (unsigned int i = 0; i < n; i++)
+			kvfree(segs[i]);
+	}
+	kvfree(statuses);
+	kvfree(mms);
 	kvfree(segs);
-out:
-	mmap_write_unlock(current->mm);
+	kvfree(reqs);
 	return res;
 }
 
-static long int unlocked_ioctl_handle_mem_overlay_cleanup_req(unsigned long arg)
+static long int unlocked_ioctl_handle_mem_overlay_batch_cleanup_req(
+	struct mem_overlay_client *client, unsigned long arg)
 {
-	struct mem_overlay_cleanup_req req;
-	unsigned long ret =
-		copy_from_user(&req, (struct mem_overlay_cleanup_req *)arg,
-			       sizeof(struct mem_overlay_cleanup_req));
+	struct mem_overlay_batch_cleanup_req batch;
+	unsigned long ret = copy_from_user(
+		&batch, (struct mem_overlay_batch_cleanup_req *)arg,
+		sizeof(struct mem_overlay_batch_cleanup_req));
 	if (ret) {
 		log_error(
-			"failed to copy memory overlay cleanup request from user: %lu",
+			"failed to copy memory overlay batch cleanup request from user: %lu",
 			ret);
 		return -EFAULT;
 	}
+	if (batch.reqs_size == 0)
+		return 0;
+	if (batch.reqs_size > MEM_OVERLAY_BATCH_MAX) {
+		log_error("too many memory overlay batch cleanup requests: %u > %u",
+			  batch.reqs_size, MEM_OVERLAY_BATCH_MAX);
+		return -E2BIG;
+	}
 
-	struct mem_overlay *mem_overlay =
-		hashtable_delete(mem_overlays, req.id);
-	if (!mem_overlay) {
-		log_error("failed to cleanup memory overlay id=%lu", req.id);
-		return -ENOENT;
+	long int res = 0;
+	unsigned int n = batch.reqs_size;
+	struct mem_overlay_cleanup_req *reqs =
+		kvcalloc(n, sizeof(struct mem_overlay_cleanup_req), GFP_KERNEL);
+	struct mem_overlay **overlays =
+		kvcalloc(n, sizeof(struct mem_overlay *), GFP_KERNEL);
+	unsigned int *flags = kvcalloc(n, sizeof(unsigned int), GFP_KERNEL);
+	int *statuses = kvcalloc(n, sizeof(int), GFP_KERNEL);
+	if (!reqs || !overlays || !flags || !statuses) {
+		log_error("failed to allocate memory for batch cleanup request");
+		res = -ENOMEM;
+		goto free_batch;
 	}
 
-	struct mm_struct *mm = mem_overlay->base_vma->vm_mm;
-	mmap_write_lock(mm);
-	cleanup_mem_overlay(mem_overlay);
-	mmap_write_unlock(mm);
+	ret = copy_from_user(reqs, batch.reqs,
+			     sizeof(struct mem_overlay_cleanup_req) * n);
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay batch cleanup requests from user: %lu",
+			ret);
+		res = -EFAULT;
+		goto free_batch;
+	}
 
-	log_info("memory overlay removed successfully id=%lu", req.id);
-	return 0;
+	unsigned int failed = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		if (reqs[i].flags & ~MEM_OVERLAY_CLEANUP_FLAGS) {
+			log_error("unknown memory overlay cleanup flags=0x%x",
+				  reqs[i].flags);
+			statuses[i] = -EINVAL;
+			failed++;
+			continue;
+		}
+		flags[i] = reqs[i].flags;
+		overlays[i] = hashtable_delete_if(mem_overlays, reqs[i].id,
+						  check_mem_overlay_owner,
+						  client);
+		if (IS_ERR(overlays[i])) {
+			statuses[i] = PTR_ERR(overlays[i]);
+			overlays[i] = NULL;
+			failed++;
+		} else if (!overlays[i]) {
+			log_error("failed to cleanup memory overlay id=%lu",
+				  reqs[i].id);
+			statuses[i] = -ENOENT;
+			failed++;
+		}
+	}
+	cleanup_mem_overlays(overlays, flags, n);
+	log_debug("handled memory overlay batch cleanup request size=%u failed=%u",
+		  n, failed);
+
+	ret = copy_to_user(batch.statuses, statuses, sizeof(int) * n);
+	if (ret) {
+		log_error(
+			"failed to copy memory overlay batch cleanup result to user: %lu",
+			ret);
+		res = -EFAULT;
+	}
+
+free_batch:
+	kvfree(statuses);
+	kvfree(flags);
+	kvfree(overlays);
+	kvfree(reqs);
+	return res;
 }
 
 static long int unlocked_ioctl(struct file *file, unsigned cmd,
 			       unsigned long arg)
 {
+	struct mem_overlay_client *client = file->private_data;
+
 	switch (cmd) {
 	case IOCTL_MEM_OVERLAY_REQ_CMD:
 		log_debug("called IOCTL_MEM_OVERLAY_REQ_CMD");
-		return unlocked_ioctl_handle_mem_overlay_req(arg);
+		return unlocked_ioctl_handle_mem_overlay_req(client, arg);
 	case IOCTL_MEM_OVERLAY_CLEANUP_CMD:
 		log_debug("called IOCTL_MEM_OVERLAY_CLEANUP_CMD");
-		return unlocked_ioctl_handle_mem_overlay_cleanup_req(arg);
+		return unlocked_ioctl_handle_mem_overlay_cleanup_req(client,
+								     arg);
+	case IOCTL_MEM_OVERLAY_REQ_V1_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_REQ_V1_CMD");
+		return unlocked_ioctl_handle_mem_overlay_req_v1(client, arg);
+	case IOCTL_MEM_OVERLAY_CLEANUP_V1_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_CLEANUP_V1_CMD");
+		return unlocked_ioctl_handle_mem_overlay_cleanup_req_v1(client,
+									arg);
+	case IOCTL_MEM_OVERLAY_BATCH_REQ_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_BATCH_REQ_CMD");
+		return unlocked_ioctl_handle_mem_overlay_batch_req(client, arg);
+	case IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD");
+		return unlocked_ioctl_handle_mem_overlay_batch_cleanup_req(
+			client, arg);
+	case IOCTL_MEM_OVERLAY_DIRTY_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_DIRTY_CMD");
+		return unlocked_ioctl_handle_mem_overlay_dirty_req(client, arg);
+	case IOCTL_MEM_OVERLAY_ACCESS_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_ACCESS_CMD");
+		return unlocked_ioctl_handle_mem_overlay_access_req(client,
+								    arg);
+	case IOCTL_MEM_OVERLAY_PREFETCH_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_PREFETCH_CMD");
+		return unlocked_ioctl_handle_mem_overlay_prefetch_req(client,
+								      arg);
+	case IOCTL_MEM_OVERLAY_READY_CMD:
+		log_debug("called IOCTL_MEM_OVERLAY_READY_CMD");
+		return unlocked_ioctl_handle_mem_overlay_ready_req(client, arg);
 	default:
 		log_error("unknown ioctl cmd %x", cmd);
 	}
 	return -EINVAL;
 }
 
+/*
+ * Handle commands submitted via io_uring IORING_OP_URING_CMD. The command
+ * opcode is one of the ioctl commands and the SQE payload holds the same
+ * argument that would be passed to ioctl().
+ */
+static int device_uring_cmd(struct io_uring_cmd *ioucmd,
+			    unsigned int issue_flags)
+{
+	// Commands may sleep while allocating memory and acquiring locks, so
+	// ask io_uring to punt them to one of its worker threads. Workers share
+	// the address space of the submitting process, so requests are handled
+	// exactly as if they were sent with ioctl().
+	if (issue_flags & IO_URING_F_NONBLOCK)
+		return -EAGAIN;
+
+	// The SQE command payload accessor is detected from the kernel headers
+	// when building the module, since it replaced ioucmd->cmd.
+#ifdef HAVE_IO_URING_SQE_CMD
+	const struct mem_overlay_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	const struct mem_overlay_uring_cmd *cmd = ioucmd->cmd;
+#endif
+	log_debug("called uring_cmd cmd_op=%x", ioucmd->cmd_op);
+	return unlocked_ioctl(ioucmd->file, ioucmd->cmd_op,
+			      READ_ONCE(cmd->arg));
+}
+
 static struct file_operations file_ops = { .owner = THIS_MODULE,
 					   .open = device_open,
 					   .release = device_close,
-					   .unlocked_ioctl = unlocked_ioctl };
+					   .read = device_read,
+					   .poll = device_poll,
+					   .unlocked_ioctl = unlocked_ioctl,
+					   .uring_cmd = device_uring_cmd };
 
 static unsigned int major;
 static dev_t device_number;
 static struct class *device_class;
 
+static void release_zero_page(void)
+{
+	folio_put(mem_overlay_zero_folio);
+	fput(mem_overlay_zero_file);
+}
+
+/*
+ * Remove the debugfs files and free the module page fault counters and
+ * latency histograms.
+ */
+static void destroy_module_stats(void)
+{
+	debugfs_remove(mem_overlay_debugfs_dir);
+	for (int i = 0; i < MEM_OVERLAY_NR_STATS; i++)
+		percpu_counter_destroy(&mem_overlay_stats[i]);
+	for (int i = 0; i < MEM_OVERLAY_NR_LATENCIES; i++)
+		histogram_destroy(&mem_overlay_latency[i]);
+}
+
 static int __init init_mod(void)
 {
+	log_init();
 	log_debug("called init_module");
 
+	for (int i = 0; i < MEM_OVERLAY_NR_STATS; i++) {
+		if (percpu_counter_init(&mem_overlay_stats[i], 0, GFP_KERNEL)) {
+			log_error("unable to allocate counters");
+			destroy_module_stats();
+			return -ENOMEM;
+		}
+	}
+	for (int i = 0; i < MEM_OVERLAY_NR_LATENCIES; i++) {
+		if (histogram_init(&mem_overlay_latency[i],
+				   mem_overlay_latency_names[i])) {
+			destroy_module_stats();
+			return -ENOMEM;
+		}
+	}
+
+	mem_overlay_wq = alloc_workqueue("memory_overlay", WQ_UNBOUND, 0);
+	if (!mem_overlay_wq) {
+		log_error("unable to allocate workqueue");
+		destroy_module_stats();
+		return -ENOMEM;
+	}
+
+	mem_overlay_zero_file = shmem_file_setup("memory_overlay_zero",
+						 PAGE_SIZE, VM_NORESERVE);
+	if (IS_ERR(mem_overlay_zero_file)) {
+		log_error("unable to create zero page file");
+		destroy_workqueue(mem_overlay_wq);
+		destroy_module_stats();
+		return PTR_ERR(mem_overlay_zero_file);
+	}
+
+	mem_overlay_zero_folio =
+		shmem_read_folio(mem_overlay_zero_file->f_mapping, 0);
+	if (IS_ERR(mem_overlay_zero_folio)) {
+		log_error("unable to read zero page");
+		fput(mem_overlay_zero_file);
+		destroy_workqueue(mem_overlay_wq);
+		destroy_module_stats();
+		return PTR_ERR(mem_overlay_zero_folio);
+	}
+
 	mem_overlays = hashtable_setup(&cleanup_mem_overlay);
 
+	// debugfs errors are not fatal, since the counters are only
+	// informative.
+	mem_overlay_debugfs_dir = debugfs_create_dir(DEVICE_ID, NULL);
+	mem_overlay_debugfs_summary =
+		debugfs_create_file("summary", 0444, mem_overlay_debugfs_dir,
+				    NULL, &mem_overlay_summary_fops);
+	struct dentry *latency_dir =
+		debugfs_create_dir("latency", mem_overlay_debugfs_dir);
+	debugfs_create_file("enabled", 0644, latency_dir, NULL,
+			    &latency_enabled_fops);
+	for (int i = 0; i < MEM_OVERLAY_NR_LATENCIES; i++)
+		histogram_debugfs_create(&mem_overlay_latency[i], latency_dir);
+
 	log_info("registering device with major %u and ID '%s'",
 		 (unsigned int)MAJOR_DEV, DEVICE_ID);
 	int ret = register_chrdev(MAJOR_DEV, DEVICE_ID, &file_ops);
@@ -405,6 +3313,9 @@ static int __init init_mod(void)
 		device_number = MKDEV(major, ret & 0xfffff);
 	} else {
 		log_error("unable to register device: %d", ret);
+		release_zero_page();
+		destroy_workqueue(mem_overlay_wq);
+		destroy_module_stats();
 		return ret;
 	}
 
@@ -413,6 +3324,9 @@ static int __init init_mod(void)
 	if (IS_ERR(device_class)) {
 		log_error("unable to create device class");
 		unregister_chrdev(major, DEVICE_ID);
+		release_zero_page();
+		destroy_workqueue(mem_overlay_wq);
+		destroy_module_stats();
 		return -EINVAL;
 	}
 
@@ -423,6 +3337,9 @@ static int __init init_mod(void)
 		log_error("unable to create device");
 		class_destroy(device_class);
 		unregister_chrdev(major, DEVICE_ID);
+		release_zero_page();
+		destroy_workqueue(mem_overlay_wq);
+		destroy_module_stats();
 		return -EINVAL;
 	}
 
@@ -433,12 +3350,27 @@ static void __exit exit_mod(void)
 {
 	log_debug("called exit_module");
 
+	// Prefetches access memory overlays without holding a reference, so
+	// they must complete before the memory overlays are freed.
+	WRITE_ONCE(mem_overlay_prefetch_stopped, true);
+	flush_workqueue(mem_overlay_wq);
+
+	// The summary walks the hashtable, so it must be removed first.
+	debugfs_remove(mem_overlay_debugfs_summary);
+
 	if (mem_overlays) {
 		log_info("cleaning up mem_overlays hashtable");
 		hashtable_cleanup(mem_overlays);
 		mem_overlays = NULL;
 	}
 
+	// Wait for deferred cleanups to complete.
+	log_info("waiting for pending memory overlay cleanups");
+	rcu_barrier();
+	destroy_workqueue(mem_overlay_wq);
+	release_zero_page();
+	destroy_module_stats();
+
 	log_info("unregistering device with major %u and ID '%s'",
 		 (unsigned int)major, DEVICE_ID);
 	device_destroy(device_class, device_number);
@@ -16,6 +16,16 @@
 */
 
 #include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/kref.h>
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "segment.h"
 
 #ifndef MEMORY_OVERLAY_MODULE_H
 #define MEMORY_OVERLAY_MODULE_H
@@ -23,21 +33,201 @@
 #define MAJOR_DEV 64
 #define DEVICE_ID "memory_overlay"
 
-struct mem_overlay_segment {
+#define MEM_OVERLAY_REQ_FLAGS                                    \
+	(MEM_OVERLAY_REQ_PIDFD | MEM_OVERLAY_REQ_WRITE_REDIRECT | \
+	 MEM_OVERLAY_REQ_TRACK_DIRTY | MEM_OVERLAY_REQ_RECORD_ACCESS)
+#define MEM_OVERLAY_CLEANUP_FLAGS MEM_OVERLAY_CLEANUP_RESTORE_BASE
+#define MEM_OVERLAY_DIRTY_FLAGS MEM_OVERLAY_DIRTY_RESET
+#define MEM_OVERLAY_ACCESS_FLAGS \
+	(MEM_OVERLAY_ACCESS_RESET | MEM_OVERLAY_ACCESS_STOP)
+#define MEM_OVERLAY_PREFETCH_FLAGS \
+	(MEM_OVERLAY_PREFETCH_CANCEL | MEM_OVERLAY_PREFETCH_THROTTLE)
+
+// Requests of the first version of common.h, whose command numbers encoded
+// the size of a pointer. They are still accepted so binaries built against
+// it keep working.
+struct mem_overlay_segment_req_v1 {
+	unsigned long start_pgoff;
+	unsigned long end_pgoff;
+};
+
+struct mem_overlay_req_v1 {
+	unsigned long id;
+
+	unsigned long base_addr;
 	unsigned long overlay_addr;
-	struct vm_area_struct *overlay_vma;
 
+	unsigned int segments_size;
+	struct mem_overlay_segment_req_v1 *segments;
+};
+
+struct mem_overlay_cleanup_req_v1 {
+	unsigned long id;
+};
+
+#define IOCTL_MEM_OVERLAY_REQ_V1_CMD \
+	_IOWR(MAGIC, 1, struct mem_overlay_req_v1 *)
+#define IOCTL_MEM_OVERLAY_CLEANUP_V1_CMD \
+	_IOWR(MAGIC, 2, struct mem_overlay_cleanup_req_v1 *)
+
+#define MEM_OVERLAY_ACCESS_BUF_SIZE 64
+
+// Base page touched for the first time, with the CPU local time it was
+// recorded at.
+struct mem_overlay_access {
+	u64 time;
+	unsigned long pgoff;
+};
+
+// Pages touched for the first time on a CPU, in the order they were touched on
+// this CPU. Entries are moved to the memory overlay access log when the buffer
+// is full or the log is read, and pages of all CPUs are sorted by time when
+// the log is read.
+struct mem_overlay_access_buf {
+	unsigned int len;
+	u64 last_time;
+	struct mem_overlay_access entries[MEM_OVERLAY_ACCESS_BUF_SIZE];
+};
+
+#define MEM_OVERLAY_PREFETCH_BATCH_PAGES 64
+
+// Replay of a prefetch profile running on the memory overlay workqueue. It
+// doesn't hold a reference to the memory overlay, which is looked up by id
+// before each batch.
+struct mem_overlay_prefetch {
+	unsigned long id;
+	struct mm_struct *mm;
+
+	unsigned long *pgoffs;
+	unsigned long pgoffs_size;
+
+	unsigned int batch_pages;
+	unsigned int delay_us;
+	bool cancelled;
+
+	struct work_struct work;
+};
+
+#define MEM_OVERLAY_EVENTS_READ_MAX 256
+
+// Page fault waiting for a range of pending pages. The event is reported to
+// userspace once, and its waiters are woken up when every page in the range
+// is ready. Each waiter and the pending list hold a reference.
+struct mem_overlay_pending {
+	struct list_head list;
+	unsigned long id;
 	unsigned long start_pgoff;
 	unsigned long end_pgoff;
+
+	bool read;
+	bool done;
+	refcount_t refs;
+	wait_queue_head_t wq;
+};
+
+// State of an open device file. Memory overlays are owned by the file that
+// registered them, and page faults waiting for their pending pages are only
+// reported as events read from this file. Each memory overlay holds a
+// reference.
+struct mem_overlay_client {
+	// Page faults waiting for pending pages of the memory overlays owned by
+	// the file. Events that haven't been read yet are counted as unread,
+	// and readers wait on events_wq for new ones.
+	spinlock_t lock;
+	struct list_head pending_list;
+	wait_queue_head_t events_wq;
+	unsigned long events_unread;
+
+	// Set when the file is closed, after which pending pages can't be
+	// supplied anymore.
+	bool closed;
+	struct kref refs;
+};
+
+// Page fault counters kept for each memory overlay and for the whole module.
+// Base and overlay pages count the pages of every run passed to
+// filemap_map_pages, including pages that were already mapped.
+enum mem_overlay_stat {
+	MEM_OVERLAY_STAT_MAP_PAGES,
+	MEM_OVERLAY_STAT_RUNS,
+	MEM_OVERLAY_STAT_BASE_PAGES,
+	MEM_OVERLAY_STAT_OVERLAY_PAGES,
+	MEM_OVERLAY_STAT_FAULTS,
+	MEM_OVERLAY_STAT_FAULT_ERRORS,
+	MEM_OVERLAY_NR_STATS,
+};
+
+// Latency histograms of the page fault and ioctl paths, in nanoseconds. Base
+// and overlay runs measure each filemap_map_pages call of a fault-around.
+enum mem_overlay_latency {
+	MEM_OVERLAY_LATENCY_MAP_PAGES,
+	MEM_OVERLAY_LATENCY_BASE_RUN,
+	MEM_OVERLAY_LATENCY_OVERLAY_RUN,
+	MEM_OVERLAY_LATENCY_FAULT,
+	MEM_OVERLAY_LATENCY_CREATE,
+	MEM_OVERLAY_LATENCY_CLEANUP,
+	MEM_OVERLAY_NR_LATENCIES,
 };
 
 struct mem_overlay {
+	struct mm_struct *mm;
+
 	unsigned long base_addr;
 	struct vm_area_struct *base_vma;
-	struct xarray segments;
+
+	struct mem_overlay_segments segments;
 
 	const struct vm_operations_struct *original_vm_ops;
 	struct vm_operations_struct *hijacked_vm_ops;
+	bool base_vma_nohugepage;
+
+	// Range of base page offsets covered by the scratch and dirty bitmaps,
+	// with one bit for each of the base_pages pages starting at base_pgoff.
+	unsigned long base_pgoff;
+	unsigned long base_pages;
+
+	// Write redirect mode state. Writes to base pages not covered by a
+	// segment are redirected to the scratch file, and the bitmap tracks
+	// which base pages have been copied to it.
+	struct file *scratch_file;
+	const struct vm_operations_struct *scratch_vm_ops;
+	unsigned long *scratch_bitmap;
+
+	// Base pages written since the memory overlay was created or since the
+	// dirty set was last reset. Only allocated if dirty tracking is
+	// enabled.
+	unsigned long *dirty_bitmap;
+
+	// Access recorder state. The bitmap tracks which base pages have been
+	// touched, and the log stores the first access to each of them as
+	// per-CPU buffers are flushed, so it's only sorted when read.
+	bool access_recording;
+	unsigned long *access_bitmap;
+	struct mem_overlay_access *access_log;
+	atomic_long_t access_len;
+	struct mem_overlay_access_buf __percpu *access_bufs;
+
+	// Device file that registered the memory overlay.
+	struct mem_overlay_client *owner;
+
+	// Pages of pending segments that userspace hasn't marked as ready yet.
+	// Only allocated if there is a pending segment. Protected by the lock
+	// of the owner.
+	unsigned long *pending_bitmap;
+
+	// Prefetch running for the memory overlay, if any. Only changed while
+	// holding the mm mmap lock.
+	struct mem_overlay_prefetch *prefetch;
+
+	// Original page protection of the base VMA, which is write-protected
+	// in write redirect and dirty tracking modes.
+	pgprot_t original_vm_page_prot;
+
+	// Page fault counters and the debugfs directory that exposes them.
+	struct percpu_counter stats[MEM_OVERLAY_NR_STATS];
+	struct dentry *debugfs_dir;
+
+	struct rcu_work free_work;
 };
 
 #endif //MEMORY_OVERLAY_MODULE_H
@@ -0,0 +1,218 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+
+#include "segment.h"
+#include "log.h"
+
+/*
+ * Initialize an empty segment index with room for size segments.
+ */
+int segments_init(struct mem_overlay_segments *segments, unsigned int size)
+{
+	xa_init(&segments->xa);
+	segments->sorted = true;
+	segments->cached = NULL;
+	segments->nodes = 0;
+
+	// Allocate all segments at once so they can be freed in bulk.
+	segments->buf = kvcalloc(size, sizeof(struct mem_overlay_segment),
+				 GFP_KERNEL);
+	if (!segments->buf) {
+		log_error("failed to allocate memory for %u memory overlay segments",
+			  size);
+		return -ENOMEM;
+	}
+	segments->size = size;
+	return 0;
+}
+
+/*
+ * Validate a segment request and copy its range and type into seg. The segment
+ * file is resolved by the caller, since it depends on the segment type and the
+ * target address space.
+ */
+int segment_parse(const struct mem_overlay_segment_req *req,
+		  struct mem_overlay_segment *seg)
+{
+	if (req->start_pgoff > req->end_pgoff) {
+		log_error("invalid memory overlay segment start=%lu end=%lu",
+			  req->start_pgoff, req->end_pgoff);
+		return -EINVAL;
+	}
+	if (req->flags & ~MEM_OVERLAY_SEGMENT_PENDING) {
+		log_error("invalid memory overlay segment flags %u",
+			  req->flags);
+		return -EINVAL;
+	}
+
+	switch (req->type) {
+	case MEM_OVERLAY_SEGMENT_FILE:
+	case MEM_OVERLAY_SEGMENT_BUFFER:
+		break;
+	case MEM_OVERLAY_SEGMENT_ZERO:
+		if (req->flags & MEM_OVERLAY_SEGMENT_PENDING) {
+			log_error("zero segments can't be pending");
+			return -EINVAL;
+		}
+		break;
+	default:
+		log_error("invalid memory overlay segment type %u", req->type);
+		return -EINVAL;
+	}
+
+	seg->start_pgoff = req->start_pgoff;
+	seg->end_pgoff = req->end_pgoff;
+	seg->type = req->type;
+	return 0;
+}
+
+/*
+ * Return in first and last the range of the xarray entry that holds pgoff.
+ */
+static void segments_entry_range(struct mem_overlay_segments *segments,
+				 pgoff_t pgoff, pgoff_t *first, pgoff_t *last)
+{
+	unsigned int order = xa_get_order(&segments->xa, pgoff);
+	unsigned long mask = order < BITS_PER_LONG ? (1UL << order) - 1 :
+						     ULONG_MAX;
+
+	*first = pgoff & ~mask;
+	*last = pgoff | mask;
+}
+
+static int segments_store(struct mem_overlay_segments *segments, pgoff_t first,
+			  pgoff_t last, struct mem_overlay_segment *seg)
+{
+	void *entry =
+		xa_store_range(&segments->xa, first, last, seg, GFP_KERNEL);
+	if (xa_is_err(entry)) {
+		log_error(
+			"failed to store memory overlay segment start=%lu end=%lu: %d",
+			first, last, xa_err(entry));
+		return xa_err(entry);
+	}
+	return 0;
+}
+
+/*
+ * Insert the i-th segment into the index. Segments must be inserted in
+ * request order, and later segments replace earlier ones where they overlap.
+ */
+int segments_insert(struct mem_overlay_segments *segments, unsigned int i)
+{
+	struct mem_overlay_segment *seg = &segments->buf[i];
+	struct mem_overlay_segment *before = NULL;
+	struct mem_overlay_segment *after = NULL;
+	pgoff_t first = seg->start_pgoff;
+	pgoff_t last = seg->end_pgoff;
+	pgoff_t unused;
+	int ret;
+
+	if (i > 0 && seg->start_pgoff <= segments->buf[i - 1].end_pgoff)
+		segments->sorted = false;
+
+	log_debug("inserting segment to overlay start=%lu end=%lu",
+		  seg->start_pgoff, seg->end_pgoff);
+
+	// Storing into part of a multi-index entry replaces all of it, so
+	// entries that cross the segment boundaries are erased first and their
+	// parts outside the segment are stored again. Sorted segments don't
+	// overlap.
+	if (!segments->sorted) {
+		before = xa_load(&segments->xa, seg->start_pgoff);
+		if (before) {
+			segments_entry_range(segments, seg->start_pgoff, &first,
+					     &unused);
+			if (first == seg->start_pgoff)
+				before = NULL;
+		}
+		after = xa_load(&segments->xa, seg->end_pgoff);
+		if (after) {
+			segments_entry_range(segments, seg->end_pgoff, &unused,
+					     &last);
+			if (last == seg->end_pgoff)
+				after = NULL;
+		}
+		if (before || after) {
+			ret = segments_store(segments, first, last, NULL);
+			if (ret)
+				return ret;
+		}
+	}
+
+	ret = segments_store(segments, seg->start_pgoff, seg->end_pgoff, seg);
+	if (ret)
+		return ret;
+	if (before) {
+		ret = segments_store(segments, first, seg->start_pgoff - 1,
+				     before);
+		if (ret)
+			return ret;
+	}
+	if (after)
+		ret = segments_store(segments, seg->end_pgoff + 1, last, after);
+	return ret;
+}
+
+/*
+ * Free the segment index. The segment files must already have been released.
+ */
+void segments_destroy(struct mem_overlay_segments *segments)
+{
+	// Segments are stored in a single allocation, so the index can be
+	// released without visiting each of its entries.
+	xa_destroy(&segments->xa);
+	kvfree(segments->buf);
+	segments->buf = NULL;
+	segments->size = 0;
+	segments->nodes = 0;
+}
+
+/*
+ * Store an estimate of the number of xarray nodes used by the segment index,
+ * counting each leaf node once. Segments are stored as multi-index entries, so
+ * most nodes are leaves. The index can hold millions of entries, so the walk
+ * periodically leaves the RCU read-side critical section and may sleep.
+ */
+void segments_count_nodes(struct mem_overlay_segments *segments)
+{
+	XA_STATE(xas, &segments->xa, 0);
+	struct xa_node *node = NULL;
+	unsigned long nodes = 0;
+	unsigned long entries = 0;
+	void *entry;
+
+	rcu_read_lock();
+	xas_for_each(&xas, entry, ULONG_MAX) {
+		if (xas.xa_node != node && !xas_top(xas.xa_node)) {
+			node = xas.xa_node;
+			nodes++;
+		}
+		if (++entries % XA_CHECK_SCHED)
+			continue;
+		xas_pause(&xas);
+		rcu_read_unlock();
+		cond_resched();
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+	segments->nodes = nodes;
+}
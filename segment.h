@@ -0,0 +1,315 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEMORY_OVERLAY_SEGMENT_H
+#define MEMORY_OVERLAY_SEGMENT_H
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/xarray.h>
+
+#include "common.h"
+
+struct mem_overlay_segment {
+	unsigned int type;
+
+	// File that backs the segment pages and the page offset in this file
+	// of the first segment page. Zero segments map every page to the same
+	// file page.
+	unsigned long overlay_addr;
+	struct file *overlay_file;
+	const struct vm_operations_struct *overlay_vm_ops;
+	unsigned long overlay_pgoff;
+
+	unsigned long start_pgoff;
+	unsigned long end_pgoff;
+};
+
+// Maximum number of segments of a memory overlay, so the single allocation
+// that holds them stays within the kvmalloc limit.
+#define MEM_OVERLAY_SEGMENTS_MAX (INT_MAX / sizeof(struct mem_overlay_segment))
+
+// Segments of a memory overlay, indexed by base page offset. All segments are
+// stored in a single allocation, in request order, and each of them is stored
+// in the xarray over its whole range.
+struct mem_overlay_segments {
+	struct xarray xa;
+	struct mem_overlay_segment *buf;
+	unsigned int size;
+
+	// Segments are sorted if they are in ascending order and don't
+	// overlap, which allows page faults to walk them without the xarray.
+	bool sorted;
+
+	// Segment resolved by the last page fault, used as the starting point
+	// for the next lookup. Only set if segments are sorted.
+	struct mem_overlay_segment *cached;
+
+	// Estimate of the number of xarray nodes used by the index, set by
+	// segments_count_nodes() once all segments are inserted.
+	unsigned long nodes;
+};
+
+int segments_init(struct mem_overlay_segments *segments, unsigned int size);
+int segment_parse(const struct mem_overlay_segment_req *req,
+		  struct mem_overlay_segment *seg);
+int segments_insert(struct mem_overlay_segments *segments, unsigned int i);
+void segments_destroy(struct mem_overlay_segments *segments);
+void segments_count_nodes(struct mem_overlay_segments *segments);
+
+/*
+ * Find the next segment that overlaps with the range between start and max.
+ * Segments are stored in the xarray as multiple aligned entries, so the same
+ * segment can be returned more than once. Skip any segment that ends before
+ * start since they have already been handled.
+ */
+static inline struct mem_overlay_segment *
+segments_find_next(struct xa_state *xas, pgoff_t start, pgoff_t max)
+{
+	struct mem_overlay_segment *seg;
+
+	do {
+		seg = xas_find(xas, max);
+	} while (xas_retry(xas, seg) || (seg && seg->end_pgoff < start));
+	return seg;
+}
+
+/*
+ * Find the first sorted segment that ends at or after start using the segment
+ * cached by the previous page fault. Sequential page faults usually land on
+ * the cached segment or its successor, so only these two are checked. Returns
+ * false if neither of them can be used.
+ */
+static inline bool segments_find_cached(struct mem_overlay_segments *segments,
+					pgoff_t start,
+					struct mem_overlay_segment **segp)
+{
+	struct mem_overlay_segment *first = segments->buf;
+	struct mem_overlay_segment *last = first + segments->size - 1;
+	struct mem_overlay_segment *seg = READ_ONCE(segments->cached);
+
+	if (seg == NULL)
+		return false;
+
+	if (start <= seg->end_pgoff) {
+		if (seg != first && (seg - 1)->end_pgoff >= start)
+			return false;
+		*segp = seg;
+		return true;
+	}
+
+	if (seg == last) {
+		*segp = NULL;
+		return true;
+	}
+	seg++;
+	if (start <= seg->end_pgoff) {
+		*segp = seg;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Find the first segment that overlaps with the range between start and max.
+ * xas must be initialized on the segments xarray at start.
+ */
+static inline struct mem_overlay_segment *
+segments_find_first(struct mem_overlay_segments *segments,
+		    struct xa_state *xas, pgoff_t start, pgoff_t max)
+{
+	struct mem_overlay_segment *seg;
+
+	if (segments->sorted && segments_find_cached(segments, start, &seg))
+		return seg && seg->start_pgoff <= max ? seg : NULL;
+	return segments_find_next(xas, start, max);
+}
+
+/*
+ * Find the segment stored after prev in the xarray, up to max. end is the
+ * last page offset of prev. Sorted segments don't overlap, so the successor of
+ * prev is the next segment in the array. Otherwise a later segment may have
+ * replaced part of prev, so end is lowered to the page offset before the
+ * next entry that isn't prev. xas must be on the last entry found for prev.
+ */
+static inline struct mem_overlay_segment *
+segments_find_after(struct mem_overlay_segments *segments,
+		    struct xa_state *xas, struct mem_overlay_segment *prev,
+		    pgoff_t *end, pgoff_t max)
+{
+	struct mem_overlay_segment *seg;
+
+	if (segments->sorted) {
+		seg = prev + 1;
+		if (seg == segments->buf + segments->size)
+			return NULL;
+		return seg->start_pgoff <= max ? seg : NULL;
+	}
+
+	// Entries are returned at the first page offset of their aligned
+	// range, and the same segment can be stored as more than one entry.
+	do {
+		seg = xas_find(xas, max);
+	} while (xas_retry(xas, seg) || seg == prev);
+	if (seg && xas->xa_index <= *end)
+		*end = xas->xa_index - 1;
+	return seg;
+}
+
+/*
+ * Cache the segment where the next lookup should start. Only update the cached
+ * segment if it changed to avoid bouncing its cache line between CPUs
+ * faulting on the same segment.
+ */
+static inline void segments_cache(struct mem_overlay_segments *segments,
+				  struct mem_overlay_segment *seg)
+{
+	if (segments->sorted && seg && READ_ONCE(segments->cached) != seg)
+		WRITE_ONCE(segments->cached, seg);
+}
+
+/*
+ * Return true if next starts right after seg and continues the same range of
+ * the same file, so both segments can be mapped together. Zero segments map
+ * every page to the same file page, so they are never merged.
+ */
+static inline bool segments_contiguous(struct mem_overlay_segment *seg,
+				       struct mem_overlay_segment *next)
+{
+	return seg->type != MEM_OVERLAY_SEGMENT_ZERO &&
+	       next->start_pgoff == seg->end_pgoff + 1 &&
+	       next->overlay_file == seg->overlay_file &&
+	       next->overlay_pgoff - next->start_pgoff ==
+		       seg->overlay_pgoff - seg->start_pgoff;
+}
+
+// Run of consecutive pages of a fault-around range that are mapped together.
+// Base runs have no segment. Overlay runs cover one or more contiguous
+// segments, and seg is the last of them.
+struct segments_run {
+	pgoff_t start;
+	pgoff_t end;
+	struct mem_overlay_segment *seg;
+};
+
+// Walk that splits a fault-around range into alternating runs of base and
+// overlay pages. Must be used in an RCU read-side critical section.
+struct segments_walk {
+	struct mem_overlay_segments *segments;
+	struct xa_state xas;
+	struct mem_overlay_segment *seg;
+	struct mem_overlay_segment *cursor;
+	pgoff_t start;
+	pgoff_t end;
+	bool done;
+};
+
+/*
+ * Start a walk over the range between start and end. If segments are sorted,
+ * the walk starts from the segment cached by the previous walk and the xarray
+ * is only used on a cache miss.
+ */
+static inline void segments_walk_start(struct segments_walk *walk,
+				       struct mem_overlay_segments *segments,
+				       pgoff_t start, pgoff_t end)
+{
+	walk->segments = segments;
+	walk->xas = (struct xa_state)__XA_STATE(&segments->xa, start, 0, 0);
+	walk->seg = segments_find_first(segments, &walk->xas, start, end);
+	walk->cursor = walk->seg;
+	walk->start = start;
+	walk->end = end;
+	walk->done = false;
+}
+
+/*
+ * Return the next run of the walk in run, or false once the whole range has
+ * been walked. The segments are walked only once, using the next segment as a
+ * lookahead to merge adjacent segments into a single overlay run.
+ */
+static inline bool segments_walk_next(struct segments_walk *walk,
+				      struct segments_run *run)
+{
+	struct mem_overlay_segment *seg = walk->seg;
+
+	if (walk->done)
+		return false;
+	run->start = walk->start;
+
+	// The rest of the range doesn't overlap with any segment.
+	if (seg == NULL) {
+		run->end = walk->end;
+		run->seg = NULL;
+		walk->done = true;
+		return true;
+	}
+
+	// Non-overlay range before the next segment.
+	if (walk->start < seg->start_pgoff) {
+		run->end = seg->start_pgoff - 1;
+		run->seg = NULL;
+		walk->start = seg->start_pgoff;
+		return true;
+	}
+
+	// Extend the overlay run over any adjacent segment backed by the same
+	// file range. The run ends early where a later overlapping segment
+	// replaced the rest of the segment, like page faults do.
+	struct mem_overlay_segment *run_seg = seg;
+	pgoff_t end = seg->end_pgoff;
+	for (;;) {
+		seg = segments_find_after(walk->segments, &walk->xas, run_seg,
+					  &end, walk->end);
+		if (seg == NULL || !segments_contiguous(run_seg, seg))
+			break;
+		run_seg = seg;
+		end = seg->end_pgoff;
+	}
+	walk->cursor = seg ? seg : run_seg;
+	if (end >= walk->end) {
+		end = walk->end;
+		walk->done = true;
+	}
+
+	run->end = end;
+	run->seg = run_seg;
+	walk->seg = seg;
+	walk->start = end + 1;
+	return true;
+}
+
+/*
+ * Finish a walk, caching the segment where the next walk should start.
+ */
+static inline void segments_walk_end(struct segments_walk *walk)
+{
+	segments_cache(walk->segments, walk->cursor);
+}
+
+/*
+ * Return the page offset in the segment file that backs the base page
+ * offset pgoff.
+ */
+static inline pgoff_t segment_file_pgoff(struct mem_overlay_segment *seg,
+					 pgoff_t pgoff)
+{
+	if (seg->type == MEM_OVERLAY_SEGMENT_ZERO)
+		return seg->overlay_pgoff;
+	return seg->overlay_pgoff + (pgoff - seg->start_pgoff);
+}
+
+#endif //MEMORY_OVERLAY_SEGMENT_H
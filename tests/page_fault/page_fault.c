@@ -171,7 +171,7 @@ int test_memory_read()
 	}
 
 	// Create test memory overlay request with several overlay scenarios.
-	struct mem_overlay_req req;
+	struct mem_overlay_req req = { 0 };
 	req.base_addr = *(unsigned long *)(&base_mmap);
 	req.overlay_addr = *(unsigned long *)(&overlay_mmap);
 	req.segments_size = 6;
@@ -262,6 +262,87 @@ unmap_base:
 	return res;
 }
 
+int test_memory_read_unsorted()
+{
+	clear_cache();
+	int res = EXIT_SUCCESS;
+
+	int base_fd;
+	char *base_mmap;
+	if (mmap_file("base.bin", TOTAL_SIZE, &base_fd, &base_mmap)) {
+		return EXIT_FAILURE;
+	}
+
+	int overlay_fd;
+	char *overlay_mmap;
+	if (mmap_file("overlay.bin", TOTAL_SIZE, &overlay_fd, &overlay_mmap)) {
+		res = EXIT_FAILURE;
+		goto unmap_base;
+	}
+
+	// Segments out of order and overlapping can't be walked in order, so
+	// page faults must look them up in the xarray.
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = *(unsigned long *)(&base_mmap);
+	req.overlay_addr = *(unsigned long *)(&overlay_mmap);
+	req.segments_size = 4;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	req.segments[0].start_pgoff = 80;
+	req.segments[0].end_pgoff = 140;
+	req.segments[1].start_pgoff = 4;
+	req.segments[1].end_pgoff = 6;
+	req.segments[2].start_pgoff = 30;
+	req.segments[2].end_pgoff = 70;
+	req.segments[3].start_pgoff = 60;
+	req.segments[3].end_pgoff = 90;
+
+	if (call_kmod(IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		res = EXIT_FAILURE;
+		goto free_segments;
+	};
+
+	// Pages 4-6 and 30-140 should have data from the overlay file.
+	int tcs_nr = 3 + 111;
+	struct test_case *tcs = calloc(sizeof(struct test_case), tcs_nr);
+	int tcs_n = 0;
+	for (int pgoff = 4; pgoff <= 6; pgoff++) {
+		tcs[tcs_n].pgoff = pgoff;
+		tcs[tcs_n].fd = overlay_fd;
+		tcs_n++;
+	}
+	for (int pgoff = 30; pgoff <= 140; pgoff++) {
+		tcs[tcs_n].pgoff = pgoff;
+		tcs[tcs_n].fd = overlay_fd;
+		tcs_n++;
+	}
+
+	printf("= TEST: checking memory contents with unsorted overlay\n");
+	if (!verify_test_cases(tcs, tcs_nr, base_fd, base_mmap)) {
+		res = EXIT_FAILURE;
+		goto free_tcs;
+	}
+	printf("== OK: unsorted overlay memory verification completed successfully!\n");
+
+free_tcs:
+	free(tcs);
+
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (call_kmod(IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req))
+		res = EXIT_FAILURE;
+free_segments:
+	free(req.segments);
+	munmap(overlay_mmap, TOTAL_SIZE);
+	close(overlay_fd);
+unmap_base:
+	munmap(base_mmap, TOTAL_SIZE);
+	close(base_fd);
+
+	return res;
+}
+
 int test_memory_write()
 {
 	clear_cache();
@@ -284,7 +365,7 @@ int test_memory_write()
 
 	// Create test memory overlay request with an overlay that covers multiple
 	// pages so we can write in the middle of the area.
-	struct mem_overlay_req req;
+	struct mem_overlay_req req = { 0 };
 	req.base_addr = *(unsigned long *)(&base_mmap);
 	req.overlay_addr = *(unsigned long *)(&overlay_mmap);
 	req.segments_size = 1;
@@ -362,6 +443,111 @@ unmap_base:
 	return res;
 }
 
+int test_restore_base()
+{
+	clear_cache();
+	int res = EXIT_SUCCESS;
+
+	// Read base.bin test file and map it into memory.
+	int base_fd;
+	char *base_mmap;
+	if (mmap_file("base.bin", TOTAL_SIZE, &base_fd, &base_mmap)) {
+		return EXIT_FAILURE;
+	}
+
+	// Read overlay.bin test file and map it into memory.
+	int overlay_fd;
+	char *overlay_mmap;
+	if (mmap_file("overlay.bin", TOTAL_SIZE, &overlay_fd, &overlay_mmap)) {
+		res = EXIT_FAILURE;
+		goto unmap_base;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = *(unsigned long *)(&base_mmap);
+	req.overlay_addr = *(unsigned long *)(&overlay_mmap);
+	req.segments_size = 2;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+
+	req.segments[0].start_pgoff = 4;
+	req.segments[0].end_pgoff = 6;
+	req.segments[1].start_pgoff = 30;
+	req.segments[1].end_pgoff = 70;
+
+	if (call_kmod(IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		res = EXIT_FAILURE;
+		goto free_segments;
+	};
+
+	int tcs_nr = 3 + 41;
+	struct test_case *tcs = calloc(sizeof(struct test_case), tcs_nr);
+	for (int i = 0, pgoff = 4; pgoff <= 6; i++, pgoff++) {
+		tcs[i].pgoff = pgoff;
+		tcs[i].fd = overlay_fd;
+	}
+	for (int i = 3, pgoff = 30; pgoff <= 70; i++, pgoff++) {
+		tcs[i].pgoff = pgoff;
+		tcs[i].fd = overlay_fd;
+	}
+
+	printf("= TEST: checking memory contents with overlay before restore\n");
+	if (!verify_test_cases(tcs, tcs_nr, base_fd, base_mmap)) {
+		res = EXIT_FAILURE;
+		free(tcs);
+		goto cleanup_kmod;
+	}
+	free(tcs);
+	printf("== OK: overlay memory verification completed successfully!\n");
+
+	// Write to an overlay page and to a non-overlay page.
+	char *data = calloc(PAGE_SIZE, 1);
+	memset(data, 'x', PAGE_SIZE);
+	memcpy(base_mmap + PAGE_SIZE * 5, data, PAGE_SIZE);
+	memcpy(base_mmap + PAGE_SIZE * 10, data, PAGE_SIZE);
+
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+		.flags = MEM_OVERLAY_CLEANUP_RESTORE_BASE,
+	};
+	if (call_kmod(IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		res = EXIT_FAILURE;
+		free(data);
+		goto free_segments;
+	}
+
+	// Overlay pages, including the one written, revert to the base file
+	// while changes outside of the segments are kept.
+	tcs_nr = 1;
+	tcs = calloc(sizeof(struct test_case), tcs_nr);
+	tcs[0].pgoff = 10;
+	tcs[0].data = data;
+
+	printf("= TEST: checking memory contents after restoring base\n");
+	if (!verify_test_cases(tcs, tcs_nr, base_fd, base_mmap)) {
+		res = EXIT_FAILURE;
+	} else {
+		printf("== OK: base memory restored successfully!\n");
+	}
+	free(tcs);
+	free(data);
+	goto free_segments;
+
+cleanup_kmod:;
+	struct mem_overlay_cleanup_req err_cleanup_req = {
+		.id = req.id,
+	};
+	call_kmod(IOCTL_MEM_OVERLAY_CLEANUP_CMD, &err_cleanup_req);
+free_segments:
+	free(req.segments);
+	munmap(overlay_mmap, TOTAL_SIZE);
+unmap_base:
+	munmap(base_mmap, TOTAL_SIZE);
+	close(base_fd);
+
+	return res;
+}
+
 int main()
 {
 	PAGE_SIZE = sysconf(_SC_PAGESIZE);
@@ -371,8 +557,12 @@ int main()
 
 	if (test_memory_read())
 		return EXIT_FAILURE;
+	if (test_memory_read_unsorted())
+		return EXIT_FAILURE;
 	if (test_memory_write())
 		return EXIT_FAILURE;
+	if (test_restore_base())
+		return EXIT_FAILURE;
 
 	// TODO: parse /proc/<pid>/smaps to verify memory sharing.
 
@@ -0,0 +1,253 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+static const int TOTAL_PAGES = 1024;
+static const char BASE_FILL = 'b';
+static const char OVERLAY_FILL = 'o';
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+int create_memfd(const char *name, char fill)
+{
+	int fd = memfd_create(name, 0);
+	if (fd < 0) {
+		printf("ERROR: could not create %s: %s\n", name,
+		       strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, TOTAL_SIZE)) {
+		printf("ERROR: could not resize %s: %s\n", name,
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	char *map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, 0);
+	if (map == MAP_FAILED) {
+		printf("ERROR: could not mmap %s: %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	memset(map, fill, TOTAL_SIZE);
+	munmap(map, TOTAL_SIZE);
+	return fd;
+}
+
+// read_access reads the recorded pages and checks the expected page offsets
+// were recorded in order. Pages mapped by fault-around are recorded along with
+// the faulting page, so other pages may be recorded between them, but every
+// page must only be recorded once. The number of recorded pages is returned in
+// count.
+int read_access(int syscall_dev, unsigned long id, unsigned int flags,
+		const unsigned long *expected, unsigned long n,
+		unsigned long *count)
+{
+	int res = EXIT_SUCCESS;
+	struct mem_overlay_access_req req = {
+		.id = id,
+		.flags = flags,
+		.pgoffs_size = TOTAL_PAGES,
+		.pgoffs = calloc(sizeof(unsigned long), TOTAL_PAGES),
+	};
+	char *seen = calloc(1, TOTAL_PAGES);
+
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_ACCESS_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_ACCESS_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto out;
+	}
+	*count = req.pgoffs_size;
+	if (req.pgoffs_size < n) {
+		printf("== ERROR: expected at least %lu recorded pages, got %lu\n",
+		       n, req.pgoffs_size);
+		res = EXIT_FAILURE;
+		goto out;
+	}
+
+	unsigned long next = 0;
+	for (unsigned long i = 0; i < req.pgoffs_size; i++) {
+		unsigned long pgoff = req.pgoffs[i];
+		if (pgoff >= TOTAL_PAGES || seen[pgoff]) {
+			printf("== ERROR: unexpected page %lu at position %lu\n",
+			       pgoff, i);
+			res = EXIT_FAILURE;
+			goto out;
+		}
+		seen[pgoff] = 1;
+		if (next < n && pgoff == expected[next])
+			next++;
+	}
+	if (next < n) {
+		printf("== ERROR: expected page %lu to be recorded after page %lu\n",
+		       expected[next], next ? expected[next - 1] : 0);
+		res = EXIT_FAILURE;
+	}
+
+out:
+	free(seen);
+	free(req.pgoffs);
+	return res;
+}
+
+int main()
+{
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	int res = EXIT_SUCCESS;
+	int base_fd = create_memfd("access_base", BASE_FILL);
+	int overlay_fd = create_memfd("access_overlay", OVERLAY_FILL);
+	if (base_fd < 0 || overlay_fd < 0)
+		return EXIT_FAILURE;
+
+	char *base_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE, base_fd, 0);
+	char *overlay_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (base_map == MAP_FAILED || overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test files: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.flags = MEM_OVERLAY_REQ_RECORD_ACCESS;
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.segments_size = 1;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	req.segments[0].start_pgoff = 100;
+	req.segments[0].end_pgoff = 199;
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	printf("= TEST: checking accessed pages are recorded in order\n");
+	volatile char c;
+	c = base_map[500 * PAGE_SIZE];
+	c = base_map[3 * PAGE_SIZE];
+	c = base_map[4 * PAGE_SIZE];
+	c = base_map[900 * PAGE_SIZE];
+	c = base_map[3 * PAGE_SIZE];
+	base_map[100 * PAGE_SIZE + 1] = 'x';
+	c = base_map[150 * PAGE_SIZE];
+	if (c != OVERLAY_FILL || base_map[500 * PAGE_SIZE] != BASE_FILL) {
+		printf("== ERROR: unexpected page contents\n");
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	const unsigned long expected[] = { 500, 3, 4, 900, 100, 150 };
+	unsigned long recorded;
+	if (read_access(syscall_dev, req.id, 0, expected, 6, &recorded)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: accessed pages recorded in order!\n");
+
+	printf("= TEST: checking small array returns E2BIG\n");
+	unsigned long pgoffs[2];
+	struct mem_overlay_access_req small_req = {
+		.id = req.id,
+		.flags = MEM_OVERLAY_ACCESS_RESET,
+		.pgoffs_size = 2,
+		.pgoffs = pgoffs,
+	};
+	if (!ioctl(syscall_dev, IOCTL_MEM_OVERLAY_ACCESS_CMD, &small_req) ||
+	    errno != E2BIG || small_req.pgoffs_size != recorded) {
+		printf("== ERROR: expected E2BIG and %lu recorded pages, got %lu: %s\n",
+		       recorded, small_req.pgoffs_size, strerror(errno));
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	unsigned long count;
+	if (read_access(syscall_dev, req.id, 0, expected, 6, &count) ||
+	    count != recorded) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: small array rejected without resetting recorder!\n");
+
+	printf("= TEST: checking recorder reset and stop\n");
+	if (read_access(syscall_dev, req.id,
+			MEM_OVERLAY_ACCESS_RESET | MEM_OVERLAY_ACCESS_STOP,
+			expected, 6, &count)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	c = base_map[200 * PAGE_SIZE];
+	c = base_map[700 * PAGE_SIZE];
+	if (read_access(syscall_dev, req.id, 0, NULL, 0, &count) || count) {
+		printf("== ERROR: expected no recorded pages after stop, got %lu\n",
+		       count);
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: recorder reset and stopped!\n");
+
+cleanup:;
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+close_syscall_dev:
+	close(syscall_dev);
+free_segments:
+	free(req.segments);
+	munmap(overlay_map, TOTAL_SIZE);
+	munmap(base_map, TOTAL_SIZE);
+	close(overlay_fd);
+	close(base_fd);
+
+	printf("done\n");
+	return res;
+}
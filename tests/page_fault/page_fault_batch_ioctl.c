@@ -0,0 +1,338 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+// Number of base memory areas registered on each test round.
+const static int nr_mappings = 512;
+const static int nr_rounds = 10;
+
+size_t page_size, total_size;
+
+static const char base_file[] = "base.bin";
+static const char overlay_file[] = "overlay.bin";
+static const int page_size_factor = 1024;
+
+long elapsed_ns(struct timespec *before, struct timespec *after)
+{
+	return (after->tv_sec - before->tv_sec) * 1000000000L +
+	       (after->tv_nsec - before->tv_nsec);
+}
+
+bool verify_memory(int overlay_fd, int base_fd, char *base_map)
+{
+	char *buffer = calloc(page_size, 1);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < total_size / page_size; pgoff++) {
+		size_t offset = pgoff * page_size;
+
+		int fd = pgoff % 2 == 0 ? overlay_fd : base_fd;
+		lseek(fd, offset, SEEK_SET);
+		read(fd, buffer, page_size);
+
+		if (memcmp(base_map + offset, buffer, page_size)) {
+			printf("== ERROR: base memory does not match the file contents at page %lu\n",
+			       pgoff);
+			valid = false;
+			break;
+		}
+		memset(buffer, 0, page_size);
+	}
+
+	free(buffer);
+	return valid;
+}
+
+// register_single registers and cleans up every request with one ioctl call
+// per request.
+int register_single(int syscall_dev, struct mem_overlay_req *reqs, long *ns)
+{
+	struct timespec before, after;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+
+	for (int i = 0; i < nr_mappings; i++) {
+		if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &reqs[i])) {
+			printf("== ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+			       strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	for (int i = 0; i < nr_mappings; i++) {
+		struct mem_overlay_cleanup_req cleanup_req = {
+			.id = reqs[i].id,
+		};
+		if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD,
+			  &cleanup_req)) {
+			printf("== ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+			       strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	*ns += elapsed_ns(&before, &after);
+	return EXIT_SUCCESS;
+}
+
+// count_failed returns the number of failed requests of a batch ioctl call.
+int count_failed(const int *statuses)
+{
+	int failed = 0;
+	for (int i = 0; i < nr_mappings; i++) {
+		if (statuses[i])
+			failed++;
+	}
+	return failed;
+}
+
+// register_batch registers and cleans up every request with a single batch
+// ioctl call each.
+int register_batch(int syscall_dev, struct mem_overlay_req *reqs,
+		   int *statuses, long *ns)
+{
+	struct mem_overlay_cleanup_req *cleanup_reqs =
+		calloc(sizeof(struct mem_overlay_cleanup_req), nr_mappings);
+	int res = EXIT_SUCCESS;
+
+	struct timespec before, after;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+
+	struct mem_overlay_batch_req batch_req = {
+		.reqs_size = nr_mappings,
+		.reqs = reqs,
+		.statuses = statuses,
+	};
+	int ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_BATCH_REQ_CMD,
+			&batch_req);
+	if (ret) {
+		printf("== ERROR: could not call 'IOCTL_MEM_OVERLAY_BATCH_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto out;
+	}
+	int failed = count_failed(statuses);
+	if (failed) {
+		printf("== ERROR: %d requests of 'IOCTL_MEM_OVERLAY_BATCH_REQ_CMD' failed\n",
+		       failed);
+		res = EXIT_FAILURE;
+		goto out;
+	}
+
+	for (int i = 0; i < nr_mappings; i++)
+		cleanup_reqs[i].id = reqs[i].id;
+	struct mem_overlay_batch_cleanup_req batch_cleanup_req = {
+		.reqs_size = nr_mappings,
+		.reqs = cleanup_reqs,
+		.statuses = statuses,
+	};
+	ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD,
+		    &batch_cleanup_req);
+	if (ret) {
+		printf("== ERROR: could not call 'IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto out;
+	}
+	failed = count_failed(statuses);
+	if (failed) {
+		printf("== ERROR: %d requests of 'IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD' failed\n",
+		       failed);
+		res = EXIT_FAILURE;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	*ns += elapsed_ns(&before, &after);
+out:
+	free(cleanup_reqs);
+	return res;
+}
+
+int main()
+{
+	int res = EXIT_SUCCESS;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	total_size = page_size * page_size_factor;
+	printf("Using pagesize %lu with total size %lu\n", page_size,
+	       total_size);
+
+	int base_fd = open(base_file, O_RDONLY);
+	if (base_fd < 0) {
+		printf("ERROR: could not open base file %s: %s\n", base_file,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int overlay_fd = open(overlay_file, O_RDONLY);
+	if (overlay_fd < 0) {
+		printf("ERROR: could not open overlay file %s: %s\n",
+		       overlay_file, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	char *overlay_map =
+		mmap(NULL, total_size, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay file %s: %s\n",
+		       overlay_file, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	// Map base file multiple times, each one resulting in a separate VMA.
+	char **base_mmaps = calloc(sizeof(char *), nr_mappings);
+	int nr_mapped = 0;
+	for (; nr_mapped < nr_mappings; nr_mapped++) {
+		base_mmaps[nr_mapped] = mmap(NULL, total_size, PROT_READ,
+					     MAP_PRIVATE, base_fd, 0);
+		if (base_mmaps[nr_mapped] == MAP_FAILED) {
+			printf("ERROR: could not mmap base file %s: %s\n",
+			       base_file, strerror(errno));
+			res = EXIT_FAILURE;
+			goto unmap_base;
+		}
+	}
+	printf("mapped base file %s %d times\n", base_file, nr_mappings);
+
+	// Overlay every other page.
+	struct mem_overlay_segment_req *segments =
+		calloc(sizeof(struct mem_overlay_segment_req),
+		       total_size / (page_size * 2));
+	for (int i = 0; i < total_size / (page_size * 2); i++) {
+		segments[i].start_pgoff = 2 * i;
+		segments[i].end_pgoff = 2 * i;
+	}
+
+	struct mem_overlay_req *reqs =
+		calloc(sizeof(struct mem_overlay_req), nr_mappings);
+	int *statuses = calloc(sizeof(int), nr_mappings);
+	for (int i = 0; i < nr_mappings; i++) {
+		reqs[i].base_addr = (unsigned long)base_mmaps[i];
+		reqs[i].overlay_addr = (unsigned long)overlay_map;
+		reqs[i].segments_size = total_size / (page_size * 2);
+		reqs[i].segments = segments;
+	}
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_reqs;
+	}
+
+	// Verify a batch with an invalid request reports per-request status
+	// and still registers the remaining requests.
+	printf("= TEST: verify IOCTL_MEM_OVERLAY_BATCH_REQ_CMD per-request status\n");
+	reqs[1].base_addr = 0;
+	struct mem_overlay_batch_req batch_req = {
+		.reqs_size = 3,
+		.reqs = reqs,
+		.statuses = statuses,
+	};
+	int ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_BATCH_REQ_CMD,
+			&batch_req);
+	reqs[1].base_addr = (unsigned long)base_mmaps[1];
+	if (ret != 0 || statuses[0] != 0 || statuses[1] != -EINVAL ||
+	    statuses[2] != 0) {
+		printf("== ERROR: unexpected batch result ret=%d statuses=[%d, %d, %d]\n",
+		       ret, statuses[0], statuses[1], statuses[2]);
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	if (!verify_memory(overlay_fd, base_fd, base_mmaps[0]) ||
+	    !verify_memory(overlay_fd, base_fd, base_mmaps[2])) {
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	struct mem_overlay_cleanup_req cleanup_reqs[] = {
+		{ .id = reqs[0].id },
+		{ .id = reqs[2].id },
+		{ .id = reqs[2].id },
+	};
+	struct mem_overlay_batch_cleanup_req batch_cleanup_req = {
+		.reqs_size = 3,
+		.reqs = cleanup_reqs,
+		.statuses = statuses,
+	};
+	ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_BATCH_CLEANUP_CMD,
+		    &batch_cleanup_req);
+	if (ret != 0 || statuses[0] != 0 || statuses[1] != 0 ||
+	    statuses[2] != -ENOENT) {
+		printf("== ERROR: unexpected batch cleanup result ret=%d statuses=[%d, %d, %d]\n",
+		       ret, statuses[0], statuses[1], statuses[2]);
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+	printf("== OK: batch requests reported per-request status successfully!\n");
+
+	// Compare single and batch ioctl throughput.
+	printf("= TEST: compare single and batch ioctl throughput\n");
+	long single_ns = 0, batch_ns = 0;
+	for (int i = 0; i < nr_rounds; i++) {
+		if (register_single(syscall_dev, reqs, &single_ns) ||
+		    register_batch(syscall_dev, reqs, statuses, &batch_ns)) {
+			res = EXIT_FAILURE;
+			goto close_syscall_dev;
+		}
+	}
+
+	long ops = (long)nr_mappings * nr_rounds;
+	printf("single: %ld overlays in %ld.%.9lds (%.0f overlays/s)\n", ops,
+	       single_ns / 1000000000L, single_ns % 1000000000L,
+	       ops / (single_ns / 1e9));
+	printf("batch:  %ld overlays in %ld.%.9lds (%.0f overlays/s)\n", ops,
+	       batch_ns / 1000000000L, batch_ns % 1000000000L,
+	       ops / (batch_ns / 1e9));
+	printf("== OK: batch ioctl throughput measured successfully!\n");
+
+close_syscall_dev:
+	close(syscall_dev);
+free_reqs:
+	free(statuses);
+	free(reqs);
+	free(segments);
+unmap_base:
+	for (int i = 0; i < nr_mapped; i++)
+		munmap(base_mmaps[i], total_size);
+	free(base_mmaps);
+	munmap(overlay_map, total_size);
+close_overlay:
+	close(overlay_fd);
+close_base:
+	close(base_fd);
+
+	printf("done\n");
+	return res;
+}
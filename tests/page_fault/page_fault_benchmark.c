@@ -15,8 +15,12 @@
     along with this program. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,20 +28,37 @@
 #include <unistd.h>
 #include <stdbool.h>
 
-#include <bits/time.h>
-
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "../../common.h"
 
-// N represents a memory overlay fragmentation factor. The benchmark setup code
-// splits the base memory area into groups of N pages and overlays every other
-// group.
+// The benchmark measures the latency of page faults in a base memory area
+// overlaid with a memory overlay, sweeping over the following parameters.
+//
+//   -n  Fragmentation factors N. The base memory area is split into groups of
+//       N pages and every other group is overlaid. N=0 runs without a memory
+//       overlay for reference.
+//   -s  Sizes of the base memory area, in MiB.
+//   -p  Access patterns: seq, random and strided. Strided accesses visit
+//       every stride-th page (-S), starting again from the next page at the
+//       end of the memory area, so every page is accessed once.
+//   -t  Number of threads. Each thread accesses a contiguous part of the
+//       access order.
+//   -c  Cache states: cold drops the page cache before each run and warm
+//       reads the test files into it first.
+//
+// Each option takes a comma separated list, and every combination is run -r
+// times. Only the access pass is timed. Run with -v to also check the memory
+// contents after each run.
+//
+// Every access reads one byte of a page and is timed separately, so the
+// latency percentiles include accesses to pages mapped by the fault-around of
+// a previous page fault. The number of page faults comes from getrusage.
 //
-// The higher the value of N, the larger each memory overlay segment is, and
-// fewer segments are created.
+// Results are printed to stdout and, with -o, written as CSV to a file, or to
+// stdout if the file is "-".
 //
 // The examples below illustrate how the base memory is overlaid for different
 // values of N (X marks overlaid pages).
@@ -64,71 +85,182 @@
 //   +---+---+---+---+---+---+---+---+
 //   :   :   :   :   :   :   :   :   :
 //
-static const int N = 10;
-
-size_t PAGE_SIZE, TOTAL_SIZE, TOTAL_PAGES;
+#define MAX_VALUES 32
 
 static const char BASE_FILE[] = "baseXL.bin";
-static const char CLEAN_BASE_FILE[] = "baseXL2.bin";
 static const char OVERLAY_FILE[] = "overlayXL.bin";
-static const int PAGE_SIZE_FACTOR = 1024 * 1024;
 
-bool verify_test_cases(int overlay_fd, int base_fd, char *base_map)
+enum pattern { PATTERN_SEQ, PATTERN_RANDOM, PATTERN_STRIDED };
+static const char *pattern_names[] = { "seq", "random", "strided" };
+
+enum cache { CACHE_COLD, CACHE_WARM };
+static const char *cache_names[] = { "cold", "warm" };
+
+size_t PAGE_SIZE;
+
+struct options {
+	long ns[MAX_VALUES];
+	int ns_size;
+	long sizes[MAX_VALUES];
+	int sizes_size;
+	long patterns[MAX_VALUES];
+	int patterns_size;
+	long threads[MAX_VALUES];
+	int threads_size;
+	long caches[MAX_VALUES];
+	int caches_size;
+	long stride;
+	long repeat;
+	bool verify;
+	FILE *csv;
+};
+
+struct config {
+	long n;
+	long size_mb;
+	enum pattern pattern;
+	long threads;
+	enum cache cache;
+	long repeat;
+};
+
+struct worker {
+	pthread_t tid;
+	pthread_barrier_t *barrier;
+	char *base_map;
+	unsigned long *order;
+	unsigned long long *latencies;
+	unsigned long start;
+	unsigned long end;
+};
+
+// parse_list parses a comma separated list of numbers or names into values.
+// If names is set, each element must be one of its nr_names entries, and its
+// index is stored.
+int parse_list(const char *arg, long *values, int *size, const char **names,
+	       int nr_names)
 {
-	char *buffer = calloc(PAGE_SIZE, 1);
-	bool valid = true;
-
-	struct timespec before, after;
-	if (clock_gettime(CLOCK_MONOTONIC, &before) < 0) {
-		printf("ERROR: could not measure 'before' time for base mmap: %s\n",
-		       strerror(errno));
-		valid = false;
-		goto out;
-	}
-
-	printf("%ld.%.9ld: starting memory check\n", before.tv_sec,
-	       before.tv_nsec);
+	char *copy = strdup(arg);
+	char *saveptr = NULL;
+	int res = EXIT_SUCCESS;
+	*size = 0;
 
-	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
-		size_t offset = pgoff * PAGE_SIZE;
+	for (char *tok = strtok_r(copy, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (*size == MAX_VALUES) {
+			printf("ERROR: too many values in '%s'\n", arg);
+			res = EXIT_FAILURE;
+			break;
+		}
 
-		int fd = base_fd;
-		bool is_overlay = pgoff % (2 * N) >= 0 && pgoff % (2 * N) < N;
-		if (overlay_fd > 0 && is_overlay) {
-			fd = overlay_fd;
+		if (names) {
+			int i;
+			for (i = 0; i < nr_names; i++) {
+				if (!strcmp(tok, names[i]))
+					break;
+			}
+			if (i == nr_names) {
+				printf("ERROR: invalid value '%s'\n", tok);
+				res = EXIT_FAILURE;
+				break;
+			}
+			values[(*size)++] = i;
+			continue;
 		}
-		lseek(fd, offset, SEEK_SET);
-		read(fd, buffer, PAGE_SIZE);
 
-		if (memcmp(base_map + offset, buffer, PAGE_SIZE)) {
-			printf("== ERROR: base memory does not match the file contents at page %lu\n",
-			       pgoff);
-			valid = false;
+		char *end;
+		long value = strtol(tok, &end, 10);
+		if (*end != '\0' || value < 0) {
+			printf("ERROR: invalid number '%s'\n", tok);
+			res = EXIT_FAILURE;
 			break;
 		}
-		memset(buffer, 0, PAGE_SIZE);
+		values[(*size)++] = value;
 	}
 
-	if (clock_gettime(CLOCK_MONOTONIC, &after) < 0) {
-		printf("ERROR: could not measure 'after' time for base mmap: %s\n",
-		       strerror(errno));
-		valid = false;
-		goto out;
-	}
+	free(copy);
+	return res;
+}
 
-	printf("%ld.%.9ld: finished memory check\n", after.tv_sec,
-	       after.tv_nsec);
+void usage(const char *name)
+{
+	printf("usage: %s [-n N,...] [-s MiB,...] [-p seq,random,strided] [-S stride]\n"
+	       "       [-t threads,...] [-c cold,warm] [-r repeat] [-o file.csv] [-v]\n",
+	       name);
+}
 
-	long secs_diff = after.tv_sec - before.tv_sec;
-	long nsecs_diff = after.tv_nsec;
-	if (secs_diff == 0) {
-		nsecs_diff = after.tv_nsec - before.tv_nsec;
+int parse_options(int argc, char **argv, struct options *opts)
+{
+	parse_list("0,1,10,100", opts->ns, &opts->ns_size, NULL, 0);
+	parse_list("1024", opts->sizes, &opts->sizes_size, NULL, 0);
+	parse_list("seq,random,strided", opts->patterns, &opts->patterns_size,
+		   pattern_names, 3);
+	parse_list("1", opts->threads, &opts->threads_size, NULL, 0);
+	parse_list("warm,cold", opts->caches, &opts->caches_size, cache_names,
+		   2);
+	opts->stride = 16;
+	opts->repeat = 1;
+
+	int opt;
+	int res = EXIT_SUCCESS;
+	while (!res && (opt = getopt(argc, argv, "n:s:p:S:t:c:r:o:vh")) != -1) {
+		switch (opt) {
+		case 'n':
+			res = parse_list(optarg, opts->ns, &opts->ns_size, NULL,
+					 0);
+			break;
+		case 's':
+			res = parse_list(optarg, opts->sizes, &opts->sizes_size,
+					 NULL, 0);
+			break;
+		case 'p':
+			res = parse_list(optarg, opts->patterns,
+					 &opts->patterns_size, pattern_names,
+					 3);
+			break;
+		case 'S':
+			opts->stride = strtol(optarg, NULL, 10);
+			break;
+		case 't':
+			res = parse_list(optarg, opts->threads,
+					 &opts->threads_size, NULL, 0);
+			break;
+		case 'c':
+			res = parse_list(optarg, opts->caches,
+					 &opts->caches_size, cache_names, 2);
+			break;
+		case 'r':
+			opts->repeat = strtol(optarg, NULL, 10);
+			break;
+		case 'o':
+			opts->csv = strcmp(optarg, "-") ? fopen(optarg, "w") :
+							  stdout;
+			if (!opts->csv) {
+				printf("ERROR: could not open %s: %s\n", optarg,
+				       strerror(errno));
+				res = EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			opts->verify = true;
+			break;
+		default:
+			usage(argv[0]);
+			res = EXIT_FAILURE;
+		}
 	}
-	printf("test verification took %ld.%.9lds\n", secs_diff, nsecs_diff);
 
-out:
-	free(buffer);
-	return valid;
+	for (int i = 0; !res && i < opts->threads_size; i++) {
+		if (opts->threads[i] < 1) {
+			printf("ERROR: thread count must be at least 1\n");
+			res = EXIT_FAILURE;
+		}
+	}
+	if (!res && (opts->stride < 1 || opts->repeat < 1)) {
+		printf("ERROR: stride and repeat must be at least 1\n");
+		res = EXIT_FAILURE;
+	}
+	return res;
 }
 
 void clear_cache()
@@ -139,149 +271,329 @@ void clear_cache()
 	close(cache_fd);
 }
 
-int main()
+void warm_cache(int fd, size_t size)
 {
-	int res = EXIT_SUCCESS;
+	char *buffer = malloc(PAGE_SIZE * 256);
+	for (size_t offset = 0; offset < size; offset += PAGE_SIZE * 256)
+		pread(fd, buffer, PAGE_SIZE * 256, offset);
+	free(buffer);
+}
 
-	PAGE_SIZE = sysconf(_SC_PAGESIZE);
-	TOTAL_SIZE = PAGE_SIZE * PAGE_SIZE_FACTOR;
-	TOTAL_PAGES = TOTAL_SIZE / PAGE_SIZE;
-	printf("Page size:     %lu bytes\n", PAGE_SIZE);
-	printf("Overlay size:  %d pages\n", N);
-	printf("Total size:    %lu bytes\n", TOTAL_SIZE);
-	printf("Total pages:   %lu pages\n", TOTAL_PAGES);
+// fill_order stores the page offsets of the base memory area in the order in
+// which they are accessed.
+void fill_order(unsigned long *order, unsigned long pages,
+		enum pattern pattern, long stride)
+{
+	unsigned long i = 0;
+	switch (pattern) {
+	case PATTERN_SEQ:
+		for (i = 0; i < pages; i++)
+			order[i] = i;
+		break;
+	case PATTERN_RANDOM:
+		for (i = 0; i < pages; i++)
+			order[i] = i;
+		for (i = pages - 1; i > 0; i--) {
+			unsigned long j = random() % (i + 1);
+			unsigned long tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+		break;
+	case PATTERN_STRIDED:
+		for (unsigned long start = 0; start < (unsigned long)stride;
+		     start++) {
+			for (unsigned long pgoff = start; pgoff < pages;
+			     pgoff += stride)
+				order[i++] = pgoff;
+		}
+		break;
+	}
+}
 
-	// Read base.bin test file and mmap it into memory.
-	int base_fd = open(BASE_FILE, O_RDONLY);
-	if (base_fd < 0) {
-		printf("ERROR: could not open base file %s: %s\n", BASE_FILE,
-		       strerror(errno));
-		return EXIT_FAILURE;
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *access_pages(void *arg)
+{
+	struct worker *worker = arg;
+	pthread_barrier_wait(worker->barrier);
+
+	for (unsigned long i = worker->start; i < worker->end; i++) {
+		char *addr = worker->base_map + worker->order[i] * PAGE_SIZE;
+		unsigned long long before = now_ns();
+		(void)*(volatile char *)addr;
+		worker->latencies[i] = now_ns() - before;
 	}
+	return NULL;
+}
 
-	int clean_base_fd = open(CLEAN_BASE_FILE, O_RDONLY);
-	if (clean_base_fd < 0) {
-		printf("ERROR: could not open clean base file %s: %s\n",
-		       CLEAN_BASE_FILE, strerror(errno));
-		close(base_fd);
-		return EXIT_FAILURE;
+int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return (x > y) - (x < y);
+}
+
+// percentile returns the value at the given rank, in per mille, of a sorted
+// array.
+unsigned long long percentile(unsigned long long *sorted, unsigned long size,
+			      unsigned int permille)
+{
+	unsigned long idx = (size * permille + 999) / 1000;
+	return sorted[idx ? idx - 1 : 0];
+}
+
+bool verify(int base_fd, int overlay_fd, char *base_map, unsigned long pages,
+	    long n)
+{
+	char *buffer = calloc(PAGE_SIZE, 1);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < pages; pgoff++) {
+		int fd = base_fd;
+		if (n > 0 && pgoff % (2 * n) < n)
+			fd = overlay_fd;
+		pread(fd, buffer, PAGE_SIZE, pgoff * PAGE_SIZE);
+
+		if (memcmp(base_map + pgoff * PAGE_SIZE, buffer, PAGE_SIZE)) {
+			printf("== ERROR: base memory does not match the file contents at page %lu for N=%ld\n",
+			       pgoff, n);
+			valid = false;
+			break;
+		}
 	}
 
-	char *base_mmap = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
-			       MAP_PRIVATE, base_fd, 0);
-	if (base_mmap == MAP_FAILED) {
-		printf("ERROR: could not mmap base file %s: %s\n", BASE_FILE,
-		       strerror(errno));
+	free(buffer);
+	return valid;
+}
+
+// run maps the base file, registers the memory overlay for the configuration
+// and times a single access pass over every page.
+int run(struct options *opts, struct config *cfg, int syscall_dev,
+	int base_fd, int overlay_fd)
+{
+	int res = EXIT_SUCCESS;
+	size_t size = cfg->size_mb * 1024 * 1024;
+	unsigned long pages = size / PAGE_SIZE;
+
+	unsigned long *order = calloc(pages, sizeof(unsigned long));
+	unsigned long long *latencies =
+		calloc(pages, sizeof(unsigned long long));
+	struct worker *workers = calloc(cfg->threads, sizeof(struct worker));
+	struct mem_overlay_req req = { 0 };
+	char *overlay_map = MAP_FAILED;
+	char *base_map = MAP_FAILED;
+	if (!order || !latencies || !workers) {
+		printf("ERROR: could not allocate memory for %lu pages\n",
+		       pages);
 		res = EXIT_FAILURE;
-		goto close_base;
+		goto out;
 	}
+	fill_order(order, pages, cfg->pattern, opts->stride);
 
-	char *clean_base_mmap = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE,
-				     clean_base_fd, 0);
-	if (clean_base_mmap == MAP_FAILED) {
-		printf("ERROR: could not mmap second base file %s: %s\n",
-		       CLEAN_BASE_FILE, strerror(errno));
+	base_map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	overlay_map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (base_map == MAP_FAILED || overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test files: %s\n",
+		       strerror(errno));
 		res = EXIT_FAILURE;
-		goto close_base;
+		goto out;
 	}
 
-	// Read overlay test file and create memory overlay request.
-	int overlay_fd = open(OVERLAY_FILE, O_RDONLY);
-	if (overlay_fd < 0) {
-		printf("ERROR: could not open overlay file %s: %s\n",
-		       OVERLAY_FILE, strerror(errno));
-		res = EXIT_FAILURE;
-		goto unmap_base;
+	if (cfg->n > 0) {
+		req.base_addr = (unsigned long)base_map;
+		req.overlay_addr = (unsigned long)overlay_map;
+		req.segments_size = (pages + (2 * cfg->n - 1)) / (2 * cfg->n);
+		req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+				      req.segments_size);
+		for (int i = 0; i < req.segments_size; i++) {
+			req.segments[i].start_pgoff = 2 * cfg->n * i;
+			unsigned long end = 2 * cfg->n * i + (cfg->n - 1);
+			req.segments[i].end_pgoff =
+				end >= pages ? pages - 1 : end;
+		}
+
+		if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+			printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+			       strerror(errno));
+			res = EXIT_FAILURE;
+			goto out;
+		}
 	}
 
-	char *overlay_map =
-		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
-	if (overlay_map == MAP_FAILED) {
-		printf("ERROR: could not mmap overlay file %s: %s\n",
-		       OVERLAY_FILE, strerror(errno));
-		res = EXIT_FAILURE;
-		goto close_overlay;
+	if (cfg->cache == CACHE_COLD) {
+		clear_cache();
+	} else {
+		warm_cache(base_fd, size);
+		warm_cache(overlay_fd, size);
 	}
 
-	struct mem_overlay_req req;
-	req.base_addr = *(unsigned long *)(&base_mmap);
-	req.overlay_addr = *(unsigned long *)(&overlay_map);
-	req.segments_size = (TOTAL_PAGES + (2 * N - 1)) / (2 * N);
-	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
-			      req.segments_size);
-
-	printf("Requesting %u operations and sending %lu bytes worth of mmap segments\n",
-	       req.segments_size,
-	       sizeof(struct mem_overlay_segment_req) * req.segments_size);
-
-	// Overlay every other N pages.
-	for (int i = 0; i < req.segments_size; i++) {
-		req.segments[i].start_pgoff = 2 * N * i;
-
-		// Cap segment end to the number of pages in the base memory area.
-		unsigned long end = 2 * N * i + (N - 1);
-		end = end > TOTAL_PAGES ? TOTAL_PAGES : end;
-		req.segments[i].end_pgoff = end;
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, cfg->threads + 1);
+	for (long t = 0; t < cfg->threads; t++) {
+		workers[t].barrier = &barrier;
+		workers[t].base_map = base_map;
+		workers[t].order = order;
+		workers[t].latencies = latencies;
+		workers[t].start = pages * t / cfg->threads;
+		workers[t].end = pages * (t + 1) / cfg->threads;
+		pthread_create(&workers[t].tid, NULL, access_pages,
+			       &workers[t]);
 	}
 
-	// Call kernel module with ioctl call to the character device.
-	int syscall_dev = open(kmod_device_path, O_WRONLY);
-	if (syscall_dev < 0) {
-		printf("ERROR: could not open %s: %s\n", kmod_device_path,
-		       strerror(errno));
-		res = EXIT_FAILURE;
-		goto free_segments;
+	struct rusage usage_before, usage_after;
+	getrusage(RUSAGE_SELF, &usage_before);
+	pthread_barrier_wait(&barrier);
+	unsigned long long before = now_ns();
+	for (long t = 0; t < cfg->threads; t++)
+		pthread_join(workers[t].tid, NULL);
+	unsigned long long elapsed = now_ns() - before;
+	getrusage(RUSAGE_SELF, &usage_after);
+	pthread_barrier_destroy(&barrier);
+
+	long faults = usage_after.ru_minflt - usage_before.ru_minflt +
+		      usage_after.ru_majflt - usage_before.ru_majflt;
+	qsort(latencies, pages, sizeof(unsigned long long), compare_ull);
+	unsigned long long p50 = percentile(latencies, pages, 500);
+	unsigned long long p90 = percentile(latencies, pages, 900);
+	unsigned long long p99 = percentile(latencies, pages, 990);
+	unsigned long long p999 = percentile(latencies, pages, 999);
+	unsigned long long max = latencies[pages - 1];
+	double faults_per_sec = elapsed ? faults * 1e9 / elapsed : 0;
+
+	printf("N=%-5ld size=%ldMiB pattern=%-7s threads=%-3ld cache=%-4s faults=%-8ld time=%.3fms faults/s=%-10.0f p50=%lluns p99=%lluns p999=%lluns max=%lluns\n",
+	       cfg->n, cfg->size_mb, pattern_names[cfg->pattern], cfg->threads,
+	       cache_names[cfg->cache], faults, elapsed / 1e6, faults_per_sec,
+	       p50, p99, p999, max);
+	if (opts->csv) {
+		fprintf(opts->csv,
+			"%ld,%ld,%s,%ld,%s,%ld,%u,%lu,%ld,%llu,%.0f,%.1f,%llu,%llu,%llu,%llu,%llu\n",
+			cfg->n, cfg->size_mb, pattern_names[cfg->pattern],
+			cfg->threads, cache_names[cfg->cache], cfg->repeat,
+			req.segments_size, pages, faults, elapsed,
+			faults_per_sec, (double)elapsed / pages, p50, p90, p99,
+			p999, max);
+		fflush(opts->csv);
+	}
+
+	if (opts->verify) {
+		before = now_ns();
+		if (!verify(base_fd, overlay_fd, base_map, pages, cfg->n))
+			res = EXIT_FAILURE;
+		printf("verification took %.3fms\n", (now_ns() - before) / 1e6);
 	}
 
-	int ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req);
-	if (ret) {
-		printf("ERROR: could not call 'IOCTL_MMAP_CMD': %s\n",
+	if (cfg->n > 0) {
+		struct mem_overlay_cleanup_req cleanup_req = {
+			.id = req.id,
+		};
+		if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD,
+			  &cleanup_req)) {
+			printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+			       strerror(errno));
+			res = EXIT_FAILURE;
+		}
+	}
+
+out:
+	if (overlay_map != MAP_FAILED)
+		munmap(overlay_map, size);
+	if (base_map != MAP_FAILED)
+		munmap(base_map, size);
+	free(req.segments);
+	free(workers);
+	free(latencies);
+	free(order);
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int res = EXIT_SUCCESS;
+	struct options opts = { 0 };
+	if (parse_options(argc, argv, &opts))
+		return EXIT_FAILURE;
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	srandom(1);
+
+	int base_fd = open(BASE_FILE, O_RDONLY);
+	if (base_fd < 0) {
+		printf("ERROR: could not open base file %s: %s\n", BASE_FILE,
 		       strerror(errno));
-		res = EXIT_FAILURE;
-		goto close_syscall_dev;
+		return EXIT_FAILURE;
 	}
 
-	printf("= TEST: checking memory contents with overlay\n");
-	clear_cache();
-	if (!verify_test_cases(overlay_fd, base_fd, base_mmap)) {
+	int overlay_fd = open(OVERLAY_FILE, O_RDONLY);
+	if (overlay_fd < 0) {
+		printf("ERROR: could not open overlay file %s: %s\n",
+		       OVERLAY_FILE, strerror(errno));
 		res = EXIT_FAILURE;
-		goto cleanup;
+		goto close_base;
 	}
-	printf("== OK: overlay memory verification completed successfully!\n");
 
-	printf("= TEST: checking memory contents without overlay\n");
-	clear_cache();
-	if (!verify_test_cases(-1, clean_base_fd, clean_base_mmap)) {
-		res = EXIT_FAILURE;
-		goto cleanup;
+	// The test files must cover the largest size.
+	off_t file_size = lseek(base_fd, 0, SEEK_END);
+	for (int i = 0; i < opts.sizes_size; i++) {
+		if (opts.sizes[i] < 1 ||
+		    opts.sizes[i] * 1024 * 1024 > file_size) {
+			printf("ERROR: size %ldMiB must be between 1MiB and the size of %s\n",
+			       opts.sizes[i], BASE_FILE);
+			res = EXIT_FAILURE;
+			goto close_overlay;
+		}
 	}
-	printf("== OK: non-overlay memory verification completed successfully!\n");
-
-cleanup:
-	// Clean up memory overlay.
-	printf("calling IOCTL_MEM_OVERLAY_CLEANUP_CMD\n");
-	struct mem_overlay_cleanup_req cleanup_req = {
-		.id = req.id,
-	};
-	ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req);
-	if (ret) {
-		printf("ERROR: could not call 'IOCTL_MMAP_CMD': %s\n",
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
 		       strerror(errno));
 		res = EXIT_FAILURE;
+		goto close_overlay;
 	}
-close_syscall_dev:
+
+	printf("Page size:     %lu bytes\n", PAGE_SIZE);
+	if (opts.csv)
+		fprintf(opts.csv,
+			"n,size_mb,pattern,threads,cache,repeat,segments,pages,faults,elapsed_ns,faults_per_sec,ns_per_page,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+
+	// Every combination of the parameters is run, with the size and cache
+	// state changing the least often.
+	long total = opts.sizes_size * opts.caches_size * opts.patterns_size *
+		     opts.threads_size * opts.ns_size * opts.repeat;
+	for (long i = 0; i < total; i++) {
+		struct config cfg;
+		long k = i;
+		cfg.repeat = k % opts.repeat;
+		k /= opts.repeat;
+		cfg.n = opts.ns[k % opts.ns_size];
+		k /= opts.ns_size;
+		cfg.threads = opts.threads[k % opts.threads_size];
+		k /= opts.threads_size;
+		cfg.pattern = opts.patterns[k % opts.patterns_size];
+		k /= opts.patterns_size;
+		cfg.cache = opts.caches[k % opts.caches_size];
+		k /= opts.caches_size;
+		cfg.size_mb = opts.sizes[k];
+
+		if (run(&opts, &cfg, syscall_dev, base_fd, overlay_fd)) {
+			res = EXIT_FAILURE;
+			break;
+		}
+	}
+
 	close(syscall_dev);
-free_segments:
-	free(req.segments);
-	munmap(overlay_map, TOTAL_SIZE);
 close_overlay:
 	close(overlay_fd);
-unmap_base:
-	munmap(clean_base_mmap, TOTAL_SIZE);
-	munmap(base_mmap, TOTAL_SIZE);
 close_base:
-	close(clean_base_fd);
 	close(base_fd);
+	if (opts.csv && opts.csv != stdout)
+		fclose(opts.csv);
 
 	printf("done\n");
 	return res;
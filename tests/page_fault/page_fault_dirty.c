@@ -0,0 +1,284 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+static const int TOTAL_PAGES = 1024;
+static const char BASE_FILL = 'b';
+static const char OVERLAY_FILL = 'o';
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+struct dirty_range {
+	unsigned long start_pgoff;
+	unsigned long end_pgoff;
+};
+
+int create_memfd(const char *name, char fill)
+{
+	int fd = memfd_create(name, 0);
+	if (fd < 0) {
+		printf("ERROR: could not create %s: %s\n", name,
+		       strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, TOTAL_SIZE)) {
+		printf("ERROR: could not resize %s: %s\n", name,
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	char *map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, 0);
+	if (map == MAP_FAILED) {
+		printf("ERROR: could not mmap %s: %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	memset(map, fill, TOTAL_SIZE);
+	munmap(map, TOTAL_SIZE);
+	return fd;
+}
+
+void write_ranges(char *base_map, const struct dirty_range *ranges, int n,
+		  char value)
+{
+	for (int i = 0; i < n; i++) {
+		for (unsigned long pgoff = ranges[i].start_pgoff;
+		     pgoff <= ranges[i].end_pgoff; pgoff++)
+			base_map[pgoff * PAGE_SIZE + 1] = value;
+	}
+}
+
+// read_dirty reads the dirty segments and checks they match the expected
+// ranges.
+int read_dirty(int syscall_dev, unsigned long id, unsigned int flags,
+	       const struct dirty_range *expected, int n)
+{
+	struct mem_overlay_dirty_req req = {
+		.id = id,
+		.flags = flags,
+	};
+
+	// Query the number of segments with an empty array first.
+	int ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_DIRTY_CMD, &req);
+	if (n > 0 && (ret == 0 || errno != E2BIG)) {
+		printf("== ERROR: expected E2BIG with empty segments array, got ret=%d: %s\n",
+		       ret, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (n == 0 && ret) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_DIRTY_CMD': %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (req.segments_size != n) {
+		printf("== ERROR: expected %d dirty segments, got %u\n", n,
+		       req.segments_size);
+		return EXIT_FAILURE;
+	}
+	if (n == 0)
+		return EXIT_SUCCESS;
+
+	int res = EXIT_SUCCESS;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req), n);
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_DIRTY_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_DIRTY_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto out;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct mem_overlay_segment_req *seg = &req.segments[i];
+		if (seg->start_pgoff != expected[i].start_pgoff ||
+		    seg->end_pgoff != expected[i].end_pgoff ||
+		    seg->type != MEM_OVERLAY_SEGMENT_FILE) {
+			printf("== ERROR: expected dirty segment [%lu, %lu], got [%lu, %lu] type=%u\n",
+			       expected[i].start_pgoff, expected[i].end_pgoff,
+			       seg->start_pgoff, seg->end_pgoff, seg->type);
+			res = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+out:
+	free(req.segments);
+	return res;
+}
+
+int verify_memory(char *base_map, struct mem_overlay_req *req)
+{
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		char fill = BASE_FILL;
+		for (int i = 0; i < req->segments_size; i++) {
+			if (pgoff >= req->segments[i].start_pgoff &&
+			    pgoff <= req->segments[i].end_pgoff)
+				fill = OVERLAY_FILL;
+		}
+		if (base_map[pgoff * PAGE_SIZE] != fill) {
+			printf("== ERROR: expected '%c' in page %lu, got '%c'\n",
+			       fill, pgoff, base_map[pgoff * PAGE_SIZE]);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	int res = EXIT_SUCCESS;
+	int base_fd = create_memfd("dirty_base", BASE_FILL);
+	int overlay_fd = create_memfd("dirty_overlay", OVERLAY_FILL);
+	if (base_fd < 0 || overlay_fd < 0)
+		return EXIT_FAILURE;
+
+	char *base_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, base_fd, 0);
+	char *overlay_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, overlay_fd, 0);
+	if (base_map == MAP_FAILED || overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test files: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// Map some pages before the memory overlay is created to make sure
+	// they are tracked as well.
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff += 8)
+		base_map[pgoff * PAGE_SIZE + 1] = BASE_FILL;
+
+	struct mem_overlay_req req = { 0 };
+	req.flags = MEM_OVERLAY_REQ_TRACK_DIRTY;
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.segments_size = 2;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	req.segments[0].start_pgoff = 100;
+	req.segments[0].end_pgoff = 199;
+	req.segments[1].start_pgoff = 500;
+	req.segments[1].end_pgoff = 599;
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	printf("= TEST: checking no page is dirty after registration\n");
+	if (verify_memory(base_map, &req) ||
+	    read_dirty(syscall_dev, req.id, 0, NULL, 0)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: no dirty pages found!\n");
+
+	printf("= TEST: checking written pages are dirty\n");
+	const struct dirty_range first_writes[] = {
+		{ 0, 0 }, { 8, 15 }, { 150, 210 }, { 599, 600 }, { 1023, 1023 },
+	};
+	write_ranges(base_map, first_writes, 5, 'x');
+	if (read_dirty(syscall_dev, req.id, 0, first_writes, 5)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: dirty pages found!\n");
+
+	printf("= TEST: checking dirty pages are reset\n");
+	if (read_dirty(syscall_dev, req.id, MEM_OVERLAY_DIRTY_RESET,
+		       first_writes, 5) ||
+	    read_dirty(syscall_dev, req.id, 0, NULL, 0)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	for (int i = 0; i < 5; i++) {
+		unsigned long pgoff = first_writes[i].start_pgoff;
+		if (base_map[pgoff * PAGE_SIZE + 1] != 'x') {
+			printf("== ERROR: page %lu lost its contents after reset\n",
+			       pgoff);
+			res = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+	printf("== OK: dirty pages reset!\n");
+
+	// Pages written before the reset must be tracked again, including the
+	// ones that have only been read since.
+	printf("= TEST: checking pages are dirty again after reset\n");
+	const struct dirty_range second_writes[] = {
+		{ 8, 9 },
+		{ 300, 300 },
+		{ 1023, 1023 },
+	};
+	write_ranges(base_map, second_writes, 3, 'y');
+	if (read_dirty(syscall_dev, req.id, MEM_OVERLAY_DIRTY_RESET,
+		       second_writes, 3)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: dirty pages found after reset!\n");
+
+cleanup:;
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+close_syscall_dev:
+	close(syscall_dev);
+free_segments:
+	free(req.segments);
+	munmap(overlay_map, TOTAL_SIZE);
+	munmap(base_map, TOTAL_SIZE);
+	close(overlay_fd);
+	close(base_fd);
+
+	printf("done\n");
+	return res;
+}
@@ -0,0 +1,303 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/mman.h>
+
+#include "../../lib/memory_overlay.h"
+
+static const int TOTAL_PAGES = 256;
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+// Expected source of each base page.
+enum source { BASE, OVERLAY, ZERO, MEMFD, SHARED_ANON };
+
+static const char *backend_names[] = {
+	[MEM_OVERLAY_BACKEND_MODULE] = "module",
+	[MEM_OVERLAY_BACKEND_MMAP] = "mmap",
+	[MEM_OVERLAY_BACKEND_UFFD] = "uffd",
+};
+
+struct test_env {
+	int base_fd;
+	int overlay_fd;
+	int memfd;
+	char *overlay_map;
+	char *memfd_map;
+	char *anon_map;
+};
+
+bool verify(struct test_env *env, char *base_map, enum source *sources,
+	    unsigned long written_pgoff)
+{
+	char *buffer = malloc(PAGE_SIZE);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		size_t offset = pgoff * PAGE_SIZE;
+
+		switch (sources[pgoff]) {
+		case BASE:
+			pread(env->base_fd, buffer, PAGE_SIZE, offset);
+			break;
+		case OVERLAY:
+			pread(env->overlay_fd, buffer, PAGE_SIZE, offset);
+			break;
+		case ZERO:
+			memset(buffer, 0, PAGE_SIZE);
+			break;
+		case MEMFD:
+			memset(buffer, 'm', PAGE_SIZE);
+			break;
+		case SHARED_ANON:
+			memset(buffer, 'a', PAGE_SIZE);
+			break;
+		}
+		if (pgoff == written_pgoff)
+			buffer[0] = 'w';
+
+		if (memcmp(base_map + offset, buffer, PAGE_SIZE)) {
+			printf("== ERROR: unexpected memory contents at page %lu\n",
+			       pgoff);
+			valid = false;
+			break;
+		}
+	}
+
+	free(buffer);
+	return valid;
+}
+
+int test_fallback(struct test_env *env, unsigned int flags,
+		  int expected_backend)
+{
+	int res = EXIT_SUCCESS;
+
+	struct mem_overlay_ctx *ctx = mem_overlay_open(flags);
+	if (!ctx) {
+		printf("ERROR: could not open memory overlay library: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	char *base_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE, env->base_fd, 0);
+	if (base_map == MAP_FAILED) {
+		printf("ERROR: could not mmap base file: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_ctx;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)env->overlay_map;
+	req.segments_size = 6;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+
+	// Adjacent file segments, which the userspace backends merge.
+	req.segments[0].start_pgoff = 0;
+	req.segments[0].end_pgoff = 4;
+	req.segments[1].start_pgoff = 5;
+	req.segments[1].end_pgoff = 9;
+
+	// Zero segments, one right after a file segment.
+	req.segments[2].start_pgoff = 10;
+	req.segments[2].end_pgoff = 20;
+	req.segments[2].type = MEM_OVERLAY_SEGMENT_ZERO;
+	req.segments[3].start_pgoff = 40;
+	req.segments[3].end_pgoff = 99;
+	req.segments[3].type = MEM_OVERLAY_SEGMENT_ZERO;
+
+	// Buffer segments from a memfd and from shared anonymous memory.
+	req.segments[4].start_pgoff = 120;
+	req.segments[4].end_pgoff = 150;
+	req.segments[4].type = MEM_OVERLAY_SEGMENT_BUFFER;
+	req.segments[4].buffer_addr =
+		(unsigned long)env->memfd_map + 5 * PAGE_SIZE;
+	req.segments[5].start_pgoff = 200;
+	req.segments[5].end_pgoff = 231;
+	req.segments[5].type = MEM_OVERLAY_SEGMENT_BUFFER;
+	req.segments[5].buffer_addr = (unsigned long)env->anon_map;
+
+	enum source *sources = calloc(sizeof(enum source), TOTAL_PAGES);
+	for (int pgoff = 0; pgoff <= 9; pgoff++)
+		sources[pgoff] = OVERLAY;
+	for (int pgoff = 10; pgoff <= 20; pgoff++)
+		sources[pgoff] = ZERO;
+	for (int pgoff = 40; pgoff <= 99; pgoff++)
+		sources[pgoff] = ZERO;
+	for (int pgoff = 120; pgoff <= 150; pgoff++)
+		sources[pgoff] = MEMFD;
+	for (int pgoff = 200; pgoff <= 231; pgoff++)
+		sources[pgoff] = SHARED_ANON;
+
+	if (mem_overlay_ioctl(ctx, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_sources;
+	}
+
+	int backend = mem_overlay_backend(ctx, req.id);
+	printf("= TEST: checking memory contents with %s backend\n",
+	       backend_names[backend]);
+	if (expected_backend >= 0 && backend != expected_backend) {
+		printf("== ERROR: expected %s backend\n",
+		       backend_names[expected_backend]);
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if (!verify(env, base_map, sources, -1)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: memory verification completed successfully!\n");
+
+	printf("= TEST: checking writes to zero pages with %s backend\n",
+	       backend_names[backend]);
+	base_map[50 * PAGE_SIZE] = 'w';
+	if (!verify(env, base_map, sources, 50)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: zero page write verification completed successfully!\n");
+
+cleanup:;
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+		.flags = MEM_OVERLAY_CLEANUP_RESTORE_BASE,
+	};
+	if (mem_overlay_ioctl(ctx, IOCTL_MEM_OVERLAY_CLEANUP_CMD,
+			      &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_sources;
+	}
+	if (res)
+		goto free_sources;
+
+	printf("= TEST: checking base memory is restored with %s backend\n",
+	       backend_names[backend]);
+	memset(sources, 0, sizeof(enum source) * TOTAL_PAGES);
+	if (!verify(env, base_map, sources, -1)) {
+		res = EXIT_FAILURE;
+		goto free_sources;
+	}
+	printf("== OK: base memory verification completed successfully!\n");
+
+free_sources:
+	free(sources);
+	free(req.segments);
+	munmap(base_map, TOTAL_SIZE);
+close_ctx:
+	mem_overlay_close(ctx);
+	return res;
+}
+
+int main()
+{
+	int res = EXIT_SUCCESS;
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	struct test_env env = { 0 };
+	env.base_fd = open("base.bin", O_RDONLY);
+	if (env.base_fd < 0) {
+		printf("ERROR: could not open base.bin: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	env.overlay_fd = open("overlay.bin", O_RDONLY);
+	if (env.overlay_fd < 0) {
+		printf("ERROR: could not open overlay.bin: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	env.overlay_map = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE,
+			       env.overlay_fd, 0);
+	if (env.overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay.bin: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	env.memfd = memfd_create("buffer", 0);
+	if (env.memfd < 0 || ftruncate(env.memfd, TOTAL_SIZE)) {
+		printf("ERROR: could not create memfd: %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap_overlay;
+	}
+
+	env.memfd_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, env.memfd, 0);
+	env.anon_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (env.memfd_map == MAP_FAILED || env.anon_map == MAP_FAILED) {
+		printf("ERROR: could not mmap buffers: %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_memfd;
+	}
+	memset(env.memfd_map, 'm', TOTAL_SIZE);
+	memset(env.anon_map, 'a', TOTAL_SIZE);
+
+	// The memfd and shared anonymous buffers can only be reopened through
+	// /proc/self/map_files as root, otherwise the library falls back to
+	// userfaultfd.
+	int mmap_backend = geteuid() == 0 ? MEM_OVERLAY_BACKEND_MMAP : -1;
+	if (test_fallback(&env, MEM_OVERLAY_OPEN_NO_MODULE, mmap_backend) ||
+	    test_fallback(&env,
+			  MEM_OVERLAY_OPEN_NO_MODULE | MEM_OVERLAY_OPEN_POPULATE,
+			  mmap_backend) ||
+	    test_fallback(&env,
+			  MEM_OVERLAY_OPEN_NO_MODULE | MEM_OVERLAY_OPEN_NO_MMAP,
+			  MEM_OVERLAY_BACKEND_UFFD) ||
+	    test_fallback(&env, 0, -1))
+		res = EXIT_FAILURE;
+
+	munmap(env.anon_map, TOTAL_SIZE);
+	munmap(env.memfd_map, TOTAL_SIZE);
+close_memfd:
+	close(env.memfd);
+unmap_overlay:
+	munmap(env.overlay_map, TOTAL_SIZE);
+close_overlay:
+	close(env.overlay_fd);
+close_base:
+	close(env.base_fd);
+
+	printf("done\n");
+	return res;
+}
@@ -169,7 +169,7 @@ int main()
 	}
 	printf("[%d] mapped overlay file %s\n", pid, overlay_file);
 
-	struct mem_overlay_req req;
+	struct mem_overlay_req req = { 0 };
 	req.base_addr = *(unsigned long *)(&base_mmap);
 	req.overlay_addr = *(unsigned long *)(&overlay_map);
 	req.segments_size = 5;
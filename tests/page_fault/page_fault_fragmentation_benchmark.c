@@ -0,0 +1,279 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "../../common.h"
+
+// The benchmark measures the cost of reading the base memory area for
+// different memory overlay fragmentation factors. For each value of N, the
+// base memory area is split into groups of N pages and every other group is
+// overlaid, so lower values of N produce fault-around windows with more
+// alternating runs of base and overlay pages.
+//
+// The file contents are kept in the page cache so the benchmark measures the
+// page fault path instead of disk IO. A run without any memory overlay is
+// used as reference.
+//
+// Run with the tmpfs argument to copy the test files into memfds first, so the
+// base and overlay memory areas are backed by shared memory instead of the
+// file system.
+//
+// Build with VERIFY=1 to also check the memory contents after each run.
+static const int N_MAX = 1024;
+static const int PAGE_SIZE_FACTOR = 256 * 1024;
+
+size_t PAGE_SIZE, TOTAL_SIZE, TOTAL_PAGES;
+
+static const char BASE_FILE[] = "baseXL.bin";
+static const char OVERLAY_FILE[] = "overlayXL.bin";
+
+void warm_cache(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return;
+	char *buffer = malloc(PAGE_SIZE * 256);
+	for (size_t offset = 0; offset < TOTAL_SIZE; offset += PAGE_SIZE * 256)
+		pread(fd, buffer, PAGE_SIZE * 256, offset);
+	free(buffer);
+	close(fd);
+}
+
+// copy_to_memfd copies the benchmark range of the file into a new memfd and
+// replaces fd with it.
+int copy_to_memfd(const char *filename, int *fd)
+{
+	int memfd = memfd_create(filename, 0);
+	if (memfd < 0) {
+		printf("ERROR: could not create memfd for %s: %s\n", filename,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int res = EXIT_SUCCESS;
+	char *buffer = malloc(PAGE_SIZE * 256);
+	for (size_t offset = 0; offset < TOTAL_SIZE;
+	     offset += PAGE_SIZE * 256) {
+		ssize_t n = pread(*fd, buffer, PAGE_SIZE * 256, offset);
+		if (n <= 0 || write(memfd, buffer, n) != n) {
+			printf("ERROR: could not copy %s to memfd: %s\n",
+			       filename, strerror(errno));
+			res = EXIT_FAILURE;
+			break;
+		}
+	}
+	free(buffer);
+
+	if (res) {
+		close(memfd);
+		return res;
+	}
+	close(*fd);
+	*fd = memfd;
+	return EXIT_SUCCESS;
+}
+
+#ifdef VERIFY
+bool verify(int base_fd, int overlay_fd, char *base_map, int n)
+{
+	char *buffer = calloc(PAGE_SIZE, 1);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		int fd = base_fd;
+		if (n > 0 && pgoff % (2 * n) < n)
+			fd = overlay_fd;
+		pread(fd, buffer, PAGE_SIZE, pgoff * PAGE_SIZE);
+
+		if (memcmp(base_map + pgoff * PAGE_SIZE, buffer, PAGE_SIZE)) {
+			printf("== ERROR: base memory does not match the file contents at page %lu for N=%d\n",
+			       pgoff, n);
+			valid = false;
+			break;
+		}
+	}
+
+	free(buffer);
+	return valid;
+}
+#endif
+
+// run maps the base file, overlays every other group of n pages and reads
+// one byte from each page. If n is 0, no memory overlay is registered.
+int run(int syscall_dev, int base_fd, int overlay_fd, char *overlay_map,
+	int n)
+{
+	int res = EXIT_SUCCESS;
+
+	char *base_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	if (base_map == MAP_FAILED) {
+		printf("ERROR: could not mmap base file %s: %s\n", BASE_FILE,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	if (n > 0) {
+		req.base_addr = (unsigned long)base_map;
+		req.overlay_addr = (unsigned long)overlay_map;
+		req.segments_size = (TOTAL_PAGES + (2 * n - 1)) / (2 * n);
+		req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+				      req.segments_size);
+		for (int i = 0; i < req.segments_size; i++) {
+			req.segments[i].start_pgoff = 2 * n * i;
+			unsigned long end = 2 * n * i + (n - 1);
+			req.segments[i].end_pgoff =
+				end >= TOTAL_PAGES ? TOTAL_PAGES - 1 : end;
+		}
+
+		if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+			printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+			       strerror(errno));
+			res = EXIT_FAILURE;
+			goto free_segments;
+		}
+	}
+
+	struct rusage usage_before, usage_after;
+	struct timespec before, after;
+	getrusage(RUSAGE_SELF, &usage_before);
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++)
+		(void)*(volatile char *)(base_map + pgoff * PAGE_SIZE);
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	getrusage(RUSAGE_SELF, &usage_after);
+
+	long ns = (after.tv_sec - before.tv_sec) * 1000000000L +
+		  (after.tv_nsec - before.tv_nsec);
+	long faults = usage_after.ru_minflt - usage_before.ru_minflt;
+	printf("N=%-5d segments=%-7u faults=%-7ld time=%ld.%.9lds ns/page=%-7.1f ns/fault=%.1f\n",
+	       n, req.segments_size, faults, ns / 1000000000L,
+	       ns % 1000000000L, (double)ns / TOTAL_PAGES,
+	       faults ? (double)ns / faults : 0);
+
+#ifdef VERIFY
+	if (!verify(base_fd, overlay_fd, base_map, n))
+		res = EXIT_FAILURE;
+#endif
+
+	if (n > 0) {
+		struct mem_overlay_cleanup_req cleanup_req = {
+			.id = req.id,
+		};
+		if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD,
+			  &cleanup_req)) {
+			printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+			       strerror(errno));
+			res = EXIT_FAILURE;
+		}
+	}
+free_segments:
+	free(req.segments);
+	munmap(base_map, TOTAL_SIZE);
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int res = EXIT_SUCCESS;
+	bool tmpfs = argc > 1 && !strcmp(argv[1], "tmpfs");
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * PAGE_SIZE_FACTOR;
+	TOTAL_PAGES = TOTAL_SIZE / PAGE_SIZE;
+	printf("Page size:     %lu bytes\n", PAGE_SIZE);
+	printf("Total size:    %lu bytes\n", TOTAL_SIZE);
+	printf("Total pages:   %lu pages\n", TOTAL_PAGES);
+	printf("Backing:       %s\n", tmpfs ? "tmpfs" : "file");
+
+	int base_fd = open(BASE_FILE, O_RDONLY);
+	if (base_fd < 0) {
+		printf("ERROR: could not open base file %s: %s\n", BASE_FILE,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int overlay_fd = open(OVERLAY_FILE, O_RDONLY);
+	if (overlay_fd < 0) {
+		printf("ERROR: could not open overlay file %s: %s\n",
+		       OVERLAY_FILE, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	if (tmpfs && (copy_to_memfd(BASE_FILE, &base_fd) ||
+		      copy_to_memfd(OVERLAY_FILE, &overlay_fd))) {
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	char *overlay_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay file %s: %s\n",
+		       OVERLAY_FILE, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap_overlay;
+	}
+
+	if (!tmpfs) {
+		warm_cache(BASE_FILE);
+		warm_cache(OVERLAY_FILE);
+	}
+
+	// Run without a memory overlay first for reference.
+	for (int n = 0; n <= N_MAX; n = n ? n * 2 : 1) {
+		if (run(syscall_dev, base_fd, overlay_fd, overlay_map, n)) {
+			res = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	close(syscall_dev);
+unmap_overlay:
+	munmap(overlay_map, TOTAL_SIZE);
+close_overlay:
+	close(overlay_fd);
+close_base:
+	close(base_fd);
+
+	printf("done\n");
+	return res;
+}
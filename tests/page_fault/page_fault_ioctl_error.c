@@ -142,7 +142,7 @@ int main()
 	}
 	printf("mapped overlay file %s\n", overlay_file);
 
-	struct mem_overlay_req req;
+	struct mem_overlay_req req = { 0 };
 	req.base_addr = *(unsigned long *)(&base_mmap);
 	req.overlay_addr = *(unsigned long *)(&overlay_map);
 	req.segments_size = 1;
@@ -164,8 +164,20 @@ int main()
 		goto free_segments;
 	}
 
-	printf("= TEST: verify IOCTL_MEM_OVERLAY_REQ_CMD succeeds\n");
+	printf("= TEST: verify IOCTL_MEM_OVERLAY_REQ_CMD fails with unknown flags\n");
 	int ret;
+	req.flags = 1 << 31;
+	ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req);
+	if (!ret || errno != EINVAL) {
+		printf("== ERROR: expected call to 'IOCTL_MMAP_CMD' to return %d, got %d.\n",
+		       EINVAL, errno);
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+	req.flags = 0;
+	printf("== OK: IOCTL_MEM_OVERLAY_REQ_CMD with unknown flags failed successfully!\n");
+
+	printf("= TEST: verify IOCTL_MEM_OVERLAY_REQ_CMD succeeds\n");
 	ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req);
 	if (ret) {
 		printf("== ERROR: could not call 'IOCTL_MMAP_CMD': %s\n",
@@ -0,0 +1,230 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+static const int TOTAL_PAGES = 256;
+static const char BASE_FILL = 'b';
+static const char OVERLAY_FILL = 'o';
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+// create_memfd creates a memfd where every page is filled with the given
+// character, except for the first bytes that store the page offset.
+int create_memfd(const char *name, char fill)
+{
+	int fd = memfd_create(name, 0);
+	if (fd < 0) {
+		printf("ERROR: could not create memfd %s: %s\n", name,
+		       strerror(errno));
+		return -1;
+	}
+
+	char *buffer = malloc(PAGE_SIZE);
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		memset(buffer, fill, PAGE_SIZE);
+		memcpy(buffer, &pgoff, sizeof(pgoff));
+		if (write(fd, buffer, PAGE_SIZE) != PAGE_SIZE) {
+			printf("ERROR: could not write to memfd %s: %s\n", name,
+			       strerror(errno));
+			close(fd);
+			fd = -1;
+			break;
+		}
+	}
+	free(buffer);
+	return fd;
+}
+
+// page_out asks the kernel to move the memfd pages to swap. The request is
+// ignored if there is no swap space available.
+void page_out(int fd)
+{
+	char *map = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++)
+		(void)*(volatile char *)(map + pgoff * PAGE_SIZE);
+	if (madvise(map, TOTAL_SIZE, MADV_PAGEOUT))
+		printf("could not page out memfd: %s\n", strerror(errno));
+	munmap(map, TOTAL_SIZE);
+}
+
+bool is_overlay(struct mem_overlay_req *req, unsigned long pgoff)
+{
+	for (int i = 0; i < req->segments_size; i++) {
+		if (pgoff >= req->segments[i].start_pgoff &&
+		    pgoff <= req->segments[i].end_pgoff)
+			return true;
+	}
+	return false;
+}
+
+bool verify_page(char *map, unsigned long pgoff, char fill, int skip)
+{
+	char *page = map + pgoff * PAGE_SIZE;
+	if (memcmp(page, &pgoff, sizeof(pgoff))) {
+		printf("== ERROR: unexpected page offset at page %lu\n", pgoff);
+		return false;
+	}
+	for (size_t i = sizeof(pgoff) + skip; i < PAGE_SIZE; i++) {
+		if (page[i] != fill) {
+			printf("== ERROR: expected '%c' at page %lu offset %lu, got '%c'\n",
+			       fill, pgoff, i, page[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+int test_memfd(int syscall_dev, bool write_fault)
+{
+	int res = EXIT_SUCCESS;
+
+	int base_fd = create_memfd("base", BASE_FILL);
+	if (base_fd < 0)
+		return EXIT_FAILURE;
+
+	int overlay_fd = create_memfd("overlay", OVERLAY_FILL);
+	if (overlay_fd < 0) {
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	char *base_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE, base_fd, 0);
+	if (base_map == MAP_FAILED) {
+		printf("ERROR: could not mmap base memfd: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	char *overlay_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_SHARED, overlay_fd, 0);
+	if (overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay memfd: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap_base;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.segments_size = 3;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	req.segments[0].start_pgoff = 0;
+	req.segments[0].end_pgoff = 0;
+	req.segments[1].start_pgoff = 10;
+	req.segments[1].end_pgoff = 40;
+	req.segments[2].start_pgoff = 100;
+	req.segments[2].end_pgoff = 200;
+
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	// Pages that are not resident are read by the overlay file fault
+	// handler instead of being mapped by fault-around.
+	page_out(base_fd);
+	page_out(overlay_fd);
+
+	if (write_fault) {
+		// Write faults in private mappings copy the page from the file
+		// that backs it.
+		printf("= TEST: checking memfd memory overlay write faults\n");
+		for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++)
+			base_map[pgoff * PAGE_SIZE + sizeof(pgoff)] = 'w';
+	} else {
+		printf("= TEST: checking memfd memory overlay read faults\n");
+	}
+
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		char fill = is_overlay(&req, pgoff) ? OVERLAY_FILL : BASE_FILL;
+		if (!verify_page(base_map, pgoff, fill, write_fault ? 1 : 0)) {
+			res = EXIT_FAILURE;
+			break;
+		}
+	}
+	if (res == EXIT_SUCCESS)
+		printf("== OK: memfd memory overlay verification completed successfully!\n");
+
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+free_segments:
+	free(req.segments);
+	munmap(overlay_map, TOTAL_SIZE);
+unmap_base:
+	munmap(base_map, TOTAL_SIZE);
+close_overlay:
+	close(overlay_fd);
+close_base:
+	close(base_fd);
+	return res;
+}
+
+int main()
+{
+	int res = EXIT_SUCCESS;
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (test_memfd(syscall_dev, false) || test_memfd(syscall_dev, true))
+		res = EXIT_FAILURE;
+
+	close(syscall_dev);
+	printf("done\n");
+	return res;
+}
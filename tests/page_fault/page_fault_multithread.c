@@ -126,7 +126,7 @@ int main()
 	}
 	printf("overlay file %s mapped\n", overlay_file);
 
-	struct mem_overlay_req req;
+	struct mem_overlay_req req = { 0 };
 	req.base_addr = *(unsigned long *)(&base_mmap);
 	req.overlay_addr = *(unsigned long *)(&overlay_map);
 	req.segments_size = total_size / (page_size * 2);
@@ -0,0 +1,564 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "../../common.h"
+
+// The benchmark faults the base memory area from a growing number of threads,
+// each one pinned to a different CPU, to find where the page fault path stops
+// scaling. CPUs are used in order of their NUMA node, so runs fill one node
+// before using the next one.
+//
+// Each thread count is run with the following page ranges.
+//
+//   disjoint  Each thread touches its own range of pages.
+//   shared    Every thread touches every page, starting at a different
+//             offset, so threads fault on the same pages and page tables.
+//
+// Each run is also repeated with another thread continuously acquiring the mm
+// mmap write lock by calling mmap and munmap. If page faults in the memory
+// overlay serialize on the mmap lock, the contended run is significantly
+// slower than the quiet one. When faults are handled under the per-VMA lock,
+// both runs should have similar throughput.
+//
+// Options:
+//   -t  Comma separated list of thread counts. Defaults to powers of 2 up to
+//       the number of CPUs the process can run on, and that number.
+//   -r  Comma separated list of page ranges: disjoint and shared.
+//   -l  Comma separated list of lock contention modes: quiet and contended.
+//   -N  Also report throughput for each NUMA node.
+//   -o  Write results as CSV to a file, or to stdout if the file is "-".
+
+// Fragmentation factor: every other group of N pages is overlaid.
+static const int N = 8;
+static const int PAGE_SIZE_FACTOR = 256 * 1024;
+
+#define MAX_CPUS 1024
+#define MAX_NODES 64
+
+size_t PAGE_SIZE, TOTAL_SIZE, TOTAL_PAGES;
+
+static const char BASE_FILE[] = "baseXL.bin";
+static const char OVERLAY_FILE[] = "overlayXL.bin";
+
+static const char *VMSTAT_COUNTERS[] = {
+	"vma_lock_success",
+	"vma_lock_abort",
+	"vma_lock_retry",
+	"vma_lock_miss",
+};
+#define NR_VMSTAT_COUNTERS \
+	(sizeof(VMSTAT_COUNTERS) / sizeof(VMSTAT_COUNTERS[0]))
+
+enum range { RANGE_DISJOINT, RANGE_SHARED };
+static const char *range_names[] = { "disjoint", "shared" };
+
+// CPUs the benchmark can run on, sorted by NUMA node.
+int cpus[MAX_CPUS];
+int cpu_nodes[MAX_CPUS];
+int nr_cpus;
+
+struct fault_thread {
+	pthread_t tid;
+	int cpu;
+	int node;
+	char *base_map;
+	unsigned long start_pgoff;
+	unsigned long nr_pages;
+	long faults;
+	long ns;
+};
+
+pthread_barrier_t barrier;
+volatile bool stop_contention;
+
+long elapsed_ns(struct timespec *before, struct timespec *after)
+{
+	return (after->tv_sec - before->tv_sec) * 1000000000L +
+	       (after->tv_nsec - before->tv_nsec);
+}
+
+// read_vmstat reads the per-VMA lock statistics, which are only available if
+// the kernel is built with CONFIG_PER_VMA_LOCK_STATS.
+bool read_vmstat(long *values)
+{
+	FILE *f = fopen("/proc/vmstat", "r");
+	if (!f)
+		return false;
+
+	bool found = false;
+	char name[64];
+	long value;
+	while (fscanf(f, "%63s %ld", name, &value) == 2) {
+		for (int i = 0; i < NR_VMSTAT_COUNTERS; i++) {
+			if (!strcmp(name, VMSTAT_COUNTERS[i])) {
+				values[i] = value;
+				found = true;
+			}
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+// cpu_node returns the NUMA node of a CPU, or 0 if the system doesn't report
+// it.
+int cpu_node(int cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	int node = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+	return node < MAX_NODES ? node : 0;
+}
+
+// load_cpus fills the list of CPUs the process can run on, sorted by NUMA
+// node and CPU number.
+int load_cpus()
+{
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		printf("ERROR: could not read CPU affinity: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	nr_cpus = 0;
+	for (int node = 0; node < MAX_NODES; node++) {
+		for (int cpu = 0; cpu < CPU_SETSIZE && nr_cpus < MAX_CPUS;
+		     cpu++) {
+			if (!CPU_ISSET(cpu, &set) || cpu_node(cpu) != node)
+				continue;
+			cpus[nr_cpus] = cpu;
+			cpu_nodes[nr_cpus] = node;
+			nr_cpus++;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+void warm_cache(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, TOTAL_SIZE, POSIX_FADV_WILLNEED);
+	char *buffer = malloc(PAGE_SIZE * 256);
+	for (size_t offset = 0; offset < TOTAL_SIZE; offset += PAGE_SIZE * 256)
+		pread(fd, buffer, PAGE_SIZE * 256, offset);
+	free(buffer);
+	close(fd);
+}
+
+void *fault_pages(void *args)
+{
+	struct fault_thread *t = args;
+	struct rusage before, after;
+	struct timespec ts_before, ts_after;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	pthread_barrier_wait(&barrier);
+	getrusage(RUSAGE_THREAD, &before);
+	clock_gettime(CLOCK_MONOTONIC, &ts_before);
+	for (unsigned long i = 0; i < t->nr_pages; i++) {
+		unsigned long pgoff = (t->start_pgoff + i) % TOTAL_PAGES;
+		(void)*(volatile char *)(t->base_map + pgoff * PAGE_SIZE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts_after);
+	getrusage(RUSAGE_THREAD, &after);
+
+	t->faults = after.ru_minflt - before.ru_minflt;
+	t->ns = elapsed_ns(&ts_before, &ts_after);
+	return NULL;
+}
+
+void *contend_mmap_lock(void *args)
+{
+	long *iterations = args;
+	while (!stop_contention) {
+		void *addr = mmap(NULL, PAGE_SIZE, PROT_READ,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr != MAP_FAILED)
+			munmap(addr, PAGE_SIZE);
+		(*iterations)++;
+	}
+	return NULL;
+}
+
+// print_nodes prints the aggregate throughput of the threads running on each
+// NUMA node.
+void print_nodes(struct fault_thread *threads, int nr_threads)
+{
+	for (int node = 0; node < MAX_NODES; node++) {
+		long faults = 0;
+		long max_ns = 0;
+		int count = 0;
+		for (int i = 0; i < nr_threads; i++) {
+			if (threads[i].node != node)
+				continue;
+			faults += threads[i].faults;
+			if (threads[i].ns > max_ns)
+				max_ns = threads[i].ns;
+			count++;
+		}
+		if (count)
+			printf("  node=%d threads=%d faults=%ld faults/s=%.0f\n",
+			       node, count, faults,
+			       max_ns ? faults / (max_ns / 1e9) : 0);
+	}
+}
+
+int run(int syscall_dev, int base_fd, char *overlay_map,
+	struct mem_overlay_segment_req *segments, unsigned int segments_size,
+	int nr_threads, enum range range, bool contended, bool per_node,
+	FILE *csv)
+{
+	int res = EXIT_SUCCESS;
+
+	char *base_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	if (base_map == MAP_FAILED) {
+		printf("ERROR: could not mmap base file %s: %s\n", BASE_FILE,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.segments_size = segments_size;
+	req.segments = segments;
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap_base;
+	}
+
+	struct fault_thread *threads =
+		calloc(sizeof(struct fault_thread), nr_threads);
+	unsigned long pages_per_thread = TOTAL_PAGES / nr_threads;
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (int i = 0; i < nr_threads; i++) {
+		threads[i].cpu = cpus[i % nr_cpus];
+		threads[i].node = cpu_nodes[i % nr_cpus];
+		threads[i].base_map = base_map;
+		threads[i].start_pgoff = i * pages_per_thread;
+		if (range == RANGE_SHARED)
+			threads[i].nr_pages = TOTAL_PAGES;
+		else
+			threads[i].nr_pages = i == nr_threads - 1 ?
+						      TOTAL_PAGES -
+							      i * pages_per_thread :
+						      pages_per_thread;
+		pthread_create(&threads[i].tid, NULL, fault_pages, &threads[i]);
+	}
+
+	pthread_t contention_tid;
+	long contention_iterations = 0;
+	stop_contention = false;
+	if (contended)
+		pthread_create(&contention_tid, NULL, contend_mmap_lock,
+			       &contention_iterations);
+
+	long vmstat_before[NR_VMSTAT_COUNTERS] = { 0 };
+	long vmstat_after[NR_VMSTAT_COUNTERS] = { 0 };
+	bool has_vmstat = read_vmstat(vmstat_before);
+
+	struct timespec before, after;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	pthread_barrier_wait(&barrier);
+
+	long faults = 0;
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		faults += threads[i].faults;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	read_vmstat(vmstat_after);
+
+	if (contended) {
+		stop_contention = true;
+		pthread_join(contention_tid, NULL);
+	}
+
+	// Per-thread latency is the time each thread spent per page fault.
+	double min_latency = 0, max_latency = 0, sum_latency = 0;
+	int latency_threads = 0;
+	for (int i = 0; i < nr_threads; i++) {
+		if (!threads[i].faults)
+			continue;
+		double latency = (double)threads[i].ns / threads[i].faults;
+		if (!latency_threads || latency < min_latency)
+			min_latency = latency;
+		if (latency > max_latency)
+			max_latency = latency;
+		sum_latency += latency;
+		latency_threads++;
+	}
+	double avg_latency =
+		latency_threads ? sum_latency / latency_threads : 0;
+
+	long ns = elapsed_ns(&before, &after);
+	printf("%-9s range=%-8s threads=%-4d pages=%lu faults=%ld time=%ld.%.9lds faults/s=%.0f pages/s=%.0f ns/fault=%.0f/%.0f/%.0f",
+	       contended ? "contended" : "quiet", range_names[range],
+	       nr_threads, TOTAL_PAGES, faults, ns / 1000000000L,
+	       ns % 1000000000L, faults / (ns / 1e9),
+	       TOTAL_PAGES / (ns / 1e9), min_latency, avg_latency,
+	       max_latency);
+	if (contended)
+		printf(" mmap_lock_writes=%ld", contention_iterations);
+	if (has_vmstat) {
+		for (int i = 0; i < NR_VMSTAT_COUNTERS; i++)
+			printf(" %s=%ld", VMSTAT_COUNTERS[i],
+			       vmstat_after[i] - vmstat_before[i]);
+	}
+	printf("\n");
+	if (per_node)
+		print_nodes(threads, nr_threads);
+	if (csv) {
+		fprintf(csv, "%s,%s,%d,%lu,%ld,%ld,%.0f,%.1f,%.1f,%.1f\n",
+			contended ? "contended" : "quiet", range_names[range],
+			nr_threads, TOTAL_PAGES, faults, ns,
+			faults / (ns / 1e9), min_latency, avg_latency,
+			max_latency);
+		fflush(csv);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(threads);
+
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+unmap_base:
+	munmap(base_map, TOTAL_SIZE);
+	return res;
+}
+
+// parse_names parses a comma separated list of names into a bitmask of their
+// indexes.
+int parse_names(char *arg, const char **names, int nr_names, int *mask)
+{
+	*mask = 0;
+	for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		int i;
+		for (i = 0; i < nr_names; i++) {
+			if (!strcmp(tok, names[i]))
+				break;
+		}
+		if (i == nr_names) {
+			printf("ERROR: invalid value '%s'\n", tok);
+			return EXIT_FAILURE;
+		}
+		*mask |= 1 << i;
+	}
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	int res = EXIT_SUCCESS;
+	static const char *contention_names[] = { "quiet", "contended" };
+	int thread_counts[64];
+	int nr_thread_counts = 0;
+	int ranges = 1 << RANGE_DISJOINT | 1 << RANGE_SHARED;
+	int contention = 1 << 0 | 1 << 1;
+	bool per_node = false;
+	FILE *csv = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:r:l:No:h")) != -1) {
+		switch (opt) {
+		case 't':
+			for (char *tok = strtok(optarg, ",");
+			     tok && nr_thread_counts < 64;
+			     tok = strtok(NULL, ",")) {
+				int count = atoi(tok);
+				if (count < 1) {
+					printf("ERROR: invalid thread count '%s'\n",
+					       tok);
+					return EXIT_FAILURE;
+				}
+				thread_counts[nr_thread_counts++] = count;
+			}
+			break;
+		case 'r':
+			if (parse_names(optarg, range_names, 2, &ranges))
+				return EXIT_FAILURE;
+			break;
+		case 'l':
+			if (parse_names(optarg, contention_names, 2,
+					&contention))
+				return EXIT_FAILURE;
+			break;
+		case 'N':
+			per_node = true;
+			break;
+		case 'o':
+			csv = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+			if (!csv) {
+				printf("ERROR: could not open %s: %s\n", optarg,
+				       strerror(errno));
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			printf("usage: %s [-t threads,...] [-r disjoint,shared] [-l quiet,contended] [-N] [-o file.csv]\n",
+			       argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (load_cpus())
+		return EXIT_FAILURE;
+	if (!nr_thread_counts) {
+		for (int count = 1; count < nr_cpus && nr_thread_counts < 63;
+		     count *= 2)
+			thread_counts[nr_thread_counts++] = count;
+		thread_counts[nr_thread_counts++] = nr_cpus;
+	}
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * PAGE_SIZE_FACTOR;
+	TOTAL_PAGES = TOTAL_SIZE / PAGE_SIZE;
+	printf("Page size:     %lu bytes\n", PAGE_SIZE);
+	printf("Overlay size:  %d pages\n", N);
+	printf("Total size:    %lu bytes\n", TOTAL_SIZE);
+	printf("Total pages:   %lu pages\n", TOTAL_PAGES);
+	printf("CPUs:          %d\n", nr_cpus);
+
+	int base_fd = open(BASE_FILE, O_RDONLY);
+	if (base_fd < 0) {
+		printf("ERROR: could not open base file %s: %s\n", BASE_FILE,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int overlay_fd = open(OVERLAY_FILE, O_RDONLY);
+	if (overlay_fd < 0) {
+		printf("ERROR: could not open overlay file %s: %s\n",
+		       OVERLAY_FILE, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	char *overlay_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay file %s: %s\n",
+		       OVERLAY_FILE, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	// Overlay every other N pages.
+	unsigned int segments_size = (TOTAL_PAGES + (2 * N - 1)) / (2 * N);
+	struct mem_overlay_segment_req *segments =
+		calloc(sizeof(struct mem_overlay_segment_req), segments_size);
+	for (int i = 0; i < segments_size; i++) {
+		segments[i].start_pgoff = 2 * N * i;
+		unsigned long end = 2 * N * i + (N - 1);
+		segments[i].end_pgoff = end >= TOTAL_PAGES ? TOTAL_PAGES - 1 :
+							     end;
+	}
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	// Keep file data in the page cache so the benchmark measures the page
+	// fault path instead of disk IO.
+	warm_cache(BASE_FILE);
+	warm_cache(OVERLAY_FILE);
+
+	if (csv)
+		fprintf(csv,
+			"contention,range,threads,pages,faults,elapsed_ns,faults_per_sec,min_ns_per_fault,avg_ns_per_fault,max_ns_per_fault\n");
+
+	for (int r = 0; r < 2 && !res; r++) {
+		if (!(ranges & 1 << r))
+			continue;
+		for (int c = 0; c < 2 && !res; c++) {
+			if (!(contention & 1 << c))
+				continue;
+			for (int t = 0; t < nr_thread_counts; t++) {
+				if (run(syscall_dev, base_fd, overlay_map,
+					segments, segments_size,
+					thread_counts[t], r, c, per_node,
+					csv)) {
+					res = EXIT_FAILURE;
+					break;
+				}
+			}
+		}
+	}
+
+	close(syscall_dev);
+free_segments:
+	free(segments);
+	munmap(overlay_map, TOTAL_SIZE);
+close_overlay:
+	close(overlay_fd);
+close_base:
+	close(base_fd);
+	if (csv && csv != stdout)
+		fclose(csv);
+
+	printf("done\n");
+	return res;
+}
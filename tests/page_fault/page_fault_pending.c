@@ -0,0 +1,309 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+static const int TOTAL_PAGES = 1024;
+static const char BASE_FILL = 'b';
+static const char OVERLAY_FILL = 'o';
+
+static const unsigned long PENDING_START = 100;
+static const unsigned long PENDING_END = 199;
+// Pages after PREFILLED_START are supplied before they are accessed.
+static const unsigned long PREFILLED_START = 190;
+#define NR_WORKERS 3
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+struct source_state {
+	int dev;
+	int overlay_fd;
+	volatile bool stop;
+	unsigned long events;
+	unsigned long pages;
+	int res;
+};
+
+struct worker_state {
+	char *base_map;
+	unsigned long start_pgoff;
+	unsigned long end_pgoff;
+	int res;
+};
+
+// write_overlay_pages stands in for a remote host, writing the data of
+// pending pages to the overlay file.
+int write_overlay_pages(int fd, unsigned long start, unsigned long end)
+{
+	char *buffer = malloc(PAGE_SIZE);
+	memset(buffer, OVERLAY_FILL, PAGE_SIZE);
+	int res = EXIT_SUCCESS;
+	for (unsigned long pgoff = start; pgoff <= end; pgoff++) {
+		if (pwrite(fd, buffer, PAGE_SIZE, pgoff * PAGE_SIZE) !=
+		    PAGE_SIZE) {
+			printf("ERROR: could not write overlay page %lu: %s\n",
+			       pgoff, strerror(errno));
+			res = EXIT_FAILURE;
+			break;
+		}
+	}
+	free(buffer);
+	return res;
+}
+
+int mark_ready(int dev, unsigned long id, struct mem_overlay_range *ranges,
+	       unsigned int n)
+{
+	struct mem_overlay_ready_req req = {
+		.id = id,
+		.ranges_size = n,
+		.ranges = ranges,
+	};
+	if (ioctl(dev, IOCTL_MEM_OVERLAY_READY_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_READY_CMD': %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// source handles the events of pending page faults, supplying the requested
+// pages and marking all of them as ready with a single command.
+void *source(void *arg)
+{
+	struct source_state *state = arg;
+	struct mem_overlay_pending_event events[64];
+	struct mem_overlay_range ranges[64];
+	struct pollfd pfd = { .fd = state->dev, .events = POLLIN };
+
+	while (!state->stop) {
+		if (poll(&pfd, 1, 10) <= 0)
+			continue;
+
+		ssize_t n = read(state->dev, events, sizeof(events));
+		if (n < 0) {
+			if (errno == EAGAIN)
+				continue;
+			printf("ERROR: could not read pending events: %s\n",
+			       strerror(errno));
+			state->res = EXIT_FAILURE;
+			break;
+		}
+
+		unsigned int count = n / sizeof(struct mem_overlay_pending_event);
+		for (unsigned int i = 0; i < count; i++) {
+			if (events[i].start_pgoff < PENDING_START ||
+			    events[i].end_pgoff >= PREFILLED_START) {
+				printf("== ERROR: unexpected pending event [%lu, %lu]\n",
+				       events[i].start_pgoff,
+				       events[i].end_pgoff);
+				state->res = EXIT_FAILURE;
+			}
+			if (write_overlay_pages(state->overlay_fd,
+						events[i].start_pgoff,
+						events[i].end_pgoff))
+				state->res = EXIT_FAILURE;
+			ranges[i].start_pgoff = events[i].start_pgoff;
+			ranges[i].end_pgoff = events[i].end_pgoff;
+			state->pages +=
+				events[i].end_pgoff - events[i].start_pgoff + 1;
+		}
+		state->events += count;
+		if (mark_ready(state->dev, events[0].id, ranges, count))
+			state->res = EXIT_FAILURE;
+	}
+	return NULL;
+}
+
+void *worker(void *arg)
+{
+	struct worker_state *state = arg;
+	for (unsigned long pgoff = state->start_pgoff;
+	     pgoff <= state->end_pgoff; pgoff++) {
+		char *page = state->base_map + pgoff * PAGE_SIZE;
+		for (size_t i = 0; i < PAGE_SIZE; i++) {
+			if (page[i] != OVERLAY_FILL) {
+				printf("== ERROR: expected '%c' in page %lu offset %lu, got '%c'\n",
+				       OVERLAY_FILL, pgoff, i, page[i]);
+				state->res = EXIT_FAILURE;
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+int main()
+{
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	int res = EXIT_SUCCESS;
+	int base_fd = memfd_create("pending_base", 0);
+	int overlay_fd = memfd_create("pending_overlay", 0);
+	if (base_fd < 0 || overlay_fd < 0 || ftruncate(base_fd, TOTAL_SIZE) ||
+	    ftruncate(overlay_fd, TOTAL_SIZE)) {
+		printf("ERROR: could not create test files: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char *fill = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  base_fd, 0);
+	if (fill == MAP_FAILED) {
+		printf("ERROR: could not mmap base file: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+	memset(fill, BASE_FILL, TOTAL_SIZE);
+	munmap(fill, TOTAL_SIZE);
+
+	char *base_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	char *overlay_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_SHARED, overlay_fd, 0);
+	if (base_map == MAP_FAILED || overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test files: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.segments_size = 1;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	req.segments[0].start_pgoff = PENDING_START;
+	req.segments[0].end_pgoff = PENDING_END;
+	req.segments[0].flags = MEM_OVERLAY_SEGMENT_PENDING;
+
+	int syscall_dev = open(kmod_device_path, O_RDWR | O_NONBLOCK);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	// Supply some pages before they are accessed.
+	struct mem_overlay_range prefilled = { PREFILLED_START, PENDING_END };
+	if (write_overlay_pages(overlay_fd, PREFILLED_START, PENDING_END) ||
+	    mark_ready(syscall_dev, req.id, &prefilled, 1)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	printf("= TEST: checking pages outside of pending segments don't block\n");
+	if (base_map[0] != BASE_FILL || base_map[500 * PAGE_SIZE] != BASE_FILL ||
+	    base_map[PREFILLED_START * PAGE_SIZE] != OVERLAY_FILL) {
+		printf("== ERROR: unexpected page contents\n");
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	struct mem_overlay_pending_event event;
+	if (read(syscall_dev, &event, sizeof(event)) >= 0 || errno != EAGAIN) {
+		printf("== ERROR: expected no pending events\n");
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: no pending events found!\n");
+
+	printf("= TEST: checking pending pages are supplied on demand\n");
+	struct source_state source_state = {
+		.dev = syscall_dev,
+		.overlay_fd = overlay_fd,
+	};
+	pthread_t source_tid;
+	pthread_create(&source_tid, NULL, source, &source_state);
+
+	unsigned long pages_per_worker =
+		(PREFILLED_START - PENDING_START) / NR_WORKERS;
+	struct worker_state workers[NR_WORKERS];
+	pthread_t worker_tids[NR_WORKERS];
+	for (int i = 0; i < NR_WORKERS; i++) {
+		workers[i].base_map = base_map;
+		workers[i].start_pgoff = PENDING_START + i * pages_per_worker;
+		workers[i].end_pgoff =
+			workers[i].start_pgoff + pages_per_worker - 1;
+		workers[i].res = EXIT_SUCCESS;
+		pthread_create(&worker_tids[i], NULL, worker, &workers[i]);
+	}
+	for (int i = 0; i < NR_WORKERS; i++) {
+		pthread_join(worker_tids[i], NULL);
+		if (workers[i].res)
+			res = EXIT_FAILURE;
+	}
+	source_state.stop = true;
+	pthread_join(source_tid, NULL);
+	if (source_state.res)
+		res = EXIT_FAILURE;
+
+	printf("received %lu events for %lu pages\n", source_state.events,
+	       source_state.pages);
+	if (res || source_state.events == 0 ||
+	    source_state.pages > PREFILLED_START - PENDING_START) {
+		printf("== ERROR: pending pages were not supplied correctly\n");
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: pending pages supplied on demand!\n");
+
+cleanup:;
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+close_syscall_dev:
+	close(syscall_dev);
+free_segments:
+	free(req.segments);
+	munmap(overlay_map, TOTAL_SIZE);
+	munmap(base_map, TOTAL_SIZE);
+	close(overlay_fd);
+	close(base_fd);
+
+	printf("done\n");
+	return res;
+}
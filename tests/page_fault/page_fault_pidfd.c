@@ -0,0 +1,354 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <syscall.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../../common.h"
+
+// Number of target processes that have memory overlays registered on their
+// behalf by the parent process in a single batch request.
+const static int nr_targets = 10;
+
+size_t page_size, total_size;
+
+static const char base_file[] = "base.bin";
+static const char overlay_file[] = "overlay.bin";
+static const int page_size_factor = 1024;
+
+struct target {
+	pid_t pid;
+	int pidfd;
+
+	// Pipes used to exchange addresses and synchronize with the parent.
+	int to_parent[2];
+	int to_target[2];
+
+	unsigned long base_addr;
+	unsigned long overlay_addr;
+};
+
+bool is_overlay_page(unsigned long pgoff)
+{
+	return pgoff % 2 == 0;
+}
+
+bool verify_memory(pid_t pid, int overlay_fd, int base_fd, char *base_map)
+{
+	char *buffer = calloc(page_size, 1);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < total_size / page_size; pgoff++) {
+		size_t offset = pgoff * page_size;
+
+		int fd = is_overlay_page(pgoff) ? overlay_fd : base_fd;
+		lseek(fd, offset, SEEK_SET);
+		read(fd, buffer, page_size);
+
+		if (memcmp(base_map + offset, buffer, page_size)) {
+			printf("[%d] == ERROR: base memory does not match the file contents at page %lu\n",
+			       pid, pgoff);
+			valid = false;
+			break;
+		}
+		memset(buffer, 0, page_size);
+	}
+
+	free(buffer);
+	return valid;
+}
+
+// run_target maps the test files, sends their addresses to the parent and
+// waits for the memory overlay to be registered before verifying it.
+int run_target(struct target *t)
+{
+	pid_t pid = getpid();
+	int res = EXIT_SUCCESS;
+	char sync;
+
+	int base_fd = open(base_file, O_RDONLY);
+	if (base_fd < 0) {
+		printf("[%d] ERROR: could not open base file %s: %s\n", pid,
+		       base_file, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	char *base_mmap = mmap(NULL, total_size, PROT_READ, MAP_PRIVATE,
+			       base_fd, 0);
+	if (base_mmap == MAP_FAILED) {
+		printf("[%d] ERROR: could not mmap base file %s: %s\n", pid,
+		       base_file, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	int overlay_fd = open(overlay_file, O_RDONLY);
+	if (overlay_fd < 0) {
+		printf("[%d] ERROR: could not open overlay file %s: %s\n", pid,
+		       overlay_file, strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap_base;
+	}
+
+	char *overlay_mmap = mmap(NULL, total_size, PROT_READ, MAP_PRIVATE,
+				  overlay_fd, 0);
+	if (overlay_mmap == MAP_FAILED) {
+		printf("[%d] ERROR: could not mmap overlay file %s: %s\n", pid,
+		       overlay_file, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	t->base_addr = (unsigned long)base_mmap;
+	t->overlay_addr = (unsigned long)overlay_mmap;
+	write(t->to_parent[1], &t->base_addr, sizeof(t->base_addr));
+	write(t->to_parent[1], &t->overlay_addr, sizeof(t->overlay_addr));
+
+	// Wait for parent to register the memory overlay.
+	if (read(t->to_target[0], &sync, 1) != 1 || sync != 1) {
+		printf("[%d] ERROR: parent failed to register memory overlay\n",
+		       pid);
+		res = EXIT_FAILURE;
+		goto unmap_overlay;
+	}
+
+	printf("[%d] = TEST: checking memory contents with overlay\n", pid);
+	if (!verify_memory(pid, overlay_fd, base_fd, base_mmap)) {
+		res = EXIT_FAILURE;
+	} else {
+		printf("[%d] == OK: overlay memory verification completed successfully!\n",
+		       pid);
+	}
+
+	// Notify parent and wait for the memory overlay to be cleaned up.
+	sync = res == EXIT_SUCCESS;
+	write(t->to_parent[1], &sync, 1);
+	read(t->to_target[0], &sync, 1);
+
+unmap_overlay:
+	munmap(overlay_mmap, total_size);
+close_overlay:
+	close(overlay_fd);
+unmap_base:
+	munmap(base_mmap, total_size);
+close_base:
+	close(base_fd);
+	return res;
+}
+
+int main()
+{
+	int res = EXIT_SUCCESS;
+	bool skipped = false;
+	pid_t pid = getpid();
+	struct target targets[nr_targets];
+
+	page_size = sysconf(_SC_PAGESIZE);
+	total_size = page_size * page_size_factor;
+	printf("[%d] Using pagesize %lu with total size %lu\n", pid, page_size,
+	       total_size);
+
+	int nr_started = 0;
+	for (; nr_started < nr_targets; nr_started++) {
+		struct target *t = &targets[nr_started];
+		if (pipe(t->to_parent) || pipe(t->to_target)) {
+			printf("[%d] ERROR: could not create pipes: %s\n", pid,
+			       strerror(errno));
+			res = EXIT_FAILURE;
+			goto wait;
+		}
+
+		t->pid = fork();
+		if (t->pid < 0) {
+			printf("[%d] ERROR: could not fork: %s\n", pid,
+			       strerror(errno));
+			close(t->to_parent[0]);
+			close(t->to_parent[1]);
+			close(t->to_target[0]);
+			close(t->to_target[1]);
+			res = EXIT_FAILURE;
+			goto wait;
+		}
+		if (t->pid == 0) {
+			// Only keep the target ends of the pipes of this target,
+			// so each end sees EOF if the other process exits
+			// early.
+			for (int i = 0; i < nr_started; i++) {
+				close(targets[i].to_parent[0]);
+				close(targets[i].to_target[1]);
+			}
+			close(t->to_parent[0]);
+			close(t->to_target[1]);
+			return run_target(t);
+		}
+		close(t->to_parent[1]);
+		close(t->to_target[0]);
+
+		t->pidfd = syscall(SYS_pidfd_open, t->pid, 0);
+		if (t->pidfd < 0) {
+			printf("[%d] ERROR: could not open pidfd for %d: %s\n",
+			       pid, t->pid, strerror(errno));
+			res = EXIT_FAILURE;
+			nr_started++;
+			goto wait;
+		}
+	}
+
+	// Create one memory overlay request per target process, overlaying
+	// every other page.
+	struct mem_overlay_segment_req *segments =
+		calloc(sizeof(struct mem_overlay_segment_req),
+		       total_size / (page_size * 2));
+	for (int i = 0; i < total_size / (page_size * 2); i++) {
+		segments[i].start_pgoff = 2 * i;
+		segments[i].end_pgoff = 2 * i;
+	}
+
+	struct mem_overlay_req *reqs =
+		calloc(sizeof(struct mem_overlay_req), nr_targets);
+	for (int i = 0; i < nr_targets; i++) {
+		struct target *t = &targets[i];
+		if (read(t->to_parent[0], &t->base_addr, sizeof(t->base_addr)) !=
+			    sizeof(t->base_addr) ||
+		    read(t->to_parent[0], &t->overlay_addr,
+			 sizeof(t->overlay_addr)) != sizeof(t->overlay_addr)) {
+			printf("[%d] ERROR: could not read addresses of %d\n",
+			       pid, t->pid);
+			res = EXIT_FAILURE;
+			goto free_reqs;
+		}
+
+		reqs[i].flags = MEM_OVERLAY_REQ_PIDFD;
+		reqs[i].pidfd = t->pidfd;
+		reqs[i].base_addr = t->base_addr;
+		reqs[i].overlay_addr = t->overlay_addr;
+		reqs[i].segments_size = total_size / (page_size * 2);
+		reqs[i].segments = segments;
+	}
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("[%d] ERROR: could not open %s: %s\n", pid,
+		       kmod_device_path, strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_reqs;
+	}
+
+	printf("[%d] = TEST: register memory overlays in %d processes with IOCTL_MEM_OVERLAY_BATCH_REQ_CMD\n",
+	       pid, nr_targets);
+	int *statuses = calloc(sizeof(int), nr_targets);
+	struct mem_overlay_batch_req batch_req = {
+		.reqs_size = nr_targets,
+		.reqs = reqs,
+		.statuses = statuses,
+	};
+	int ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_BATCH_REQ_CMD,
+			&batch_req);
+	int failed = 0;
+	int unsupported = 0;
+	for (int i = 0; ret == 0 && i < nr_targets; i++) {
+		if (statuses[i])
+			failed++;
+		if (statuses[i] == -EOPNOTSUPP)
+			unsupported++;
+	}
+	if (unsupported == nr_targets) {
+		printf("[%d] == SKIP: MEM_OVERLAY_REQ_PIDFD is not supported by the running kernel\n",
+		       pid);
+		skipped = true;
+	} else if (ret) {
+		printf("[%d] == ERROR: could not call 'IOCTL_MEM_OVERLAY_BATCH_REQ_CMD': %s\n",
+		       pid, strerror(errno));
+		res = EXIT_FAILURE;
+	} else if (failed) {
+		printf("[%d] == ERROR: %d requests of 'IOCTL_MEM_OVERLAY_BATCH_REQ_CMD' failed\n",
+		       pid, failed);
+		res = EXIT_FAILURE;
+	} else {
+		printf("[%d] == OK: registered %d memory overlays successfully!\n",
+		       pid, nr_targets);
+	}
+
+	// Let targets verify their memory and wait for results.
+	for (int i = 0; i < nr_targets; i++) {
+		char sync = ret >= 0 && statuses[i] == 0;
+		write(targets[i].to_target[1], &sync, 1);
+	}
+	for (int i = 0; i < nr_targets; i++) {
+		if (ret < 0 || statuses[i])
+			continue;
+		char sync = 0;
+		read(targets[i].to_parent[0], &sync, 1);
+		if (!sync)
+			res = EXIT_FAILURE;
+	}
+
+	printf("[%d] = TEST: clean up memory overlays from parent process\n",
+	       pid);
+	for (int i = 0; i < nr_targets; i++) {
+		if (ret < 0 || statuses[i])
+			continue;
+		struct mem_overlay_cleanup_req cleanup_req = {
+			.id = reqs[i].id,
+		};
+		int cleanup_ret = ioctl(syscall_dev,
+					IOCTL_MEM_OVERLAY_CLEANUP_CMD,
+					&cleanup_req);
+		if (cleanup_ret) {
+			printf("[%d] == ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+			       pid, strerror(errno));
+			res = EXIT_FAILURE;
+		}
+		write(targets[i].to_target[1], &cleanup_ret, 1);
+	}
+	if (res == EXIT_SUCCESS)
+		printf("[%d] == OK: memory overlays cleaned up successfully!\n",
+		       pid);
+
+	free(statuses);
+	close(syscall_dev);
+free_reqs:
+	free(reqs);
+	free(segments);
+wait:
+	// Targets still waiting for the parent see EOF and exit.
+	for (int i = 0; i < nr_started; i++) {
+		close(targets[i].to_target[1]);
+		close(targets[i].to_parent[0]);
+	}
+	for (int i = 0; i < nr_started; i++) {
+		int child_rc;
+		waitpid(targets[i].pid, &child_rc, 0);
+		if (skipped)
+			continue;
+		if (!WIFEXITED(child_rc) || WEXITSTATUS(child_rc) != 0)
+			res = EXIT_FAILURE;
+	}
+
+	printf("[%d] done\n", pid);
+	return res;
+}
@@ -0,0 +1,288 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+static const int TOTAL_PAGES = 4096;
+static const char BASE_FILL = 'b';
+static const char OVERLAY_FILL = 'o';
+static const int PREFETCH_TIMEOUT_MS = 5000;
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+int create_memfd(const char *name, char fill)
+{
+	int fd = memfd_create(name, 0);
+	if (fd < 0) {
+		printf("ERROR: could not create %s: %s\n", name,
+		       strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, TOTAL_SIZE)) {
+		printf("ERROR: could not resize %s: %s\n", name,
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	char *map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, 0);
+	if (map == MAP_FAILED) {
+		printf("ERROR: could not mmap %s: %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	memset(map, fill, TOTAL_SIZE);
+	munmap(map, TOTAL_SIZE);
+	return fd;
+}
+
+// is_mapped checks if a page has a page table entry using /proc/self/pagemap.
+bool is_mapped(int pagemap_fd, char *addr)
+{
+	uint64_t entry = 0;
+	off_t offset = ((unsigned long)addr / PAGE_SIZE) * sizeof(uint64_t);
+	if (pread(pagemap_fd, &entry, sizeof(entry), offset) != sizeof(entry))
+		return false;
+	return entry & (1ULL << 63);
+}
+
+// wait_mapped waits for all pages in pgoffs to be mapped by the prefetch.
+bool wait_mapped(int pagemap_fd, char *base_map, unsigned long *pgoffs,
+		 unsigned long n)
+{
+	for (int ms = 0; ms < PREFETCH_TIMEOUT_MS; ms++) {
+		unsigned long mapped = 0;
+		for (unsigned long i = 0; i < n; i++) {
+			if (is_mapped(pagemap_fd, base_map + pgoffs[i] * PAGE_SIZE))
+				mapped++;
+		}
+		if (mapped == n)
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+int main()
+{
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	int res = EXIT_SUCCESS;
+	int base_fd = create_memfd("prefetch_base", BASE_FILL);
+	int overlay_fd = create_memfd("prefetch_overlay", OVERLAY_FILL);
+	int pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+	if (base_fd < 0 || overlay_fd < 0 || pagemap_fd < 0)
+		return EXIT_FAILURE;
+
+	char *base_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	char *overlay_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (base_map == MAP_FAILED || overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test files: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.segments_size = 1;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	req.segments[0].start_pgoff = 1000;
+	req.segments[0].end_pgoff = 1999;
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	printf("= TEST: checking throttle without a running prefetch fails\n");
+	struct mem_overlay_prefetch_req throttle_req = {
+		.id = req.id,
+		.flags = MEM_OVERLAY_PREFETCH_THROTTLE,
+		.delay_us = 100,
+	};
+	if (!ioctl(syscall_dev, IOCTL_MEM_OVERLAY_PREFETCH_CMD,
+		   &throttle_req) ||
+	    errno != ESRCH) {
+		printf("== ERROR: expected ESRCH: %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: throttle rejected!\n");
+
+	// Profile pages are far enough from the cold page that fault-around
+	// doesn't map it.
+	printf("= TEST: checking profile pages are prefetched\n");
+	unsigned long pgoffs[] = { 3000, 1500, 10, 11, 12, 1999, 2000, 700 };
+	unsigned long n = sizeof(pgoffs) / sizeof(unsigned long);
+	unsigned long cold_pgoff = 3500;
+	struct mem_overlay_prefetch_req prefetch_req = {
+		.id = req.id,
+		.batch_pages = 2,
+		.pgoffs_size = n,
+		.pgoffs = pgoffs,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_PREFETCH_CMD,
+		  &prefetch_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_PREFETCH_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if (!wait_mapped(pagemap_fd, base_map, pgoffs, n)) {
+		printf("== ERROR: profile pages were not prefetched\n");
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if (is_mapped(pagemap_fd, base_map + cold_pgoff * PAGE_SIZE)) {
+		printf("== ERROR: cold page %lu was prefetched\n", cold_pgoff);
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	for (unsigned long i = 0; i < n; i++) {
+		char expected = pgoffs[i] >= 1000 && pgoffs[i] <= 1999 ?
+					OVERLAY_FILL :
+					BASE_FILL;
+		if (base_map[pgoffs[i] * PAGE_SIZE] != expected) {
+			printf("== ERROR: expected '%c' in page %lu, got '%c'\n",
+			       expected, pgoffs[i],
+			       base_map[pgoffs[i] * PAGE_SIZE]);
+			res = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+	printf("== OK: profile pages prefetched!\n");
+
+	// A slow prefetch is cancelled, after which a new one can be started.
+	printf("= TEST: checking prefetch can be cancelled\n");
+	unsigned long *slow_pgoffs = calloc(sizeof(unsigned long), TOTAL_PAGES);
+	for (unsigned long i = 0; i < TOTAL_PAGES; i++)
+		slow_pgoffs[i] = i;
+	prefetch_req.batch_pages = 1;
+	prefetch_req.delay_us = 100000;
+	prefetch_req.pgoffs_size = TOTAL_PAGES;
+	prefetch_req.pgoffs = slow_pgoffs;
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_PREFETCH_CMD,
+		  &prefetch_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_PREFETCH_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_slow_pgoffs;
+	}
+	if (!ioctl(syscall_dev, IOCTL_MEM_OVERLAY_PREFETCH_CMD,
+		   &prefetch_req) ||
+	    errno != EBUSY) {
+		printf("== ERROR: expected EBUSY for second prefetch: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_slow_pgoffs;
+	}
+	throttle_req.batch_pages = 1;
+	throttle_req.delay_us = 200000;
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_PREFETCH_CMD,
+		  &throttle_req)) {
+		printf("ERROR: could not throttle prefetch: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_slow_pgoffs;
+	}
+
+	struct mem_overlay_prefetch_req cancel_req = {
+		.id = req.id,
+		.flags = MEM_OVERLAY_PREFETCH_CANCEL,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_PREFETCH_CMD, &cancel_req)) {
+		printf("ERROR: could not cancel prefetch: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_slow_pgoffs;
+	}
+
+	// The worker detaches from the memory overlay once it stops.
+	prefetch_req.delay_us = 0;
+	prefetch_req.pgoffs_size = 1;
+	bool restarted = false;
+	for (int ms = 0; ms < PREFETCH_TIMEOUT_MS && !restarted; ms++) {
+		if (!ioctl(syscall_dev, IOCTL_MEM_OVERLAY_PREFETCH_CMD,
+			   &prefetch_req))
+			restarted = true;
+		else
+			usleep(1000);
+	}
+	if (!restarted ||
+	    is_mapped(pagemap_fd, base_map + cold_pgoff * PAGE_SIZE)) {
+		printf("== ERROR: prefetch was not cancelled\n");
+		res = EXIT_FAILURE;
+		goto free_slow_pgoffs;
+	}
+	printf("== OK: prefetch cancelled!\n");
+
+free_slow_pgoffs:
+	free(slow_pgoffs);
+cleanup:;
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+close_syscall_dev:
+	close(syscall_dev);
+free_segments:
+	free(req.segments);
+	munmap(overlay_map, TOTAL_SIZE);
+	munmap(base_map, TOTAL_SIZE);
+	close(pagemap_fd);
+	close(overlay_fd);
+	close(base_fd);
+
+	printf("done\n");
+	return res;
+}
@@ -0,0 +1,347 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+// The benchmark measures how registering and removing a memory overlay scales
+// with its number of segments, from 1 to 10M segments by default, for the
+// following segment layouts (shapes).
+//
+//   dense   Adjacent single page segments.
+//   zebra   Single page segments on every other page.
+//   random  Single page segments at random page offsets, registered in random
+//           order.
+//
+// For each run it reports the latency of the registration and cleanup
+// ioctls, the longest time the process mmap lock was held during the
+// registration, and the kernel memory used per segment.
+//
+// The mmap lock hold time is measured by a probe thread that calls mincore,
+// which needs the mmap read lock, in a loop while the registration runs.
+//
+// Kernel memory is the change of Slab and VmallocUsed in /proc/meminfo, so it
+// includes any other allocation made by the system at the same time. Memory
+// is freed in the background after the cleanup, so the benchmark waits for
+// FREE_DELAY_US before reading it again.
+//
+// The base and overlay memory areas are backed by sparse memfds that are
+// never accessed, so no page is allocated for them.
+//
+// Options:
+//   -m  Maximum number of segments. Runs use powers of 10 up to it.
+//   -S  Comma separated list of shapes.
+//   -o  Write results as CSV to a file, or to stdout if the file is "-".
+static const useconds_t FREE_DELAY_US = 200000;
+
+enum shape { SHAPE_DENSE, SHAPE_ZEBRA, SHAPE_RANDOM };
+static const char *shape_names[] = { "dense", "zebra", "random" };
+#define NR_SHAPES 3
+
+size_t PAGE_SIZE;
+
+struct probe {
+	pthread_t tid;
+	char *addr;
+	atomic_bool running;
+	atomic_bool stop;
+	unsigned long long max_ns;
+};
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// read_kernel_memory returns the Slab and VmallocUsed memory, in kB.
+long read_kernel_memory()
+{
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return -1;
+
+	char line[256];
+	long total = 0;
+	while (fgets(line, sizeof(line), f)) {
+		long kb;
+		if (sscanf(line, "Slab: %ld kB", &kb) == 1 ||
+		    sscanf(line, "VmallocUsed: %ld kB", &kb) == 1)
+			total += kb;
+	}
+	fclose(f);
+	return total;
+}
+
+// probe_mmap_lock records the longest mincore call made while running is
+// set, which is blocked while the mmap write lock is held.
+void *probe_mmap_lock(void *arg)
+{
+	struct probe *probe = arg;
+	unsigned char vec;
+
+	while (!atomic_load(&probe->stop)) {
+		if (!atomic_load(&probe->running)) {
+			sched_yield();
+			continue;
+		}
+		unsigned long long before = now_ns();
+		mincore(probe->addr, PAGE_SIZE, &vec);
+		unsigned long long elapsed = now_ns() - before;
+		if (elapsed > probe->max_ns)
+			probe->max_ns = elapsed;
+	}
+	return NULL;
+}
+
+// fill_segments stores n segments of the shape and returns the number of
+// base pages they span.
+unsigned long fill_segments(struct mem_overlay_segment_req *segs,
+			    unsigned long n, enum shape shape)
+{
+	switch (shape) {
+	case SHAPE_DENSE:
+		for (unsigned long i = 0; i < n; i++)
+			segs[i].start_pgoff = i;
+		break;
+	case SHAPE_ZEBRA:
+		for (unsigned long i = 0; i < n; i++)
+			segs[i].start_pgoff = 2 * i;
+		break;
+	case SHAPE_RANDOM:
+		// Pick one page in each group of 4 pages, then shuffle.
+		for (unsigned long i = 0; i < n; i++)
+			segs[i].start_pgoff = 4 * i + random() % 4;
+		for (unsigned long i = n - 1; i > 0; i--) {
+			unsigned long j = random() % (i + 1);
+			unsigned long tmp = segs[i].start_pgoff;
+			segs[i].start_pgoff = segs[j].start_pgoff;
+			segs[j].start_pgoff = tmp;
+		}
+		break;
+	}
+
+	unsigned long pages = 0;
+	for (unsigned long i = 0; i < n; i++) {
+		segs[i].end_pgoff = segs[i].start_pgoff;
+		segs[i].type = MEM_OVERLAY_SEGMENT_FILE;
+		if (segs[i].end_pgoff + 1 > pages)
+			pages = segs[i].end_pgoff + 1;
+	}
+	return pages;
+}
+
+int run(int syscall_dev, struct probe *probe, int base_fd, int overlay_fd,
+	unsigned long n, enum shape shape, FILE *csv)
+{
+	int res = EXIT_SUCCESS;
+	struct mem_overlay_req req = { 0 };
+	req.segments_size = n;
+	req.segments = calloc(n, sizeof(struct mem_overlay_segment_req));
+	if (!req.segments) {
+		printf("ERROR: could not allocate %lu segments\n", n);
+		return EXIT_FAILURE;
+	}
+	size_t size = fill_segments(req.segments, n, shape) * PAGE_SIZE;
+
+	char *base_map =
+		mmap(NULL, size, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	char *overlay_map =
+		mmap(NULL, size, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (base_map == MAP_FAILED || overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test memfds: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto out;
+	}
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+
+	// Wait for memory of previous runs to be freed.
+	usleep(FREE_DELAY_US);
+	long mem_before = read_kernel_memory();
+
+	probe->addr = base_map;
+	probe->max_ns = 0;
+	atomic_store(&probe->running, true);
+	unsigned long long before = now_ns();
+	int ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req);
+	unsigned long long create_ns = now_ns() - before;
+	atomic_store(&probe->running, false);
+	if (ret) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD' with %lu segments: %s\n",
+		       n, strerror(errno));
+		res = EXIT_FAILURE;
+		goto out;
+	}
+	long mem_after = read_kernel_memory();
+
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	before = now_ns();
+	ret = ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req);
+	unsigned long long cleanup_ns = now_ns() - before;
+	if (ret) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto out;
+	}
+	usleep(FREE_DELAY_US);
+	long mem_freed = mem_after - read_kernel_memory();
+
+	long mem_used = mem_after - mem_before;
+	double bytes_per_segment = mem_used * 1024.0 / n;
+	printf("shape=%-6s segments=%-9lu create=%.3fms lock_hold=%.3fms cleanup=%.3fms memory=%ldkB bytes/segment=%.1f freed=%ldkB\n",
+	       shape_names[shape], n, create_ns / 1e6, probe->max_ns / 1e6,
+	       cleanup_ns / 1e6, mem_used, bytes_per_segment, mem_freed);
+	if (csv) {
+		fprintf(csv, "%s,%lu,%llu,%llu,%llu,%ld,%.1f,%ld\n",
+			shape_names[shape], n, create_ns, probe->max_ns,
+			cleanup_ns, mem_used, bytes_per_segment, mem_freed);
+		fflush(csv);
+	}
+
+out:
+	if (overlay_map != MAP_FAILED)
+		munmap(overlay_map, size);
+	if (base_map != MAP_FAILED)
+		munmap(base_map, size);
+	free(req.segments);
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int res = EXIT_SUCCESS;
+	unsigned long max_segments = 10000000;
+	bool shapes[NR_SHAPES] = { true, true, true };
+	FILE *csv = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:S:o:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			max_segments = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			memset(shapes, 0, sizeof(shapes));
+			for (char *tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ",")) {
+				int i;
+				for (i = 0; i < NR_SHAPES; i++) {
+					if (!strcmp(tok, shape_names[i]))
+						break;
+				}
+				if (i == NR_SHAPES) {
+					printf("ERROR: invalid shape '%s'\n",
+					       tok);
+					return EXIT_FAILURE;
+				}
+				shapes[i] = true;
+			}
+			break;
+		case 'o':
+			csv = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+			if (!csv) {
+				printf("ERROR: could not open %s: %s\n", optarg,
+				       strerror(errno));
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			printf("usage: %s [-m max_segments] [-S dense,zebra,random] [-o file.csv]\n",
+			       argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	srandom(1);
+
+	// The largest shape spans 4 pages per segment.
+	off_t file_size = 4 * max_segments * PAGE_SIZE;
+	int base_fd = memfd_create("base", 0);
+	int overlay_fd = memfd_create("overlay", 0);
+	if (base_fd < 0 || overlay_fd < 0 ||
+	    ftruncate(base_fd, file_size) || ftruncate(overlay_fd, file_size)) {
+		printf("ERROR: could not create test memfds: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_fds;
+	}
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_fds;
+	}
+
+	struct probe probe = { 0 };
+	pthread_create(&probe.tid, NULL, probe_mmap_lock, &probe);
+
+	printf("Page size:     %lu bytes\n", PAGE_SIZE);
+	if (csv)
+		fprintf(csv,
+			"shape,segments,create_ns,lock_hold_ns,cleanup_ns,memory_kb,bytes_per_segment,freed_kb\n");
+
+	for (int s = 0; s < NR_SHAPES && !res; s++) {
+		if (!shapes[s])
+			continue;
+		for (unsigned long n = 1; n <= max_segments; n *= 10) {
+			if (run(syscall_dev, &probe, base_fd, overlay_fd, n, s,
+				csv)) {
+				res = EXIT_FAILURE;
+				break;
+			}
+		}
+	}
+
+	atomic_store(&probe.stop, true);
+	pthread_join(probe.tid, NULL);
+	close(syscall_dev);
+close_fds:
+	if (base_fd >= 0)
+		close(base_fd);
+	if (overlay_fd >= 0)
+		close(overlay_fd);
+	if (csv && csv != stdout)
+		fclose(csv);
+
+	printf("done\n");
+	return res;
+}
@@ -0,0 +1,351 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+static const int TOTAL_PAGES = 256;
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+// Expected source of each base page.
+enum source { BASE, OVERLAY, ZERO, MEMFD, SHARED_ANON };
+
+struct test_env {
+	int base_fd;
+	int overlay_fd;
+	int memfd;
+	char *overlay_map;
+	char *memfd_map;
+	char *anon_map;
+};
+
+int call_kmod(unsigned long cmd, void *req)
+{
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		return -1;
+	}
+
+	int result = ioctl(syscall_dev, cmd, req);
+	int err = errno;
+	close(syscall_dev);
+	errno = err;
+	return result;
+}
+
+bool verify(struct test_env *env, char *base_map, enum source *sources,
+	    unsigned long written_pgoff)
+{
+	char *buffer = malloc(PAGE_SIZE);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		size_t offset = pgoff * PAGE_SIZE;
+
+		switch (sources[pgoff]) {
+		case BASE:
+			pread(env->base_fd, buffer, PAGE_SIZE, offset);
+			break;
+		case OVERLAY:
+			pread(env->overlay_fd, buffer, PAGE_SIZE, offset);
+			break;
+		case ZERO:
+			memset(buffer, 0, PAGE_SIZE);
+			break;
+		case MEMFD:
+			memset(buffer, 'm', PAGE_SIZE);
+			break;
+		case SHARED_ANON:
+			memset(buffer, 'a', PAGE_SIZE);
+			break;
+		}
+		if (pgoff == written_pgoff)
+			buffer[0] = 'w';
+
+		if (memcmp(base_map + offset, buffer, PAGE_SIZE)) {
+			printf("== ERROR: unexpected memory contents at page %lu\n",
+			       pgoff);
+			valid = false;
+			break;
+		}
+	}
+
+	free(buffer);
+	return valid;
+}
+
+int test_segment_types(struct test_env *env)
+{
+	int res = EXIT_SUCCESS;
+
+	char *base_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE, env->base_fd, 0);
+	if (base_map == MAP_FAILED) {
+		printf("ERROR: could not mmap base file: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)env->overlay_map;
+	req.segments_size = 5;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+
+	// File segment.
+	req.segments[0].start_pgoff = 0;
+	req.segments[0].end_pgoff = 9;
+
+	// Zero segments, including one that crosses fault-around windows and
+	// one right after a file segment.
+	req.segments[1].start_pgoff = 10;
+	req.segments[1].end_pgoff = 20;
+	req.segments[1].type = MEM_OVERLAY_SEGMENT_ZERO;
+	req.segments[2].start_pgoff = 40;
+	req.segments[2].end_pgoff = 99;
+	req.segments[2].type = MEM_OVERLAY_SEGMENT_ZERO;
+
+	// Buffer segments from a memfd and from shared anonymous memory. The
+	// memfd buffer starts in the middle of its mapping.
+	req.segments[3].start_pgoff = 120;
+	req.segments[3].end_pgoff = 150;
+	req.segments[3].type = MEM_OVERLAY_SEGMENT_BUFFER;
+	req.segments[3].buffer_addr =
+		(unsigned long)env->memfd_map + 5 * PAGE_SIZE;
+	req.segments[4].start_pgoff = 200;
+	req.segments[4].end_pgoff = 231;
+	req.segments[4].type = MEM_OVERLAY_SEGMENT_BUFFER;
+	req.segments[4].buffer_addr = (unsigned long)env->anon_map;
+
+	enum source *sources = calloc(sizeof(enum source), TOTAL_PAGES);
+	for (int pgoff = 0; pgoff <= 9; pgoff++)
+		sources[pgoff] = OVERLAY;
+	for (int pgoff = 10; pgoff <= 20; pgoff++)
+		sources[pgoff] = ZERO;
+	for (int pgoff = 40; pgoff <= 99; pgoff++)
+		sources[pgoff] = ZERO;
+	for (int pgoff = 120; pgoff <= 150; pgoff++)
+		sources[pgoff] = MEMFD;
+	for (int pgoff = 200; pgoff <= 231; pgoff++)
+		sources[pgoff] = SHARED_ANON;
+
+	if (call_kmod(IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_sources;
+	}
+
+	printf("= TEST: checking memory contents with segment types\n");
+	if (!verify(env, base_map, sources, -1)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: segment types memory verification completed successfully!\n");
+
+	// Writing to a zero page must copy it without affecting other zero
+	// pages.
+	printf("= TEST: checking writes to zero pages\n");
+	base_map[50 * PAGE_SIZE] = 'w';
+	if (!verify(env, base_map, sources, 50)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: zero page write verification completed successfully!\n");
+
+cleanup:;
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (call_kmod(IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+free_sources:
+	free(sources);
+	free(req.segments);
+	munmap(base_map, TOTAL_SIZE);
+	return res;
+}
+
+int test_invalid_segments(struct test_env *env)
+{
+	int res = EXIT_SUCCESS;
+
+	char *shared_base_map = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_SHARED,
+				     env->base_fd, 0);
+	char *private_anon_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+				      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *base_map = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE,
+			      env->base_fd, 0);
+	if (shared_base_map == MAP_FAILED || private_anon_map == MAP_FAILED ||
+	    base_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test memory: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+
+	struct mem_overlay_segment_req seg = { 0 };
+	struct mem_overlay_req req = { 0 };
+	req.segments_size = 1;
+	req.segments = &seg;
+
+	// The base file was opened read-only, so its shared mapping can't
+	// become writable and zero segments are allowed.
+	printf("= TEST: checking zero segment in read-only shared mapping\n");
+	req.base_addr = (unsigned long)shared_base_map;
+	seg.start_pgoff = 0;
+	seg.end_pgoff = 10;
+	seg.type = MEM_OVERLAY_SEGMENT_ZERO;
+	if (call_kmod(IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("== ERROR: unexpected error: %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	call_kmod(IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req);
+	printf("== OK: zero segment accepted\n");
+
+	printf("= TEST: checking buffer segment from private anonymous memory\n");
+	req.base_addr = (unsigned long)base_map;
+	seg.type = MEM_OVERLAY_SEGMENT_BUFFER;
+	seg.buffer_addr = (unsigned long)private_anon_map;
+	if (!call_kmod(IOCTL_MEM_OVERLAY_REQ_CMD, &req) || errno != EINVAL) {
+		printf("== ERROR: expected EINVAL, got %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+	printf("== OK: buffer segment rejected\n");
+
+	printf("= TEST: checking buffer segment larger than its mapping\n");
+	seg.buffer_addr = (unsigned long)env->memfd_map +
+			  (TOTAL_PAGES - 5) * PAGE_SIZE;
+	if (!call_kmod(IOCTL_MEM_OVERLAY_REQ_CMD, &req) || errno != EINVAL) {
+		printf("== ERROR: expected EINVAL, got %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+	printf("== OK: buffer segment rejected\n");
+
+	printf("= TEST: checking invalid segment type\n");
+	seg.type = 42;
+	if (!call_kmod(IOCTL_MEM_OVERLAY_REQ_CMD, &req) || errno != EINVAL) {
+		printf("== ERROR: expected EINVAL, got %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+	printf("== OK: segment type rejected\n");
+
+unmap:
+	if (base_map != MAP_FAILED)
+		munmap(base_map, TOTAL_SIZE);
+	if (private_anon_map != MAP_FAILED)
+		munmap(private_anon_map, TOTAL_SIZE);
+	if (shared_base_map != MAP_FAILED)
+		munmap(shared_base_map, TOTAL_SIZE);
+	return res;
+}
+
+int main()
+{
+	int res = EXIT_SUCCESS;
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	struct test_env env = { 0 };
+	env.base_fd = open("base.bin", O_RDONLY);
+	if (env.base_fd < 0) {
+		printf("ERROR: could not open base.bin: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	env.overlay_fd = open("overlay.bin", O_RDONLY);
+	if (env.overlay_fd < 0) {
+		printf("ERROR: could not open overlay.bin: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	env.overlay_map = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE,
+			       env.overlay_fd, 0);
+	if (env.overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay.bin: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	env.memfd = memfd_create("buffer", 0);
+	if (env.memfd < 0 || ftruncate(env.memfd, TOTAL_SIZE)) {
+		printf("ERROR: could not create memfd: %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap_overlay;
+	}
+
+	env.memfd_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, env.memfd, 0);
+	env.anon_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (env.memfd_map == MAP_FAILED || env.anon_map == MAP_FAILED) {
+		printf("ERROR: could not mmap buffers: %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_memfd;
+	}
+	memset(env.memfd_map, 'm', TOTAL_SIZE);
+	memset(env.anon_map, 'a', TOTAL_SIZE);
+
+	if (test_segment_types(&env) || test_invalid_segments(&env))
+		res = EXIT_FAILURE;
+
+	munmap(env.anon_map, TOTAL_SIZE);
+	munmap(env.memfd_map, TOTAL_SIZE);
+close_memfd:
+	close(env.memfd);
+unmap_overlay:
+	munmap(env.overlay_map, TOTAL_SIZE);
+close_overlay:
+	close(env.overlay_fd);
+close_base:
+	close(env.base_fd);
+
+	printf("done\n");
+	return res;
+}
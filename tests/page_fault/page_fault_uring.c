@@ -0,0 +1,338 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+// Number of memory overlays submitted to the ring at once.
+const static int nr_mappings = 8;
+
+size_t page_size, total_size;
+
+static const char base_file[] = "base.bin";
+static const char overlay_file[] = "overlay.bin";
+static const int page_size_factor = 1024;
+
+struct ring {
+	int fd;
+	struct io_uring_params params;
+
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+int ring_setup(struct ring *ring, unsigned entries)
+{
+	memset(ring, 0, sizeof(struct ring));
+	ring->fd = syscall(SYS_io_uring_setup, entries, &ring->params);
+	if (ring->fd < 0) {
+		printf("ERROR: could not setup io_uring: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct io_uring_params *p = &ring->params;
+	size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	size_t cq_size =
+		p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+
+	// Kernels with IORING_FEAT_SINGLE_MMAP share the SQ and CQ rings.
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	char *sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || sqes == MAP_FAILED ||
+	    !(p->features & IORING_FEAT_SINGLE_MMAP)) {
+		printf("ERROR: could not mmap io_uring: %s\n", strerror(errno));
+		close(ring->fd);
+		return EXIT_FAILURE;
+	}
+
+	ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+	ring->sqes = (struct io_uring_sqe *)sqes;
+	ring->cq_head = (unsigned *)(sq + p->cq_off.head);
+	ring->cq_tail = (unsigned *)(sq + p->cq_off.tail);
+	ring->cq_mask = (unsigned *)(sq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(sq + p->cq_off.cqes);
+	return EXIT_SUCCESS;
+}
+
+// ring_queue_cmd queues a memory overlay command without submitting it.
+void ring_queue_cmd(struct ring *ring, int dev_fd, unsigned cmd, void *arg,
+		    unsigned long user_data)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = dev_fd;
+	sqe->cmd_op = cmd;
+	sqe->user_data = user_data;
+	((struct mem_overlay_uring_cmd *)sqe->cmd)->arg = (unsigned long)arg;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// ring_wait waits for nr completions and stores their results indexed by
+// user_data.
+int ring_wait(struct ring *ring, int nr, int *results)
+{
+	for (int done = 0; done < nr;) {
+		unsigned head = *ring->cq_head;
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(SYS_io_uring_enter, ring->fd, 0, 1,
+				    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+				printf("ERROR: could not wait for io_uring completions: %s\n",
+				       strerror(errno));
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		results[cqe->user_data] = cqe->res;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		done++;
+	}
+	return EXIT_SUCCESS;
+}
+
+int ring_submit(struct ring *ring, int nr)
+{
+	int ret = syscall(SYS_io_uring_enter, ring->fd, nr, 0, 0, NULL, 0);
+	if (ret != nr) {
+		printf("ERROR: could not submit io_uring commands: %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+bool verify_memory(int overlay_fd, int base_fd, char *base_map)
+{
+	char *buffer = calloc(page_size, 1);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < total_size / page_size; pgoff++) {
+		size_t offset = pgoff * page_size;
+
+		int fd = pgoff % 2 == 0 ? overlay_fd : base_fd;
+		lseek(fd, offset, SEEK_SET);
+		read(fd, buffer, page_size);
+
+		if (memcmp(base_map + offset, buffer, page_size)) {
+			printf("== ERROR: base memory does not match the file contents at page %lu\n",
+			       pgoff);
+			valid = false;
+			break;
+		}
+		memset(buffer, 0, page_size);
+	}
+
+	free(buffer);
+	return valid;
+}
+
+int main()
+{
+	int res = EXIT_SUCCESS;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	total_size = page_size * page_size_factor;
+	printf("Using pagesize %lu with total size %lu\n", page_size,
+	       total_size);
+
+	int base_fd = open(base_file, O_RDONLY);
+	if (base_fd < 0) {
+		printf("ERROR: could not open base file %s: %s\n", base_file,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int overlay_fd = open(overlay_file, O_RDONLY);
+	if (overlay_fd < 0) {
+		printf("ERROR: could not open overlay file %s: %s\n",
+		       overlay_file, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	char *overlay_map =
+		mmap(NULL, total_size, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay file %s: %s\n",
+		       overlay_file, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	char **base_mmaps = calloc(sizeof(char *), nr_mappings);
+	int nr_mapped = 0;
+	for (; nr_mapped < nr_mappings; nr_mapped++) {
+		base_mmaps[nr_mapped] = mmap(NULL, total_size, PROT_READ,
+					     MAP_PRIVATE, base_fd, 0);
+		if (base_mmaps[nr_mapped] == MAP_FAILED) {
+			printf("ERROR: could not mmap base file %s: %s\n",
+			       base_file, strerror(errno));
+			res = EXIT_FAILURE;
+			goto unmap_base;
+		}
+	}
+
+	// Overlay every other page.
+	struct mem_overlay_segment_req *segments =
+		calloc(sizeof(struct mem_overlay_segment_req),
+		       total_size / (page_size * 2));
+	for (int i = 0; i < total_size / (page_size * 2); i++) {
+		segments[i].start_pgoff = 2 * i;
+		segments[i].end_pgoff = 2 * i;
+	}
+
+	struct mem_overlay_req *reqs =
+		calloc(sizeof(struct mem_overlay_req), nr_mappings);
+	struct mem_overlay_cleanup_req *cleanup_reqs =
+		calloc(sizeof(struct mem_overlay_cleanup_req), nr_mappings);
+	int *results = calloc(sizeof(int), nr_mappings);
+	for (int i = 0; i < nr_mappings; i++) {
+		reqs[i].base_addr = (unsigned long)base_mmaps[i];
+		reqs[i].overlay_addr = (unsigned long)overlay_map;
+		reqs[i].segments_size = total_size / (page_size * 2);
+		reqs[i].segments = segments;
+	}
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	struct ring ring;
+	if (ring_setup(&ring, nr_mappings)) {
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	printf("= TEST: submit IOCTL_MEM_OVERLAY_REQ_CMD via io_uring\n");
+	for (int i = 0; i < nr_mappings; i++) {
+		ring_queue_cmd(&ring, syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD,
+			       &reqs[i], i);
+	}
+	if (ring_submit(&ring, nr_mappings)) {
+		res = EXIT_FAILURE;
+		goto close_ring;
+	}
+
+	// Requests are handled asynchronously, so the submitting thread is free
+	// to do other work, like warming up the overlay file page cache.
+	char *buffer = malloc(page_size);
+	for (size_t offset = 0; offset < total_size; offset += page_size)
+		pread(overlay_fd, buffer, page_size, offset);
+	free(buffer);
+
+	if (ring_wait(&ring, nr_mappings, results)) {
+		res = EXIT_FAILURE;
+		goto close_ring;
+	}
+	for (int i = 0; i < nr_mappings; i++) {
+		if (results[i]) {
+			printf("== ERROR: IOCTL_MEM_OVERLAY_REQ_CMD %d failed: %s\n",
+			       i, strerror(-results[i]));
+			res = EXIT_FAILURE;
+		} else if (!verify_memory(overlay_fd, base_fd, base_mmaps[i])) {
+			res = EXIT_FAILURE;
+		}
+	}
+	if (res == EXIT_SUCCESS)
+		printf("== OK: io_uring memory overlays verified successfully!\n");
+
+	printf("= TEST: submit IOCTL_MEM_OVERLAY_CLEANUP_CMD via io_uring\n");
+	int nr_cleanup = 0;
+	for (int i = 0; i < nr_mappings; i++) {
+		if (results[i])
+			continue;
+		cleanup_reqs[i].id = reqs[i].id;
+		ring_queue_cmd(&ring, syscall_dev,
+			       IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_reqs[i],
+			       i);
+		nr_cleanup++;
+	}
+	if (ring_submit(&ring, nr_cleanup) ||
+	    ring_wait(&ring, nr_cleanup, results)) {
+		res = EXIT_FAILURE;
+		goto close_ring;
+	}
+	for (int i = 0; i < nr_mappings; i++) {
+		if (results[i]) {
+			printf("== ERROR: IOCTL_MEM_OVERLAY_CLEANUP_CMD %d failed: %s\n",
+			       i, strerror(-results[i]));
+			res = EXIT_FAILURE;
+		}
+	}
+	if (res == EXIT_SUCCESS)
+		printf("== OK: io_uring memory overlays cleaned up successfully!\n");
+
+close_ring:
+	close(ring.fd);
+close_syscall_dev:
+	close(syscall_dev);
+free_segments:
+	free(results);
+	free(cleanup_reqs);
+	free(reqs);
+	free(segments);
+unmap_base:
+	for (int i = 0; i < nr_mapped; i++)
+		munmap(base_mmaps[i], total_size);
+	free(base_mmaps);
+	munmap(overlay_map, total_size);
+close_overlay:
+	close(overlay_fd);
+close_base:
+	close(base_fd);
+
+	printf("done\n");
+	return res;
+}
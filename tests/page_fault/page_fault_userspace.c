@@ -0,0 +1,526 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <linux/userfaultfd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../../common.h"
+
+// The benchmark builds the same memory layout, with every other group of N
+// pages read from the overlay file and the rest from the base file, using
+// three different mechanisms.
+//
+//   mmap     The base file is mapped and each overlay segment is mapped on top
+//            of it with mmap(MAP_FIXED). Adjacent segments are merged into a
+//            single mapping, so each group of N pages needs one mmap call.
+//   uffd     Anonymous memory is registered with userfaultfd, and a handler
+//            thread copies each missing page from the right file with
+//            UFFDIO_COPY.
+//   module   The base file is mapped and a memory overlay is registered with
+//            the kernel module. Skipped if the module is not loaded.
+//
+// For each mechanism it reports the setup time, the number of VMAs created,
+// the time and per-access latency of the first pass over every page, and the
+// time of a second pass once every page is mapped. Both passes read one word
+// of each page, and their checksum must match the one read from the files.
+//
+// The test files are read into the page cache first, so the benchmark
+// measures the mechanisms instead of disk IO.
+//
+// Options:
+//   -n  Fragmentation factor N.
+//   -s  Size of the memory area, in MiB.
+//   -o  Write results as CSV to a file, or to stdout if the file is "-".
+
+static const char BASE_FILE[] = "baseXL.bin";
+static const char OVERLAY_FILE[] = "overlayXL.bin";
+
+size_t PAGE_SIZE, TOTAL_SIZE, TOTAL_PAGES;
+long N = 8;
+
+struct result {
+	const char *method;
+	unsigned long long setup_ns;
+	long vmas;
+	unsigned long long first_ns;
+	unsigned long long first_p50_ns;
+	unsigned long long first_p99_ns;
+	unsigned long long steady_ns;
+	bool valid;
+};
+
+struct uffd_handler {
+	pthread_t tid;
+	int uffd;
+	int stop_fds[2];
+	char *area;
+	int base_fd;
+	int overlay_fd;
+	char *page;
+	long faults;
+};
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool is_overlay_page(unsigned long pgoff)
+{
+	return pgoff % (2 * N) < N;
+}
+
+long count_vmas()
+{
+	FILE *f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return -1;
+
+	long vmas = 0;
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		if (c == '\n')
+			vmas++;
+	}
+	fclose(f);
+	return vmas;
+}
+
+void warm_cache(int fd)
+{
+	char *buffer = malloc(PAGE_SIZE * 256);
+	for (size_t offset = 0; offset < TOTAL_SIZE; offset += PAGE_SIZE * 256)
+		pread(fd, buffer, PAGE_SIZE * 256, offset);
+	free(buffer);
+}
+
+// expected_checksum returns the checksum of the layout read from the files.
+unsigned long expected_checksum(int base_fd, int overlay_fd)
+{
+	unsigned long sum = 0;
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		unsigned long word = 0;
+		int fd = is_overlay_page(pgoff) ? overlay_fd : base_fd;
+		pread(fd, &word, sizeof(word), pgoff * PAGE_SIZE);
+		sum += word;
+	}
+	return sum;
+}
+
+int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return (x > y) - (x < y);
+}
+
+// measure reads the first word of every page twice, timing each access of
+// the first pass, and checks the checksum of both passes.
+void measure(char *area, unsigned long checksum, struct result *result)
+{
+	unsigned long long *latencies =
+		calloc(TOTAL_PAGES, sizeof(unsigned long long));
+	unsigned long sum = 0;
+
+	unsigned long long before = now_ns();
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		unsigned long long access_before = now_ns();
+		sum += *(volatile unsigned long *)(area + pgoff * PAGE_SIZE);
+		latencies[pgoff] = now_ns() - access_before;
+	}
+	result->first_ns = now_ns() - before;
+	result->valid = sum == checksum;
+
+	sum = 0;
+	before = now_ns();
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++)
+		sum += *(volatile unsigned long *)(area + pgoff * PAGE_SIZE);
+	result->steady_ns = now_ns() - before;
+	result->valid = result->valid && sum == checksum;
+
+	qsort(latencies, TOTAL_PAGES, sizeof(unsigned long long), compare_ull);
+	result->first_p50_ns = latencies[TOTAL_PAGES / 2];
+	result->first_p99_ns = latencies[TOTAL_PAGES * 99 / 100];
+	free(latencies);
+}
+
+int run_mmap(int base_fd, int overlay_fd, unsigned long checksum,
+	     struct result *result)
+{
+	int res = EXIT_SUCCESS;
+	long vmas_before = count_vmas();
+
+	unsigned long long before = now_ns();
+	char *area = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	if (area == MAP_FAILED) {
+		printf("ERROR: could not mmap base file %s: %s\n", BASE_FILE,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (unsigned long start = 0; start < TOTAL_PAGES; start += 2 * N) {
+		unsigned long pages = start + N > TOTAL_PAGES ?
+					      TOTAL_PAGES - start :
+					      N;
+		char *addr = mmap(area + start * PAGE_SIZE, pages * PAGE_SIZE,
+				  PROT_READ, MAP_PRIVATE | MAP_FIXED,
+				  overlay_fd, start * PAGE_SIZE);
+		if (addr == MAP_FAILED) {
+			printf("ERROR: could not mmap overlay segment at page %lu (check vm.max_map_count): %s\n",
+			       start, strerror(errno));
+			res = EXIT_FAILURE;
+			goto unmap;
+		}
+	}
+	result->setup_ns = now_ns() - before;
+	result->vmas = count_vmas() - vmas_before;
+
+	measure(area, checksum, result);
+
+unmap:
+	munmap(area, TOTAL_SIZE);
+	return res;
+}
+
+void *handle_uffd_faults(void *arg)
+{
+	struct uffd_handler *h = arg;
+	struct pollfd fds[2] = {
+		{ .fd = h->uffd, .events = POLLIN },
+		{ .fd = h->stop_fds[0], .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("ERROR: could not poll userfaultfd: %s\n",
+			       strerror(errno));
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		struct uffd_msg msg;
+		if (read(h->uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		unsigned long addr =
+			msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
+		unsigned long pgoff = (addr - (unsigned long)h->area) / PAGE_SIZE;
+		int fd = is_overlay_page(pgoff) ? h->overlay_fd : h->base_fd;
+		pread(fd, h->page, PAGE_SIZE, pgoff * PAGE_SIZE);
+
+		struct uffdio_copy copy = {
+			.dst = addr,
+			.src = (unsigned long)h->page,
+			.len = PAGE_SIZE,
+		};
+		if (ioctl(h->uffd, UFFDIO_COPY, &copy) && errno != EEXIST)
+			printf("ERROR: could not copy page %lu: %s\n", pgoff,
+			       strerror(errno));
+		h->faults++;
+	}
+	return NULL;
+}
+
+int run_uffd(int base_fd, int overlay_fd, unsigned long checksum,
+	     struct result *result)
+{
+	int res = EXIT_SUCCESS;
+	struct uffd_handler h = {
+		.base_fd = base_fd,
+		.overlay_fd = overlay_fd,
+		.stop_fds = { -1, -1 },
+	};
+	long vmas_before = count_vmas();
+
+	unsigned long long before = now_ns();
+	h.uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (h.uffd < 0) {
+		printf("ERROR: could not create userfaultfd (check vm.unprivileged_userfaultfd): %s\n",
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct uffdio_api api = { .api = UFFD_API };
+	if (ioctl(h.uffd, UFFDIO_API, &api)) {
+		printf("ERROR: could not enable userfaultfd API: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_uffd;
+	}
+
+	h.area = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (h.area == MAP_FAILED) {
+		printf("ERROR: could not mmap anonymous memory: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_uffd;
+	}
+
+	struct uffdio_register reg = {
+		.range = { .start = (unsigned long)h.area, .len = TOTAL_SIZE },
+		.mode = UFFDIO_REGISTER_MODE_MISSING,
+	};
+	if (ioctl(h.uffd, UFFDIO_REGISTER, &reg)) {
+		printf("ERROR: could not register memory with userfaultfd: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+
+	// Counted before the handler thread adds its stack.
+	result->vmas = count_vmas() - vmas_before;
+
+	h.page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	if (pipe(h.stop_fds)) {
+		printf("ERROR: could not create pipe: %s\n", strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+	pthread_create(&h.tid, NULL, handle_uffd_faults, &h);
+	result->setup_ns = now_ns() - before;
+
+	measure(h.area, checksum, result);
+
+	write(h.stop_fds[1], "x", 1);
+	pthread_join(h.tid, NULL);
+
+unmap:
+	munmap(h.area, TOTAL_SIZE);
+close_uffd:
+	if (h.stop_fds[0] >= 0) {
+		close(h.stop_fds[0]);
+		close(h.stop_fds[1]);
+	}
+	free(h.page);
+	close(h.uffd);
+	return res;
+}
+
+int run_module(int syscall_dev, int base_fd, char *overlay_map,
+	       unsigned long checksum, struct result *result)
+{
+	int res = EXIT_SUCCESS;
+	long vmas_before = count_vmas();
+
+	unsigned long long before = now_ns();
+	char *area = mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, base_fd, 0);
+	if (area == MAP_FAILED) {
+		printf("ERROR: could not mmap base file %s: %s\n", BASE_FILE,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.base_addr = (unsigned long)area;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.segments_size = (TOTAL_PAGES + (2 * N - 1)) / (2 * N);
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	for (int i = 0; i < req.segments_size; i++) {
+		req.segments[i].start_pgoff = 2 * N * i;
+		unsigned long end = 2 * N * i + (N - 1);
+		req.segments[i].end_pgoff = end >= TOTAL_PAGES ?
+						    TOTAL_PAGES - 1 :
+						    end;
+	}
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+	result->setup_ns = now_ns() - before;
+	result->vmas = count_vmas() - vmas_before;
+
+	measure(area, checksum, result);
+
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+
+unmap:
+	free(req.segments);
+	munmap(area, TOTAL_SIZE);
+	return res;
+}
+
+void print_result(struct result *result, FILE *csv)
+{
+	printf("%-7s setup=%.3fms vmas=%-7ld first=%.3fms first_p50=%lluns first_p99=%lluns steady=%.3fms steady_ns/page=%.1f checksum=%s\n",
+	       result->method, result->setup_ns / 1e6, result->vmas,
+	       result->first_ns / 1e6, result->first_p50_ns,
+	       result->first_p99_ns, result->steady_ns / 1e6,
+	       (double)result->steady_ns / TOTAL_PAGES,
+	       result->valid ? "ok" : "MISMATCH");
+	if (csv) {
+		fprintf(csv, "%s,%ld,%lu,%llu,%ld,%llu,%llu,%llu,%llu,%d\n",
+			result->method, N, TOTAL_PAGES, result->setup_ns,
+			result->vmas, result->first_ns, result->first_p50_ns,
+			result->first_p99_ns, result->steady_ns,
+			result->valid);
+		fflush(csv);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int res = EXIT_SUCCESS;
+	long size_mb = 256;
+	FILE *csv = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:o:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			N = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			size_mb = strtol(optarg, NULL, 10);
+			break;
+		case 'o':
+			csv = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+			if (!csv) {
+				printf("ERROR: could not open %s: %s\n", optarg,
+				       strerror(errno));
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			printf("usage: %s [-n N] [-s MiB] [-o file.csv]\n",
+			       argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (N < 1 || size_mb < 1) {
+		printf("ERROR: N and size must be at least 1\n");
+		return EXIT_FAILURE;
+	}
+
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = size_mb * 1024 * 1024;
+	TOTAL_PAGES = TOTAL_SIZE / PAGE_SIZE;
+	printf("Page size:     %lu bytes\n", PAGE_SIZE);
+	printf("Overlay size:  %ld pages\n", N);
+	printf("Total size:    %lu bytes\n", TOTAL_SIZE);
+	printf("Total pages:   %lu pages\n", TOTAL_PAGES);
+
+	int base_fd = open(BASE_FILE, O_RDONLY);
+	if (base_fd < 0) {
+		printf("ERROR: could not open base file %s: %s\n", BASE_FILE,
+		       strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int overlay_fd = open(OVERLAY_FILE, O_RDONLY);
+	if (overlay_fd < 0) {
+		printf("ERROR: could not open overlay file %s: %s\n",
+		       OVERLAY_FILE, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_base;
+	}
+
+	char *overlay_map =
+		mmap(NULL, TOTAL_SIZE, PROT_READ, MAP_PRIVATE, overlay_fd, 0);
+	if (overlay_map == MAP_FAILED) {
+		printf("ERROR: could not mmap overlay file %s: %s\n",
+		       OVERLAY_FILE, strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_overlay;
+	}
+
+	warm_cache(base_fd);
+	warm_cache(overlay_fd);
+	unsigned long checksum = expected_checksum(base_fd, overlay_fd);
+
+	if (csv)
+		fprintf(csv,
+			"method,n,pages,setup_ns,vmas,first_ns,first_p50_ns,first_p99_ns,steady_ns,valid\n");
+
+	struct result result = { .method = "mmap" };
+	if (run_mmap(base_fd, overlay_fd, checksum, &result)) {
+		res = EXIT_FAILURE;
+	} else {
+		print_result(&result, csv);
+		res |= !result.valid;
+	}
+
+	result = (struct result){ .method = "uffd" };
+	if (run_uffd(base_fd, overlay_fd, checksum, &result)) {
+		res = EXIT_FAILURE;
+	} else {
+		print_result(&result, csv);
+		res |= !result.valid;
+	}
+
+	// The module is optional, so the userspace mechanisms can be compared
+	// on hosts where it's not loaded.
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("module  skipped: could not open %s: %s\n",
+		       kmod_device_path, strerror(errno));
+	} else {
+		result = (struct result){ .method = "module" };
+		if (run_module(syscall_dev, base_fd, overlay_map, checksum,
+			       &result)) {
+			res = EXIT_FAILURE;
+		} else {
+			print_result(&result, csv);
+			res |= !result.valid;
+		}
+		close(syscall_dev);
+	}
+
+	munmap(overlay_map, TOTAL_SIZE);
+close_overlay:
+	close(overlay_fd);
+close_base:
+	close(base_fd);
+	if (csv && csv != stdout)
+		fclose(csv);
+
+	printf("done\n");
+	return res;
+}
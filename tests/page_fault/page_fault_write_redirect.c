@@ -0,0 +1,289 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../../common.h"
+
+static const int TOTAL_PAGES = 256;
+static const char BASE_FILL = 'b';
+static const char OVERLAY_FILL = 'o';
+static const char WRITE_MARK = 'W';
+
+size_t PAGE_SIZE, TOTAL_SIZE;
+
+struct redirect_files {
+	int base_fd;
+	int overlay_fd;
+	int scratch_fd;
+};
+
+int fill_file(int fd, char fill)
+{
+	char *buffer = malloc(PAGE_SIZE);
+	memset(buffer, fill, PAGE_SIZE);
+	int res = EXIT_SUCCESS;
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES; pgoff++) {
+		if (pwrite(fd, buffer, PAGE_SIZE, pgoff * PAGE_SIZE) !=
+		    PAGE_SIZE) {
+			printf("ERROR: could not write test file: %s\n",
+			       strerror(errno));
+			res = EXIT_FAILURE;
+			break;
+		}
+	}
+	free(buffer);
+	return res;
+}
+
+int open_files(struct redirect_files *files, bool memfd)
+{
+	const char *names[] = { "redirect_base.bin", "redirect_overlay.bin",
+				"redirect_scratch.bin" };
+	int *fds[] = { &files->base_fd, &files->overlay_fd,
+		       &files->scratch_fd };
+
+	for (int i = 0; i < 3; i++) {
+		*fds[i] = memfd ? memfd_create(names[i], 0) :
+				  open(names[i], O_RDWR | O_CREAT | O_TRUNC,
+				       0644);
+		if (*fds[i] < 0) {
+			printf("ERROR: could not create %s: %s\n", names[i],
+			       strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (fill_file(files->base_fd, BASE_FILL) ||
+	    fill_file(files->overlay_fd, OVERLAY_FILL) ||
+	    ftruncate(files->scratch_fd, TOTAL_SIZE))
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+void close_files(struct redirect_files *files)
+{
+	close(files->base_fd);
+	close(files->overlay_fd);
+	close(files->scratch_fd);
+}
+
+bool is_overlay(struct mem_overlay_req *req, unsigned long pgoff)
+{
+	for (int i = 0; i < req->segments_size; i++) {
+		if (pgoff >= req->segments[i].start_pgoff &&
+		    pgoff <= req->segments[i].end_pgoff)
+			return true;
+	}
+	return false;
+}
+
+bool check_page(const char *what, char *page, unsigned long pgoff, char fill,
+		bool written)
+{
+	if (page[0] != (written ? WRITE_MARK : fill)) {
+		printf("== ERROR: unexpected first byte '%c' in %s page %lu\n",
+		       page[0], what, pgoff);
+		return false;
+	}
+	for (size_t i = 1; i < PAGE_SIZE; i++) {
+		if (page[i] != fill) {
+			printf("== ERROR: expected '%c' in %s page %lu offset %lu, got '%c'\n",
+			       fill, what, pgoff, i, page[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+// verify checks the base memory and the contents of the files after they are
+// synced. Writes must only be visible in the overlay and scratch files.
+bool verify(struct redirect_files *files, struct mem_overlay_req *req,
+	    char *base_map, bool *written)
+{
+	char *buffer = malloc(PAGE_SIZE);
+	bool valid = true;
+
+	for (unsigned long pgoff = 0; pgoff < TOTAL_PAGES && valid; pgoff++) {
+		bool overlay = is_overlay(req, pgoff);
+		char fill = overlay ? OVERLAY_FILL : BASE_FILL;
+		size_t offset = pgoff * PAGE_SIZE;
+
+		valid = check_page("memory", base_map + offset, pgoff, fill,
+				   written[pgoff]);
+		if (!valid)
+			break;
+
+		pread(files->base_fd, buffer, PAGE_SIZE, offset);
+		valid = check_page("base file", buffer, pgoff, BASE_FILL,
+				   false);
+		if (!valid)
+			break;
+
+		if (overlay) {
+			pread(files->overlay_fd, buffer, PAGE_SIZE, offset);
+			valid = check_page("overlay file", buffer, pgoff,
+					   OVERLAY_FILL, written[pgoff]);
+		} else if (written[pgoff]) {
+			pread(files->scratch_fd, buffer, PAGE_SIZE, offset);
+			valid = check_page("scratch file", buffer, pgoff,
+					   BASE_FILL, true);
+		}
+	}
+
+	free(buffer);
+	return valid;
+}
+
+int test_write_redirect(bool memfd)
+{
+	int res = EXIT_SUCCESS;
+	struct redirect_files files = { -1, -1, -1 };
+	if (open_files(&files, memfd)) {
+		close_files(&files);
+		return EXIT_FAILURE;
+	}
+
+	char *base_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, files.base_fd, 0);
+	char *overlay_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, files.overlay_fd, 0);
+	char *scratch_map = mmap(NULL, TOTAL_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, files.scratch_fd, 0);
+	if (base_map == MAP_FAILED || overlay_map == MAP_FAILED ||
+	    scratch_map == MAP_FAILED) {
+		printf("ERROR: could not mmap test files: %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto unmap;
+	}
+
+	struct mem_overlay_req req = { 0 };
+	req.flags = MEM_OVERLAY_REQ_WRITE_REDIRECT;
+	req.base_addr = (unsigned long)base_map;
+	req.overlay_addr = (unsigned long)overlay_map;
+	req.scratch_addr = (unsigned long)scratch_map;
+	req.segments_size = 2;
+	req.segments = calloc(sizeof(struct mem_overlay_segment_req),
+			      req.segments_size);
+	req.segments[0].start_pgoff = 10;
+	req.segments[0].end_pgoff = 19;
+	req.segments[1].start_pgoff = 50;
+	req.segments[1].end_pgoff = 99;
+
+	int syscall_dev = open(kmod_device_path, O_WRONLY);
+	if (syscall_dev < 0) {
+		printf("ERROR: could not open %s: %s\n", kmod_device_path,
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto free_segments;
+	}
+
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_REQ_CMD, &req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_REQ_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+		goto close_syscall_dev;
+	}
+
+	bool *written = calloc(sizeof(bool), TOTAL_PAGES);
+
+	// Write to pages that have not been accessed yet.
+	printf("= TEST: checking writes to unmapped pages (%s)\n",
+	       memfd ? "memfd" : "file");
+	unsigned long first_writes[] = { 0, 1, 2, 10, 11, 12, 50, 51, 120 };
+	for (int i = 0; i < sizeof(first_writes) / sizeof(unsigned long);
+	     i++) {
+		base_map[first_writes[i] * PAGE_SIZE] = WRITE_MARK;
+		written[first_writes[i]] = true;
+	}
+	fsync(files.overlay_fd);
+	fsync(files.scratch_fd);
+	if (!verify(&files, &req, base_map, written)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: writes to unmapped pages redirected successfully!\n");
+
+	// All pages have been read by the verification, so these writes hit
+	// read-only mappings of base and overlay pages.
+	printf("= TEST: checking writes to mapped pages (%s)\n",
+	       memfd ? "memfd" : "file");
+	unsigned long second_writes[] = { 3, 4, 18, 19, 98, 100, 200 };
+	for (int i = 0; i < sizeof(second_writes) / sizeof(unsigned long);
+	     i++) {
+		base_map[second_writes[i] * PAGE_SIZE] = WRITE_MARK;
+		written[second_writes[i]] = true;
+	}
+	fsync(files.overlay_fd);
+	fsync(files.scratch_fd);
+	if (!verify(&files, &req, base_map, written)) {
+		res = EXIT_FAILURE;
+		goto cleanup;
+	}
+	printf("== OK: writes to mapped pages redirected successfully!\n");
+
+cleanup:
+	free(written);
+	struct mem_overlay_cleanup_req cleanup_req = {
+		.id = req.id,
+	};
+	if (ioctl(syscall_dev, IOCTL_MEM_OVERLAY_CLEANUP_CMD, &cleanup_req)) {
+		printf("ERROR: could not call 'IOCTL_MEM_OVERLAY_CLEANUP_CMD': %s\n",
+		       strerror(errno));
+		res = EXIT_FAILURE;
+	}
+close_syscall_dev:
+	close(syscall_dev);
+free_segments:
+	free(req.segments);
+unmap:
+	if (scratch_map != MAP_FAILED)
+		munmap(scratch_map, TOTAL_SIZE);
+	if (overlay_map != MAP_FAILED)
+		munmap(overlay_map, TOTAL_SIZE);
+	if (base_map != MAP_FAILED)
+		munmap(base_map, TOTAL_SIZE);
+	close_files(&files);
+	return res;
+}
+
+int main()
+{
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	TOTAL_SIZE = PAGE_SIZE * TOTAL_PAGES;
+	printf("Using pagesize %lu with total size %lu\n", PAGE_SIZE,
+	       TOTAL_SIZE);
+
+	int res = EXIT_SUCCESS;
+	if (test_write_redirect(false) || test_write_redirect(true))
+		res = EXIT_FAILURE;
+
+	printf("done\n");
+	return res;
+}
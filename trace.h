@@ -0,0 +1,226 @@
+/*
+    Copyright (C) 2024 Loophole Labs
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM memory_overlay
+
+#if !defined(MEMORY_OVERLAY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MEMORY_OVERLAY_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "common.h"
+
+// Source of a run of pages mapped by fault-around. Overlay runs use the type
+// of their first segment.
+#define MEM_OVERLAY_TRACE_RUN_BASE -1
+
+#define show_run_source(source)                                   \
+	__print_symbolic(source, { MEM_OVERLAY_TRACE_RUN_BASE, "base" }, \
+			 { MEM_OVERLAY_SEGMENT_FILE, "file" },            \
+			 { MEM_OVERLAY_SEGMENT_ZERO, "zero" },            \
+			 { MEM_OVERLAY_SEGMENT_BUFFER, "buffer" })
+
+TRACE_EVENT(mem_overlay_map_pages_start,
+
+	TP_PROTO(unsigned long id, unsigned long pgoff, unsigned long start,
+		 unsigned long end),
+
+	TP_ARGS(id, pgoff, start, end),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, id)
+		__field(unsigned long, pgoff)
+		__field(unsigned long, start)
+		__field(unsigned long, end)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->pgoff = pgoff;
+		__entry->start = start;
+		__entry->end = end;
+	),
+
+	TP_printk("id=%lu pgoff=%lu start=%lu end=%lu", __entry->id,
+		  __entry->pgoff, __entry->start, __entry->end)
+);
+
+TRACE_EVENT(mem_overlay_map_pages_run,
+
+	TP_PROTO(unsigned long id, unsigned long start, unsigned long end,
+		 int source),
+
+	TP_ARGS(id, start, end, source),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, id)
+		__field(unsigned long, start)
+		__field(unsigned long, end)
+		__field(int, source)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->start = start;
+		__entry->end = end;
+		__entry->source = source;
+	),
+
+	TP_printk("id=%lu start=%lu end=%lu source=%s", __entry->id,
+		  __entry->start, __entry->end,
+		  show_run_source(__entry->source))
+);
+
+TRACE_EVENT(mem_overlay_map_pages_end,
+
+	TP_PROTO(unsigned long id, unsigned long runs, unsigned long base_pages,
+		 unsigned long overlay_pages, unsigned int ret),
+
+	TP_ARGS(id, runs, base_pages, overlay_pages, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, id)
+		__field(unsigned long, runs)
+		__field(unsigned long, base_pages)
+		__field(unsigned long, overlay_pages)
+		__field(unsigned int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->runs = runs;
+		__entry->base_pages = base_pages;
+		__entry->overlay_pages = overlay_pages;
+		__entry->ret = ret;
+	),
+
+	TP_printk("id=%lu runs=%lu base_pages=%lu overlay_pages=%lu ret=0x%x",
+		  __entry->id, __entry->runs, __entry->base_pages,
+		  __entry->overlay_pages, __entry->ret)
+);
+
+TRACE_EVENT(mem_overlay_fault,
+
+	TP_PROTO(unsigned long id, unsigned long pgoff, unsigned int flags,
+		 unsigned int ret),
+
+	TP_ARGS(id, pgoff, flags, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, id)
+		__field(unsigned long, pgoff)
+		__field(unsigned int, flags)
+		__field(unsigned int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->pgoff = pgoff;
+		__entry->flags = flags;
+		__entry->ret = ret;
+	),
+
+	TP_printk("id=%lu pgoff=%lu flags=0x%x ret=0x%x", __entry->id,
+		  __entry->pgoff, __entry->flags, __entry->ret)
+);
+
+TRACE_EVENT(mem_overlay_create,
+
+	TP_PROTO(unsigned long id, unsigned long base_addr,
+		 unsigned int segments, unsigned int flags, long res,
+		 u64 duration_ns),
+
+	TP_ARGS(id, base_addr, segments, flags, res, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, id)
+		__field(unsigned long, base_addr)
+		__field(unsigned int, segments)
+		__field(unsigned int, flags)
+		__field(long, res)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->base_addr = base_addr;
+		__entry->segments = segments;
+		__entry->flags = flags;
+		__entry->res = res;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("id=%lu base_addr=0x%lx segments=%u flags=0x%x res=%ld duration_ns=%llu",
+		  __entry->id, __entry->base_addr, __entry->segments,
+		  __entry->flags, __entry->res, __entry->duration_ns)
+);
+
+TRACE_EVENT(mem_overlay_cleanup,
+
+	TP_PROTO(unsigned long id, unsigned int segments, unsigned int flags,
+		 u64 duration_ns),
+
+	TP_ARGS(id, segments, flags, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, id)
+		__field(unsigned int, segments)
+		__field(unsigned int, flags)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->segments = segments;
+		__entry->flags = flags;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("id=%lu segments=%u flags=0x%x duration_ns=%llu",
+		  __entry->id, __entry->segments, __entry->flags,
+		  __entry->duration_ns)
+);
+
+TRACE_EVENT(mem_overlay_lock_wait,
+
+	TP_PROTO(unsigned long id, u64 wait_ns),
+
+	TP_ARGS(id, wait_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, id)
+		__field(u64, wait_ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->wait_ns = wait_ns;
+	),
+
+	TP_printk("id=%lu wait_ns=%llu", __entry->id, __entry->wait_ns)
+);
+
+#endif //MEMORY_OVERLAY_TRACE_H
+
+// The header is included again by define_trace.h from the module directory,
+// which is added to the include path of module.o by the Makefile.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>